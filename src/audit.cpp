@@ -0,0 +1,192 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#include "audit.hpp"
+
+#include <phosphor-logging/log.hpp>
+
+#include <cstring>
+#include <stdexcept>
+
+using namespace phosphor::logging;
+
+AuditQueue::AuditQueue(size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+    {
+        size <<= 1;
+    }
+    cells = std::make_unique<Cell[]>(size);
+    mask = size - 1;
+    for (size_t i = 0; i < size; ++i)
+    {
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+bool AuditQueue::push(AuditRecord& record)
+{
+    size_t pos = head.load(std::memory_order_relaxed);
+    while (true)
+    {
+        Cell& cell = cells[pos & mask];
+        const size_t seq = cell.sequence.load(std::memory_order_acquire);
+        const intptr_t diff =
+            static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (diff == 0)
+        {
+            // cell is free, try to reserve it
+            if (head.compare_exchange_weak(pos, pos + 1,
+                                           std::memory_order_relaxed))
+            {
+                cell.record = std::move(record);
+                cell.sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0)
+        {
+            // cell is still filled by the previous round
+            return false;
+        }
+        else
+        {
+            // reserved by another producer
+            pos = head.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool AuditQueue::pop(AuditRecord& record)
+{
+    Cell& cell = cells[tail & mask];
+    if (cell.sequence.load(std::memory_order_acquire) != tail + 1)
+    {
+        return false;
+    }
+    record = std::move(cell.record);
+    cell.sequence.store(tail + mask + 1, std::memory_order_release);
+    ++tail;
+    return true;
+}
+
+Audit::Rule Audit::Rule::parse(const std::string& str)
+{
+    Rule rule;
+    std::string name = str;
+    const size_t colon = str.find(':');
+    if (colon != std::string::npos ||
+        (str.size() == UUID_STR_LEN - 1 &&
+         uuid_parse(str.c_str(), rule.guid) == 0))
+    {
+        const std::string guid = str.substr(0, colon);
+        if (uuid_parse(guid.c_str(), rule.guid))
+        {
+            throw std::invalid_argument("Invalid GUID: " + guid);
+        }
+        rule.anyGuid = false;
+        name = colon == std::string::npos ? "*" : str.substr(colon + 1);
+    }
+    if (!name.empty() && name.back() == '*')
+    {
+        rule.prefix = true;
+        name.pop_back();
+    }
+    if (name.empty() && rule.anyGuid && !rule.prefix)
+    {
+        throw std::invalid_argument("Empty audit rule");
+    }
+    rule.name = std::move(name);
+    return rule;
+}
+
+bool Audit::Rule::match(const VariableKeyView& key) const
+{
+    if (!anyGuid && memcmp(guid, key.guid, sizeof(guid)))
+    {
+        return false;
+    }
+    return prefix ? key.name.substr(0, name.size()) == name
+                  : key.name == name;
+}
+
+Audit::Audit(const std::filesystem::path& file, size_t capacity) :
+    source(file), queue(capacity)
+{}
+
+Audit::~Audit()
+{
+    drain();
+}
+
+void Audit::setFilter(std::vector<Rule> rules)
+{
+    filter = std::move(rules);
+}
+
+bool Audit::record(AuditRecord::Action action, const VariableKeyView& key)
+{
+    if (!filter.empty())
+    {
+        bool matched = false;
+        for (const Rule& rule : filter)
+        {
+            matched = matched || rule.match(key);
+        }
+        if (!matched)
+        {
+            return false;
+        }
+    }
+
+    AuditRecord record;
+    record.action = action;
+    record.key.name = key.name;
+    record.key.guid = key.guid;
+    ++queued;
+    while (!queue.push(record))
+    {
+        drain();
+    }
+    return true;
+}
+
+size_t Audit::drain()
+{
+    static const char* const actions[] = {"Create", "Change", "Append",
+                                          "Remove"};
+
+    std::lock_guard<std::mutex> lock(drainLock);
+    std::string changes;
+    size_t count = 0;
+    AuditRecord record;
+    while (queue.pop(record))
+    {
+        char uuid[UUID_STR_LEN];
+        uuid_unparse_upper(record.key.guid, uuid);
+        if (count++)
+        {
+            changes += "; ";
+        }
+        changes += actions[static_cast<size_t>(record.action)];
+        changes += ' ';
+        changes += record.key.name;
+        changes += ' ';
+        changes += uuid;
+    }
+    if (count)
+    {
+        queued -= count;
+        log<level::INFO>("AUDIT: Modify UEFI settings",
+                         entry("FILE=%s", source.c_str()),
+                         entry("COUNT=%zu", count),
+                         entry("CHANGES=%s", changes.c_str()));
+    }
+    return count;
+}
+
+bool Audit::pending() const
+{
+    return queued != 0;
+}
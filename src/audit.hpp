@@ -0,0 +1,199 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#pragma once
+
+#include "variable.hpp"
+
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Audit record of a variable modification.
+ */
+struct AuditRecord
+{
+    /** @brief Kind of modification. */
+    enum class Action : uint8_t
+    {
+        create,
+        change,
+        append,
+        remove,
+    };
+
+    Action action = Action::create; ///< Kind of modification
+    VariableKey key;                ///< Modified variable
+};
+
+/**
+ * @brief Bounded lock-free queue of audit records with multiple producers
+ *        and a single consumer.
+ */
+class AuditQueue
+{
+  public:
+    /**
+     * @brief Constructor.
+     *
+     * @param[in] capacity Max number of records, rounded up to power of 2
+     */
+    explicit AuditQueue(size_t capacity);
+
+    AuditQueue(const AuditQueue&) = delete;
+    AuditQueue& operator=(const AuditQueue&) = delete;
+
+    /**
+     * @brief Put record to the queue, can be called by any thread.
+     *
+     * @param[in] record Audit record, moved only on success
+     *
+     * @return false if the queue is full
+     */
+    bool push(AuditRecord& record);
+
+    /**
+     * @brief Get the oldest record, must be called by a single thread.
+     *
+     * @param[out] record Audit record
+     *
+     * @return false if the queue is empty
+     */
+    bool pop(AuditRecord& record);
+
+    /**
+     * @brief Get the queue capacity.
+     *
+     * @return max number of records
+     */
+    size_t capacity() const
+    {
+        return mask + 1;
+    }
+
+  private:
+    /**
+     * @brief Queue cell, the sequence number tells whether the cell is free
+     *        for the producer of the given position or filled for the
+     *        consumer.
+     */
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        AuditRecord record;
+    };
+
+    /** @brief Ring of cells. */
+    std::unique_ptr<Cell[]> cells;
+    /** @brief Mask of position to cell index. */
+    size_t mask;
+    /** @brief Position of the next record to push. */
+    alignas(64) std::atomic<size_t> head = 0;
+    /** @brief Position of the next record to pop, owned by the consumer. */
+    alignas(64) size_t tail = 0;
+};
+
+/**
+ * @brief Audit log of variable modifications. Records are queued by
+ *        writers and written to the journal in batches, one entry per
+ *        drain.
+ */
+class Audit
+{
+  public:
+    /** @brief Default queue capacity. */
+    static constexpr size_t defaultCapacity = 256;
+
+    /**
+     * @brief Filter rule, selects variables to audit.
+     */
+    struct Rule
+    {
+        bool anyGuid = true; ///< Match any vendor GUID
+        uuid_t guid = {};    ///< Vendor GUID
+        std::string name;    ///< Variable name or its prefix, empty for any
+        bool prefix = false; ///< Match name prefix
+
+        /**
+         * @brief Parse rule: [GUID:]NAME[*], GUID or GUID:*.
+         *
+         * @param[in] str String to parse
+         *
+         * @return rule
+         *
+         * @throw std::invalid_argument in case of errors
+         */
+        static Rule parse(const std::string& str);
+
+        /**
+         * @brief Check if the variable matches the rule.
+         *
+         * @param[in] key Variable key
+         *
+         * @return true if the variable matches
+         */
+        bool match(const VariableKeyView& key) const;
+    };
+
+    /**
+     * @brief Constructor.
+     *
+     * @param[in] file Path to the storage file, used as a record source
+     * @param[in] capacity Max number of records waiting for drain
+     */
+    explicit Audit(const std::filesystem::path& file,
+                   size_t capacity = defaultCapacity);
+
+    /**
+     * @brief Destructor, writes queued records.
+     */
+    ~Audit();
+
+    /**
+     * @brief Set filter rules, must not be called concurrently with record.
+     *
+     * @param[in] rules Rules to match variables, empty to audit all
+     */
+    void setFilter(std::vector<Rule> rules);
+
+    /**
+     * @brief Queue audit record. If the queue is full, it is drained by the
+     *        caller, so records are never lost.
+     *
+     * @param[in] action Kind of modification
+     * @param[in] key Modified variable
+     *
+     * @return false if the variable is filtered out
+     */
+    bool record(AuditRecord::Action action, const VariableKeyView& key);
+
+    /**
+     * @brief Write queued records to the journal as a single entry.
+     *
+     * @return number of written records
+     */
+    size_t drain();
+
+    /**
+     * @brief Check if there are records waiting for drain.
+     *
+     * @return true if the queue is not empty
+     */
+    bool pending() const;
+
+  private:
+    /** @brief Source of records. */
+    std::string source;
+    /** @brief Filter rules. */
+    std::vector<Rule> filter;
+    /** @brief Queue of records. */
+    AuditQueue queue;
+    /** @brief Number of queued records. */
+    std::atomic<size_t> queued = 0;
+    /** @brief Lock to serialize consumers. */
+    std::mutex drainLock;
+};
@@ -0,0 +1,278 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#include "backend.hpp"
+#include "binary.hpp"
+#include "diff.hpp"
+
+#include <phosphor-logging/log.hpp>
+
+#include <algorithm>
+#include <exception>
+
+using namespace phosphor::logging;
+
+JsonBackend::JsonBackend(const std::filesystem::path& jsonFile) :
+    file(jsonFile), backup(file.string() + ".bak"),
+    cache(file.string() + ".bin")
+{}
+
+/**
+ * @brief Collect keys of variables that differ from the expected ones.
+ *
+ * @param[in] stored Variables read from the storage
+ * @param[in] vars Expected variables
+ * @param[in,out] damaged Keys of damaged variables
+ */
+static void collectDamaged(const Variables& stored, const Variables& vars,
+                           std::vector<VariableKey>& damaged)
+{
+    for (const auto& entry : diff::compare(stored, vars))
+    {
+        damaged.push_back(entry.key);
+    }
+    // corrupted records are also reported by diff as missing
+    std::sort(damaged.begin(), damaged.end());
+    damaged.erase(std::unique(damaged.begin(), damaged.end(),
+                              [](const auto& lhs, const auto& rhs) {
+                                  return !(lhs < rhs) && !(rhs < lhs);
+                              }),
+                  damaged.end());
+}
+
+std::optional<Variables>
+    JsonBackend::load(std::pmr::memory_resource* resource)
+{
+    fileValid = false;
+    damaged.clear();
+    profileSet = Profiles();
+    const bool hasFile = std::filesystem::exists(file);
+    if (!hasFile && !std::filesystem::exists(backup))
+    {
+        return std::nullopt;
+    }
+
+    if (hasFile)
+    {
+        auto cached = binary::loadVariables(cache, binary::Source::of(file),
+                                            &generation, resource);
+        if (cached)
+        {
+            fileValid = true;
+            return cached;
+        }
+    }
+
+    // the file is newer than the backup unless it is corrupted or missing,
+    // files replaced externally are used as is regardless of the generation
+    std::optional<Variables> vars;
+    std::exception_ptr error;
+    for (const auto& slot : {file, backup})
+    {
+        if (!std::filesystem::exists(slot))
+        {
+            continue;
+        }
+        try
+        {
+            LoadInfo info;
+            vars = loadVariables(slot, &info, resource);
+            generation = info.generation;
+            damaged = std::move(info.corrupted);
+            profileSet = std::move(info.profiles);
+            // the file with damaged records must not replace the backup
+            fileValid = slot == file && damaged.empty();
+            break;
+        }
+        catch (const std::exception& ex)
+        {
+            log<level::ERR>("Invalid storage slot",
+                            entry("FILE=%s", slot.c_str()),
+                            entry("EXCEPTION=%s", ex.what()));
+            if (!error)
+            {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (!vars)
+    {
+        std::rethrow_exception(error);
+    }
+
+    if (fileValid)
+    {
+        // the cache has no profiles, files with profiles are always parsed
+        if (profileSet.deltas.empty())
+        {
+            updateCache(*vars);
+        }
+    }
+    else if (!damaged.empty())
+    {
+        log<level::ERR>("UEFI storage has damaged variables",
+                        entry("FILE=%s", file.c_str()),
+                        entry("COUNT=%zu", damaged.size()));
+    }
+    else
+    {
+        log<level::WARNING>("UEFI storage restored from backup",
+                            entry("FILE=%s", backup.c_str()),
+                            entry("GENERATION=%llu",
+                                  static_cast<unsigned long long>(generation)));
+    }
+    return vars;
+}
+
+size_t JsonBackend::save(const Variables&, const Variables& vars)
+{
+    // the current file becomes the backup slot, a corrupted file is
+    // dropped to keep the valid backup; the link is synced together with
+    // the rename of the new file
+    if (fileValid)
+    {
+        std::filesystem::remove(backup);
+        std::filesystem::create_hard_link(file, backup);
+    }
+    const size_t written =
+        saveVariables(vars, file, ++generation, &profileSet, pageLoader);
+    fileValid = true;
+    return written + (profileSet.deltas.empty() ? updateCache(vars) : 0);
+}
+
+size_t JsonBackend::saveProfiles(const Variables& current,
+                                 const Variables& vars,
+                                 const Profiles& profiles)
+{
+    Profiles previous = std::move(profileSet);
+    profileSet = profiles;
+    try
+    {
+        return save(current, vars);
+    }
+    catch (...)
+    {
+        profileSet = std::move(previous);
+        throw;
+    }
+}
+
+Profiles JsonBackend::profiles() const
+{
+    return profileSet;
+}
+
+std::vector<VariableKey> JsonBackend::scrub(const Variables& vars)
+{
+    // read the file itself, not the cache
+    std::vector<VariableKey> keys;
+    try
+    {
+        LoadInfo info;
+        const Variables stored = std::filesystem::exists(file)
+                                     ? loadVariables(file, &info)
+                                     : Variables();
+        keys = std::move(info.corrupted);
+        collectDamaged(stored, vars, keys);
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::ERR>("Invalid storage file", entry("FILE=%s", file.c_str()),
+                        entry("EXCEPTION=%s", ex.what()));
+        keys.clear();
+        for (const auto& it : vars)
+        {
+            keys.push_back(it.first);
+        }
+    }
+
+    if (!keys.empty())
+    {
+        fileValid = false; // keep the backup
+        save(vars, vars);
+    }
+    else if (std::filesystem::exists(file) && profileSet.deltas.empty())
+    {
+        // the file identity can match within the timestamp granularity,
+        // the generation tells a cache of the previous save
+        uint64_t cached = 0;
+        if (!binary::loadVariables(cache, binary::Source::of(file), &cached) ||
+            cached != generation)
+        {
+            updateCache(vars);
+        }
+    }
+    damaged.clear();
+    return keys;
+}
+
+std::vector<VariableKey> JsonBackend::corrupted() const
+{
+    return damaged;
+}
+
+size_t JsonBackend::updateCache(const Variables& vars) noexcept
+{
+    try
+    {
+        return binary::saveVariables(vars, binary::Source::of(file), cache,
+                                     generation, pageLoader);
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::WARNING>("Unable to update cache",
+                            entry("FILE=%s", cache.c_str()),
+                            entry("EXCEPTION=%s", ex.what()));
+    }
+    return 0;
+}
+
+BinaryBackend::BinaryBackend(const std::filesystem::path& imageFile) :
+    file(imageFile)
+{}
+
+std::optional<Variables>
+    BinaryBackend::load(std::pmr::memory_resource* resource)
+{
+    if (!std::filesystem::exists(file))
+    {
+        return std::nullopt;
+    }
+
+    auto vars = binary::loadVariables(file, std::nullopt, nullptr, resource);
+    if (!vars)
+    {
+        throw std::runtime_error("Invalid binary image " + file.string());
+    }
+    return vars;
+}
+
+size_t BinaryBackend::save(const Variables&, const Variables& vars)
+{
+    return binary::saveVariables(vars, binary::Source{}, file, 0, pageLoader);
+}
+
+std::vector<VariableKey> BinaryBackend::scrub(const Variables& vars)
+{
+    std::vector<VariableKey> damaged;
+    auto stored = std::filesystem::exists(file)
+                      ? binary::loadVariables(file, std::nullopt)
+                      : Variables();
+    if (stored)
+    {
+        collectDamaged(*stored, vars, damaged);
+    }
+    else
+    {
+        // the image has a single checksum, nothing can be trusted
+        for (const auto& it : vars)
+        {
+            damaged.push_back(it.first);
+        }
+    }
+    if (!damaged.empty())
+    {
+        save(vars, vars);
+    }
+    return damaged;
+}
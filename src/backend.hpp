@@ -0,0 +1,222 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#pragma once
+
+#include "variable.hpp"
+
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+/**
+ * @brief Persistence backend of the variable storage.
+ */
+class Backend
+{
+  public:
+    virtual ~Backend() = default;
+
+    /**
+     * @brief Load variables.
+     *
+     * @param[in] resource Memory resource of the variables container
+     *
+     * @return UEFI variables or nullopt if the storage doesn't exist
+     *
+     * @throw std::exception in case of errors
+     */
+    virtual std::optional<Variables>
+        load(std::pmr::memory_resource* resource =
+                 std::pmr::get_default_resource()) = 0;
+
+    /**
+     * @brief Save variables.
+     *
+     * @param[in] current Variables loaded or saved last time, incremental
+     *                    backends write only the difference
+     * @param[in] vars Variables to save
+     *
+     * @return number of bytes written to the media
+     *
+     * @throw std::exception in case of errors
+     */
+    virtual size_t save(const Variables& current, const Variables& vars) = 0;
+
+    /**
+     * @brief Save variables together with configuration profiles in a
+     *        single atomic write. Profiles are kept by the backend and
+     *        saved again by the following plain saves.
+     *
+     * @param[in] current Variables loaded or saved last time
+     * @param[in] vars Variables to save
+     * @param[in] profiles Configuration profiles to save
+     *
+     * @return number of bytes written to the media
+     *
+     * @throw std::exception in case of errors or if the backend doesn't
+     *        support profiles
+     */
+    virtual size_t saveProfiles(const Variables& current, const Variables& vars,
+                                const Profiles& profiles)
+    {
+        if (!profiles.deltas.empty())
+        {
+            throw std::runtime_error("Profiles are not supported");
+        }
+        return save(current, vars);
+    }
+
+    /**
+     * @brief Get configuration profiles loaded or saved last time.
+     *
+     * @return configuration profiles
+     */
+    virtual Profiles profiles() const
+    {
+        return {};
+    }
+
+    /**
+     * @brief Verify the persistent copy of variables and rewrite it if it
+     *        is damaged or differs from the expected variables.
+     *
+     * @param[in] vars Expected variables
+     *
+     * @return keys of damaged variables
+     *
+     * @throw std::exception in case of errors
+     */
+    virtual std::vector<VariableKey> scrub(const Variables& vars) = 0;
+
+    /**
+     * @brief Get variables dropped on the last load, because their records
+     *        failed the integrity check.
+     *
+     * @return keys of damaged variables
+     */
+    virtual std::vector<VariableKey> corrupted() const
+    {
+        return {};
+    }
+
+    /**
+     * @brief Check if the backend writes only the difference against the
+     *        current variables. Such backend gets both containers with all
+     *        data, others get paged out values as is and load them with
+     *        the page loader.
+     *
+     * @return true if the backend is incremental
+     */
+    virtual bool incremental() const
+    {
+        return false;
+    }
+
+    /**
+     * @brief Check if the backend keeps the attributes as is. The storage
+     *        rejects variables with attributes that would change on load.
+     *
+     * @param[in] attributes Variable attributes
+     *
+     * @return true if the attributes can be stored
+     */
+    virtual bool storable(uint32_t /*attributes*/) const
+    {
+        return true;
+    }
+
+    /**
+     * @brief Set loader of paged out values.
+     *
+     * @param[in] loader Page loader
+     */
+    void setPageLoader(PageLoader loader)
+    {
+        pageLoader = std::move(loader);
+    }
+
+  protected:
+    /** @brief Loader of paged out values, if the storage pages them out. */
+    PageLoader pageLoader;
+};
+
+/**
+ * @brief Backend with JSON file, accompanied with the binary cache to load
+ *        the file without parsing.
+ *
+ * The storage consists of two generation-stamped slots: the JSON file and
+ * its backup, the previous version of the file. The file is replaced
+ * atomically on save and the replaced version becomes the backup, so the
+ * newest valid slot survives a power loss or a corrupted write.
+ */
+class JsonBackend : public Backend
+{
+  public:
+    /**
+     * @brief Constructor.
+     *
+     * @param[in] jsonFile Path to the JSON file
+     */
+    JsonBackend(const std::filesystem::path& jsonFile);
+
+    std::optional<Variables>
+        load(std::pmr::memory_resource* resource =
+                 std::pmr::get_default_resource()) override;
+    size_t save(const Variables& current, const Variables& vars) override;
+    size_t saveProfiles(const Variables& current, const Variables& vars,
+                        const Profiles& profiles) override;
+    Profiles profiles() const override;
+    std::vector<VariableKey> scrub(const Variables& vars) override;
+    std::vector<VariableKey> corrupted() const override;
+
+  private:
+    /**
+     * @brief Rebuild binary cache of the JSON file. Errors are not fatal,
+     *        the cache is just not used on the next load.
+     *
+     * @param[in] vars variables saved to the JSON file
+     *
+     * @return number of bytes written
+     */
+    size_t updateCache(const Variables& vars) noexcept;
+
+    /** @brief JSON file. */
+    std::filesystem::path file;
+    /** @brief Backup slot, previous version of the JSON file. */
+    std::filesystem::path backup;
+    /** @brief Binary cache of the JSON file. */
+    std::filesystem::path cache;
+    /** @brief Generation of the last loaded or saved slot. */
+    uint64_t generation = 0;
+    /** @brief Whether the JSON file is valid and can become the backup. */
+    bool fileValid = false;
+    /** @brief Variables dropped on the last load. */
+    std::vector<VariableKey> damaged;
+    /** @brief Configuration profiles, saved with each version of the file. */
+    Profiles profileSet;
+};
+
+/**
+ * @brief Backend with binary image file.
+ */
+class BinaryBackend : public Backend
+{
+  public:
+    /**
+     * @brief Constructor.
+     *
+     * @param[in] imageFile Path to the image file
+     */
+    BinaryBackend(const std::filesystem::path& imageFile);
+
+    std::optional<Variables>
+        load(std::pmr::memory_resource* resource =
+                 std::pmr::get_default_resource()) override;
+    size_t save(const Variables& current, const Variables& vars) override;
+    std::vector<VariableKey> scrub(const Variables& vars) override;
+
+  private:
+    /** @brief Image file. */
+    std::filesystem::path file;
+};
@@ -0,0 +1,241 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#include "binary.hpp"
+#include "crc32c.hpp"
+#include "mapper.hpp"
+#include "pager.hpp"
+
+#include <endian.h>
+
+#include <cstring>
+#include <limits>
+
+namespace binary
+{
+
+/** @brief Image signature. */
+static constexpr char signature[8] = {'U', 'E', 'F', 'I', 'V', 'A', 'R', 'B'};
+/** @brief Image format version. */
+static constexpr uint32_t version = 3;
+
+/** @brief Image header, all fields are little-endian. */
+struct Header
+{
+    char signature[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t srcSize;
+    uint64_t srcMtime;
+    uint64_t srcInode;
+    uint64_t generation; ///< Generation of the source
+    uint32_t checksum;   ///< CRC32C of all records
+} __attribute__((packed));
+
+/** @brief Variable record header, followed by name and data. */
+struct Record
+{
+    uint32_t attributes;
+    uint32_t dataSize;
+    uint16_t nameSize;
+    uint8_t guid[sizeof(uuid_t)];
+} __attribute__((packed));
+
+/**
+ * @brief Write buffer to file, the file is replaced atomically.
+ *
+ * @param[in] file Path to the file to write
+ * @param[in] data Data to write
+ *
+ * @throw std::system_error in case of file IO errors
+ */
+static void writeFile(const std::filesystem::path& file,
+                      const std::vector<uint8_t>& data)
+{
+    std::filesystem::path tmp = file;
+    tmp += ".tmp";
+
+    const int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        throw std::system_error(errno, std::generic_category());
+    }
+    size_t pos = 0;
+    while (pos < data.size())
+    {
+        const ssize_t rc = write(fd, &data[pos], data.size() - pos);
+        if (rc == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            const int err = errno;
+            close(fd);
+            std::filesystem::remove(tmp);
+            throw std::system_error(err, std::generic_category());
+        }
+        pos += rc;
+    }
+    close(fd);
+
+    std::filesystem::rename(tmp, file);
+}
+
+bool Source::operator==(const Source& rhs) const
+{
+    return size == rhs.size && mtime == rhs.mtime && inode == rhs.inode;
+}
+
+Source Source::of(const std::filesystem::path& file)
+{
+    struct stat st;
+    if (stat(file.c_str(), &st) == -1)
+    {
+        throw std::system_error(errno, std::generic_category());
+    }
+
+    Source src;
+    src.size = st.st_size;
+    src.mtime = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                st.st_mtim.tv_nsec;
+    src.inode = st.st_ino;
+
+    return src;
+}
+
+size_t saveVariables(const Variables& variables, const Source& source,
+                     const std::filesystem::path& file, uint64_t generation,
+                     const PageLoader& loader)
+{
+    size_t size = sizeof(Header);
+    for (const auto& it : variables)
+    {
+        if (it.first.name.size() > std::numeric_limits<uint16_t>::max())
+        {
+            throw std::length_error("Variable name is too long");
+        }
+        const size_t dataSize =
+            it.second.page ? it.second.page->size : it.second.data.size();
+        size += sizeof(Record) + it.first.name.size() + dataSize;
+    }
+
+    std::vector<uint8_t> image(size);
+    uint8_t* ptr = image.data() + sizeof(Header);
+    for (const auto& it : variables)
+    {
+        // paged out data is held only while its record is copied
+        const std::shared_ptr<const VariableValue> paged =
+            it.second.page ? loader(*it.second.page) : nullptr;
+        const VariableValue& value = paged ? *paged : it.second;
+        Record rec;
+        rec.attributes = htole32(value.attributes);
+        rec.dataSize = htole32(value.data.size());
+        rec.nameSize = htole16(it.first.name.size());
+        memcpy(rec.guid, it.first.guid, sizeof(rec.guid));
+        memcpy(ptr, &rec, sizeof(rec));
+        ptr += sizeof(rec);
+        memcpy(ptr, it.first.name.data(), it.first.name.size());
+        ptr += it.first.name.size();
+        if (!value.data.empty())
+        {
+            memcpy(ptr, value.data.data(), value.data.size());
+            ptr += value.data.size();
+        }
+    }
+
+    Header hdr;
+    memcpy(hdr.signature, signature, sizeof(hdr.signature));
+    hdr.version = htole32(version);
+    hdr.count = htole32(variables.size());
+    hdr.srcSize = htole64(source.size);
+    hdr.srcMtime = htole64(source.mtime);
+    hdr.srcInode = htole64(source.inode);
+    hdr.generation = htole64(generation);
+    hdr.checksum = htole32(crc32c(image.data() + sizeof(Header),
+                                  image.size() - sizeof(Header)));
+    memcpy(image.data(), &hdr, sizeof(hdr));
+
+    writeFile(file, image);
+
+    return image.size();
+}
+
+std::optional<Variables> loadVariables(const std::filesystem::path& file,
+                                       const std::optional<Source>& source,
+                                       uint64_t* generation,
+                                       std::pmr::memory_resource* resource)
+{
+    FileMapper fileMap;
+    try
+    {
+        fileMap.load(file);
+    }
+    catch (const std::system_error&)
+    {
+        return std::nullopt;
+    }
+
+    const uint8_t* ptr = static_cast<const uint8_t*>(fileMap.data);
+    const uint8_t* end = ptr + fileMap.size;
+
+    Header hdr;
+    if (fileMap.size < sizeof(hdr))
+    {
+        return std::nullopt;
+    }
+    memcpy(&hdr, ptr, sizeof(hdr));
+    ptr += sizeof(hdr);
+
+    const Source imageSource{le64toh(hdr.srcSize), le64toh(hdr.srcMtime),
+                             le64toh(hdr.srcInode)};
+    if (memcmp(hdr.signature, signature, sizeof(signature)) != 0 ||
+        le32toh(hdr.version) != version ||
+        (source && !(imageSource == *source)) ||
+        le32toh(hdr.checksum) != crc32c(ptr, end - ptr))
+    {
+        return std::nullopt;
+    }
+
+    if (generation)
+    {
+        *generation = le64toh(hdr.generation);
+    }
+
+    Variables variables(resource);
+    uint32_t count = le32toh(hdr.count);
+    while (count--)
+    {
+        Record rec;
+        if (static_cast<size_t>(end - ptr) < sizeof(rec))
+        {
+            return std::nullopt;
+        }
+        memcpy(&rec, ptr, sizeof(rec));
+        ptr += sizeof(rec);
+
+        const size_t nameSize = le16toh(rec.nameSize);
+        const size_t dataSize = le32toh(rec.dataSize);
+        if (static_cast<size_t>(end - ptr) < nameSize + dataSize)
+        {
+            return std::nullopt;
+        }
+
+        VariableKey key;
+        key.name.assign(reinterpret_cast<const char*>(ptr), nameSize);
+        ptr += nameSize;
+        key.guid = rec.guid;
+
+        VariableValue value;
+        value.attributes = le32toh(rec.attributes);
+        value.data.assign(ptr, ptr + dataSize);
+        ptr += dataSize;
+
+        variables.emplace_hint(variables.end(), std::move(key),
+                               std::move(value));
+    }
+
+    return variables;
+}
+
+} // namespace binary
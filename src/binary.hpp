@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#pragma once
+
+#include "variable.hpp"
+
+#include <optional>
+
+/**
+ * @brief Binary image of variables.
+ *
+ * The image is used as a cache of the JSON storage file: it can be loaded
+ * without text parsing and hex decoding. The image keeps identity of the
+ * source file (size, modification time and inode), so a stale image is
+ * detected and ignored without reading the source file.
+ */
+namespace binary
+{
+
+/**
+ * @brief Identity of the source file.
+ */
+struct Source
+{
+    uint64_t size;  ///< File size in bytes
+    uint64_t mtime; ///< Modification time in nanoseconds
+    uint64_t inode; ///< Inode number, changed by atomic replacement
+
+    bool operator==(const Source& rhs) const;
+
+    /**
+     * @brief Get identity of the file, the content is not read.
+     *
+     * @param[in] file Path to the file
+     *
+     * @return file identity
+     *
+     * @throw std::system_error in case of file IO errors
+     */
+    static Source of(const std::filesystem::path& file);
+};
+
+/**
+ * @brief Save variables to binary file.
+ *
+ * @param[in] variables UEFI variables to save
+ * @param[in] source Identity of the source file
+ * @param[in] file Path to the binary file to write
+ * @param[in] generation Generation of the source
+ * @param[in] loader Loader of paged out values, required if there are any
+ *
+ * @return number of bytes written
+ *
+ * @throw std::system_error in case of file IO errors
+ * @throw std::length_error if a variable name exceeds 64 KiB
+ */
+size_t saveVariables(const Variables& variables, const Source& source,
+                     const std::filesystem::path& file,
+                     uint64_t generation = 0,
+                     const PageLoader& loader = nullptr);
+
+/**
+ * @brief Load variables from binary file.
+ *
+ * @param[in] file Path to the binary file to load
+ * @param[in] source Expected identity of the source file, nullopt to load
+ *                   the image regardless of the source
+ * @param[out] generation Generation of the source, optional
+ * @param[in] resource Memory resource of the variables container
+ *
+ * @return UEFI variables or nullopt if the image is missing, corrupted or
+ *         doesn't match the source
+ */
+std::optional<Variables>
+    loadVariables(const std::filesystem::path& file,
+                  const std::optional<Source>& source,
+                  uint64_t* generation = nullptr,
+                  std::pmr::memory_resource* resource =
+                      std::pmr::get_default_resource());
+
+} // namespace binary
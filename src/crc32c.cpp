@@ -0,0 +1,178 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#include "crc32c.hpp"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
+
+#include <array>
+#include <cstring>
+
+/** @brief Reversed CRC32C polynomial. */
+static constexpr uint32_t polynomial = 0x82f63b78;
+
+/** @brief Lookup tables for slicing-by-8 calculation. */
+using Tables = std::array<std::array<uint32_t, 256>, 8>;
+
+/**
+ * @brief Generate lookup tables: the first one is for byte-wise
+ *        calculation, the others shift it by 1-7 bytes.
+ *
+ * @return lookup tables
+ */
+static constexpr Tables makeTables()
+{
+    Tables tables{};
+    for (uint32_t idx = 0; idx < 256; ++idx)
+    {
+        uint32_t crc = idx;
+        for (int bit = 0; bit < 8; ++bit)
+        {
+            crc = (crc >> 1) ^ (crc & 1 ? polynomial : 0);
+        }
+        tables[0][idx] = crc;
+    }
+    for (uint32_t idx = 0; idx < 256; ++idx)
+    {
+        for (size_t slice = 1; slice < tables.size(); ++slice)
+        {
+            const uint32_t prev = tables[slice - 1][idx];
+            tables[slice][idx] = (prev >> 8) ^ tables[0][prev & 0xff];
+        }
+    }
+    return tables;
+}
+
+static constexpr Tables crcTables = makeTables();
+
+/**
+ * @brief Calculation kernel, works with inverted checksum.
+ *
+ * @param[in] ptr Pointer to the data buffer
+ * @param[in] size Size of the buffer in bytes
+ * @param[in] crc Inverted checksum of preceding data
+ *
+ * @return inverted checksum
+ */
+using Kernel = uint32_t (*)(const uint8_t* ptr, size_t size, uint32_t crc);
+
+/** @brief Table-driven kernel, processes 8 bytes per step. */
+static uint32_t softwareKernel(const uint8_t* ptr, size_t size, uint32_t crc)
+{
+    while (size >= 8)
+    {
+        uint32_t lo, hi;
+        memcpy(&lo, ptr, sizeof(lo));
+        memcpy(&hi, ptr + 4, sizeof(hi));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= crc;
+        crc = crcTables[7][lo & 0xff] ^ crcTables[6][(lo >> 8) & 0xff] ^
+              crcTables[5][(lo >> 16) & 0xff] ^ crcTables[4][lo >> 24] ^
+              crcTables[3][hi & 0xff] ^ crcTables[2][(hi >> 8) & 0xff] ^
+              crcTables[1][(hi >> 16) & 0xff] ^ crcTables[0][hi >> 24];
+        ptr += 8;
+        size -= 8;
+    }
+    while (size--)
+    {
+        crc = crcTables[0][(crc ^ *ptr++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+/** @brief SSE4.2 kernel. */
+__attribute__((target("sse4.2"))) static uint32_t
+    hardwareKernel(const uint8_t* ptr, size_t size, uint32_t crc)
+{
+    uint64_t crc64 = crc;
+    while (size >= 8)
+    {
+        uint64_t qword;
+        memcpy(&qword, ptr, sizeof(qword));
+        crc64 = _mm_crc32_u64(crc64, qword);
+        ptr += 8;
+        size -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
+    while (size--)
+    {
+        crc = _mm_crc32_u8(crc, *ptr++);
+    }
+    return crc;
+}
+
+/**
+ * @brief Check if CPU has CRC32C instructions.
+ *
+ * @return true if hardware kernel can be used
+ */
+static bool hardwareSupported()
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+/** @brief ARMv8 CRC extension kernel. */
+__attribute__((target("+crc"))) static uint32_t
+    hardwareKernel(const uint8_t* ptr, size_t size, uint32_t crc)
+{
+    while (size >= 8)
+    {
+        uint64_t qword;
+        memcpy(&qword, ptr, sizeof(qword));
+        crc = __crc32cd(crc, qword);
+        ptr += 8;
+        size -= 8;
+    }
+    while (size--)
+    {
+        crc = __crc32cb(crc, *ptr++);
+    }
+    return crc;
+}
+
+/**
+ * @brief Check if CPU has CRC32C instructions.
+ *
+ * @return true if hardware kernel can be used
+ */
+static bool hardwareSupported()
+{
+    return getauxval(AT_HWCAP) & HWCAP_CRC32;
+}
+#endif
+
+/**
+ * @brief Select the fastest kernel supported by the CPU.
+ *
+ * @return calculation kernel
+ */
+static Kernel selectKernel()
+{
+#if defined(__x86_64__) || defined(__aarch64__)
+    if (hardwareSupported())
+    {
+        return hardwareKernel;
+    }
+#endif
+    return softwareKernel;
+}
+
+uint32_t crc32c(const void* data, size_t size, uint32_t crc)
+{
+    static const Kernel kernel = selectKernel();
+    return ~kernel(static_cast<const uint8_t*>(data), size, ~crc);
+}
+
+uint32_t crc32cSoftware(const void* data, size_t size, uint32_t crc)
+{
+    return ~softwareKernel(static_cast<const uint8_t*>(data), size, ~crc);
+}
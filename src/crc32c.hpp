@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Calculate CRC32C (Castagnoli) checksum. CRC instructions of the
+ *        CPU (SSE4.2 or ARMv8 CRC extension) are used if available.
+ *
+ * @param[in] data Pointer to the data buffer
+ * @param[in] size Size of the buffer in bytes
+ * @param[in] crc Checksum of preceding data to continue with
+ *
+ * @return checksum value
+ */
+uint32_t crc32c(const void* data, size_t size, uint32_t crc = 0);
+
+/**
+ * @brief Calculate CRC32C checksum without CRC instructions of the CPU.
+ *
+ * @param[in] data Pointer to the data buffer
+ * @param[in] size Size of the buffer in bytes
+ * @param[in] crc Checksum of preceding data to continue with
+ *
+ * @return checksum value
+ */
+uint32_t crc32cSoftware(const void* data, size_t size, uint32_t crc = 0);
@@ -0,0 +1,505 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#include "backend.hpp"
+#include "diff.hpp"
+#include "lock.hpp"
+#include "nvram.hpp"
+#include "storage.hpp"
+#include "version.hpp"
+
+#include <getopt.h>
+
+#include <phosphor-logging/log.hpp>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace phosphor::logging;
+
+/**
+ * @brief Single change of the storage.
+ */
+struct Change
+{
+    VariableKey key;                    ///< Variable key
+    std::optional<VariableValue> value; ///< New value, none to remove
+};
+
+/**
+ * @brief Parse variable key.
+ *
+ * @param[in] guid Vendor GUID
+ * @param[in] name Variable name
+ *
+ * @return variable key
+ *
+ * @throw std::invalid_argument in case of errors
+ */
+static VariableKey parseKey(const std::string& guid, const std::string& name)
+{
+    VariableKey key;
+    uuid_t uuid;
+    if (uuid_parse(guid.c_str(), uuid))
+    {
+        throw std::invalid_argument("Invalid GUID: " + guid);
+    }
+    key.guid = uuid;
+    if (name.empty())
+    {
+        throw std::invalid_argument("Empty variable name");
+    }
+    key.name = name;
+    return key;
+}
+
+/**
+ * @brief Parse variable value.
+ *
+ * @param[in] attributes UEFI attributes
+ * @param[in] hex Data as hex string
+ *
+ * @return variable value
+ *
+ * @throw std::invalid_argument in case of errors
+ */
+static VariableValue parseValue(const std::string& attributes,
+                                const std::string& hex)
+{
+    VariableValue value;
+
+    char* end;
+    value.attributes = strtoul(attributes.c_str(), &end, 0);
+    if (*end || attributes.empty())
+    {
+        throw std::invalid_argument("Invalid attributes: " + attributes);
+    }
+
+    if (hex.size() % 2)
+    {
+        throw std::invalid_argument("Invalid hex data: " + hex);
+    }
+    std::vector<uint8_t> data;
+    data.reserve(hex.size() / 2);
+    for (size_t i = 0; i < hex.size(); i += 2)
+    {
+        const std::string byte = hex.substr(i, 2);
+        data.push_back(strtoul(byte.c_str(), &end, 16));
+        if (*end || !isxdigit(byte[0]))
+        {
+            throw std::invalid_argument("Invalid hex data: " + hex);
+        }
+    }
+    value.data = std::move(data);
+
+    return value;
+}
+
+/**
+ * @brief Format variable key.
+ *
+ * @param[in] key Variable key
+ *
+ * @return string with GUID and name
+ */
+static std::string formatKey(const VariableKey& key)
+{
+    char uuid[UUID_STR_LEN];
+    uuid_unparse_upper(key.guid, uuid);
+    return std::string(uuid) + ' ' + key.name;
+}
+
+/**
+ * @brief Parse size value.
+ *
+ * @param[in] str string to parse
+ * @param[out] size parsed value
+ *
+ * @return false if the string is not a valid size
+ */
+static bool parseSize(const char* str, uint64_t& size)
+{
+    char* end;
+    errno = 0;
+    const unsigned long long val = strtoull(str, &end, 0);
+    if (*end || !*str || errno || val == 0)
+    {
+        return false;
+    }
+    size = val;
+    return true;
+}
+
+/**
+ * @brief Load the storage.
+ *
+ * @param[in] backend Storage backend
+ *
+ * @return UEFI variables, empty if the storage doesn't exist
+ *
+ * @throw std::exception in case of errors
+ */
+static Variables loadStorage(Backend& backend)
+{
+    auto vars = backend.load();
+    return vars ? std::move(*vars) : Variables();
+}
+
+/**
+ * @brief Parse manifest file.
+ *
+ * Each line of the manifest is a command:
+ *   set GUID NAME ATTRIBUTES HEXDATA
+ *   remove GUID NAME
+ * Empty lines and lines started with '#' are ignored.
+ *
+ * @param[in] file Path to the manifest file
+ *
+ * @return list of changes
+ *
+ * @throw std::exception in case of errors
+ */
+static std::vector<Change> parseManifest(const std::filesystem::path& file)
+{
+    std::ifstream in(file);
+    if (!in)
+    {
+        throw std::runtime_error("Unable to open file " + file.string());
+    }
+
+    std::vector<Change> changes;
+    std::string line;
+    size_t num = 0;
+    while (std::getline(in, line))
+    {
+        ++num;
+        std::istringstream ss(line);
+        std::string cmd, guid, name, attributes, data, tail;
+        ss >> cmd;
+        if (cmd.empty() || cmd[0] == '#')
+        {
+            continue;
+        }
+        try
+        {
+            if (cmd == "set" && ss >> guid >> name >> attributes)
+            {
+                ss >> data;
+                changes.push_back(
+                    {parseKey(guid, name), parseValue(attributes, data)});
+            }
+            else if (cmd == "remove" && ss >> guid >> name)
+            {
+                changes.push_back({parseKey(guid, name), std::nullopt});
+            }
+            else
+            {
+                throw std::invalid_argument("Invalid command");
+            }
+            if (ss >> tail)
+            {
+                throw std::invalid_argument("Unexpected argument: " + tail);
+            }
+        }
+        catch (const std::invalid_argument& ex)
+        {
+            throw std::runtime_error(file.string() + ':' +
+                                     std::to_string(num) + ": " + ex.what());
+        }
+    }
+
+    return changes;
+}
+
+/** @brief Print version info. */
+static void printVersion()
+{
+    puts("UEFI variable storage control rev." UEFIVAR_VERSION);
+}
+
+/**
+ * @brief Print help usage info.
+ *
+ * @param[in] app application's file name
+ */
+static void printHelp(const char* app)
+{
+    printVersion();
+    puts("Copyright (c) " UEFIVAR_YEAR " YADRO.");
+    printf("Usage: %s [OPTION...] COMMAND [ARG...]\n", app);
+    puts("Options:");
+    puts("  -f, --file FILE     Storage file to use");
+    puts("  -b, --nvar DEVICE   "
+         "Use variables in NVAR format on flash device, as the service");
+    puts("  -r, --history SIZE  "
+         "Record changes to the history up to SIZE bytes, as the service");
+    puts("  -w, --wait          Wait for the storage to be released");
+    puts("  -v, --version       Print version and exit");
+    puts("  -h, --help          Print this help and exit");
+    puts("Commands:");
+    puts("  list                          List variables");
+    puts("  get GUID NAME                 Print variable");
+    puts("  set GUID NAME ATTR [HEXDATA]  Set variable");
+    puts("  remove GUID NAME              Remove variable");
+    puts("  diff FILE                     "
+         "Compare storage with JSON, binary or NVRAM file");
+    puts("  import FILE                   "
+         "Import variables from JSON file or NVRAM dump");
+    puts("  export FILE                   Export variables to JSON file");
+    puts("  apply MANIFEST                Apply batch of changes");
+    puts("Modifying commands require exclusive access to the storage, "
+         "the storage service must be stopped.");
+    puts("Without --history, modifying commands reset the history log of "
+         "the storage.");
+}
+
+/** @brief Application entry point. */
+int main(int argc, char* argv[])
+{
+    // clang-format off
+    const struct option longOpts[] = {
+        { "file",    required_argument, nullptr, 'f' },
+        { "nvar",    required_argument, nullptr, 'b' },
+        { "history", required_argument, nullptr, 'r' },
+        { "wait",    no_argument,       nullptr, 'w' },
+        { "version", no_argument,       nullptr, 'v' },
+        { "help",    no_argument,       nullptr, 'h' },
+        { nullptr,   0,                 nullptr,  0  }
+    };
+    // clang-format on
+    const char* shortOpts = "+f:b:r:wvh";
+    opterr = 0; // prevent native error messages
+    int val;
+    std::filesystem::path file = Storage::defaultFile;
+    std::filesystem::path nvar;
+    uint64_t historySize = 0; // reset history
+    bool wait = false;
+    while ((val = getopt_long(argc, argv, shortOpts, longOpts, nullptr)) != -1)
+    {
+        switch (val)
+        {
+            case 'f':
+                file = optarg;
+                break;
+            case 'b':
+                nvar = optarg;
+                break;
+            case 'r':
+                if (!parseSize(optarg, historySize))
+                {
+                    fprintf(stderr, "Invalid size: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'w':
+                wait = true;
+                break;
+            case 'v':
+                printVersion();
+                return EXIT_SUCCESS;
+            case 'h':
+                printHelp(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                fprintf(stderr, "Invalid argument: %s\n", argv[optind - 1]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc)
+    {
+        fprintf(stderr, "Command not specified\n");
+        return EXIT_FAILURE;
+    }
+
+    const std::string cmd = argv[optind];
+    const std::vector<std::string> args(argv + optind + 1, argv + argc);
+    const auto checkArgs = [&](size_t min, size_t max) {
+        if (args.size() < min || args.size() > max)
+        {
+            throw std::invalid_argument("Invalid number of arguments for " +
+                                        cmd);
+        }
+    };
+
+    // the storage is kept as the service does: on the flash device, if
+    // specified, with the history next to the storage file
+    const std::filesystem::path storageFile = nvar.empty() ? file : nvar;
+    const auto makeBackend = [&]() -> std::unique_ptr<Backend> {
+        if (nvar.empty())
+        {
+            return std::make_unique<JsonBackend>(file);
+        }
+        return std::make_unique<nvram::LogBackend>(nvar);
+    };
+    std::filesystem::path historyFile = file;
+    historyFile += ".history";
+
+    try
+    {
+        // read-only commands
+        Variables vars;
+        if (cmd == "list" || cmd == "get" || cmd == "diff" || cmd == "export")
+        {
+            // the flash device is read only by its owner, it can be in the
+            // middle of compaction
+            FileLock lock;
+            if (!nvar.empty() && !lock.lock(nvar, wait))
+            {
+                fprintf(stderr, "Storage %s is used by another process\n",
+                        nvar.c_str());
+                return EXIT_FAILURE;
+            }
+            std::unique_ptr<Backend> backend = makeBackend();
+            vars = loadStorage(*backend);
+        }
+        if (cmd == "list")
+        {
+            checkArgs(0, 0);
+            for (const auto& [key, value] : vars)
+            {
+                printf("%s 0x%08x %zu\n", formatKey(key).c_str(),
+                       value.attributes, value.data.size());
+            }
+            return EXIT_SUCCESS;
+        }
+        if (cmd == "get")
+        {
+            checkArgs(2, 2);
+            auto it = vars.find(parseKey(args[0], args[1]));
+            if (it == vars.end())
+            {
+                fprintf(stderr, "Variable not found\n");
+                return EXIT_FAILURE;
+            }
+            printf("0x%08x ", it->second.attributes);
+            for (const uint8_t byte : it->second.data)
+            {
+                printf("%02x", byte);
+            }
+            putchar('\n');
+            return EXIT_SUCCESS;
+        }
+        if (cmd == "diff")
+        {
+            checkArgs(1, 1);
+            const Variables other = diff::load(args[0]);
+            for (const auto& entry : diff::compare(vars, other))
+            {
+                const std::string key = formatKey(entry.key);
+                if (entry.kind & diff::Difference::added)
+                {
+                    printf("+ %s\n", key.c_str());
+                    continue;
+                }
+                if (entry.kind & diff::Difference::removed)
+                {
+                    printf("- %s\n", key.c_str());
+                    continue;
+                }
+                printf("* %s", key.c_str());
+                if (entry.kind & diff::Difference::attributes)
+                {
+                    printf(" attributes");
+                }
+                for (const auto& range : entry.ranges)
+                {
+                    printf(" [%zu:%zu]", range.offset,
+                           range.offset + range.size);
+                }
+                putchar('\n');
+            }
+            return EXIT_SUCCESS;
+        }
+        if (cmd == "export")
+        {
+            checkArgs(1, 1);
+            saveVariables(vars, args[0]);
+            return EXIT_SUCCESS;
+        }
+
+        // modifying commands: collect the batch of changes
+        std::vector<Change> changes;
+        std::optional<Variables> imported;
+        if (cmd == "set")
+        {
+            checkArgs(3, 4);
+            changes.push_back({parseKey(args[0], args[1]),
+                               parseValue(args[2], args.size() > 3 ? args[3]
+                                                                   : "")});
+        }
+        else if (cmd == "remove")
+        {
+            checkArgs(2, 2);
+            changes.push_back({parseKey(args[0], args[1]), std::nullopt});
+        }
+        else if (cmd == "import")
+        {
+            checkArgs(1, 1);
+            imported = diff::load(args[0]);
+            if (imported->find(Storage::stdDefaults) == imported->end())
+            {
+                // copy of the storage, merged as is
+                for (auto& [key, value] : *imported)
+                {
+                    changes.push_back({key, value});
+                }
+                imported.reset();
+            }
+        }
+        else if (cmd == "apply")
+        {
+            checkArgs(1, 1);
+            changes = parseManifest(args[0]);
+        }
+        else
+        {
+            fprintf(stderr, "Invalid command: %s\n", cmd.c_str());
+            return EXIT_FAILURE;
+        }
+
+        Storage storage(storageFile, makeBackend(), false, wait);
+        // changes bypassing the history would break rollback, so the
+        // history is either kept up to date or dropped
+        if (historySize)
+        {
+            storage.enableHistory(historyFile, historySize);
+        }
+        else if (std::filesystem::remove(historyFile))
+        {
+            fprintf(stderr, "History %s is reset\n", historyFile.c_str());
+        }
+
+        if (imported)
+        {
+            // NVRAM dump, imported as by the service
+            storage.importVars(*imported);
+        }
+        else
+        {
+            // single save for the whole batch
+            VariableDelta delta;
+            for (auto& change : changes)
+            {
+                delta[std::move(change.key)] = std::move(change.value);
+            }
+            storage.apply(delta);
+        }
+
+        log<level::INFO>("AUDIT: Offline update of UEFI settings",
+                         entry("FILE=%s", storageFile.c_str()),
+                         entry("CHANGES=%zu",
+                               imported ? imported->size() : changes.size()));
+    }
+    catch (const std::exception& ex)
+    {
+        fprintf(stderr, "%s\n", ex.what());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
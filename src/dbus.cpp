@@ -2,64 +2,282 @@
 // Copyright (C) 2021 YADRO
 
 #include "dbus.hpp"
+#include "diff.hpp"
 
 #include <phosphor-logging/log.hpp>
 #include <xyz/openbmc_project/Common/error.hpp>
 
+#include <cstring>
+
 using namespace phosphor::logging;
 using namespace sdbusplus::xyz::openbmc_project::Common::Error;
 
 /**
  * @brief Make variable key.
  *
- * @param[in] name Variable name
+ * @param[in] name Variable name, moved to the key
  * @param[in] guid Vendor GUID
  *
  * @return variable key
  *
  * @throw InvalidArgument in case of errors
  */
-static VariableKey makeKey(const std::string& name,
-                           const std::vector<uint8_t>& guid)
+static VariableKey makeKey(std::string&& name, const std::vector<uint8_t>& guid)
 {
     if (guid.size() != sizeof(uuid_t))
     {
         throw InvalidArgument();
     }
     VariableKey key;
-    key.name = name;
-    std::copy(guid.begin(), guid.end(), key.guid);
+    key.name = std::move(name);
+    key.guid = guid.data();
     return key;
 }
 
-DBus::DBus(sdbusplus::bus::bus& bus, Storage& varStorage) :
-    Super(bus, objectPath), storage(varStorage)
+/**
+ * @brief Make reference to the variable key for lookup.
+ *
+ * @param[in] name Variable name
+ * @param[in] guid Vendor GUID
+ *
+ * @return variable key view, valid while the arguments exist
+ *
+ * @throw InvalidArgument in case of errors
+ */
+static VariableKeyView makeKeyView(const std::string& name,
+                                   const std::vector<uint8_t>& guid)
+{
+    if (guid.size() != sizeof(uuid_t))
+    {
+        throw InvalidArgument();
+    }
+    return VariableKeyView(name, guid.data());
+}
+
+/**
+ * @brief Get vendor GUID as an array of bytes for the reply.
+ *
+ * @param[in] guid Vendor GUID
+ *
+ * @return GUID bytes
+ */
+static std::vector<uint8_t> guidBytes(const VariableGuid& guid)
+{
+    const uint8_t* data = guid;
+    return std::vector<uint8_t>(data, data + sizeof(uuid_t));
+}
+
+DBus::DBus(sdbusplus::bus::bus& bus, const char* path, Storage& varStorage,
+           std::function<void()> poll) :
+    Super(bus, path), storage(varStorage), objPath(path),
+    startPoll(std::move(poll))
 {}
 
+bool DBus::checkReady()
+{
+    if (!ready() && !loadFailed && storage.ready())
+    {
+        try
+        {
+            storage.wait(); // rethrow loading errors
+        }
+        catch (const std::exception& ex)
+        {
+            log<level::ERR>("Unable to load UEFI storage",
+                            entry("PATH=%s", objPath.c_str()),
+                            entry("EXCEPTION=%s", ex.what()));
+            loadFailed = true;
+            return true;
+        }
+        ready(true);
+        updateProperties();
+    }
+    return ready() || loadFailed;
+}
+
+void DBus::reload()
+{
+    if (reloading.valid())
+    {
+        reloadPending = true;
+    }
+    else if (ready() && storage.changed())
+    {
+        reloading = std::async(std::launch::async, &Storage::reload, &storage);
+    }
+}
+
+bool DBus::checkReload()
+{
+    if (!reloading.valid())
+    {
+        return false;
+    }
+    if (reloading.wait_for(std::chrono::seconds(0)) !=
+        std::future_status::ready)
+    {
+        return true;
+    }
+
+    try
+    {
+        if (reloading.get())
+        {
+            updateProperties();
+        }
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::ERR>("Unable to reload UEFI storage",
+                        entry("EXCEPTION=%s", ex.what()));
+    }
+
+    if (reloadPending)
+    {
+        reloadPending = false;
+        reload();
+    }
+    return reloading.valid();
+}
+
+bool DBus::checkScrub()
+{
+    if (!scrubbing.valid())
+    {
+        return false;
+    }
+    if (scrubbing.wait_for(std::chrono::seconds(0)) !=
+        std::future_status::ready)
+    {
+        return true;
+    }
+
+    try
+    {
+        scrubbing.get();
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::ERR>("Unable to scrub UEFI storage",
+                        entry("EXCEPTION=%s", ex.what()));
+    }
+    updateProperties();
+    return false;
+}
+
+void DBus::flushAudit()
+{
+    auditScheduled = false;
+    storage.flushAudit();
+}
+
+void DBus::updateProperties()
+{
+    memoryUsage(storage.memoryUsage());
+    generation(storage.generation());
+    damaged(storage.corrupted());
+    const Storage::WriteStats stats = storage.writeStats();
+    bytesWritten(stats.logicalBytes);
+    physicalBytesWritten(stats.physicalBytes);
+    activeProfile(storage.activeProfile());
+
+    if (!auditScheduled && storage.auditPending())
+    {
+        // records of requests received until the poll go to a single entry
+        auditScheduled = true;
+        startPoll();
+    }
+}
+
 std::tuple<uint32_t, std::vector<uint8_t>>
     DBus::getVariable(std::string name, std::vector<uint8_t> guid)
 {
-    if (storage.empty())
+    // requests don't wait for the load: the event loop is shared by all
+    // hosts
+    if (!ready() || storage.empty())
     {
         throw NotAllowed(); // it should be "Unavailable", but we have too old
                             // DBus interfaces in the Vegman repo
     }
-    const VariableKey key = makeKey(name, guid);
-    auto variable = storage.get(key);
+    std::shared_ptr<const VariableValue> variable;
+    try
+    {
+        variable = storage.get(makeKeyView(name, guid));
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::ERR>("Error processing GetVariable method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure();
+    }
     if (!variable)
     {
         throw ResourceNotFound();
     }
+    // the only copy of data: from the pinned snapshot to the reply
     return std::make_tuple(variable->attributes, variable->data);
 }
 
+std::tuple<uint32_t, std::vector<uint8_t>>
+    DBus::getVariableRange(std::string name, std::vector<uint8_t> guid,
+                           uint32_t offset, uint32_t length)
+{
+    if (!ready() || storage.empty())
+    {
+        throw NotAllowed();
+    }
+    std::shared_ptr<const VariableValue> variable;
+    try
+    {
+        variable = storage.get(makeKeyView(name, guid));
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::ERR>("Error processing GetVariableRange method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure();
+    }
+    if (!variable)
+    {
+        throw ResourceNotFound();
+    }
+    const std::vector<uint8_t>& data = variable->data;
+    if (offset > data.size())
+    {
+        throw InvalidArgument();
+    }
+    const size_t size = std::min<size_t>(length, data.size() - offset);
+    return std::make_tuple(
+        variable->attributes,
+        std::vector<uint8_t>(data.begin() + offset,
+                             data.begin() + offset + size));
+}
+
 void DBus::setVariable(std::string name, std::vector<uint8_t> guid,
                        uint32_t attributes, std::vector<uint8_t> data)
 {
-    const VariableKey key = makeKey(name, guid);
+    if (!ready())
+    {
+        throw NotAllowed();
+    }
+    VariableKey key = makeKey(std::move(name), guid);
     try
     {
-        storage.set(key, VariableValue{attributes, data});
+        storage.set(std::move(key),
+                    VariableValue{attributes, std::move(data)});
+        updateProperties();
+    }
+    catch (const std::length_error& ex)
+    {
+        log<level::ERR>("Error processing SetVariable method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw TooManyResources();
+    }
+    catch (const std::invalid_argument& ex)
+    {
+        log<level::ERR>("Error processing SetVariable method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw InvalidArgument();
     }
     catch (const std::exception& ex)
     {
@@ -69,16 +287,95 @@ void DBus::setVariable(std::string name, std::vector<uint8_t> guid,
     }
 }
 
+uint32_t DBus::beginVariableWrite(std::string name, std::vector<uint8_t> guid,
+                                  uint32_t attributes, uint32_t size)
+{
+    try
+    {
+        return storage.beginWrite(makeKey(std::move(name), guid), attributes,
+                                  size);
+    }
+    catch (const std::invalid_argument& ex)
+    {
+        log<level::ERR>("Error processing BeginVariableWrite method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw InvalidArgument();
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::ERR>("Error processing BeginVariableWrite method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure();
+    }
+}
+
+void DBus::writeVariableChunk(uint32_t handle, uint32_t offset,
+                              std::vector<uint8_t> data)
+{
+    try
+    {
+        storage.writeChunk(handle, offset, data);
+    }
+    catch (const std::invalid_argument& ex)
+    {
+        log<level::ERR>("Error processing WriteVariableChunk method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw InvalidArgument();
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::ERR>("Error processing WriteVariableChunk method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure();
+    }
+}
+
+void DBus::commitVariableWrite(uint32_t handle)
+{
+    if (!ready())
+    {
+        throw NotAllowed();
+    }
+    try
+    {
+        storage.commitWrite(handle);
+        updateProperties();
+    }
+    catch (const std::invalid_argument& ex)
+    {
+        log<level::ERR>("Error processing CommitVariableWrite method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw InvalidArgument();
+    }
+    catch (const std::length_error& ex)
+    {
+        log<level::ERR>("Error processing CommitVariableWrite method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw TooManyResources();
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::ERR>("Error processing CommitVariableWrite method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure();
+    }
+}
+
 void DBus::removeVariable(std::string name, std::vector<uint8_t> guid)
 {
-    const VariableKey key = makeKey(name, guid);
+    if (!ready())
+    {
+        throw NotAllowed();
+    }
+    const VariableKeyView key = makeKeyView(name, guid);
     try
     {
         storage.remove(key);
+        updateProperties();
     }
     catch (const std::exception& ex)
     {
-        log<level::ERR>("Error processing SetVariable method",
+        log<level::ERR>("Error processing RemoveVariable method",
                         entry("EXCEPTION=%s", ex.what()));
         throw sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure();
     }
@@ -87,27 +384,94 @@ void DBus::removeVariable(std::string name, std::vector<uint8_t> guid)
 std::tuple<std::string, std::vector<uint8_t>>
     DBus::nextVariable(std::string name, std::vector<uint8_t> guid)
 {
-    if (storage.empty())
+    if (!ready() || storage.empty())
     {
         throw NotAllowed();
     }
-    const VariableKey key = makeKey(name, guid);
-    auto variable = storage.next(key);
+    auto variable = storage.next(makeKeyView(name, guid));
     if (!variable)
     {
         throw ResourceNotFound();
     }
-    std::vector<uint8_t> vg(reinterpret_cast<const uint8_t*>(variable->guid),
-                            reinterpret_cast<const uint8_t*>(variable->guid) +
-                                sizeof(variable->guid));
-    return std::make_tuple(variable->name, vg);
+    return std::make_tuple(variable->name.str(), guidBytes(variable->guid));
+}
+
+std::vector<std::tuple<std::string, std::vector<uint8_t>, uint32_t>>
+    DBus::findVariables(std::vector<uint8_t> guid, std::string prefix,
+                        uint32_t attributes)
+{
+    if (!ready() || storage.empty())
+    {
+        throw NotAllowed();
+    }
+
+    Storage::Query query;
+    if (!guid.empty())
+    {
+        if (guid.size() != sizeof(query.guid))
+        {
+            throw InvalidArgument();
+        }
+        query.anyGuid = false;
+        memcpy(query.guid, guid.data(), sizeof(query.guid));
+    }
+    query.prefix = std::move(prefix);
+    query.attributes = attributes;
+
+    std::vector<Storage::Match> found;
+    try
+    {
+        found = storage.find(query);
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::ERR>("Error processing FindVariables method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure();
+    }
+
+    std::vector<std::tuple<std::string, std::vector<uint8_t>, uint32_t>>
+        reply;
+    reply.reserve(found.size());
+    for (auto& match : found)
+    {
+        reply.emplace_back(match.key.name.str(), guidBytes(match.key.guid),
+                           match.attributes);
+    }
+    return reply;
+}
+
+std::tuple<uint64_t, uint64_t, uint64_t>
+    DBus::queryVariableInfo(uint32_t attributes)
+{
+    if (!ready())
+    {
+        throw NotAllowed();
+    }
+    try
+    {
+        const Storage::Info info = storage.queryInfo(attributes);
+        return std::make_tuple(info.maxStorage, info.remaining,
+                               info.maxVariable);
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::ERR>("Error processing QueryVariableInfo method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure();
+    }
 }
 
 void DBus::reset()
 {
+    if (!ready())
+    {
+        throw NotAllowed();
+    }
     try
     {
         storage.reset();
+        updateProperties();
     }
     catch (const std::exception& ex)
     {
@@ -119,9 +483,14 @@ void DBus::reset()
 
 void DBus::updateVars(std::string file)
 {
+    if (!ready())
+    {
+        throw NotAllowed();
+    }
     try
     {
         storage.updateVars(file);
+        updateProperties();
     }
     catch (const std::exception& ex)
     {
@@ -133,9 +502,14 @@ void DBus::updateVars(std::string file)
 
 void DBus::importVars(std::string file)
 {
+    if (!ready())
+    {
+        throw NotAllowed();
+    }
     try
     {
         storage.importVars(file);
+        updateProperties();
     }
     catch (const std::exception& ex)
     {
@@ -144,3 +518,255 @@ void DBus::importVars(std::string file)
         throw sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure();
     }
 }
+
+std::vector<std::tuple<std::string, std::vector<uint8_t>, uint8_t,
+                       std::vector<std::tuple<uint32_t, uint32_t>>>>
+    DBus::diffVars(std::string file)
+{
+    if (!ready())
+    {
+        throw NotAllowed();
+    }
+    std::vector<diff::Difference> diffs;
+    try
+    {
+        diffs = diff::compare(*storage.materialize(), diff::load(file));
+    }
+    catch (const std::invalid_argument& ex)
+    {
+        log<level::ERR>("Error processing DiffVars method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw InvalidArgument();
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::ERR>("Error processing DiffVars method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure();
+    }
+
+    std::vector<std::tuple<std::string, std::vector<uint8_t>, uint8_t,
+                           std::vector<std::tuple<uint32_t, uint32_t>>>>
+        reply;
+    reply.reserve(diffs.size());
+    for (auto& entry : diffs)
+    {
+        std::vector<std::tuple<uint32_t, uint32_t>> ranges;
+        ranges.reserve(entry.ranges.size());
+        for (const auto& range : entry.ranges)
+        {
+            ranges.emplace_back(range.offset, range.size);
+        }
+        reply.emplace_back(entry.key.name.str(), guidBytes(entry.key.guid),
+                           entry.kind, std::move(ranges));
+    }
+    return reply;
+}
+
+void DBus::scrub()
+{
+    if (!ready())
+    {
+        throw NotAllowed();
+    }
+    if (!scrubbing.valid())
+    {
+        scrubbing = std::async(std::launch::async, &Storage::scrub, &storage);
+        startPoll();
+    }
+}
+
+std::vector<std::tuple<std::string, std::vector<uint8_t>, uint64_t, uint64_t,
+                       uint64_t, uint64_t>>
+    DBus::getWriteStats()
+{
+    if (!ready())
+    {
+        throw NotAllowed();
+    }
+
+    std::vector<std::tuple<std::string, std::vector<uint8_t>, uint64_t,
+                           uint64_t, uint64_t, uint64_t>>
+        reply;
+    for (const auto& [key, stats] : storage.variableWriteStats())
+    {
+        reply.emplace_back(key.name.str(), guidBytes(key.guid), stats.writes,
+                           stats.logicalBytes, stats.physicalBytes,
+                           stats.throttled);
+    }
+    return reply;
+}
+
+void DBus::createProfile(std::string name)
+{
+    if (!ready())
+    {
+        throw NotAllowed();
+    }
+    try
+    {
+        storage.createProfile(name);
+        updateProperties();
+    }
+    catch (const std::invalid_argument& ex)
+    {
+        log<level::ERR>("Error processing CreateProfile method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw InvalidArgument();
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::ERR>("Error processing CreateProfile method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure();
+    }
+}
+
+void DBus::deleteProfile(std::string name)
+{
+    if (!ready())
+    {
+        throw NotAllowed();
+    }
+    try
+    {
+        storage.deleteProfile(name);
+        updateProperties();
+    }
+    catch (const std::out_of_range& ex)
+    {
+        log<level::ERR>("Error processing DeleteProfile method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw ResourceNotFound();
+    }
+    catch (const std::invalid_argument& ex)
+    {
+        log<level::ERR>("Error processing DeleteProfile method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw InvalidArgument();
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::ERR>("Error processing DeleteProfile method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure();
+    }
+}
+
+void DBus::selectProfile(std::string name)
+{
+    if (!ready())
+    {
+        throw NotAllowed();
+    }
+    try
+    {
+        storage.selectProfile(name);
+        updateProperties();
+    }
+    catch (const std::out_of_range& ex)
+    {
+        log<level::ERR>("Error processing SelectProfile method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw ResourceNotFound();
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::ERR>("Error processing SelectProfile method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure();
+    }
+}
+
+std::vector<std::string> DBus::listProfiles()
+{
+    if (!ready())
+    {
+        throw NotAllowed();
+    }
+    return storage.profiles();
+}
+
+std::vector<std::tuple<uint64_t, uint64_t, std::string, std::vector<uint8_t>,
+                       uint8_t>>
+    DBus::listChanges(uint32_t count)
+{
+    if (!ready() || !storage.hasHistory())
+    {
+        throw NotAllowed();
+    }
+
+    std::vector<History::Change> changes;
+    try
+    {
+        changes = storage.changes(count);
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::ERR>("Error processing ListChanges method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure();
+    }
+
+    std::vector<std::tuple<uint64_t, uint64_t, std::string,
+                           std::vector<uint8_t>, uint8_t>>
+        reply;
+    reply.reserve(changes.size());
+    for (auto& change : changes)
+    {
+        reply.emplace_back(change.generation, change.time,
+                           change.key.name.str(), guidBytes(change.key.guid),
+                           change.kind);
+    }
+    return reply;
+}
+
+void DBus::rollback(uint64_t generation)
+{
+    if (!ready() || !storage.hasHistory())
+    {
+        throw NotAllowed();
+    }
+    try
+    {
+        storage.rollback(generation);
+        updateProperties();
+    }
+    catch (const std::out_of_range& ex)
+    {
+        log<level::ERR>("Error processing Rollback method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw InvalidArgument();
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::ERR>("Error processing Rollback method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure();
+    }
+}
+
+void DBus::rollbackToTime(uint64_t time)
+{
+    if (!ready() || !storage.hasHistory())
+    {
+        throw NotAllowed();
+    }
+    try
+    {
+        storage.rollbackToTime(time);
+        updateProperties();
+    }
+    catch (const std::out_of_range& ex)
+    {
+        log<level::ERR>("Error processing RollbackToTime method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw InvalidArgument();
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::ERR>("Error processing RollbackToTime method",
+                        entry("EXCEPTION=%s", ex.what()));
+        throw sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure();
+    }
+}
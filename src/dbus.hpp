@@ -6,6 +6,8 @@
 #include "server.hpp"
 #include "storage.hpp"
 
+#include <functional>
+
 using Super = sdbusplus::server::object_t<
     sdbusplus::com::yadro::server::UefiVar>;
 
@@ -25,31 +27,140 @@ class DBus : public Super
      * @brief Constructor.
      *
      * @param[in] bus Bus to attach
+     * @param[in] path Object path to register
      * @param[in] varStorage UEFI variable storage
+     * @param[in] poll Callback to start polling of background tasks
      *
      * @throw std::exception in case of errors
      */
-    DBus(sdbusplus::bus::bus& bus, Storage& varStorage);
+    DBus(sdbusplus::bus::bus& bus, const char* path, Storage& varStorage,
+         std::function<void()> poll);
+
+    /**
+     * @brief Update readiness state of the storage. If loading failed, the
+     *        error is logged and the object stays not ready, so the
+     *        methods are rejected while other hosts are served.
+     *
+     * @return true if storage is ready or failed to load
+     */
+    bool checkReady();
+
+    /**
+     * @brief Check if the storage failed to load.
+     *
+     * @return true if loading failed
+     */
+    bool failed() const
+    {
+        return loadFailed;
+    }
+
+    /**
+     * @brief Start reloading of the storage file in background if it was
+     *        changed by someone else.
+     */
+    void reload();
+
+    /**
+     * @brief Update reloading state of the storage.
+     *
+     * @return true if reloading is in progress
+     */
+    bool checkReload();
+
+    /**
+     * @brief Update scrubbing state of the storage.
+     *
+     * @return true if scrubbing is in progress
+     */
+    bool checkScrub();
+
+    /**
+     * @brief Write audit records queued since the previous poll.
+     */
+    void flushAudit();
 
     // Implementation of DBus methods
     std::tuple<uint32_t, std::vector<uint8_t>>
         getVariable(std::string name, std::vector<uint8_t> guid) override;
 
+    std::tuple<uint32_t, std::vector<uint8_t>>
+        getVariableRange(std::string name, std::vector<uint8_t> guid,
+                         uint32_t offset, uint32_t length) override;
+
     void setVariable(std::string name, std::vector<uint8_t> guid,
                      uint32_t attributes, std::vector<uint8_t> data) override;
 
+    uint32_t beginVariableWrite(std::string name, std::vector<uint8_t> guid,
+                                uint32_t attributes, uint32_t size) override;
+
+    void writeVariableChunk(uint32_t handle, uint32_t offset,
+                            std::vector<uint8_t> data) override;
+
+    void commitVariableWrite(uint32_t handle) override;
+
     std::tuple<std::string, std::vector<uint8_t>>
         nextVariable(std::string name, std::vector<uint8_t> guid) override;
 
+    std::vector<std::tuple<std::string, std::vector<uint8_t>, uint32_t>>
+        findVariables(std::vector<uint8_t> guid, std::string prefix,
+                      uint32_t attributes) override;
+
     void removeVariable(std::string name, std::vector<uint8_t> guid);
 
+    std::tuple<uint64_t, uint64_t, uint64_t>
+        queryVariableInfo(uint32_t attributes) override;
+
     void reset() override;
 
     void updateVars(std::string file) override;
 
     void importVars(std::string file) override;
 
+    std::vector<std::tuple<std::string, std::vector<uint8_t>, uint8_t,
+                           std::vector<std::tuple<uint32_t, uint32_t>>>>
+        diffVars(std::string file) override;
+
+    void scrub() override;
+
+    std::vector<std::tuple<std::string, std::vector<uint8_t>, uint64_t,
+                           uint64_t, uint64_t, uint64_t>>
+        getWriteStats() override;
+
+    void createProfile(std::string name) override;
+
+    void deleteProfile(std::string name) override;
+
+    void selectProfile(std::string name) override;
+
+    std::vector<std::string> listProfiles() override;
+
+    std::vector<std::tuple<uint64_t, uint64_t, std::string,
+                           std::vector<uint8_t>, uint8_t>>
+        listChanges(uint32_t count) override;
+
+    void rollback(uint64_t generation) override;
+
+    void rollbackToTime(uint64_t time) override;
+
   private:
+    /** @brief Update properties from the storage state. */
+    void updateProperties();
+
     /** @brief UEFI variables storage. */
     Storage& storage;
+    /** @brief Object path, used in logs. */
+    const std::string objPath;
+    /** @brief The storage failed to load. */
+    bool loadFailed = false;
+    /** @brief Background reloading of the storage file. */
+    std::future<bool> reloading;
+    /** @brief The file was changed again while reloading. */
+    bool reloadPending = false;
+    /** @brief Background scrubbing of the storage. */
+    std::future<std::vector<VariableKey>> scrubbing;
+    /** @brief Callback to start polling of background tasks. */
+    std::function<void()> startPoll;
+    /** @brief Audit records are waiting for the next poll. */
+    bool auditScheduled = false;
 };
@@ -0,0 +1,154 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#include "binary.hpp"
+#include "diff.hpp"
+#include "nvram.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+#include <stdexcept>
+#include <system_error>
+
+namespace diff
+{
+
+bool Range::operator==(const Range& rhs) const
+{
+    return offset == rhs.offset && size == rhs.size;
+}
+
+std::vector<Difference> compare(const Variables& from, const Variables& to)
+{
+    std::vector<Difference> diffs;
+    const VariableKeyLess less;
+
+    auto itFrom = from.begin();
+    auto itTo = to.begin();
+    while (itFrom != from.end() || itTo != to.end())
+    {
+        if (itTo == to.end() ||
+            (itFrom != from.end() && less(itFrom->first, itTo->first)))
+        {
+            diffs.push_back({itFrom->first, Difference::removed, {}});
+            ++itFrom;
+        }
+        else if (itFrom == from.end() || less(itTo->first, itFrom->first))
+        {
+            diffs.push_back({itTo->first, Difference::added, {}});
+            ++itTo;
+        }
+        else
+        {
+            const VariableValue& oldVal = itFrom->second;
+            const VariableValue& newVal = itTo->second;
+            uint8_t kind = 0;
+            if (oldVal.attributes != newVal.attributes)
+            {
+                kind |= Difference::attributes;
+            }
+            std::vector<Range> ranges;
+            if (oldVal.data != newVal.data)
+            {
+                kind |= Difference::data;
+                ranges = compare(oldVal.data, newVal.data);
+            }
+            if (kind)
+            {
+                diffs.push_back({itTo->first, kind, std::move(ranges)});
+            }
+            ++itFrom;
+            ++itTo;
+        }
+    }
+
+    return diffs;
+}
+
+std::vector<Range> compare(const std::vector<uint8_t>& from,
+                           const std::vector<uint8_t>& to)
+{
+    std::vector<Range> ranges;
+
+    const size_t common = std::min(from.size(), to.size());
+    size_t pos = 0;
+    while (pos < common)
+    {
+        // skip equal bytes
+        const auto mismatch = std::mismatch(from.begin() + pos,
+                                            from.begin() + common,
+                                            to.begin() + pos);
+        pos = mismatch.first - from.begin();
+        if (pos == common)
+        {
+            break;
+        }
+        // collect changed bytes
+        const size_t start = pos;
+        while (pos < common && from[pos] != to[pos])
+        {
+            ++pos;
+        }
+        ranges.push_back({start, pos - start});
+    }
+
+    const size_t tail = std::max(from.size(), to.size());
+    if (tail > common)
+    {
+        if (!ranges.empty() &&
+            ranges.back().offset + ranges.back().size == common)
+        {
+            ranges.back().size += tail - common;
+        }
+        else
+        {
+            ranges.push_back({common, tail - common});
+        }
+    }
+
+    return ranges;
+}
+
+Variables load(const std::filesystem::path& file)
+{
+    auto image = binary::loadVariables(file, std::nullopt);
+    if (image)
+    {
+        return std::move(*image);
+    }
+
+    std::ifstream in(file);
+    if (!in.is_open())
+    {
+        throw std::system_error(errno, std::generic_category(),
+                                "Unable to open file " + file.string());
+    }
+    char first = 0;
+    in >> first;
+    if (in.bad())
+    {
+        throw std::system_error(EIO, std::generic_category(),
+                                "Unable to read file " + file.string());
+    }
+
+    // IO errors are system errors, anything else is a format error
+    try
+    {
+        if (!in)
+        {
+            throw std::runtime_error("File is empty");
+        }
+        return first == '{' ? loadVariables(file) : nvram::parseVolume(file);
+    }
+    catch (const std::system_error&)
+    {
+        throw;
+    }
+    catch (const std::exception& ex)
+    {
+        throw std::invalid_argument(ex.what());
+    }
+}
+
+} // namespace diff
@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#pragma once
+
+#include "variable.hpp"
+
+/**
+ * @brief Structural comparison of variable sets.
+ */
+namespace diff
+{
+
+/**
+ * @brief Range of changed bytes in variable data.
+ */
+struct Range
+{
+    size_t offset; ///< Offset of the first changed byte
+    size_t size;   ///< Number of changed bytes
+
+    bool operator==(const Range& rhs) const;
+};
+
+/**
+ * @brief Difference of a single variable.
+ */
+struct Difference
+{
+    /** @brief Kind of difference, attributes and data can change together. */
+    enum Kind : uint8_t
+    {
+        added = 0x01,      ///< Variable exists only in the new set
+        removed = 0x02,    ///< Variable exists only in the old set
+        attributes = 0x04, ///< Attributes differ
+        data = 0x08,       ///< Data differ
+    };
+
+    VariableKey key;           ///< Variable key
+    uint8_t kind;              ///< Kind of difference (bit mask)
+    std::vector<Range> ranges; ///< Changed ranges of data (for data kind)
+};
+
+/**
+ * @brief Compare two sets of variables.
+ *
+ * Both sets are walked once in the sorted order.
+ *
+ * @param[in] from Old set of variables
+ * @param[in] to New set of variables
+ *
+ * @return list of differences in the sorted order of variables
+ */
+std::vector<Difference> compare(const Variables& from, const Variables& to);
+
+/**
+ * @brief Compare variable data.
+ *
+ * Bytes beyond the end of the shorter buffer are considered changed.
+ *
+ * @param[in] from Old data
+ * @param[in] to New data
+ *
+ * @return list of changed byte ranges
+ */
+std::vector<Range> compare(const std::vector<uint8_t>& from,
+                           const std::vector<uint8_t>& to);
+
+/**
+ * @brief Load variables from any supported file: JSON storage, binary image
+ *        or NVRAM volume dump.
+ *
+ * @param[in] file Path to the file to load
+ *
+ * @return UEFI variables
+ *
+ * @throw std::invalid_argument if the file format is invalid
+ * @throw std::system_error in case of file IO errors
+ */
+Variables load(const std::filesystem::path& file);
+
+} // namespace diff
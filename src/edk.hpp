@@ -24,6 +24,7 @@ using UINT8 = uint8_t;
 #define EFI_VARIABLE_RUNTIME_ACCESS              0x00000004
 #define EFI_VARIABLE_HARDWARE_ERROR_RECORD       0x00000008
 #define EFI_VARIABLE_AUTHENTICATED_WRITE_ACCESS  0x00000010
+#define EFI_VARIABLE_APPEND_WRITE                0x00000040
 
 typedef struct {
   UINT32  Data1;
@@ -79,5 +80,12 @@ typedef struct {
   EFI_FFS_FILE_STATE      State;
 } EFI_FFS_FILE_HEADER;
 
+typedef struct {
+  EFI_GUID  SignatureType;
+  UINT32    SignatureListSize;
+  UINT32    SignatureHeaderSize;
+  UINT32    SignatureSize;
+} EFI_SIGNATURE_LIST;
+
 #pragma pack()
 // clang-format on
@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#pragma once
+
+#include <endian.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+/**
+ * @brief Access to fields of little-endian binary structures (firmware
+ *        images) without casting the buffer to a packed structure.
+ *
+ * Layout of a structure is described at compile time as a set of fields,
+ * the description is checked with static_assert against the reference
+ * structure. Fields are loaded and stored with memcpy, so unaligned data
+ * is accessed safely on any CPU, and converted from/to little-endian
+ * explicitly. With constant offsets and sizes, each access compiles down
+ * to a single load or store on little-endian hosts.
+ */
+namespace field
+{
+
+/**
+ * @brief Little-endian unsigned integer field.
+ *
+ * @tparam T Type of the value
+ * @tparam Offset Offset of the field from the structure start
+ * @tparam Size Size of the field in bytes, can be less than the size of T
+ *              (e.g. 24-bit fields)
+ */
+template <typename T, size_t Offset, size_t Size = sizeof(T)>
+struct Field
+{
+    static_assert(std::is_unsigned_v<T>, "Unsigned integer expected");
+    static_assert(Size > 0 && Size <= sizeof(T), "Invalid field size");
+
+    using Type = T;
+    static constexpr size_t offset = Offset;
+    static constexpr size_t size = Size;
+    static constexpr size_t end = Offset + Size;
+};
+
+/**
+ * @brief Byte array field (GUID, signature, etc).
+ *
+ * @tparam Offset Offset of the field from the structure start
+ * @tparam Size Size of the field in bytes
+ */
+template <size_t Offset, size_t Size>
+struct Bytes
+{
+    static constexpr size_t offset = Offset;
+    static constexpr size_t size = Size;
+    static constexpr size_t end = Offset + Size;
+};
+
+/**
+ * @brief Check the field position in the reference structure.
+ *
+ * @tparam F Field description
+ *
+ * @param[in] offset Offset of the field in the structure (offsetof)
+ * @param[in] size Size of the field in the structure
+ *
+ * @return true if the description matches the structure
+ */
+template <typename F>
+constexpr bool at(size_t offset, size_t size)
+{
+    return F::offset == offset && F::size == size;
+}
+
+/**
+ * @brief Convert value between little-endian and host byte order, the
+ *        conversion is symmetric.
+ *
+ * @param[in] value Value to convert
+ *
+ * @return converted value
+ */
+template <typename T>
+inline T swapLe(T value)
+{
+    if constexpr (sizeof(T) == sizeof(uint64_t))
+    {
+        return le64toh(value);
+    }
+    else if constexpr (sizeof(T) == sizeof(uint32_t))
+    {
+        return le32toh(value);
+    }
+    else if constexpr (sizeof(T) == sizeof(uint16_t))
+    {
+        return le16toh(value);
+    }
+    else
+    {
+        static_assert(sizeof(T) == sizeof(uint8_t), "Unsupported type");
+        return value;
+    }
+}
+
+/**
+ * @brief Load field value.
+ *
+ * @tparam F Field description
+ *
+ * @param[in] base Pointer to the structure start
+ *
+ * @return field value in host byte order
+ */
+template <typename F>
+inline typename F::Type get(const uint8_t* base)
+{
+    // short fields fill the low bytes of the little-endian value
+    typename F::Type value = 0;
+    memcpy(&value, base + F::offset, F::size);
+    return swapLe(value);
+}
+
+/**
+ * @brief Store field value.
+ *
+ * @tparam F Field description
+ *
+ * @param[out] base Pointer to the structure start
+ * @param[in] value Field value in host byte order, truncated to the field
+ *                  size
+ */
+template <typename F>
+inline void set(uint8_t* base, typename F::Type value)
+{
+    value = swapLe(value);
+    memcpy(base + F::offset, &value, F::size);
+}
+
+/**
+ * @brief Get pointer to the byte array field.
+ *
+ * @tparam F Field description
+ *
+ * @param[in] base Pointer to the structure start
+ *
+ * @return pointer to the field data
+ */
+template <typename F>
+inline const uint8_t* data(const uint8_t* base)
+{
+    return base + F::offset;
+}
+
+} // namespace field
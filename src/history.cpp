@@ -0,0 +1,651 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#include "crc32c.hpp"
+#include "diff.hpp"
+#include "history.hpp"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <phosphor-logging/log.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+using namespace phosphor::logging;
+
+/** @brief Log signature. */
+static constexpr char signature[8] = {'U', 'E', 'F', 'I', 'H', 'I', 'S', 'T'};
+/** @brief Log format version. */
+static constexpr uint32_t version = 1;
+
+/** @brief Log header, all fields are little-endian. */
+struct Header
+{
+    char signature[8];
+    uint32_t version;
+    uint64_t baseGeneration; ///< Generation the log starts from
+    uint64_t baseTime;       ///< Time of the last dropped change
+    uint32_t checksum;       ///< CRC32C of the header
+} __attribute__((packed));
+
+/**
+ * @brief Record header, followed by name, payload and the record size
+ *        again, so the log can be read from the end. The payload is the
+ *        previous data or its ranges that differ from the new data.
+ */
+struct Record
+{
+    uint32_t size;        ///< Size of the whole record
+    uint32_t checksum;    ///< CRC32C from the generation to the payload end
+    uint64_t generation;  ///< Generation of the change
+    uint64_t time;        ///< Time of the change, seconds since Epoch
+    uint32_t attributes;  ///< Previous attributes
+    uint32_t dataSize;    ///< Previous data size
+    uint32_t newChecksum; ///< CRC32C of the new value
+    uint16_t nameSize;
+    uint8_t flags;
+    uint8_t guid[sizeof(uuid_t)];
+} __attribute__((packed));
+
+/** @brief Size of the record trailer. */
+static constexpr size_t trailerSize = sizeof(uint32_t);
+
+/** @brief Record flags. */
+enum : uint8_t
+{
+    oldExists = 0x01, ///< Variable existed before the change
+    newExists = 0x02, ///< Variable exists after the change
+    deltaData = 0x04, ///< Payload contains changed ranges only
+};
+
+/**
+ * @brief Calculate checksum of the variable value.
+ *
+ * @param[in] value Variable value
+ *
+ * @return CRC32C of attributes and data
+ */
+static uint32_t checksum(const VariableValue& value)
+{
+    const uint32_t attributes = htole32(value.attributes);
+    const uint32_t crc = crc32c(&attributes, sizeof(attributes));
+    return crc32c(value.data.data(), value.data.size(), crc);
+}
+
+/**
+ * @brief Get current time.
+ *
+ * @return seconds since Epoch
+ */
+static uint64_t currentTime()
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+/**
+ * @brief Read from the file.
+ *
+ * @param[in] fd File descriptor
+ * @param[out] data Buffer to fill
+ * @param[in] size Number of bytes to read
+ * @param[in] offset Offset in the file
+ *
+ * @throw std::system_error in case of file IO errors or unexpected end
+ */
+static void readAt(int fd, void* data, size_t size, size_t offset)
+{
+    uint8_t* ptr = static_cast<uint8_t*>(data);
+    while (size)
+    {
+        const ssize_t rc = pread(fd, ptr, size, offset);
+        if (rc == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rc <= 0)
+        {
+            throw std::system_error(rc ? errno : EIO, std::generic_category());
+        }
+        ptr += rc;
+        size -= rc;
+        offset += rc;
+    }
+}
+
+/**
+ * @brief Write to the file.
+ *
+ * @param[in] fd File descriptor
+ * @param[in] data Data to write
+ * @param[in] size Number of bytes to write
+ * @param[in] offset Offset in the file
+ *
+ * @throw std::system_error in case of file IO errors
+ */
+static void writeAt(int fd, const void* data, size_t size, size_t offset)
+{
+    const uint8_t* ptr = static_cast<const uint8_t*>(data);
+    while (size)
+    {
+        const ssize_t rc = pwrite(fd, ptr, size, offset);
+        if (rc == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rc == -1)
+        {
+            throw std::system_error(errno, std::generic_category());
+        }
+        ptr += rc;
+        size -= rc;
+        offset += rc;
+    }
+}
+
+/**
+ * @brief Parse and verify record.
+ *
+ * @param[in] data Record data
+ * @param[in] size Record size
+ *
+ * @return record header
+ *
+ * @throw std::runtime_error if the record is damaged
+ */
+static const Record& parseRecord(const uint8_t* data, size_t size)
+{
+    const Record& rec = *reinterpret_cast<const Record*>(data);
+    uint32_t trailer;
+    memcpy(&trailer, data + size - trailerSize, sizeof(trailer));
+    const size_t header = offsetof(Record, generation);
+    if (le32toh(rec.size) != size || le32toh(trailer) != size ||
+        sizeof(Record) + le16toh(rec.nameSize) + trailerSize > size ||
+        crc32c(data + header, size - header - trailerSize) !=
+            le32toh(rec.checksum))
+    {
+        throw std::runtime_error("Damaged history record");
+    }
+    return rec;
+}
+
+History::History(const std::filesystem::path& logFile, size_t maxBytes) :
+    file(logFile), limit(maxBytes)
+{
+    if (file.has_parent_path())
+    {
+        std::filesystem::create_directories(file.parent_path());
+    }
+    fd = open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        throw std::system_error(errno, std::generic_category(),
+                                "Unable to open file " + file.string());
+    }
+
+    const size_t fileSize = std::filesystem::file_size(file);
+    Header hdr;
+    if (fileSize >= sizeof(hdr))
+    {
+        readAt(fd, &hdr, sizeof(hdr), 0);
+    }
+    if (fileSize < sizeof(hdr) ||
+        memcmp(hdr.signature, signature, sizeof(signature)) ||
+        le32toh(hdr.version) != version ||
+        crc32c(&hdr, offsetof(Header, checksum)) != le32toh(hdr.checksum))
+    {
+        if (fileSize)
+        {
+            log<level::WARNING>("Invalid history log, reset",
+                                entry("FILE=%s", file.c_str()));
+        }
+        if (ftruncate(fd, 0) == -1)
+        {
+            throw std::system_error(errno, std::generic_category());
+        }
+        writeHeader(fd);
+        size = sizeof(Header);
+        return;
+    }
+    baseGeneration = le64toh(hdr.baseGeneration);
+    baseTime = le64toh(hdr.baseTime);
+    lastGeneration = baseGeneration;
+
+    // records appended before a crash can be incomplete
+    size = sizeof(Header);
+    std::vector<uint8_t> buffer;
+    while (size + sizeof(Record) + trailerSize <= fileSize)
+    {
+        Record rec;
+        readAt(fd, &rec, sizeof(rec), size);
+        const size_t recSize = le32toh(rec.size);
+        if (recSize < sizeof(Record) + trailerSize ||
+            recSize > fileSize - size)
+        {
+            break;
+        }
+        buffer.resize(recSize);
+        readAt(fd, buffer.data(), recSize, size);
+        try
+        {
+            lastGeneration = le64toh(parseRecord(buffer.data(), recSize)
+                                         .generation);
+        }
+        catch (const std::runtime_error&)
+        {
+            break;
+        }
+        size += recSize;
+    }
+    if (size != fileSize)
+    {
+        log<level::WARNING>("Incomplete history records dropped",
+                            entry("FILE=%s", file.c_str()),
+                            entry("SIZE=%zu", fileSize - size));
+        if (ftruncate(fd, size) == -1)
+        {
+            throw std::system_error(errno, std::generic_category());
+        }
+    }
+}
+
+History::~History()
+{
+    if (fd != -1)
+    {
+        close(fd);
+    }
+}
+
+void History::record(const Variables& from, const Variables& to)
+{
+    const uint64_t now = currentTime();
+    std::vector<uint8_t> batch;
+    for (const auto& change : diff::compare(from, to))
+    {
+        auto before = from.find(change.key);
+        auto after = to.find(change.key);
+        append(batch, change.key,
+               before == from.end() ? nullptr : &before->second,
+               after == to.end() ? nullptr : &after->second, now);
+    }
+    if (!batch.empty())
+    {
+        write(batch);
+    }
+}
+
+void History::record(const Variables& from, const Variables& to,
+                     const VariableKeyView& key)
+{
+    const uint64_t now = currentTime();
+    auto before = from.find(key);
+    auto after = to.find(key);
+    std::vector<uint8_t> batch;
+    append(batch, key, before == from.end() ? nullptr : &before->second,
+           after == to.end() ? nullptr : &after->second, now);
+    write(batch);
+}
+
+std::vector<History::Change> History::list(size_t count) const
+{
+    std::vector<Change> changes;
+    std::vector<uint8_t> buffer;
+    Entry entry;
+    size_t end = size;
+    while (end > sizeof(Header) && changes.size() < count)
+    {
+        end = read(end, buffer, entry);
+        const Kind kind = !(entry.flags & oldExists)   ? created
+                          : !(entry.flags & newExists) ? removed
+                                                       : modified;
+        changes.push_back(
+            {entry.generation, entry.time, std::move(entry.key), kind});
+    }
+    return changes;
+}
+
+VariableDelta History::rollback(const Variables& current,
+                                uint64_t target) const
+{
+    if (target < baseGeneration || target > lastGeneration)
+    {
+        throw std::out_of_range("Generation is out of the history");
+    }
+
+    // only variables changed after the target are kept in memory
+    VariableDelta values;
+    std::vector<uint8_t> buffer;
+    Entry entry;
+    size_t end = size;
+    while (end > sizeof(Header))
+    {
+        const size_t start = read(end, buffer, entry);
+        if (entry.generation <= target)
+        {
+            break;
+        }
+        end = start;
+
+        std::optional<VariableValue> value;
+        auto known = values.find(entry.key);
+        if (known != values.end())
+        {
+            value = std::move(known->second);
+        }
+        else
+        {
+            auto it = current.find(entry.key);
+            if (it != current.end())
+            {
+                value = it->second;
+            }
+        }
+        if (static_cast<bool>(entry.flags & newExists) != value.has_value() ||
+            (value && checksum(*value) != entry.newChecksum))
+        {
+            throw std::runtime_error("History doesn't match variables");
+        }
+
+        std::optional<VariableValue> previous;
+        if (entry.flags & oldExists)
+        {
+            previous.emplace();
+            previous->attributes = entry.attributes;
+            if (entry.flags & deltaData)
+            {
+                std::vector<uint8_t> data = value->data;
+                data.resize(entry.dataSize);
+                const uint8_t* ptr = entry.payload;
+                const uint8_t* last = entry.payload + entry.payloadSize;
+                while (ptr < last)
+                {
+                    uint32_t range[2];
+                    if (static_cast<size_t>(last - ptr) < sizeof(range))
+                    {
+                        throw std::runtime_error("Damaged history record");
+                    }
+                    memcpy(range, ptr, sizeof(range));
+                    ptr += sizeof(range);
+                    const size_t offset = le32toh(range[0]);
+                    const size_t rangeSize = le32toh(range[1]);
+                    if (offset > entry.dataSize ||
+                        rangeSize > entry.dataSize - offset ||
+                        rangeSize > static_cast<size_t>(last - ptr))
+                    {
+                        throw std::runtime_error("Damaged history record");
+                    }
+                    memcpy(data.data() + offset, ptr, rangeSize);
+                    ptr += rangeSize;
+                }
+                previous->data = std::move(data);
+            }
+            else
+            {
+                previous->data.assign(entry.payload,
+                                      entry.payload + entry.payloadSize);
+            }
+        }
+        if (known != values.end())
+        {
+            known->second = std::move(previous);
+        }
+        else
+        {
+            values.emplace(std::move(entry.key), std::move(previous));
+        }
+    }
+    return values;
+}
+
+uint64_t History::generationAt(uint64_t time) const
+{
+    std::vector<uint8_t> buffer;
+    Entry entry;
+    size_t end = size;
+    while (end > sizeof(Header))
+    {
+        end = read(end, buffer, entry);
+        if (entry.time <= time)
+        {
+            return entry.generation;
+        }
+    }
+    if (time < baseTime)
+    {
+        throw std::out_of_range("Time is out of the history");
+    }
+    return baseGeneration;
+}
+
+void History::append(std::vector<uint8_t>& batch, const VariableKeyView& key,
+                     const VariableValue* before, const VariableValue* after,
+                     uint64_t time) const
+{
+    // short ranges of long data are stored instead of the whole data
+    std::vector<diff::Range> ranges;
+    size_t payloadSize = before ? before->data.size() : 0;
+    if (before && after)
+    {
+        // bytes beyond the previous data end are dropped on rollback
+        const size_t oldSize = before->data.size();
+        size_t deltaSize = 0;
+        for (auto range : diff::compare(before->data, after->data))
+        {
+            if (range.offset >= oldSize)
+            {
+                continue;
+            }
+            range.size = std::min(range.size, oldSize - range.offset);
+            deltaSize += 2 * sizeof(uint32_t) + range.size;
+            ranges.push_back(range);
+        }
+        if (deltaSize < payloadSize)
+        {
+            payloadSize = deltaSize;
+        }
+        else
+        {
+            ranges.clear();
+        }
+    }
+    const bool delta = before && after && payloadSize < before->data.size();
+
+    const size_t pos = batch.size();
+    const size_t recSize =
+        sizeof(Record) + key.name.size() + payloadSize + trailerSize;
+    batch.resize(pos + recSize);
+    uint8_t* ptr = batch.data() + pos;
+
+    Record rec;
+    rec.size = htole32(recSize);
+    rec.generation = htole64(lastGeneration + 1);
+    rec.time = htole64(time);
+    rec.attributes = htole32(before ? before->attributes : 0);
+    rec.dataSize = htole32(before ? before->data.size() : 0);
+    rec.newChecksum = htole32(after ? checksum(*after) : 0);
+    rec.nameSize = htole16(key.name.size());
+    rec.flags = (before ? oldExists : 0) | (after ? newExists : 0) |
+                (delta ? deltaData : 0);
+    memcpy(rec.guid, key.guid, sizeof(rec.guid));
+    ptr += sizeof(Record);
+    memcpy(ptr, key.name.data(), key.name.size());
+    ptr += key.name.size();
+    if (delta)
+    {
+        for (const auto& range : ranges)
+        {
+            const uint32_t header[2] = {htole32(range.offset),
+                                        htole32(range.size)};
+            memcpy(ptr, header, sizeof(header));
+            ptr += sizeof(header);
+            memcpy(ptr, before->data.data() + range.offset, range.size);
+            ptr += range.size;
+        }
+    }
+    else if (before)
+    {
+        memcpy(ptr, before->data.data(), before->data.size());
+        ptr += before->data.size();
+    }
+    const uint32_t trailer = htole32(recSize);
+    memcpy(ptr, &trailer, sizeof(trailer));
+
+    const size_t header = offsetof(Record, generation);
+    rec.checksum =
+        htole32(crc32c(reinterpret_cast<const uint8_t*>(&rec) + header,
+                       sizeof(Record) - header));
+    rec.checksum = htole32(crc32c(batch.data() + pos + sizeof(Record),
+                                  recSize - sizeof(Record) - trailerSize,
+                                  le32toh(rec.checksum)));
+    memcpy(batch.data() + pos, &rec, sizeof(rec));
+}
+
+void History::write(const std::vector<uint8_t>& batch)
+{
+    trim(batch.size());
+    try
+    {
+        writeAt(fd, batch.data(), batch.size(), size);
+    }
+    catch (...)
+    {
+        // drop the partially written batch
+        if (ftruncate(fd, size) == -1)
+        {
+            log<level::ERR>("Unable to truncate history log",
+                            entry("FILE=%s", file.c_str()));
+        }
+        throw;
+    }
+    size += batch.size();
+    ++lastGeneration;
+}
+
+size_t History::read(size_t end, std::vector<uint8_t>& buffer,
+                     Entry& entry) const
+{
+    uint32_t trailer;
+    readAt(fd, &trailer, sizeof(trailer), end - trailerSize);
+    const size_t recSize = le32toh(trailer);
+    if (recSize < sizeof(Record) + trailerSize ||
+        recSize > end - sizeof(Header))
+    {
+        throw std::runtime_error("Damaged history record");
+    }
+    const size_t start = end - recSize;
+    buffer.resize(recSize);
+    readAt(fd, buffer.data(), recSize, start);
+
+    const Record& rec = parseRecord(buffer.data(), recSize);
+    entry.generation = le64toh(rec.generation);
+    entry.time = le64toh(rec.time);
+    entry.flags = rec.flags;
+    entry.attributes = le32toh(rec.attributes);
+    entry.dataSize = le32toh(rec.dataSize);
+    entry.newChecksum = le32toh(rec.newChecksum);
+    const size_t nameSize = le16toh(rec.nameSize);
+    const uint8_t* name = buffer.data() + sizeof(Record);
+    entry.key.name.assign(name, name + nameSize);
+    entry.key.guid = rec.guid;
+    entry.payload = name + nameSize;
+    entry.payloadSize = recSize - sizeof(Record) - nameSize - trailerSize;
+    if (!(entry.flags & deltaData) &&
+        entry.payloadSize != (entry.flags & oldExists ? entry.dataSize : 0))
+    {
+        throw std::runtime_error("Damaged history record");
+    }
+    return start;
+}
+
+void History::trim(size_t reserve)
+{
+    if (size + reserve <= limit)
+    {
+        return;
+    }
+
+    // keep the newest whole generations within a half of the limit,
+    // so the log is not rewritten on each change
+    const size_t keep = limit / 2 > reserve ? limit / 2 - reserve : 0;
+    std::vector<uint8_t> buffer;
+    Entry entry;
+    size_t cut = size;
+    size_t end = size;
+    uint64_t generation = 0;
+    while (end > sizeof(Header))
+    {
+        const size_t start = read(end, buffer, entry);
+        if (entry.generation != generation)
+        {
+            cut = end;
+            generation = entry.generation;
+        }
+        if (size - start > keep)
+        {
+            break;
+        }
+        end = start;
+    }
+    if (end == sizeof(Header))
+    {
+        cut = sizeof(Header);
+    }
+    if (cut > sizeof(Header))
+    {
+        read(cut, buffer, entry);
+        baseGeneration = entry.generation;
+        baseTime = entry.time;
+    }
+
+    std::vector<uint8_t> kept(size - cut);
+    readAt(fd, kept.data(), kept.size(), cut);
+
+    std::filesystem::path tmp = file;
+    tmp += ".tmp";
+    const int tmpFd =
+        open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (tmpFd == -1)
+    {
+        throw std::system_error(errno, std::generic_category(),
+                                "Unable to write file " + tmp.string());
+    }
+    try
+    {
+        writeHeader(tmpFd);
+        writeAt(tmpFd, kept.data(), kept.size(), sizeof(Header));
+        if (fsync(tmpFd) == -1)
+        {
+            throw std::system_error(errno, std::generic_category());
+        }
+        std::filesystem::rename(tmp, file);
+    }
+    catch (...)
+    {
+        close(tmpFd);
+        std::error_code ec;
+        std::filesystem::remove(tmp, ec);
+        throw;
+    }
+    close(fd);
+    fd = tmpFd;
+    size = sizeof(Header) + kept.size();
+}
+
+void History::writeHeader(int dst) const
+{
+    Header hdr;
+    memcpy(hdr.signature, signature, sizeof(signature));
+    hdr.version = htole32(version);
+    hdr.baseGeneration = htole64(baseGeneration);
+    hdr.baseTime = htole64(baseTime);
+    hdr.checksum = htole32(crc32c(&hdr, offsetof(Header, checksum)));
+    writeAt(dst, &hdr, sizeof(hdr), 0);
+}
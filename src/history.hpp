@@ -0,0 +1,214 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#pragma once
+
+#include "variable.hpp"
+
+#include <filesystem>
+#include <vector>
+
+/**
+ * @brief Bounded log of variable changes, used to roll the storage back.
+ *
+ * Each change keeps the previous value of the variable: attributes and data,
+ * the data is stored as ranges that differ from the new value when it is
+ * shorter. Changes committed together share a generation number. Records are
+ * appended to the file and can be read from its end, so recent changes are
+ * listed without loading the whole log. When the log exceeds its size limit,
+ * the oldest generations are dropped.
+ */
+class History
+{
+  public:
+    /**
+     * @brief Kind of change.
+     */
+    enum Kind : uint8_t
+    {
+        created = 0x01,  ///< Variable didn't exist before
+        removed = 0x02,  ///< Variable was removed
+        modified = 0x04, ///< Attributes or data were changed
+    };
+
+    /**
+     * @brief Change of a variable.
+     */
+    struct Change
+    {
+        uint64_t generation; ///< Generation of the change
+        uint64_t time;       ///< Time of the change, seconds since Epoch
+        VariableKey key;     ///< Variable key
+        Kind kind;           ///< Kind of change
+    };
+
+    /**
+     * @brief Constructor, opens the log and drops incomplete records at its
+     *        end.
+     *
+     * @param[in] logFile Path to the log file
+     * @param[in] maxBytes Max size of the log file
+     *
+     * @throw std::system_error in case of file IO errors
+     */
+    History(const std::filesystem::path& logFile, size_t maxBytes);
+
+    History(const History&) = delete;
+    History& operator=(const History&) = delete;
+
+    ~History();
+
+    /**
+     * @brief Record changes between two sets of variables as a single
+     *        generation.
+     *
+     * @param[in] from Variables before the change
+     * @param[in] to Variables after the change
+     *
+     * @throw std::exception in case of errors
+     */
+    void record(const Variables& from, const Variables& to);
+
+    /**
+     * @brief Record change of a single variable as a new generation.
+     *
+     * @param[in] from Variables before the change
+     * @param[in] to Variables after the change
+     * @param[in] key Key of the changed variable
+     *
+     * @throw std::exception in case of errors
+     */
+    void record(const Variables& from, const Variables& to,
+                const VariableKeyView& key);
+
+    /**
+     * @brief Get recent changes.
+     *
+     * @param[in] count Max number of changes to get
+     *
+     * @return changes, the newest first
+     *
+     * @throw std::exception in case of errors
+     */
+    std::vector<Change> list(size_t count) const;
+
+    /**
+     * @brief Get previous values of variables changed after the generation.
+     *
+     * @param[in] current Current variables
+     * @param[in] target Generation to roll back to
+     *
+     * @return values of variables as they were right after the target
+     *         generation, none for variables that didn't exist
+     *
+     * @throw std::out_of_range if the generation is not in the log
+     * @throw std::runtime_error if the log doesn't match the variables
+     */
+    VariableDelta rollback(const Variables& current, uint64_t target) const;
+
+    /**
+     * @brief Find the generation the variables had at the given time.
+     *
+     * @param[in] time Time, seconds since Epoch
+     *
+     * @return the last generation committed not later than the time
+     *
+     * @throw std::out_of_range if the time precedes the log
+     */
+    uint64_t generationAt(uint64_t time) const;
+
+    /**
+     * @brief Get generation of the last change.
+     *
+     * @return generation number
+     */
+    uint64_t generation() const
+    {
+        return lastGeneration;
+    }
+
+  private:
+    /**
+     * @brief Parsed record of the log.
+     */
+    struct Entry
+    {
+        uint64_t generation;
+        uint64_t time;
+        uint8_t flags;
+        uint32_t attributes;
+        uint32_t dataSize;
+        uint32_t newChecksum;
+        VariableKey key;
+        const uint8_t* payload;
+        size_t payloadSize;
+    };
+
+    /**
+     * @brief Append record of the variable change to the batch.
+     *
+     * @param[in,out] batch Buffer of records
+     * @param[in] key Variable key
+     * @param[in] before Previous value, nullptr if the variable didn't exist
+     * @param[in] after New value, nullptr if the variable was removed
+     * @param[in] time Time of the change
+     */
+    void append(std::vector<uint8_t>& batch, const VariableKeyView& key,
+                const VariableValue* before, const VariableValue* after,
+                uint64_t time) const;
+
+    /**
+     * @brief Write batch of records of a new generation to the log.
+     *
+     * @param[in] batch Buffer of records
+     *
+     * @throw std::system_error in case of file IO errors
+     */
+    void write(const std::vector<uint8_t>& batch);
+
+    /**
+     * @brief Read record ending at the offset.
+     *
+     * @param[in] end Offset of the record end
+     * @param[out] buffer Buffer for the record
+     * @param[out] entry Parsed record, pointing to the buffer
+     *
+     * @return offset of the record start
+     *
+     * @throw std::runtime_error if the record is damaged
+     */
+    size_t read(size_t end, std::vector<uint8_t>& buffer, Entry& entry) const;
+
+    /**
+     * @brief Drop the oldest generations to fit the new batch.
+     *
+     * @param[in] reserve Size of the batch to append
+     *
+     * @throw std::system_error in case of file IO errors
+     */
+    void trim(size_t reserve);
+
+    /**
+     * @brief Write the log header.
+     *
+     * @param[in] fd File descriptor of the log
+     *
+     * @throw std::system_error in case of file IO errors
+     */
+    void writeHeader(int fd) const;
+
+    /** @brief Log file. */
+    std::filesystem::path file;
+    /** @brief Max size of the log file. */
+    size_t limit;
+    /** @brief Log file descriptor. */
+    int fd = -1;
+    /** @brief Size of valid records in the log file. */
+    size_t size = 0;
+    /** @brief Generation of the state the log starts from. */
+    uint64_t baseGeneration = 0;
+    /** @brief Time of the last dropped change, 0 if none was dropped. */
+    uint64_t baseTime = 0;
+    /** @brief Generation of the last change. */
+    uint64_t lastGeneration = 0;
+};
@@ -0,0 +1,157 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+/**
+ * @brief Reference to the interned value.
+ *
+ * Equal values share a single immutable entry of the process-wide pool, so
+ * the reference is one pointer, a copy only increments the reference
+ * counter of the entry, and equal values are recognized by comparing the
+ * pointers. The entry is freed with its last reference, so the pool does
+ * not grow with values that are no longer used.
+ *
+ * @tparam T Type of the value
+ * @tparam Hash Hash function of the value
+ */
+template <typename T, typename Hash = std::hash<T>>
+class Interned
+{
+  public:
+    /**
+     * @brief Constructor.
+     *
+     * @param[in] value Value to intern
+     */
+    explicit Interned(const T& value) : entry(acquire(value))
+    {}
+
+    Interned(const Interned& other) noexcept : entry(other.entry)
+    {
+        entry->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Interned& operator=(const Interned& other) noexcept
+    {
+        Interned copy(other);
+        std::swap(entry, copy.entry);
+        return *this;
+    }
+
+    ~Interned()
+    {
+        release(entry);
+    }
+
+    /** @brief Get the interned value. */
+    const T& get() const
+    {
+        return entry->value;
+    }
+
+  private:
+    /** @brief Entry of the pool. */
+    struct Entry
+    {
+        const T value;
+        std::atomic<size_t> refs;
+    };
+
+    /** @brief Hash of the value referred by the pool index. */
+    struct RefHash
+    {
+        size_t operator()(std::reference_wrapper<const T> value) const
+        {
+            return Hash()(value.get());
+        }
+    };
+
+    /** @brief Pool of the entries indexed by their values. */
+    struct Pool
+    {
+        std::mutex mutex;
+        std::unordered_map<std::reference_wrapper<const T>, Entry*, RefHash,
+                           std::equal_to<T>>
+            index;
+    };
+
+    /**
+     * @brief Get the pool. It is never destroyed, so static objects may
+     *        hold references until the very exit.
+     */
+    static Pool& pool()
+    {
+        static Pool* instance = new Pool;
+        return *instance;
+    }
+
+    /**
+     * @brief Get the entry of the value, create one if there is none.
+     *
+     * @param[in] value Value to intern
+     *
+     * @return referenced entry
+     */
+    static Entry* acquire(const T& value)
+    {
+        Pool& p = pool();
+        std::lock_guard<std::mutex> lock(p.mutex);
+
+        const auto it = p.index.find(std::cref(value));
+        if (it != p.index.end())
+        {
+            // the last reference may be released concurrently, such entry
+            // is about to be freed and must not be revived
+            Entry* existing = it->second;
+            size_t refs = existing->refs.load(std::memory_order_relaxed);
+            while (refs &&
+                   !existing->refs.compare_exchange_weak(
+                       refs, refs + 1, std::memory_order_relaxed))
+            {}
+            if (refs)
+            {
+                return existing;
+            }
+            p.index.erase(it);
+        }
+
+        Entry* created = new Entry{value, 1};
+        p.index.emplace(std::cref(created->value), created);
+        return created;
+    }
+
+    /**
+     * @brief Drop the reference to the entry, free it with the last one.
+     *
+     * @param[in] entry Entry to release
+     */
+    static void release(Entry* entry)
+    {
+        if (entry->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        {
+            return;
+        }
+
+        Pool& p = pool();
+        {
+            std::lock_guard<std::mutex> lock(p.mutex);
+            // the value could be interned again by a new entry meanwhile
+            const auto it = p.index.find(std::cref(entry->value));
+            if (it != p.index.end() && it->second == entry)
+            {
+                p.index.erase(it);
+            }
+        }
+        delete entry;
+    }
+
+    /** @brief Referenced entry of the pool. */
+    Entry* entry;
+};
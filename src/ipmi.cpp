@@ -0,0 +1,292 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#include "edk.hpp"
+#include "ipmi.hpp"
+
+#include <endian.h>
+#include <ipmid/api.h>
+
+#include <phosphor-logging/log.hpp>
+
+#include <cstring>
+
+using namespace phosphor::logging;
+
+/** @brief Size of GUID in requests and responses. */
+static constexpr size_t guidSize = sizeof(uuid_t);
+
+/**
+ * @brief Read little-endian 32-bit value.
+ *
+ * @param[in] ptr Pointer to the value
+ *
+ * @return value in host byte order
+ */
+static uint32_t readLe32(const uint8_t* ptr)
+{
+    uint32_t val;
+    memcpy(&val, ptr, sizeof(val));
+    return le32toh(val);
+}
+
+/**
+ * @brief Write little-endian 32-bit value.
+ *
+ * @param[out] ptr Pointer to the destination
+ * @param[in] val Value in host byte order
+ */
+static void writeLe32(uint8_t* ptr, uint32_t val)
+{
+    val = htole32(val);
+    memcpy(ptr, &val, sizeof(val));
+}
+
+/**
+ * @brief Command handler called by ipmid.
+ *
+ * @param[in] cmd Command
+ * @param[in] request Request data
+ * @param[out] response Response data
+ * @param[in,out] dataLen Size of request and response data
+ * @param[in] context Pointer to the Ipmi instance
+ *
+ * @return completion code
+ */
+static ipmi_ret_t handler(ipmi_netfn_t, ipmi_cmd_t cmd, ipmi_request_t request,
+                          ipmi_response_t response, ipmi_data_len_t dataLen,
+                          ipmi_context_t context)
+{
+    Ipmi* ipmi = static_cast<Ipmi*>(context);
+    return ipmi->handle(cmd, static_cast<const uint8_t*>(request), *dataLen,
+                        static_cast<uint8_t*>(response), *dataLen);
+}
+
+Ipmi::Ipmi(Storage& varStorage) :
+    storage(varStorage), auditThread(&Ipmi::auditWriter, this)
+{}
+
+Ipmi::~Ipmi()
+{
+    {
+        std::lock_guard<std::mutex> lock(auditLock);
+        stopAudit = true;
+    }
+    auditSignal.notify_one();
+    auditThread.join();
+}
+
+void Ipmi::auditWriter()
+{
+    std::unique_lock<std::mutex> lock(auditLock);
+    while (true)
+    {
+        auditSignal.wait(lock, [this]() { return auditQueued || stopAudit; });
+        if (stopAudit)
+        {
+            // the rest is written by the storage on destruction
+            break;
+        }
+        auditQueued = false;
+        lock.unlock();
+        storage.flushAudit();
+        lock.lock();
+    }
+}
+
+void Ipmi::registerHandlers()
+{
+    for (const uint8_t cmd : {getVariable, setVariable, nextVariable})
+    {
+        ipmi_register_callback(netFn, cmd, this, handler, PRIVILEGE_ADMIN);
+    }
+}
+
+uint8_t Ipmi::handle(uint8_t cmd, const uint8_t* req, size_t reqLen,
+                     uint8_t* rsp, size_t& rspLen)
+{
+    rspLen = 0;
+
+    if (reqLen < ianaSize)
+    {
+        return ccReqDataLenInvalid;
+    }
+    if (static_cast<uint32_t>(req[0] | req[1] << 8 | req[2] << 16) != iana)
+    {
+        return ccInvalidField;
+    }
+    if (!storage.ready())
+    {
+        // don't block ipmid while the storage is loading
+        return ccNotInState;
+    }
+
+    req += ianaSize;
+    reqLen -= ianaSize;
+    rsp[0] = iana & 0xff;
+    rsp[1] = (iana >> 8) & 0xff;
+    rsp[2] = (iana >> 16) & 0xff;
+    size_t dataLen = 0;
+
+    uint8_t rc;
+    try
+    {
+        switch (cmd)
+        {
+            case getVariable:
+                rc = get(req, reqLen, rsp + ianaSize, dataLen);
+                break;
+            case setVariable:
+                rc = set(req, reqLen);
+                break;
+            case nextVariable:
+                rc = next(req, reqLen, rsp + ianaSize, dataLen);
+                break;
+            default:
+                rc = ccInvalidCommand;
+                break;
+        }
+    }
+    catch (const std::length_error& ex)
+    {
+        log<level::ERR>("Error processing IPMI command",
+                        entry("CMD=0x%02x", cmd),
+                        entry("EXCEPTION=%s", ex.what()));
+        rc = ccOutOfSpace;
+    }
+    catch (const std::invalid_argument& ex)
+    {
+        log<level::ERR>("Error processing IPMI command",
+                        entry("CMD=0x%02x", cmd),
+                        entry("EXCEPTION=%s", ex.what()));
+        rc = ccInvalidField;
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::ERR>("Error processing IPMI command",
+                        entry("CMD=0x%02x", cmd),
+                        entry("EXCEPTION=%s", ex.what()));
+        rc = ccUnspecified;
+    }
+
+    if (rc == ccSuccess)
+    {
+        rspLen = ianaSize + dataLen;
+    }
+    return rc;
+}
+
+uint8_t Ipmi::get(const uint8_t* req, size_t reqLen, uint8_t* rsp,
+                  size_t& rspLen)
+{
+    constexpr size_t hdrSize = guidSize + sizeof(uint32_t);
+    if (reqLen <= hdrSize)
+    {
+        return ccReqDataLenInvalid;
+    }
+    const uint32_t offset = readLe32(req + guidSize);
+    const std::string_view name(reinterpret_cast<const char*>(req + hdrSize),
+                                reqLen - hdrSize);
+
+    if (storage.empty())
+    {
+        return ccNotInState;
+    }
+    auto variable = storage.get(VariableKeyView(name, req));
+    if (!variable)
+    {
+        return ccDataNotPresent;
+    }
+    const std::vector<uint8_t>& data = variable->data;
+    if (offset > data.size())
+    {
+        return ccInvalidField;
+    }
+
+    constexpr size_t maxData = maxResponse - ianaSize - 2 * sizeof(uint32_t);
+    const size_t size = std::min(data.size() - offset, maxData);
+    writeLe32(rsp, variable->attributes);
+    writeLe32(rsp + sizeof(uint32_t), data.size());
+    memcpy(rsp + 2 * sizeof(uint32_t), data.data() + offset, size);
+    rspLen = 2 * sizeof(uint32_t) + size;
+
+    return ccSuccess;
+}
+
+uint8_t Ipmi::set(const uint8_t* req, size_t reqLen)
+{
+    constexpr size_t hdrSize = guidSize + sizeof(uint32_t) + sizeof(uint8_t);
+    if (reqLen <= hdrSize || reqLen < hdrSize + req[hdrSize - 1])
+    {
+        return ccReqDataLenInvalid;
+    }
+    const uint32_t attributes = readLe32(req + guidSize);
+    const size_t nameSize = req[hdrSize - 1];
+    const uint8_t* name = req + hdrSize;
+    const uint8_t* data = name + nameSize;
+    const uint8_t* end = req + reqLen;
+    if (nameSize == 0)
+    {
+        return ccInvalidField;
+    }
+
+    if (data == end && !(attributes & EFI_VARIABLE_APPEND_WRITE))
+    {
+        const VariableKeyView key(
+            std::string_view(reinterpret_cast<const char*>(name), nameSize),
+            req);
+        if (!storage.get(key))
+        {
+            return ccDataNotPresent;
+        }
+        storage.remove(key);
+    }
+    else
+    {
+        VariableKey key;
+        key.name.assign(name, data);
+        key.guid = req;
+        storage.set(std::move(key),
+                    VariableValue{attributes, std::vector<uint8_t>(data, end)});
+    }
+    {
+        std::lock_guard<std::mutex> lock(auditLock);
+        auditQueued = true;
+    }
+    auditSignal.notify_one();
+
+    return ccSuccess;
+}
+
+uint8_t Ipmi::next(const uint8_t* req, size_t reqLen, uint8_t* rsp,
+                   size_t& rspLen)
+{
+    if (reqLen < guidSize)
+    {
+        return ccReqDataLenInvalid;
+    }
+    const std::string_view name(reinterpret_cast<const char*>(req + guidSize),
+                                reqLen - guidSize);
+
+    if (storage.empty())
+    {
+        return ccNotInState;
+    }
+    auto variable = storage.next(VariableKeyView(name, req));
+    if (!variable)
+    {
+        return ccDataNotPresent;
+    }
+    if (guidSize + variable->name.size() > maxResponse - ianaSize)
+    {
+        log<level::ERR>("Variable name is too long for IPMI response",
+                        entry("NAME=%s", variable->name.c_str()));
+        return ccUnspecified;
+    }
+
+    memcpy(rsp, variable->guid, guidSize);
+    memcpy(rsp + guidSize, variable->name.data(), variable->name.size());
+    rspLen = guidSize + variable->name.size();
+
+    return ccSuccess;
+}
@@ -0,0 +1,133 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#pragma once
+
+#include "storage.hpp"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+/**
+ * @brief IPMI OEM commands of UEFI variable storage, handled directly by the
+ *        ipmid provider without round trips to the D-Bus service.
+ */
+class Ipmi
+{
+  public:
+    /** @brief Network function: OEM/Group. */
+    static constexpr uint8_t netFn = 0x2e;
+
+    /** @brief IANA enterprise number (YADRO) of the OEM/Group commands. */
+    static constexpr uint32_t iana = 49769;
+
+    /** @brief Size of the IANA number in requests and responses. */
+    static constexpr size_t ianaSize = 3;
+
+    /** @brief Max size of response data, limited by legacy ipmid buffer. */
+    static constexpr size_t maxResponse = 64;
+
+    /** @brief OEM commands. */
+    enum Command : uint8_t
+    {
+        getVariable = 0x01,
+        setVariable = 0x02,
+        nextVariable = 0x03,
+    };
+
+    /** @brief Completion codes, see IPMI specification. */
+    enum CompletionCode : uint8_t
+    {
+        ccSuccess = 0x00,
+        ccInvalidCommand = 0xc1,
+        ccOutOfSpace = 0xc4,
+        ccReqDataLenInvalid = 0xc7,
+        ccDataNotPresent = 0xcb,
+        ccInvalidField = 0xcc,
+        ccNotInState = 0xd5,
+        ccUnspecified = 0xff,
+    };
+
+    /**
+     * @brief Constructor, starts the audit writer thread.
+     *
+     * @param[in] varStorage UEFI variable storage
+     */
+    Ipmi(Storage& varStorage);
+
+    Ipmi(const Ipmi&) = delete;
+    Ipmi& operator=(const Ipmi&) = delete;
+
+    /**
+     * @brief Destructor, stops the audit writer thread.
+     */
+    ~Ipmi();
+
+    /**
+     * @brief Register command handlers in ipmid.
+     */
+    void registerHandlers();
+
+    /**
+     * @brief Handle IPMI request.
+     *
+     * @param[in] cmd Command
+     * @param[in] req Request data
+     * @param[in] reqLen Size of request data
+     * @param[out] rsp Response data buffer, at least maxResponse bytes
+     * @param[out] rspLen Size of response data
+     *
+     * @return completion code
+     */
+    uint8_t handle(uint8_t cmd, const uint8_t* req, size_t reqLen,
+                   uint8_t* rsp, size_t& rspLen);
+
+  private:
+    /**
+     * @brief Get variable.
+     *
+     * Request: GUID[16], offset (u32), name.
+     * Response: attributes (u32), full size of data (u32), data starting
+     * from the offset, truncated to fit the response.
+     */
+    uint8_t get(const uint8_t* req, size_t reqLen, uint8_t* rsp,
+                size_t& rspLen);
+
+    /**
+     * @brief Set variable, empty data removes the variable.
+     *
+     * Request: GUID[16], attributes (u32), name size (u8), name, data.
+     * Response: empty.
+     */
+    uint8_t set(const uint8_t* req, size_t reqLen);
+
+    /**
+     * @brief Get next variable key.
+     *
+     * Request: GUID[16], name, empty name to get the first variable.
+     * Response: GUID[16], name.
+     */
+    uint8_t next(const uint8_t* req, size_t reqLen, uint8_t* rsp,
+                 size_t& rspLen);
+
+    /**
+     * @brief Write queued audit records in background: the provider has no
+     *        event loop of its own, and the journal must not be written on
+     *        the request path.
+     */
+    void auditWriter();
+
+    /** @brief UEFI variables storage. */
+    Storage& storage;
+    /** @brief Lock to protect the audit writer state. */
+    std::mutex auditLock;
+    /** @brief Signal of queued audit records or stop. */
+    std::condition_variable auditSignal;
+    /** @brief Audit records were queued since the last write. */
+    bool auditQueued = false;
+    /** @brief Stop the audit writer thread. */
+    bool stopAudit = false;
+    /** @brief Thread writing audit records. */
+    std::thread auditThread;
+};
@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <system_error>
+
+/**
+ * @brief Exclusive advisory lock of the storage file, used to guarantee
+ *        a single owner of the storage: the service, the IPMI provider or
+ *        an offline tool.
+ */
+class FileLock
+{
+  public:
+    FileLock() = default;
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+
+    /** @brief Destructor, releases the lock. */
+    ~FileLock()
+    {
+        unlock();
+    }
+
+    /**
+     * @brief Get path to the lock file for the storage file.
+     *
+     * @param[in] file Path to the storage file
+     *
+     * @return path to the lock file
+     */
+    static std::filesystem::path lockFile(const std::filesystem::path& file)
+    {
+        std::filesystem::path path = file;
+        path += ".lock";
+        return path;
+    }
+
+    /**
+     * @brief Acquire the lock.
+     *
+     * @param[in] file Path to the storage file
+     * @param[in] wait Wait for the lock if it is held by someone else
+     *
+     * @return false if the lock is held by someone else and wait is false
+     *
+     * @throw std::system_error in case of file IO errors
+     */
+    bool lock(const std::filesystem::path& file, bool wait = true)
+    {
+        unlock();
+
+        const std::filesystem::path path = lockFile(file);
+        if (path.has_parent_path())
+        {
+            std::filesystem::create_directories(path.parent_path());
+        }
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1)
+        {
+            throw std::system_error(errno, std::generic_category());
+        }
+
+        int rc;
+        do
+        {
+            rc = flock(fd, LOCK_EX | (wait ? 0 : LOCK_NB));
+        } while (rc == -1 && errno == EINTR);
+
+        if (rc == -1)
+        {
+            const int err = errno;
+            close(fd);
+            fd = -1;
+            if (err == EWOULDBLOCK)
+            {
+                return false;
+            }
+            throw std::system_error(err, std::generic_category());
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Check if the lock is acquired.
+     *
+     * @return true if the lock is held by this instance
+     */
+    bool locked() const
+    {
+        return fd != -1;
+    }
+
+    /** @brief Release the lock. */
+    void unlock()
+    {
+        if (fd != -1)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+  private:
+    /** @brief Descriptor of the locked file. */
+    int fd = -1;
+};
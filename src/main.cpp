@@ -2,12 +2,108 @@
 // Copyright (C) 2021 YADRO
 
 #include "dbus.hpp"
+#include "nvram.hpp"
 #include "version.hpp"
+#include "watcher.hpp"
 
 #include <getopt.h>
+#include <systemd/sd-event.h>
 
+#include <cerrno>
+#include <chrono>
+#include <csignal>
 #include <cstdio>
 #include <cstdlib>
+#include <list>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+/** @brief Max number of hosts in multi-host mode. */
+static constexpr size_t maxHosts = 64;
+
+/** @brief Interval of polling storages while they are loading. */
+static constexpr auto loadPollInterval = std::chrono::milliseconds(100);
+
+/**
+ * @brief Schedule polling of the storages.
+ *
+ * @param[in] timer Polling timer
+ */
+static void schedulePoll(sd_event_source* timer)
+{
+    uint64_t now;
+    sd_event_now(sd_event_source_get_event(timer), CLOCK_MONOTONIC, &now);
+    sd_event_source_set_time(
+        timer, now + std::chrono::microseconds(loadPollInterval).count());
+    sd_event_source_set_enabled(timer, SD_EVENT_ONESHOT);
+}
+
+/**
+ * @brief Poll loading, reloading and scrubbing state of the storages, the
+ *        timer is rescheduled while any of them is in progress. Queued
+ *        audit records are written on each poll. A host which storage
+ *        failed to load stays unavailable, the service exits only if all
+ *        of them failed.
+ *
+ * @param[in] timer Polling timer
+ * @param[in] userdata Pointer to the list of D-Bus objects
+ *
+ * @return 0 to continue processing of the event loop
+ */
+static int poll(sd_event_source* timer, uint64_t, void* userdata)
+{
+    auto& objects = *static_cast<std::list<DBus>*>(userdata);
+    try
+    {
+        bool busy = false;
+        bool failed = true;
+        for (auto& obj : objects)
+        {
+            busy |= !obj.checkReady();
+            busy |= obj.checkReload();
+            busy |= obj.checkScrub();
+            obj.flushAudit();
+            failed &= obj.failed();
+        }
+        if (failed)
+        {
+            sd_event_exit(sd_event_source_get_event(timer), EXIT_FAILURE);
+        }
+        else if (busy)
+        {
+            schedulePoll(timer);
+        }
+    }
+    catch (const std::exception& ex)
+    {
+        fprintf(stderr, "%s\n", ex.what());
+        sd_event_exit(sd_event_source_get_event(timer), EXIT_FAILURE);
+    }
+    return 0;
+}
+
+/**
+ * @brief Parse size value.
+ *
+ * @param[in] str string to parse
+ * @param[out] size parsed value
+ *
+ * @return false if the string is not a valid size
+ */
+static bool parseSize(const char* str, uint64_t& size)
+{
+    char* end;
+    errno = 0;
+    const unsigned long long val = strtoull(str, &end, 0);
+    if (*end || !*str || errno || val == 0)
+    {
+        return false;
+    }
+    size = val;
+    return true;
+}
 
 /** @brief Print version info. */
 static void printVersion()
@@ -25,8 +121,30 @@ static void printHelp(const char* app)
     printVersion();
     puts("Copyright (c) " UEFIVAR_YEAR " YADRO.");
     printf("Usage: %s [OPTION...]\n", app);
-    puts("  -v, --version  Print version and exit");
-    puts("  -h, --help     Print this help and exit");
+    puts("  -n, --hosts NUM               "
+         "Number of hosts to serve (multi-host mode)");
+    puts("  -s, --max-storage SIZE        "
+         "Max size of variables storage in bytes");
+    puts("  -e, --max-hwerr-storage SIZE  "
+         "Max size of HW error records storage in bytes");
+    puts("  -m, --max-var-size SIZE       "
+         "Max size of a single variable in bytes");
+    puts("  -b, --nvar DEVICE             "
+         "Keep variables in NVAR format on flash device (single host mode)");
+    puts("  -w, --max-writes NUM          "
+         "Max writes of a single variable per hour, saved with delay above");
+    puts("  -d, --write-delay SEC         "
+         "Delay of saving variables exceeded max writes (default 60)");
+    puts("  -a, --audit [GUID:]NAME[*]    "
+         "Audit only matching variables (repeatable)");
+    puts("  -r, --history SIZE            "
+         "Keep history of changes up to SIZE bytes for rollback");
+    puts("  -t, --page-size SIZE          "
+         "Keep data of variables from SIZE bytes out of memory");
+    puts("  -c, --page-cache SIZE         "
+         "Max size of paged data cached in memory (default 65536)");
+    puts("  -v, --version                 Print version and exit");
+    puts("  -h, --help                    Print this help and exit");
 }
 
 /** @brief Application entry point. */
@@ -34,18 +152,108 @@ int main(int argc, char* argv[])
 {
     // clang-format off
     const struct option longOpts[] = {
-        { "version", no_argument, nullptr, 'v' },
-        { "help",    no_argument, nullptr, 'h' },
-        { nullptr,   0,           nullptr,  0  }
+        { "hosts",             required_argument, nullptr, 'n' },
+        { "max-storage",       required_argument, nullptr, 's' },
+        { "max-hwerr-storage", required_argument, nullptr, 'e' },
+        { "max-var-size",      required_argument, nullptr, 'm' },
+        { "nvar",              required_argument, nullptr, 'b' },
+        { "max-writes",        required_argument, nullptr, 'w' },
+        { "write-delay",       required_argument, nullptr, 'd' },
+        { "audit",             required_argument, nullptr, 'a' },
+        { "history",           required_argument, nullptr, 'r' },
+        { "page-size",         required_argument, nullptr, 't' },
+        { "page-cache",        required_argument, nullptr, 'c' },
+        { "version",           no_argument,       nullptr, 'v' },
+        { "help",              no_argument,       nullptr, 'h' },
+        { nullptr,             0,                 nullptr,  0  }
     };
     // clang-format on
-    const char* shortOpts = "vh";
+    const char* shortOpts = "n:s:e:m:b:w:d:a:r:t:c:vh";
     opterr = 0; // prevent native error messages
     int val;
+    size_t hosts = 0; // single host mode
+    Storage::Limits limits;
+    Storage::WriteBudget budget;
+    std::vector<Audit::Rule> auditRules;
+    uint64_t historySize = 0; // no history
+    uint64_t pageSize = 0;    // all data in memory
+    uint64_t pageCache = 64 * 1024;
+    std::filesystem::path nvar;
     while ((val = getopt_long(argc, argv, shortOpts, longOpts, nullptr)) != -1)
     {
         switch (val)
         {
+            case 'n':
+            {
+                char* end;
+                const unsigned long num = strtoul(optarg, &end, 0);
+                if (*end || num == 0 || num > maxHosts)
+                {
+                    fprintf(stderr, "Invalid number of hosts: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                hosts = num;
+                break;
+            }
+            case 's':
+            case 'e':
+            case 'm':
+            {
+                uint64_t& limit = val == 's'   ? limits.maxStorage
+                                  : val == 'e' ? limits.maxHwErrStorage
+                                               : limits.maxVariable;
+                if (!parseSize(optarg, limit))
+                {
+                    fprintf(stderr, "Invalid size: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case 'r':
+            case 't':
+            case 'c':
+                if (!parseSize(optarg, val == 'r'   ? historySize
+                                       : val == 't' ? pageSize
+                                                    : pageCache))
+                {
+                    fprintf(stderr, "Invalid size: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'b':
+                nvar = optarg;
+                break;
+            case 'w':
+            case 'd':
+            {
+                char* end;
+                const unsigned long num = strtoul(optarg, &end, 0);
+                if (*end || !*optarg || (val == 'd' && num == 0))
+                {
+                    fprintf(stderr, "Invalid number: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                if (val == 'w')
+                {
+                    budget.writes = num;
+                }
+                else
+                {
+                    budget.delay = std::chrono::seconds(num);
+                }
+                break;
+            }
+            case 'a':
+                try
+                {
+                    auditRules.push_back(Audit::Rule::parse(optarg));
+                }
+                catch (const std::invalid_argument& ex)
+                {
+                    fprintf(stderr, "%s\n", ex.what());
+                    return EXIT_FAILURE;
+                }
+                break;
             case 'v':
                 printVersion();
                 return EXIT_SUCCESS;
@@ -62,19 +270,134 @@ int main(int argc, char* argv[])
         fprintf(stderr, "Unexpected argument: %s\n", argv[optind - 1]);
         return EXIT_FAILURE;
     }
+    if (hosts && !nvar.empty())
+    {
+        fprintf(stderr, "NVAR storage is not supported in multi-host mode\n");
+        return EXIT_FAILURE;
+    }
 
     try
     {
-        Storage storage(Storage::defaultFile);
+        sd_event* event = nullptr;
+        int rc = sd_event_default(&event);
+        if (rc < 0)
+        {
+            throw std::system_error(-rc, std::generic_category(),
+                                    "Unable to create event loop");
+        }
+        std::unique_ptr<sd_event, decltype(&sd_event_unref)> eventPtr(
+            event, sd_event_unref);
+
+        // Leave the event loop on termination to save delayed changes,
+        // signals must be blocked before starting any thread
+        sigset_t sigs;
+        sigemptyset(&sigs);
+        sigaddset(&sigs, SIGTERM);
+        sigaddset(&sigs, SIGINT);
+        sigprocmask(SIG_BLOCK, &sigs, nullptr);
+        for (const int sig : {SIGTERM, SIGINT})
+        {
+            rc = sd_event_add_signal(
+                event, nullptr, sig,
+                [](sd_event_source* src, const struct signalfd_siginfo*,
+                   void*) {
+                    return sd_event_exit(sd_event_source_get_event(src), 0);
+                },
+                nullptr);
+            if (rc < 0)
+            {
+                throw std::system_error(-rc, std::generic_category(),
+                                        "Unable to handle signal");
+            }
+        }
+
         sdbusplus::bus::bus bus = sdbusplus::bus::new_default();
+        bus.attach_event(event, SD_EVENT_PRIORITY_NORMAL);
         sdbusplus::server::manager_t mgr{bus, DBus::objectPath};
-        bus.request_name(DBus::interfaceName);
-        DBus dbus(bus, storage);
-        while (true)
+
+        // Storages and D-Bus objects, one per host.
+        // Lists never relocate elements, so references remain valid.
+        std::list<Storage> storages;
+        std::list<DBus> objects;
+        std::list<Watcher> watchers;
+
+        // Timer to poll storages while they are loading or reloading
+        sd_event_source* timer = nullptr;
+        rc = sd_event_add_time(event, &timer, CLOCK_MONOTONIC, 0, 0, poll,
+                               &objects);
+        if (rc < 0)
+        {
+            throw std::system_error(-rc, std::generic_category(),
+                                    "Unable to create timer");
+        }
+        std::unique_ptr<sd_event_source, decltype(&sd_event_source_unref)>
+            timerPtr(timer, sd_event_source_unref);
+
+        const auto startPoll = [timer]() { schedulePoll(timer); };
+
+        // Storages are loaded in background, the bus name is requested
+        // immediately, requests are rejected until the Ready property is set.
+        // Storage files replaced externally are reloaded in background.
+        // History and spill file of the NVAR storage are kept next to the
+        // default file.
+        const auto addHost = [&](const std::filesystem::path& file,
+                                 const std::string& path) {
+            if (!nvar.empty())
+            {
+                storages.emplace_back(
+                    nvar, std::make_unique<nvram::LogBackend>(nvar), true);
+            }
+            else
+            {
+                storages.emplace_back(file, true);
+            }
+            if (historySize)
+            {
+                std::filesystem::path log = file;
+                log += ".history";
+                storages.back().enableHistory(log, historySize);
+            }
+            if (pageSize)
+            {
+                std::filesystem::path spill = file;
+                spill += ".cold";
+                storages.back().enableTiering(spill, pageSize, pageCache);
+            }
+            objects.emplace_back(bus, path.c_str(), storages.back(),
+                                 startPoll);
+            if (!nvar.empty())
+            {
+                // flash device is owned by the service, nothing to watch
+                return;
+            }
+            DBus& obj = objects.back();
+            watchers.emplace_back(event, file, [&obj, timer]() {
+                obj.reload();
+                schedulePoll(timer);
+            });
+        };
+        if (!hosts)
         {
-            bus.process_discard();
-            bus.wait();
+            addHost(Storage::defaultFile, DBus::objectPath);
         }
+        for (size_t host = 0; host < hosts; ++host)
+        {
+            const std::string name = "host" + std::to_string(host);
+            addHost(std::filesystem::path(Storage::hostDir) / (name + ".json"),
+                    std::string(DBus::objectPath) + '/' + name);
+        }
+
+        for (auto& storage : storages)
+        {
+            storage.setLimits(limits);
+            storage.setWriteBudget(budget);
+            storage.setAuditFilter(auditRules);
+        }
+
+        bus.request_name(DBus::interfaceName);
+
+        rc = sd_event_loop(event);
+        return rc < 0 ? EXIT_FAILURE : rc;
     }
     catch (const std::exception& ex)
     {
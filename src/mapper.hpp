@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <system_error>
+
+/** @brief Map file to memory. */
+class FileMapper
+{
+  public:
+    /** @brief Destructor. */
+    ~FileMapper()
+    {
+        if (data != MAP_FAILED)
+        {
+            munmap(data, size);
+        }
+    }
+
+    /**
+     * @brief Load file.
+     *
+     * @param[in] file Path to the file to load
+     *
+     * @throw std::system_error in case of errors
+     */
+    void load(const std::filesystem::path& file)
+    {
+        // open file
+        const int fd = open(file.c_str(), O_RDONLY);
+        if (fd == -1)
+        {
+            throw std::system_error(errno, std::generic_category());
+        }
+
+        // get file size
+        struct stat st;
+        if (fstat(fd, &st) == -1)
+        {
+            const int err = errno;
+            close(fd);
+            throw std::system_error(err, std::generic_category());
+        }
+        size = st.st_size;
+
+        // map file to memory
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            const int err = errno;
+            close(fd);
+            throw std::system_error(err, std::generic_category());
+        }
+        close(fd);
+    }
+
+    void* data = MAP_FAILED;
+    size_t size = 0;
+};
@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#pragma once
+
+#include <atomic>
+#include <memory_resource>
+
+/**
+ * @brief Memory resource that counts bytes allocated from the upstream.
+ */
+class CountingResource : public std::pmr::memory_resource
+{
+  public:
+    /**
+     * @brief Constructor.
+     *
+     * @param[in] upstream Resource to allocate memory from
+     */
+    explicit CountingResource(
+        std::pmr::memory_resource* upstream = std::pmr::new_delete_resource()) :
+        upstream(upstream)
+    {}
+
+    /**
+     * @brief Get number of allocated bytes.
+     *
+     * @return size of memory in use
+     */
+    size_t used() const
+    {
+        return allocated.load(std::memory_order_relaxed);
+    }
+
+  private:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+        void* ptr = upstream->allocate(bytes, alignment);
+        allocated.fetch_add(bytes, std::memory_order_relaxed);
+        return ptr;
+    }
+
+    void do_deallocate(void* ptr, size_t bytes, size_t alignment) override
+    {
+        upstream->deallocate(ptr, bytes, alignment);
+        allocated.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
+    bool do_is_equal(
+        const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+
+    /** @brief Upstream resource. */
+    std::pmr::memory_resource* upstream;
+    /** @brief Number of allocated bytes. */
+    std::atomic<size_t> allocated = 0;
+};
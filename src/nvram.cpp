@@ -1,21 +1,87 @@
 // SPDX-License-Identifier: Apache-2.0
 // Copyright (C) 2021 YADRO
 
+#include "crc32c.hpp"
+#include "diff.hpp"
 #include "edk.hpp"
+#include "field.hpp"
+#include "mapper.hpp"
 #include "nvram.hpp"
 
 #include <endian.h>
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <unistd.h>
+#include <mtd/mtd-user.h>
+#include <sys/ioctl.h>
 
+#include <algorithm>
 #include <cstring>
-#include <system_error>
 
 namespace nvram
 {
 
+/** @brief Fields of EFI_FIRMWARE_VOLUME_HEADER. */
+struct VolumeHeader
+{
+    using FileSystemGuid = field::Bytes<16, sizeof(EFI_GUID)>;
+    using ExtHeaderOffset = field::Field<uint16_t, 52>;
+
+    static constexpr size_t size = sizeof(EFI_FIRMWARE_VOLUME_HEADER);
+};
+
+static_assert(field::at<VolumeHeader::FileSystemGuid>(
+    offsetof(EFI_FIRMWARE_VOLUME_HEADER, FileSystemGuid),
+    sizeof(EFI_FIRMWARE_VOLUME_HEADER::FileSystemGuid)));
+static_assert(field::at<VolumeHeader::ExtHeaderOffset>(
+    offsetof(EFI_FIRMWARE_VOLUME_HEADER, ExtHeaderOffset),
+    sizeof(EFI_FIRMWARE_VOLUME_HEADER::ExtHeaderOffset)));
+
+/** @brief Fields of EFI_FIRMWARE_VOLUME_EXT_HEADER. */
+struct VolumeExtHeader
+{
+    using FvName = field::Bytes<0, sizeof(EFI_GUID)>;
+    using ExtHeaderSize = field::Field<uint32_t, 16>;
+
+    static constexpr size_t size = sizeof(EFI_FIRMWARE_VOLUME_EXT_HEADER);
+};
+
+static_assert(field::at<VolumeExtHeader::FvName>(
+    offsetof(EFI_FIRMWARE_VOLUME_EXT_HEADER, FvName),
+    sizeof(EFI_FIRMWARE_VOLUME_EXT_HEADER::FvName)));
+static_assert(field::at<VolumeExtHeader::ExtHeaderSize>(
+    offsetof(EFI_FIRMWARE_VOLUME_EXT_HEADER, ExtHeaderSize),
+    sizeof(EFI_FIRMWARE_VOLUME_EXT_HEADER::ExtHeaderSize)));
+
+/** @brief Fields of EFI_FFS_FILE_HEADER. */
+struct FileHeader
+{
+    using Name = field::Bytes<0, sizeof(EFI_GUID)>;
+    using Size = field::Field<uint32_t, 20, 3>;
+
+    static constexpr size_t size = sizeof(EFI_FFS_FILE_HEADER);
+};
+
+static_assert(field::at<FileHeader::Name>(offsetof(EFI_FFS_FILE_HEADER, Name),
+                                          sizeof(EFI_FFS_FILE_HEADER::Name)));
+static_assert(field::at<FileHeader::Size>(offsetof(EFI_FFS_FILE_HEADER, Size),
+                                          sizeof(EFI_FFS_FILE_HEADER::Size)));
+
+/**
+ * @brief Convert GUID between EFI format (mixed endian) and uuid_t (flat
+ *        array), the conversion is symmetric.
+ *
+ * @param[in] src source GUID
+ * @param[out] dst destination GUID
+ */
+static void swapGuid(const uint8_t* src, uint8_t* dst)
+{
+    const uint8_t order[] = {3, 2, 1, 0, 5, 4, 7, 6};
+    for (size_t i = 0; i < sizeof(order); ++i)
+    {
+        dst[i] = src[order[i]];
+    }
+    memcpy(dst + sizeof(order), src + sizeof(order),
+           sizeof(EFI_GUID) - sizeof(order));
+}
+
 /** @brief GUID wrapper. */
 class Guid
 {
@@ -28,72 +94,31 @@ class Guid
      */
     Guid(const EFI_GUID& guid)
     {
-        *reinterpret_cast<uint32_t*>(&uuid[0]) = htobe32(guid.Data1);
-        *reinterpret_cast<uint16_t*>(&uuid[4]) = htobe16(guid.Data2);
-        *reinterpret_cast<uint16_t*>(&uuid[6]) = htobe16(guid.Data3);
+        const uint32_t data1 = htobe32(guid.Data1);
+        const uint16_t data2 = htobe16(guid.Data2);
+        const uint16_t data3 = htobe16(guid.Data3);
+        memcpy(&uuid[0], &data1, sizeof(data1));
+        memcpy(&uuid[4], &data2, sizeof(data2));
+        memcpy(&uuid[6], &data3, sizeof(data3));
         memcpy(&uuid[8], &guid.Data4, sizeof(guid.Data4));
     }
 
-    bool operator!=(const Guid& rhs) const
-    {
-        return uuid_compare(uuid, rhs.uuid) != 0;
-    }
-
-    uuid_t uuid;
-};
-
-/** @brief Map file to memory. */
-class FileMapper
-{
-  public:
-    /** @brief Destructor. */
-    ~FileMapper()
-    {
-        if (data != MAP_FAILED)
-        {
-            munmap(data, size);
-        }
-    }
-
     /**
-     * @brief Load file.
-     *
-     * @param[in] file Path to the file to load
+     * @brief Constructor.
      *
-     * @throw std::system_error in case of errors
+     * @param[in] data GUID in EFI format as stored in the image
      */
-    void load(const std::filesystem::path& file)
+    explicit Guid(const uint8_t* data)
     {
-        // open file
-        const int fd = open(file.c_str(), O_RDONLY);
-        if (fd == -1)
-        {
-            throw std::system_error(errno, std::generic_category());
-        }
-
-        // get file size
-        struct stat st;
-        if (fstat(fd, &st) == -1)
-        {
-            const int err = errno;
-            close(fd);
-            throw std::system_error(err, std::generic_category());
-        }
-        size = st.st_size;
+        swapGuid(data, uuid);
+    }
 
-        // map file to memory
-        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
-        if (data == MAP_FAILED)
-        {
-            const int err = errno;
-            close(fd);
-            throw std::system_error(err, std::generic_category());
-        }
-        close(fd);
+    bool operator!=(const Guid& rhs) const
+    {
+        return memcmp(uuid, rhs.uuid, sizeof(uuid)) != 0;
     }
 
-    void* data = MAP_FAILED;
-    size_t size = 0;
+    uuid_t uuid;
 };
 
 /** @brief NVRAM parser wrapper. */
@@ -111,6 +136,7 @@ class Nvram
         'N' | ('V' << 8) | ('A' << 16) | ('R' << 24);
 
     static constexpr uint32_t flagRuntime = 0b00000001;
+    static constexpr uint32_t flagAsciiName = 0b00000010;
     static constexpr uint32_t flagDataOnly = 0b00001000;
     static constexpr uint32_t flagHwError = 0b00100000;
     static constexpr uint32_t flagAuthWrite = 0b01000000;
@@ -118,6 +144,7 @@ class Nvram
 
     static constexpr uint32_t lastNodeId = 0x00ffffff;
 
+    /** @brief Reference layout of NVAR node header. */
     struct NodeHeader
     {
         uint32_t signature;
@@ -126,19 +153,32 @@ class Nvram
         uint8_t flags;
     } __attribute__((packed));
 
+    /** @brief Fields of NVAR node header. */
+    struct Node
+    {
+        using Signature = field::Field<uint32_t, 0>;
+        using Size = field::Field<uint16_t, 4>;
+        using Next = field::Field<uint32_t, 6, 3>;
+        using Flags = field::Field<uint8_t, 9>;
+
+        static constexpr size_t size = sizeof(NodeHeader);
+    };
+
     /**
      * @brief Parse NVRAM dump.
      *
      * @param[in] data Pointer to the buffer to parse
      * @param[in] size Size of the buffer in bytes
+     * @param[in] resource Memory resource of the variables container
      *
      * @return array of UEFI variables
      *
      * @throw std::runtime_error in case of format errors
      */
-    Variables parse(const uint8_t* data, size_t size)
+    Variables parse(const uint8_t* data, size_t size,
+                    std::pmr::memory_resource* resource)
     {
-        if (size < sizeof(NodeHeader))
+        if (size < Node::size)
         {
             throw std::runtime_error("Not enough data in NVRAM");
         }
@@ -146,24 +186,72 @@ class Nvram
         dumpStart = data;
         dumpSize = size;
 
-        Variables variables;
+        Variables variables(resource);
 
-        const NodeHeader* node = reinterpret_cast<const NodeHeader*>(data);
-        while (isPtrValid(node, sizeof(*node)) &&
-               node->signature == nvarSignature)
+        const uint8_t* node = data;
+        while (isPtrValid(node, Node::size) &&
+               field::get<Node::Signature>(node) == nvarSignature)
         {
-            if ((node->flags & flagValid) && !(node->flags & flagDataOnly))
+            const uint8_t flags = field::get<Node::Flags>(node);
+            if ((flags & flagValid) && !(flags & flagDataOnly))
             {
                 auto [key, value] = readVariable(node);
                 variables.insert(std::make_pair(key, value));
             }
             // move to the next node
-            node = reinterpret_cast<const NodeHeader*>(
-                reinterpret_cast<const uint8_t*>(node) + node->size);
+            const size_t nodeSize = field::get<Node::Size>(node);
+            if (nodeSize < Node::size)
+            {
+                throw std::runtime_error("Invalid header");
+            }
+            node += nodeSize;
         }
         return variables;
     }
 
+    /**
+     * @brief Get variable attributes from node flags.
+     *
+     * @param[in] flags variable flags
+     *
+     * @return variable attributes
+     */
+    static uint32_t getAttributes(uint32_t flags)
+    {
+        uint32_t attr =
+            EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS;
+
+        if (flags & flagRuntime)
+            attr |= EFI_VARIABLE_RUNTIME_ACCESS;
+        if (flags & flagHwError)
+            attr |= EFI_VARIABLE_HARDWARE_ERROR_RECORD;
+        if (flags & flagAuthWrite)
+            attr |= EFI_VARIABLE_AUTHENTICATED_WRITE_ACCESS;
+
+        return attr;
+    }
+
+    /**
+     * @brief Get node flags from variable attributes.
+     *
+     * @param[in] attributes variable attributes
+     *
+     * @return node flags
+     */
+    static uint8_t getFlags(uint32_t attributes)
+    {
+        uint8_t flags = flagValid | flagAsciiName;
+
+        if (attributes & EFI_VARIABLE_RUNTIME_ACCESS)
+            flags |= flagRuntime;
+        if (attributes & EFI_VARIABLE_HARDWARE_ERROR_RECORD)
+            flags |= flagHwError;
+        if (attributes & EFI_VARIABLE_AUTHENTICATED_WRITE_ACCESS)
+            flags |= flagAuthWrite;
+
+        return flags;
+    }
+
   private:
     /**
      * @brief Construct variable from node.
@@ -175,19 +263,18 @@ class Nvram
      * @throw std::runtime_error in case of format errors
      */
     std::tuple<VariableKey, VariableValue>
-        readVariable(const NodeHeader* node) const
+        readVariable(const uint8_t* node) const
     {
         VariableKey key;
         VariableValue value;
 
-        if (node->size < sizeof(NodeHeader))
+        const size_t nodeSize = field::get<Node::Size>(node);
+        if (nodeSize < Node::size)
         {
             throw std::runtime_error("Invalid header");
         }
-        const uint8_t* payloadStart =
-            reinterpret_cast<const uint8_t*>(node) + sizeof(NodeHeader);
-        const uint8_t* payloadEnd =
-            reinterpret_cast<const uint8_t*>(node) + node->size;
+        const uint8_t* payloadStart = node + Node::size;
+        const uint8_t* payloadEnd = node + nodeSize;
         if (!isPtrValid(payloadStart, 1) || !isPtrValid(payloadEnd - 1, 1))
         {
             throw std::runtime_error("Invalid header");
@@ -195,7 +282,9 @@ class Nvram
 
         // vendor guid
         const uint8_t guidIndex = *payloadStart;
-        getGuid(guidIndex, key.guid);
+        uuid_t guid;
+        getGuid(guidIndex, guid);
+        key.guid = guid;
         ++payloadStart; // skip GUID index
 
         // variable name
@@ -212,20 +301,18 @@ class Nvram
         ++payloadStart; // skip last null
 
         // variable attributes
-        value.attributes = getAttributes(node->flags);
+        value.attributes = getAttributes(field::get<Node::Flags>(node));
 
         // value data
-        const NodeHeader* dataNode = getLastNode(node);
+        const uint8_t* dataNode = getLastNode(node);
         if (!dataNode)
         {
             throw std::runtime_error("Data not found");
         }
         if (dataNode != node)
         {
-            payloadStart =
-                reinterpret_cast<const uint8_t*>(dataNode) + sizeof(NodeHeader);
-            payloadEnd =
-                reinterpret_cast<const uint8_t*>(dataNode) + dataNode->size;
+            payloadStart = dataNode + Node::size;
+            payloadEnd = dataNode + field::get<Node::Size>(dataNode);
             if (!isPtrValid(payloadStart, 1) || !isPtrValid(payloadEnd - 1, 1))
             {
                 throw std::runtime_error("Data out of range");
@@ -247,10 +334,9 @@ class Nvram
      *
      * @return last node or nullptr if not found
      */
-    const NodeHeader* getLastNode(const NodeHeader* node) const
+    const uint8_t* getLastNode(const uint8_t* node) const
     {
-        uint32_t next =
-            *reinterpret_cast<const uint32_t*>(node->next) & 0x00ffffff;
+        uint32_t next = field::get<Node::Next>(node);
 
         while (next != lastNodeId)
         {
@@ -259,16 +345,15 @@ class Nvram
                 return nullptr;
             }
 
-            node = reinterpret_cast<const NodeHeader*>(
-                reinterpret_cast<const uint8_t*>(node) + next);
+            node += next;
 
-            if (!isPtrValid(node, sizeof(*node)) ||
-                node->signature != nvarSignature)
+            if (!isPtrValid(node, Node::size) ||
+                field::get<Node::Signature>(node) != nvarSignature)
             {
                 return nullptr;
             }
 
-            next = *reinterpret_cast<const uint32_t*>(node->next) & 0x00ffffff;
+            next = field::get<Node::Next>(node);
         }
 
         return node;
@@ -284,37 +369,13 @@ class Nvram
      */
     void getGuid(uint8_t index, uuid_t guid) const
     {
-        const EFI_GUID* zeroGuid = reinterpret_cast<const EFI_GUID*>(
-            dumpStart + dumpSize - sizeof(EFI_GUID));
-        const EFI_GUID* indexGuid = zeroGuid - index;
+        const uint8_t* zeroGuid = dumpStart + dumpSize - sizeof(EFI_GUID);
+        const uint8_t* indexGuid = zeroGuid - index * sizeof(EFI_GUID);
         if (!isPtrValid(indexGuid, sizeof(EFI_GUID)))
         {
             throw std::runtime_error("GUID not found");
         }
-        Guid id(*indexGuid);
-        uuid_copy(guid, id.uuid);
-    }
-
-    /**
-     * @brief Get variable attributes from node flags.
-     *
-     * @param[in] flags variable flags
-     *
-     * @return variable attributes
-     */
-    uint32_t getAttributes(uint32_t flags) const
-    {
-        uint32_t attr =
-            EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS;
-
-        if (flags & flagRuntime)
-            attr |= EFI_VARIABLE_RUNTIME_ACCESS;
-        if (flags & flagHwError)
-            attr |= EFI_VARIABLE_HARDWARE_ERROR_RECORD;
-        if (flags & flagAuthWrite)
-            attr |= EFI_VARIABLE_AUTHENTICATED_WRITE_ACCESS;
-
-        return attr;
+        swapGuid(indexGuid, guid);
     }
 
     /**
@@ -336,6 +397,16 @@ class Nvram
     size_t dumpSize;
 };
 
+static_assert(field::at<Nvram::Node::Signature>(
+    offsetof(Nvram::NodeHeader, signature),
+    sizeof(Nvram::NodeHeader::signature)));
+static_assert(field::at<Nvram::Node::Size>(offsetof(Nvram::NodeHeader, size),
+                                           sizeof(Nvram::NodeHeader::size)));
+static_assert(field::at<Nvram::Node::Next>(offsetof(Nvram::NodeHeader, next),
+                                           sizeof(Nvram::NodeHeader::next)));
+static_assert(field::at<Nvram::Node::Flags>(
+    offsetof(Nvram::NodeHeader, flags), sizeof(Nvram::NodeHeader::flags)));
+
 Variables parseVolume(const std::filesystem::path& file)
 {
     FileMapper fileMap;
@@ -344,59 +415,749 @@ Variables parseVolume(const std::filesystem::path& file)
 
     // Unpack volume
 
-    if (fileMap.size < sizeof(EFI_FIRMWARE_VOLUME_HEADER))
+    if (fileMap.size < VolumeHeader::size)
         throw std::runtime_error("Invalid volume header");
 
-    const EFI_FIRMWARE_VOLUME_HEADER* volHdr =
-        reinterpret_cast<const EFI_FIRMWARE_VOLUME_HEADER*>(data);
-
-    if (Guid(volHdr->FileSystemGuid) != Guid(EFI_FIRMWARE_FILE_SYSTEM2_GUID))
+    if (Guid(field::data<VolumeHeader::FileSystemGuid>(data)) !=
+        Guid(EFI_FIRMWARE_FILE_SYSTEM2_GUID))
         throw std::runtime_error("Unsupported firmware file system");
-    if (!volHdr->ExtHeaderOffset)
+    const size_t extOffset = field::get<VolumeHeader::ExtHeaderOffset>(data);
+    if (!extOffset)
         throw std::runtime_error("Extended header not found");
-    if (fileMap.size <
-        volHdr->ExtHeaderOffset + sizeof(EFI_FIRMWARE_VOLUME_EXT_HEADER))
+    if (fileMap.size < extOffset + VolumeExtHeader::size)
         throw std::runtime_error("Invalid extended header");
 
-    const EFI_FIRMWARE_VOLUME_EXT_HEADER* volExtHdr =
-        reinterpret_cast<const EFI_FIRMWARE_VOLUME_EXT_HEADER*>(
-            reinterpret_cast<const uint8_t*>(volHdr) + volHdr->ExtHeaderOffset);
+    const uint8_t* volExtHdr = data + extOffset;
 
-    if (Guid(volExtHdr->FvName) != Guid(Nvram::volumeGuid))
+    if (Guid(field::data<VolumeExtHeader::FvName>(volExtHdr)) !=
+        Guid(Nvram::volumeGuid))
         throw std::runtime_error("Unsupported volume");
 
     // Unpack file
 
     // FFS file header is 8-byte aligned
-    const uint8_t* ffsStart =
-        reinterpret_cast<const uint8_t*>(volExtHdr) + volExtHdr->ExtHeaderSize;
-    ffsStart += reinterpret_cast<size_t>(ffsStart) % 8;
+    size_t ffsOffset =
+        extOffset + field::get<VolumeExtHeader::ExtHeaderSize>(volExtHdr);
+    ffsOffset = (ffsOffset + 7) & ~static_cast<size_t>(7);
 
-    if (fileMap.size < ffsStart - data + sizeof(EFI_FFS_FILE_HEADER))
+    if (fileMap.size < ffsOffset + FileHeader::size)
         throw std::runtime_error("FFS file header not found");
 
-    const EFI_FFS_FILE_HEADER* ffsHdr =
-        reinterpret_cast<const EFI_FFS_FILE_HEADER*>(ffsStart);
+    const uint8_t* ffsHdr = data + ffsOffset;
 
-    if (Guid(ffsHdr->Name) != Guid(Nvram::ffsGuid))
+    if (Guid(field::data<FileHeader::Name>(ffsHdr)) != Guid(Nvram::ffsGuid))
         throw std::runtime_error("Unsupported NVRAM file system");
 
     // Unpack NVRAM data
 
-    const uint8_t* nvramStart =
-        reinterpret_cast<const uint8_t*>(ffsHdr) + sizeof(EFI_FFS_FILE_HEADER);
-    const size_t nvramSize =
-        (*reinterpret_cast<const uint32_t*>(ffsHdr->Size) & 0x00ffffff) -
-        sizeof(EFI_FFS_FILE_HEADER);
-    if (fileMap.size < nvramStart - data + nvramSize)
+    const size_t ffsSize = field::get<FileHeader::Size>(ffsHdr);
+    if (ffsSize < FileHeader::size || fileMap.size < ffsOffset + ffsSize)
         throw std::runtime_error("Unexpected end of NVRAM file");
 
-    return parseNvram(nvramStart, nvramSize);
+    return parseNvram(ffsHdr + FileHeader::size, ffsSize - FileHeader::size);
+}
+
+Variables parseNvram(const uint8_t* data, size_t size,
+                     std::pmr::memory_resource* resource)
+{
+    return Nvram().parse(data, size, resource);
+}
+
+/** @brief Value of the erased flash byte. */
+static constexpr uint8_t erasedByte = 0xff;
+
+/** @brief Fields of the compaction journal header, followed by entries. */
+struct JournalHeader
+{
+    static constexpr uint64_t signature =
+        'N' | ('V' << 8) | ('A' << 16) | ('R' << 24) |
+        (static_cast<uint64_t>('J' | ('R' << 8) | ('N' << 16) | ('L' << 24))
+         << 32);
+
+    using Signature = field::Field<uint64_t, 0>;
+    using Size = field::Field<uint32_t, 8>;     ///< Size of all entries
+    using Checksum = field::Field<uint32_t, 12>; ///< CRC32C of all entries
+
+    static constexpr size_t size = 16;
+};
+
+/** @brief Fields of the compaction journal entry, followed by data. */
+struct JournalEntry
+{
+    static constexpr uint32_t flagErase = 1;
+
+    using Offset = field::Field<uint32_t, 0>; ///< Offset in the NVAR area
+    using Size = field::Field<uint32_t, 4>;   ///< Size of data
+    using Flags = field::Field<uint32_t, 8>;
+
+    static constexpr size_t size = 12;
+};
+
+LogBackend::LogBackend(const std::filesystem::path& device, size_t size,
+                       size_t eraseSize) :
+    blockSize(eraseSize)
+{
+    fd = open(device.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        throw std::system_error(errno, std::generic_category(),
+                                device.string());
+    }
+
+    try
+    {
+        struct stat st;
+        if (fstat(fd, &st) == -1)
+        {
+            throw std::system_error(errno, std::generic_category());
+        }
+
+        mtd = S_ISCHR(st.st_mode);
+        if (mtd)
+        {
+            mtd_info_user info;
+            if (ioctl(fd, MEMGETINFO, &info) == -1)
+            {
+                throw std::system_error(errno, std::generic_category());
+            }
+            size = info.size;
+            blockSize = info.erasesize;
+        }
+        else if (st.st_size)
+        {
+            size = st.st_size;
+        }
+        else if (!size)
+        {
+            size = defaultSize;
+        }
+
+        // NVAR area and the spare region take at least a block each
+        if (size < 2 * blockSize || size % blockSize)
+        {
+            throw std::runtime_error("Invalid size of NVAR storage " +
+                                     device.string());
+        }
+        spareSize = size / blockSize / 2 * blockSize;
+
+        if (!mtd && !st.st_size)
+        {
+            // new plain file: create as erased flash
+            const std::vector<uint8_t> blank(size, erasedByte);
+            store(0, blank.data(), size);
+            image.assign(size - spareSize, erasedByte);
+        }
+        else
+        {
+            image.resize(size - spareSize);
+            read();
+        }
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+}
+
+LogBackend::~LogBackend()
+{
+    close(fd);
+}
+
+size_t LogBackend::erased() const
+{
+    return erasedBlocks;
+}
+
+void LogBackend::read()
+{
+    fetch(0, image.data(), image.size());
+}
+
+void LogBackend::fetch(size_t offset, uint8_t* data, size_t size)
+{
+    ssize_t rc;
+    for (size_t pos = 0; pos < size; pos += rc)
+    {
+        rc = pread(fd, data + pos, size - pos, offset + pos);
+        if (rc == -1 && errno == EINTR)
+        {
+            rc = 0;
+        }
+        else if (rc <= 0)
+        {
+            throw std::system_error(rc ? errno : EIO, std::generic_category());
+        }
+    }
+}
+
+void LogBackend::recover()
+{
+    std::vector<uint8_t> spare(spareSize);
+    fetch(image.size(), spare.data(), spare.size());
+    const auto used = std::find_if(spare.rbegin(), spare.rend(), [](uint8_t b) {
+        return b != erasedByte;
+    });
+    if (used == spare.rend())
+    {
+        return;
+    }
+
+    // the journal without the valid header was not complete, the log
+    // wasn't touched yet
+    const uint8_t* hdr = spare.data();
+    const size_t size = field::get<JournalHeader::Size>(hdr);
+    if (field::get<JournalHeader::Signature>(hdr) == JournalHeader::signature &&
+        size <= spare.size() - JournalHeader::size &&
+        field::get<JournalHeader::Checksum>(hdr) ==
+            crc32c(hdr + JournalHeader::size, size))
+    {
+        std::vector<Rewrite> changes;
+        const uint8_t* ptr = hdr + JournalHeader::size;
+        const uint8_t* end = ptr + size;
+        while (ptr < end)
+        {
+            Rewrite change;
+            change.offset = field::get<JournalEntry::Offset>(ptr);
+            change.erase = field::get<JournalEntry::Flags>(ptr) &
+                           JournalEntry::flagErase;
+            const size_t dataSize = field::get<JournalEntry::Size>(ptr);
+            ptr += JournalEntry::size;
+            if (static_cast<size_t>(end - ptr) < dataSize ||
+                change.offset + dataSize > image.size())
+            {
+                throw std::runtime_error("Invalid NVAR journal");
+            }
+            change.data.assign(ptr, ptr + dataSize);
+            ptr += dataSize;
+            changes.push_back(std::move(change));
+        }
+        apply(changes);
+        fdatasync(fd);
+    }
+    clearJournal(spare.rend() - used);
+}
+
+void LogBackend::journal(const std::vector<Rewrite>& changes)
+{
+    size_t size = 0;
+    for (const auto& change : changes)
+    {
+        size += JournalEntry::size + change.data.size();
+    }
+    if (JournalHeader::size + size > spareSize)
+    {
+        throw std::length_error("NVAR storage is full");
+    }
+
+    std::vector<uint8_t> entries(size);
+    uint8_t* ptr = entries.data();
+    for (const auto& change : changes)
+    {
+        field::set<JournalEntry::Offset>(ptr, change.offset);
+        field::set<JournalEntry::Size>(ptr, change.data.size());
+        field::set<JournalEntry::Flags>(
+            ptr, change.erase ? JournalEntry::flagErase : 0);
+        ptr += JournalEntry::size;
+        std::copy(change.data.begin(), change.data.end(), ptr);
+        ptr += change.data.size();
+    }
+
+    uint8_t hdr[JournalHeader::size];
+    field::set<JournalHeader::Signature>(hdr, JournalHeader::signature);
+    field::set<JournalHeader::Size>(hdr, size);
+    field::set<JournalHeader::Checksum>(hdr,
+                                        crc32c(entries.data(), size));
+
+    // entries must be on the media before the header validates them
+    store(image.size() + JournalHeader::size, entries.data(), size);
+    fdatasync(fd);
+    store(image.size(), hdr, sizeof(hdr));
+    fdatasync(fd);
+}
+
+void LogBackend::clearJournal(size_t used)
+{
+    for (size_t block = 0; block < used; block += blockSize)
+    {
+        erase(image.size() + block);
+    }
+    fdatasync(fd);
+}
+
+void LogBackend::apply(const std::vector<Rewrite>& changes)
+{
+    for (const auto& change : changes)
+    {
+        if (change.erase)
+        {
+            erase(change.offset / blockSize * blockSize);
+        }
+        if (!change.data.empty())
+        {
+            program(change.offset, change.data.data(), change.data.size());
+        }
+    }
+}
+
+std::optional<Variables>
+    LogBackend::load(std::pmr::memory_resource* resource)
+{
+    // the device is written only by its owner, so the journal is replayed
+    // here, under the storage lock, rather than on opening
+    read();
+    recover();
+    Variables vars = scan(resource);
+    if (nodes.empty() && guids.empty())
+    {
+        return std::nullopt;
+    }
+    return vars;
+}
+
+Variables LogBackend::scan(std::pmr::memory_resource* resource)
+{
+    guids.clear();
+    nodes.clear();
+
+    // GUID table grows down from the end of the partition to the free space
+    size_t end = image.size();
+    while (end >= sizeof(EFI_GUID) &&
+           guids.size() <= std::numeric_limits<uint8_t>::max() &&
+           std::any_of(image.begin() + end - sizeof(EFI_GUID),
+                       image.begin() + end,
+                       [](uint8_t byte) { return byte != erasedByte; }))
+    {
+        end -= sizeof(EFI_GUID);
+        Guid guid;
+        swapGuid(&image[end], guid.data());
+        guids.push_back(guid);
+    }
+
+    // log of nodes grows up from the start of the partition
+    Variables vars(resource);
+    size_t offset = 0;
+    while (offset + Nvram::Node::size <= end)
+    {
+        const uint8_t* node = &image[offset];
+        if (field::get<Nvram::Node::Signature>(node) != Nvram::nvarSignature)
+        {
+            break;
+        }
+        const size_t size = field::get<Nvram::Node::Size>(node);
+        if (size < Nvram::Node::size || offset + size > end)
+        {
+            throw std::runtime_error("Invalid NVAR node");
+        }
+
+        const uint8_t flags = field::get<Nvram::Node::Flags>(node);
+        if ((flags & Nvram::flagValid) && !(flags & Nvram::flagDataOnly))
+        {
+            const uint8_t* payload = node + Nvram::Node::size;
+            const uint8_t* payloadEnd = node + size;
+            if (payload >= payloadEnd || *payload >= guids.size())
+            {
+                throw std::runtime_error("GUID not found");
+            }
+            VariableKey key;
+            key.guid = guids[*payload].data();
+            ++payload;
+            const uint8_t* name = payload;
+            payload = std::find(payload, payloadEnd, 0);
+            if (payload == payloadEnd)
+            {
+                throw std::runtime_error("Variable name too long");
+            }
+            key.name.assign(name, payload);
+            ++payload;
+
+            // data can be moved to the chain of data-only nodes
+            size_t last = offset;
+            uint32_t next = field::get<Nvram::Node::Next>(node);
+            while (next != Nvram::lastNodeId)
+            {
+                last += next;
+                if (!next || last + Nvram::Node::size > end)
+                {
+                    throw std::runtime_error("Data not found");
+                }
+                const uint8_t* dataNode = &image[last];
+                const size_t dataSize = field::get<Nvram::Node::Size>(dataNode);
+                if (field::get<Nvram::Node::Signature>(dataNode) !=
+                        Nvram::nvarSignature ||
+                    last + dataSize > end)
+                {
+                    throw std::runtime_error("Data out of range");
+                }
+                payload = dataNode + Nvram::Node::size;
+                payloadEnd = dataNode + dataSize;
+                next = field::get<Nvram::Node::Next>(dataNode);
+            }
+
+            VariableValue value;
+            value.attributes = Nvram::getAttributes(flags);
+            value.data.assign(payload, std::max(payload, payloadEnd));
+
+            // the newer node wins if the older one wasn't invalidated
+            auto it = nodes.find(key);
+            if (it != nodes.end())
+            {
+                invalidate(it->second);
+            }
+            nodes[key] = offset;
+            vars[std::move(key)] = std::move(value);
+        }
+
+        offset += size;
+    }
+    tail = offset;
+
+    return vars;
+}
+
+uint8_t LogBackend::guidIndex(const uuid_t guid, std::vector<Guid>& table)
+{
+    for (size_t i = 0; i < table.size(); ++i)
+    {
+        if (memcmp(table[i].data(), guid, sizeof(uuid_t)) == 0)
+        {
+            return i;
+        }
+    }
+    if (table.size() > std::numeric_limits<uint8_t>::max())
+    {
+        throw std::length_error("NVAR GUID table is full");
+    }
+    Guid entry;
+    memcpy(entry.data(), guid, sizeof(uuid_t));
+    table.push_back(entry);
+    return table.size() - 1;
+}
+
+bool LogBackend::storable(uint32_t attributes) const
+{
+    return Nvram::getAttributes(Nvram::getFlags(attributes)) == attributes;
+}
+
+std::vector<uint8_t> LogBackend::makeNode(uint8_t index,
+                                          const VariableKey& key,
+                                          const VariableValue& value)
+{
+    const size_t size =
+        Nvram::Node::size + 1 + key.name.size() + 1 + value.data.size();
+    if (size > std::numeric_limits<uint16_t>::max())
+    {
+        throw std::length_error("Variable is too large for NVAR node");
+    }
+    if (Nvram::getAttributes(Nvram::getFlags(value.attributes)) !=
+        value.attributes)
+    {
+        throw std::invalid_argument("Attributes are not supported by NVAR");
+    }
+
+    std::vector<uint8_t> node(size);
+    uint8_t* ptr = node.data();
+    field::set<Nvram::Node::Signature>(ptr, Nvram::nvarSignature);
+    field::set<Nvram::Node::Size>(ptr, size);
+    field::set<Nvram::Node::Next>(ptr, Nvram::lastNodeId);
+    field::set<Nvram::Node::Flags>(ptr, Nvram::getFlags(value.attributes));
+    ptr += Nvram::Node::size;
+    *ptr++ = index;
+    memcpy(ptr, key.name.c_str(), key.name.size() + 1);
+    ptr += key.name.size() + 1;
+    std::copy(value.data.begin(), value.data.end(), ptr);
+
+    return node;
+}
+
+size_t LogBackend::save(const Variables& current, const Variables& vars)
+{
+    const uint64_t before = storedBytes;
+    const std::vector<diff::Difference> diffs = diff::compare(current, vars);
+
+    // build new nodes, compact the log if they don't fit
+    std::vector<Guid> table = guids;
+    std::vector<std::vector<uint8_t>> appends;
+    size_t needed = 0;
+    try
+    {
+        for (const auto& entry : diffs)
+        {
+            if (!(entry.kind & diff::Difference::removed))
+            {
+                auto it = vars.find(entry.key);
+                appends.push_back(makeNode(guidIndex(it->first.guid, table),
+                                           it->first, it->second));
+                needed += appends.back().size();
+            }
+        }
+    }
+    catch (const std::length_error&)
+    {
+        compact(vars);
+        return storedBytes - before;
+    }
+    if (tail + needed > image.size() - table.size() * sizeof(EFI_GUID))
+    {
+        compact(vars);
+        return storedBytes - before;
+    }
+
+    // new GUIDs first, then new nodes, then invalidate outdated nodes:
+    // interrupted save leaves both nodes valid, the newer one wins on load
+    for (size_t i = guids.size(); i < table.size(); ++i)
+    {
+        uint8_t efi[sizeof(EFI_GUID)];
+        swapGuid(table[i].data(), efi);
+        program(image.size() - (i + 1) * sizeof(EFI_GUID), efi, sizeof(efi));
+    }
+    guids = std::move(table);
+
+    auto node = appends.begin();
+    for (const auto& entry : diffs)
+    {
+        auto it = nodes.find(entry.key);
+        const bool exists = it != nodes.end();
+        const size_t outdated = exists ? it->second : 0;
+        if (entry.kind & diff::Difference::removed)
+        {
+            if (exists)
+            {
+                nodes.erase(it);
+            }
+        }
+        else
+        {
+            program(tail, node->data(), node->size());
+            nodes[entry.key] = tail;
+            tail += node->size();
+            ++node;
+        }
+        if (exists)
+        {
+            invalidate(outdated);
+        }
+    }
+
+    fdatasync(fd);
+    return storedBytes - before;
+}
+
+std::vector<VariableKey> LogBackend::scrub(const Variables& vars)
+{
+    // the image in memory is replaced with the actual content of the media,
+    // so compaction rewrites the damaged blocks
+    read();
+    std::vector<VariableKey> damaged;
+    try
+    {
+        for (const auto& entry : diff::compare(scan(), vars))
+        {
+            damaged.push_back(entry.key);
+        }
+    }
+    catch (const std::runtime_error&)
+    {
+        // broken structure of the log, nothing can be trusted
+        for (const auto& it : vars)
+        {
+            damaged.push_back(it.first);
+        }
+    }
+    if (!damaged.empty())
+    {
+        compact(vars);
+    }
+    return damaged;
 }
 
-Variables parseNvram(const uint8_t* data, size_t size)
+void LogBackend::compact(const Variables& vars)
 {
-    return Nvram().parse(data, size);
+    // keep the order of the existing nodes and the GUID table: unchanged
+    // beginning of the log and the table don't need to be rewritten
+    std::vector<std::pair<size_t, Variables::const_iterator>> order;
+    order.reserve(vars.size());
+    for (auto it = vars.begin(); it != vars.end(); ++it)
+    {
+        auto node = nodes.find(it->first);
+        order.emplace_back(node == nodes.end() ? image.size() : node->second,
+                           it);
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [](const auto& lhs, const auto& rhs) {
+                         return lhs.first < rhs.first;
+                     });
+
+    std::vector<Guid> table = guids;
+    std::vector<uint8_t> newImage(image.size(), erasedByte);
+    size_t offset = 0;
+    for (const auto& [pos, it] : order)
+    {
+        uint8_t index;
+        try
+        {
+            index = guidIndex(it->first.guid, table);
+        }
+        catch (const std::length_error&)
+        {
+            if (guids.empty())
+            {
+                throw;
+            }
+            // drop unused GUIDs and start over
+            guids.clear();
+            nodes.clear();
+            compact(vars);
+            return;
+        }
+        const std::vector<uint8_t> node = makeNode(index, it->first,
+                                                   it->second);
+        if (offset + node.size() >
+            image.size() - table.size() * sizeof(EFI_GUID))
+        {
+            throw std::length_error("NVAR storage is full");
+        }
+        std::copy(node.begin(), node.end(), newImage.begin() + offset);
+        offset += node.size();
+    }
+    for (size_t i = 0; i < table.size(); ++i)
+    {
+        swapGuid(table[i].data(),
+                 &newImage[newImage.size() - (i + 1) * sizeof(EFI_GUID)]);
+    }
+
+    // rewrite changed blocks only, erase only if bits must be set
+    std::vector<Rewrite> changes;
+    for (size_t block = 0; block < image.size(); block += blockSize)
+    {
+        const uint8_t* oldData = &image[block];
+        const uint8_t* newData = &newImage[block];
+        if (memcmp(oldData, newData, blockSize) == 0)
+        {
+            continue;
+        }
+        bool programmable = true;
+        for (size_t i = 0; i < blockSize && programmable; ++i)
+        {
+            programmable = (oldData[i] & newData[i]) == newData[i];
+        }
+        // write changed ranges of the block, nothing if the block becomes
+        // free after erase; short unchanged gaps are written over to keep
+        // the journal compact
+        const uint8_t* base = programmable ? oldData : nullptr;
+        const auto same = [base, newData](size_t i) {
+            return newData[i] == (base ? base[i] : erasedByte);
+        };
+        bool eraseFirst = !programmable;
+        size_t pos = 0;
+        while (true)
+        {
+            while (pos < blockSize && same(pos))
+            {
+                ++pos;
+            }
+            if (pos == blockSize)
+            {
+                break;
+            }
+            size_t end = pos;
+            for (size_t i = pos, gap = 0;
+                 i < blockSize && gap < JournalEntry::size; ++i)
+            {
+                gap = same(i) ? gap + 1 : 0;
+                end = gap ? end : i + 1;
+            }
+            changes.push_back(Rewrite{
+                block + pos, eraseFirst,
+                std::vector<uint8_t>(newData + pos, newData + end)});
+            eraseFirst = false;
+            pos = end;
+        }
+        if (eraseFirst)
+        {
+            changes.push_back(Rewrite{block, true, {}});
+        }
+    }
+
+    // blocks of the log are erased only when the journal can restore them
+    if (!changes.empty())
+    {
+        journal(changes);
+        apply(changes);
+        fdatasync(fd);
+        size_t used = JournalHeader::size;
+        for (const auto& change : changes)
+        {
+            used += JournalEntry::size + change.data.size();
+        }
+        clearJournal(used);
+    }
+    scan();
+}
+
+void LogBackend::invalidate(size_t offset)
+{
+    offset += Nvram::Node::Flags::offset;
+    const uint8_t flags = image[offset] & ~Nvram::flagValid;
+    program(offset, &flags, sizeof(flags));
+}
+
+void LogBackend::program(size_t offset, const uint8_t* data, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        if ((image[offset + i] & data[i]) != data[i])
+        {
+            throw std::logic_error("Flash programming requires erase");
+        }
+    }
+    store(offset, data, size);
+    std::copy(data, data + size, image.begin() + offset);
+}
+
+void LogBackend::erase(size_t offset)
+{
+    if (offset < image.size())
+    {
+        std::fill_n(image.begin() + offset, blockSize, erasedByte);
+    }
+    if (mtd)
+    {
+        erase_info_user info;
+        info.start = offset;
+        info.length = blockSize;
+        if (ioctl(fd, MEMERASE, &info) == -1)
+        {
+            throw std::system_error(errno, std::generic_category());
+        }
+    }
+    else
+    {
+        const std::vector<uint8_t> blank(blockSize, erasedByte);
+        store(offset, blank.data(), blockSize);
+    }
+    ++erasedBlocks;
+}
+
+void LogBackend::store(size_t offset, const uint8_t* data, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        const ssize_t rc =
+            pwrite(fd, data + done, size - done, offset + done);
+        if (rc == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category());
+        }
+        done += rc;
+    }
+    storedBytes += size;
 }
 
 } // namespace nvram
@@ -3,8 +3,12 @@
 
 #pragma once
 
+#include "backend.hpp"
 #include "variable.hpp"
 
+#include <array>
+#include <map>
+
 /**
  * @brief Parsers of the non-volatile partition on BIOS flash.
  */
@@ -28,11 +32,264 @@ Variables parseVolume(const std::filesystem::path& file);
  *
  * @param[in] data Pointer to the buffer to parse
  * @param[in] size Size of the buffer in bytes
+ * @param[in] resource Memory resource of the variables container
  *
  * @return array of UEFI variables
  *
  * @throw std::runtime_error in case of format errors
  */
-Variables parseNvram(const uint8_t* data, size_t size);
+Variables parseNvram(const uint8_t* data, size_t size,
+                     std::pmr::memory_resource* resource =
+                         std::pmr::get_default_resource());
+
+/**
+ * @brief Backend with NVAR log on a flash partition (MTD device) or on a
+ *        plain file standing in for it.
+ *
+ * Variables are stored in the native NVAR format. New values are appended
+ * to the log as new nodes, outdated nodes are invalidated by clearing the
+ * valid flag, which doesn't need an erase. Vendor GUIDs are kept in the
+ * table at the end of the NVAR area. When the log is full, it is compacted:
+ * the new image is built in memory and only the erase blocks that differ
+ * from the current content are rewritten.
+ *
+ * The NVAR area takes the first half of the device, the second half is the
+ * spare region for the compaction journal: changed blocks are written to
+ * the journal before any block of the log is erased, and the journal left
+ * by an interrupted compaction is replayed on the next start. So a power
+ * loss keeps either the old or the new content of the log.
+ */
+class LogBackend : public Backend
+{
+  public:
+    /** @brief Default erase block size for plain files. */
+    static constexpr size_t defaultEraseSize = 4096;
+    /** @brief Default size of new plain files. */
+    static constexpr size_t defaultSize = 256 * 1024;
+
+    /**
+     * @brief Constructor.
+     *
+     * @param[in] device Path to the MTD device or plain file
+     * @param[in] size Size of the plain file, the missing file is created
+     *                 with this size or defaultSize if it is 0 (ignored for
+     *                 MTD devices)
+     * @param[in] eraseSize Erase block size of the plain file (ignored for
+     *                      MTD devices)
+     *
+     * @throw std::system_error in case of IO errors
+     * @throw std::runtime_error if the device is too small
+     */
+    LogBackend(const std::filesystem::path& device, size_t size = 0,
+               size_t eraseSize = defaultEraseSize);
+
+    LogBackend(const LogBackend&) = delete;
+    LogBackend& operator=(const LogBackend&) = delete;
+
+    ~LogBackend();
+
+    std::optional<Variables>
+        load(std::pmr::memory_resource* resource =
+                 std::pmr::get_default_resource()) override;
+    size_t save(const Variables& current, const Variables& vars) override;
+    std::vector<VariableKey> scrub(const Variables& vars) override;
+
+    bool incremental() const override
+    {
+        return true;
+    }
+
+    /**
+     * @brief Check attributes against NVAR node flags: the variables are
+     *        always non-volatile with boot service access, only runtime
+     *        access, hardware error record and authenticated write access
+     *        are optional.
+     */
+    bool storable(uint32_t attributes) const override;
+
+    /**
+     * @brief Get number of erase operations.
+     *
+     * @return number of erased blocks since the backend was created
+     */
+    size_t erased() const;
+
+  private:
+    using Guid = std::array<uint8_t, sizeof(uuid_t)>;
+
+    /**
+     * @brief Change of an erase block of the NVAR area.
+     */
+    struct Rewrite
+    {
+        size_t offset;             ///< Offset of the data in the image
+        bool erase;                ///< Erase the block before programming
+        std::vector<uint8_t> data; ///< Data to program, can be empty
+    };
+
+    /**
+     * @brief Read the whole NVAR area to the image.
+     *
+     * @throw std::system_error in case of IO errors
+     */
+    void read();
+
+    /**
+     * @brief Read data from the device.
+     *
+     * @param[in] offset Offset on the device
+     * @param[out] data Buffer to read to
+     * @param[in] size Size of data
+     *
+     * @throw std::system_error in case of IO errors
+     */
+    void fetch(size_t offset, uint8_t* data, size_t size);
+
+    /**
+     * @brief Replay the journal of the interrupted compaction, if any, and
+     *        clear the spare region.
+     *
+     * @throw std::exception in case of errors
+     */
+    void recover();
+
+    /**
+     * @brief Write changes to the journal in the spare region. The journal
+     *        becomes valid with its header, written last.
+     *
+     * @param[in] changes Changes of blocks
+     *
+     * @throw std::length_error if the changes don't fit the spare region
+     * @throw std::system_error in case of IO errors
+     */
+    void journal(const std::vector<Rewrite>& changes);
+
+    /**
+     * @brief Erase used blocks of the spare region, the header first.
+     *
+     * @param[in] used Size of the used part of the spare region
+     *
+     * @throw std::system_error in case of IO errors
+     */
+    void clearJournal(size_t used);
+
+    /**
+     * @brief Apply changes to the NVAR area.
+     *
+     * @param[in] changes Changes of blocks
+     *
+     * @throw std::exception in case of errors
+     */
+    void apply(const std::vector<Rewrite>& changes);
+
+    /**
+     * @brief Build index of the valid nodes from the image.
+     *
+     * @param[in] resource Memory resource of the variables container
+     *
+     * @return UEFI variables
+     *
+     * @throw std::runtime_error in case of format errors
+     */
+    Variables scan(std::pmr::memory_resource* resource =
+                       std::pmr::get_default_resource());
+
+    /**
+     * @brief Get index of the GUID in the table, add the GUID if needed.
+     *
+     * @param[in] guid Vendor GUID
+     * @param[in] table GUID table
+     *
+     * @return GUID index
+     *
+     * @throw std::length_error if the table is full
+     */
+    static uint8_t guidIndex(const uuid_t guid, std::vector<Guid>& table);
+
+    /**
+     * @brief Build node of the variable.
+     *
+     * @param[in] index Vendor GUID index
+     * @param[in] key Variable key
+     * @param[in] value Variable value
+     *
+     * @return node data
+     *
+     * @throw std::length_error if the variable doesn't fit a node
+     * @throw std::invalid_argument if the attributes can't be stored
+     */
+    static std::vector<uint8_t> makeNode(uint8_t index, const VariableKey& key,
+                                         const VariableValue& value);
+
+    /**
+     * @brief Rewrite the whole image with the minimal number of erases.
+     *
+     * @param[in] vars Variables to save
+     *
+     * @throw std::exception in case of errors
+     */
+    void compact(const Variables& vars);
+
+    /**
+     * @brief Program data without erase: bits can only be cleared.
+     *
+     * @param[in] offset Offset in the image
+     * @param[in] data Data to write
+     * @param[in] size Size of data
+     *
+     * @throw std::exception in case of errors
+     */
+    void program(size_t offset, const uint8_t* data, size_t size);
+
+    /**
+     * @brief Invalidate node by clearing its valid flag.
+     *
+     * @param[in] offset Offset of the node in the image
+     *
+     * @throw std::system_error in case of IO errors
+     */
+    void invalidate(size_t offset);
+
+    /**
+     * @brief Erase block.
+     *
+     * @param[in] offset Offset of the block on the device
+     *
+     * @throw std::system_error in case of IO errors
+     */
+    void erase(size_t offset);
+
+    /**
+     * @brief Write data to the device as is.
+     *
+     * @param[in] offset Offset on the device
+     * @param[in] data Data to write
+     * @param[in] size Size of data
+     *
+     * @throw std::system_error in case of IO errors
+     */
+    void store(size_t offset, const uint8_t* data, size_t size);
+
+    /** @brief Device descriptor. */
+    int fd = -1;
+    /** @brief Device is an MTD partition. */
+    bool mtd = false;
+    /** @brief Erase block size. */
+    size_t blockSize;
+    /** @brief Copy of the NVAR area content. */
+    std::vector<uint8_t> image;
+    /** @brief Size of the spare region following the NVAR area. */
+    size_t spareSize = 0;
+    /** @brief Vendor GUIDs table, index is a position from the end. */
+    std::vector<Guid> guids;
+    /** @brief Offsets of the valid nodes. */
+    std::map<VariableKey, size_t> nodes;
+    /** @brief End of the log (offset of the free space). */
+    size_t tail = 0;
+    /** @brief Number of erased blocks. */
+    size_t erasedBlocks = 0;
+    /** @brief Number of bytes written to the media. */
+    uint64_t storedBytes = 0;
+};
 
 } // namespace nvram
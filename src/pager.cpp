@@ -0,0 +1,252 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#include "crc32c.hpp"
+#include "pager.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <phosphor-logging/log.hpp>
+
+#include <stdexcept>
+#include <system_error>
+
+using namespace phosphor::logging;
+
+/** @brief Min size of unused space in the spill file to compact it. */
+static constexpr size_t minCompactBytes = 64 * 1024;
+
+/**
+ * @brief Read from the file.
+ *
+ * @param[in] fd File descriptor
+ * @param[out] data Buffer to fill
+ * @param[in] size Number of bytes to read
+ * @param[in] offset Offset in the file
+ *
+ * @throw std::system_error in case of file IO errors or unexpected end
+ */
+static void readAt(int fd, uint8_t* data, size_t size, uint64_t offset)
+{
+    while (size)
+    {
+        const ssize_t rc = pread(fd, data, size, offset);
+        if (rc == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rc <= 0)
+        {
+            throw std::system_error(rc ? errno : EIO, std::generic_category());
+        }
+        data += rc;
+        size -= rc;
+        offset += rc;
+    }
+}
+
+/**
+ * @brief Write to the file.
+ *
+ * @param[in] fd File descriptor
+ * @param[in] data Data to write
+ * @param[in] size Number of bytes to write
+ * @param[in] offset Offset in the file
+ *
+ * @throw std::system_error in case of file IO errors
+ */
+static void writeAt(int fd, const uint8_t* data, size_t size, uint64_t offset)
+{
+    while (size)
+    {
+        const ssize_t rc = pwrite(fd, data, size, offset);
+        if (rc == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rc == -1)
+        {
+            throw std::system_error(errno, std::generic_category());
+        }
+        data += rc;
+        size -= rc;
+        offset += rc;
+    }
+}
+
+Page::Page(std::shared_ptr<Pager> owner, uint64_t offset,
+           const VariableValue& value) :
+    attributes(value.attributes),
+    size(value.data.size()), checksum(crc32c(value.data.data(), size)),
+    owner(std::move(owner)), offset(offset)
+{}
+
+Page::~Page()
+{
+    owner->release(*this);
+}
+
+std::shared_ptr<Pager> Pager::create(const std::filesystem::path& spillFile,
+                                     size_t cacheBytes)
+{
+    const int fd = open(spillFile.c_str(),
+                        O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        throw std::system_error(errno, std::generic_category(),
+                                "Unable to create file " + spillFile.string());
+    }
+    unlink(spillFile.c_str());
+    return std::shared_ptr<Pager>(new Pager(fd, cacheBytes));
+}
+
+Pager::Pager(int fd, size_t cacheBytes) : fd(fd), budget(cacheBytes)
+{}
+
+Pager::~Pager()
+{
+    close(fd);
+}
+
+std::shared_ptr<const Page> Pager::store(const VariableValue& value)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    writeAt(fd, value.data.data(), value.data.size(), fileSize);
+    // the slot is taken first: a page destroyed under the lock would
+    // deadlock on its release
+    auto slot = pages.emplace(fileSize, nullptr).first;
+    std::shared_ptr<Page> page;
+    try
+    {
+        page = std::make_shared<Page>(shared_from_this(), fileSize, value);
+    }
+    catch (...)
+    {
+        pages.erase(slot);
+        throw;
+    }
+    slot->second = page.get();
+    fileSize += page->size;
+    liveBytes += page->size;
+    return page;
+}
+
+std::shared_ptr<const VariableValue> Pager::load(const Page& page, bool keep)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto cached = index.find(&page);
+    if (cached != index.end())
+    {
+        lru.splice(lru.begin(), lru, cached->second);
+        return cached->second->second;
+    }
+
+    auto value = std::make_shared<VariableValue>();
+    value->attributes = page.attributes;
+    std::vector<uint8_t> data(page.size);
+    try
+    {
+        readAt(fd, data.data(), page.size, page.offset);
+    }
+    catch (const std::system_error& ex)
+    {
+        throw std::runtime_error(std::string("Unable to read paged value: ") +
+                                 ex.what());
+    }
+    if (crc32c(data.data(), page.size) != page.checksum)
+    {
+        throw std::runtime_error("Paged value is damaged");
+    }
+    value->data = std::move(data);
+
+    if (keep && page.size <= budget)
+    {
+        lru.emplace_front(&page, value);
+        index.emplace(&page, lru.begin());
+        cachedBytes += page.size;
+        while (cachedBytes > budget)
+        {
+            cachedBytes -= lru.back().second->data.size();
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+    return value;
+}
+
+size_t Pager::cached() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return cachedBytes;
+}
+
+size_t Pager::stored() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return liveBytes;
+}
+
+void Pager::release(const Page& page)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto cached = index.find(&page);
+    if (cached != index.end())
+    {
+        cachedBytes -= page.size;
+        lru.erase(cached->second);
+        index.erase(cached);
+    }
+    pages.erase(page.offset);
+    liveBytes -= page.size;
+
+    if (pages.empty())
+    {
+        fileSize = 0;
+    }
+    else if (fileSize - liveBytes >= minCompactBytes &&
+             fileSize - liveBytes > liveBytes)
+    {
+        try
+        {
+            compact();
+        }
+        catch (const std::exception& ex)
+        {
+            // the space is reused after the next release
+            log<level::WARNING>("Unable to compact spill file",
+                                entry("EXCEPTION=%s", ex.what()));
+        }
+    }
+}
+
+void Pager::compact()
+{
+    // pages are moved to lower offsets in order, so the data being copied
+    // is never overwritten before it is read
+    std::vector<uint8_t> buffer;
+    uint64_t end = 0;
+    for (auto it = pages.begin(); it != pages.end();)
+    {
+        Page* page = it->second;
+        if (page->offset != end)
+        {
+            buffer.resize(page->size);
+            readAt(fd, buffer.data(), page->size, page->offset);
+            writeAt(fd, buffer.data(), page->size, end);
+            it = pages.erase(it);
+            page->offset = end;
+            pages.emplace_hint(it, end, page);
+        }
+        else
+        {
+            ++it;
+        }
+        end += page->size;
+    }
+    fileSize = end;
+    if (ftruncate(fd, fileSize) == -1)
+    {
+        throw std::system_error(errno, std::generic_category());
+    }
+}
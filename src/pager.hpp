@@ -0,0 +1,170 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#pragma once
+
+#include "variable.hpp"
+
+#include <filesystem>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+class Pager;
+
+/**
+ * @brief Variable value paged out to the spill file. The space is released
+ *        with the last reference to the page.
+ */
+class Page
+{
+  public:
+    /**
+     * @brief Constructor.
+     *
+     * @param[in] owner Pager keeping the value
+     * @param[in] offset Offset of the data in the spill file
+     * @param[in] value Paged out value
+     */
+    Page(std::shared_ptr<Pager> owner, uint64_t offset,
+         const VariableValue& value);
+
+    Page(const Page&) = delete;
+    Page& operator=(const Page&) = delete;
+
+    ~Page();
+
+    /** @brief Attributes of the variable. */
+    const uint32_t attributes;
+    /** @brief Size of the data. */
+    const size_t size;
+    /** @brief CRC32C of the data. */
+    const uint32_t checksum;
+
+  private:
+    friend class Pager;
+
+    /** @brief Pager keeping the value. */
+    std::shared_ptr<Pager> owner;
+    /** @brief Offset of the data in the spill file, used with the pager
+     *         lock. */
+    uint64_t offset;
+};
+
+/**
+ * @brief Storage tier for large payloads: the data is kept in a spill file
+ *        and loaded on demand through the LRU cache with a byte budget.
+ *
+ * The spill file is unlinked right after creation: it holds no persistent
+ * state, the storage file remains the only source of variables.
+ */
+class Pager : public std::enable_shared_from_this<Pager>
+{
+  public:
+    /**
+     * @brief Create pager.
+     *
+     * @param[in] spillFile Path to the spill file
+     * @param[in] cacheBytes Max size of cached data
+     *
+     * @return pager
+     *
+     * @throw std::system_error in case of file IO errors
+     */
+    static std::shared_ptr<Pager>
+        create(const std::filesystem::path& spillFile, size_t cacheBytes);
+
+    Pager(const Pager&) = delete;
+    Pager& operator=(const Pager&) = delete;
+
+    ~Pager();
+
+    /**
+     * @brief Write value to the spill file.
+     *
+     * @param[in] value Value to page out
+     *
+     * @return page of the value
+     *
+     * @throw std::system_error in case of file IO errors
+     */
+    std::shared_ptr<const Page> store(const VariableValue& value);
+
+    /**
+     * @brief Get paged out value.
+     *
+     * @param[in] page Page of the value
+     * @param[in] keep Put the loaded value to the cache
+     *
+     * @return value
+     *
+     * @throw std::runtime_error if the data can't be read or is damaged
+     */
+    std::shared_ptr<const VariableValue> load(const Page& page,
+                                              bool keep = true);
+
+    /**
+     * @brief Get size of cached data.
+     *
+     * @return number of bytes
+     */
+    size_t cached() const;
+
+    /**
+     * @brief Get size of data kept in the spill file.
+     *
+     * @return number of bytes
+     */
+    size_t stored() const;
+
+  private:
+    friend class Page;
+
+    /**
+     * @brief Constructor.
+     *
+     * @param[in] fd Descriptor of the spill file
+     * @param[in] cacheBytes Max size of cached data
+     */
+    Pager(int fd, size_t cacheBytes);
+
+    /**
+     * @brief Release space of the page.
+     *
+     * @param[in] page Page being destroyed
+     */
+    void release(const Page& page);
+
+    /**
+     * @brief Move pages to the file start and truncate the file.
+     *        Must be called with the lock held.
+     *
+     * @throw std::system_error in case of file IO errors
+     */
+    void compact();
+
+    /** @brief Cached value. */
+    using CacheEntry =
+        std::pair<const Page*, std::shared_ptr<const VariableValue>>;
+
+    /** @brief Descriptor of the spill file. */
+    int fd;
+    /** @brief Max size of cached data. */
+    size_t budget;
+    /** @brief Size of the spill file. */
+    uint64_t fileSize = 0;
+    /** @brief Size of data of live pages. */
+    size_t liveBytes = 0;
+    /** @brief Size of cached data. */
+    size_t cachedBytes = 0;
+    /** @brief Live pages by offset. */
+    std::map<uint64_t, Page*> pages;
+    /** @brief Cached values, the most recently used first. */
+    std::list<CacheEntry> lru;
+    /** @brief Index of cached values. */
+    std::unordered_map<const Page*, std::list<CacheEntry>::iterator> index;
+    /** @brief Lock to protect the pager state. */
+    mutable std::mutex lock;
+};
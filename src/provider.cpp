@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#include "ipmi.hpp"
+
+#include <phosphor-logging/log.hpp>
+
+#include <memory>
+
+using namespace phosphor::logging;
+
+/**
+ * @brief Register the provider in ipmid, called on loading the library.
+ */
+void registerUefiVarFunctions() __attribute__((constructor));
+
+void registerUefiVarFunctions()
+{
+    // loaded in background to not block ipmid startup, commands are
+    // rejected until the storage is ready
+    static std::unique_ptr<Storage> storage;
+    static std::unique_ptr<Ipmi> ipmi;
+
+    // the storage can be owned by the service: the provider stays disabled
+    // instead of waiting for the storage file, so neither ipmid startup nor
+    // its exit is blocked
+    try
+    {
+        storage = std::make_unique<Storage>(Storage::defaultFile, true, false);
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::ERR>("UEFI variables provider disabled",
+                        entry("FILE=%s", Storage::defaultFile),
+                        entry("EXCEPTION=%s", ex.what()));
+        return;
+    }
+    ipmi = std::make_unique<Ipmi>(*storage);
+    ipmi->registerHandlers();
+}
@@ -0,0 +1,155 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#include "edk.hpp"
+#include "signature.hpp"
+
+#include <endian.h>
+
+#include <cstddef>
+#include <cstring>
+#include <set>
+#include <string_view>
+
+namespace signature
+{
+
+/** @brief Signature list location and its header in host byte order. */
+struct List
+{
+    const uint8_t* start; ///< Start of the list
+    uint32_t listSize;    ///< Size of the whole list
+    uint32_t headerSize;  ///< Size of signature header
+    uint32_t sigSize;     ///< Size of each signature entry
+};
+
+/** @brief Signature entry: type of the list and the signature itself. */
+using Entry = std::pair<std::string_view, std::string_view>;
+
+/**
+ * @brief Split buffer to signature lists.
+ *
+ * @param[in] data Buffer to parse
+ * @param[out] lists Signature lists
+ *
+ * @return false if the buffer is not an array of signature lists
+ */
+static bool parse(const std::vector<uint8_t>& data, std::vector<List>& lists)
+{
+    size_t offset = 0;
+    while (offset < data.size())
+    {
+        const size_t left = data.size() - offset;
+        if (left < sizeof(EFI_SIGNATURE_LIST))
+        {
+            return false;
+        }
+
+        EFI_SIGNATURE_LIST hdr;
+        memcpy(&hdr, &data[offset], sizeof(hdr));
+
+        List list;
+        list.start = &data[offset];
+        list.listSize = le32toh(hdr.SignatureListSize);
+        list.headerSize = le32toh(hdr.SignatureHeaderSize);
+        list.sigSize = le32toh(hdr.SignatureSize);
+
+        const size_t sigStart = sizeof(hdr) + list.headerSize;
+        if (list.sigSize == 0 || list.listSize > left ||
+            list.listSize < sigStart ||
+            (list.listSize - sigStart) % list.sigSize != 0)
+        {
+            return false;
+        }
+
+        lists.push_back(list);
+        offset += list.listSize;
+    }
+    return true;
+}
+
+/**
+ * @brief Get entries of the signature list.
+ *
+ * @param[in] list Signature list
+ *
+ * @return array of signature entries
+ */
+static std::vector<Entry> entries(const List& list)
+{
+    const std::string_view type(reinterpret_cast<const char*>(list.start),
+                                sizeof(EFI_GUID));
+    const size_t sigStart = sizeof(EFI_SIGNATURE_LIST) + list.headerSize;
+
+    std::vector<Entry> result;
+    for (size_t offset = sigStart; offset < list.listSize;
+         offset += list.sigSize)
+    {
+        result.emplace_back(
+            type, std::string_view(
+                      reinterpret_cast<const char*>(list.start + offset),
+                      list.sigSize));
+    }
+    return result;
+}
+
+std::vector<uint8_t> append(const std::vector<uint8_t>& data,
+                            const std::vector<uint8_t>& append)
+{
+    std::vector<uint8_t> result;
+    result.reserve(data.size() + append.size());
+    result.assign(data.begin(), data.end());
+
+    std::vector<List> current, appended;
+    if (!parse(data, current) || !parse(append, appended))
+    {
+        // not a signature database, just concatenate
+        result.insert(result.end(), append.begin(), append.end());
+        return result;
+    }
+
+    std::set<Entry> known;
+    for (const List& list : current)
+    {
+        for (const Entry& entry : entries(list))
+        {
+            known.insert(entry);
+        }
+    }
+
+    for (const List& list : appended)
+    {
+        // copy list header and signature header, then unique signatures
+        const size_t listStart = result.size();
+        const size_t sigStart = sizeof(EFI_SIGNATURE_LIST) + list.headerSize;
+        result.insert(result.end(), list.start, list.start + sigStart);
+
+        bool empty = true;
+        for (const Entry& entry : entries(list))
+        {
+            if (known.insert(entry).second)
+            {
+                const uint8_t* sig =
+                    reinterpret_cast<const uint8_t*>(entry.second.data());
+                result.insert(result.end(), sig, sig + entry.second.size());
+                empty = false;
+            }
+        }
+
+        if (empty)
+        {
+            result.resize(listStart);
+        }
+        else
+        {
+            const uint32_t listSize = htole32(result.size() - listStart);
+            memcpy(&result[listStart +
+                           offsetof(EFI_SIGNATURE_LIST, SignatureListSize)],
+                   &listSize, sizeof(listSize));
+        }
+    }
+
+    return result;
+}
+
+} // namespace signature
@@ -0,0 +1,32 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Handling of signature databases (EFI_SIGNATURE_LIST arrays) used
+ *        by secure boot variables (db, dbx, KEK, etc).
+ */
+namespace signature
+{
+
+/**
+ * @brief Append data to the variable value.
+ *
+ * If both buffers are valid arrays of EFI_SIGNATURE_LIST, signatures which
+ * already exist in the variable are dropped from the appended lists as
+ * required by UEFI specification for EFI_VARIABLE_APPEND_WRITE, otherwise
+ * the data is just concatenated.
+ *
+ * @param[in] data Current variable data
+ * @param[in] append Data to append
+ *
+ * @return new variable data
+ */
+std::vector<uint8_t> append(const std::vector<uint8_t>& data,
+                            const std::vector<uint8_t>& append);
+
+} // namespace signature
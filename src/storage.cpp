@@ -1,184 +1,1538 @@
 // SPDX-License-Identifier: Apache-2.0
 // Copyright (C) 2021 YADRO
 
+#include "edk.hpp"
+#include "memory.hpp"
 #include "nvram.hpp"
+#include "signature.hpp"
 #include "storage.hpp"
 
+#include <sys/stat.h>
+
 #include <phosphor-logging/log.hpp>
 
-#include <exception>
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <stdexcept>
+
+using namespace phosphor::logging;
+
+const VariableKey Storage::stdDefaults{
+    "StdDefaults",
+    {0x45, 0x99, 0xD2, 0x6F, 0x1A, 0x11, 0x49, 0xB8, 0xB9, 0x1F, 0x85, 0x87,
+     0x45, 0xCF, 0xF8, 0x24}};
+
+/**
+ * @brief Check if variable is a hardware error record.
+ *
+ * @param[in] attributes Variable attributes
+ *
+ * @return true for hardware error record
+ */
+static bool isHwErr(uint32_t attributes)
+{
+    return attributes & EFI_VARIABLE_HARDWARE_ERROR_RECORD;
+}
+
+/**
+ * @brief Get size of the variable data, resident or paged out.
+ *
+ * @param[in] value Variable value
+ *
+ * @return data size in bytes
+ */
+static size_t dataSize(const VariableValue& value)
+{
+    return value.page ? value.page->size : value.data.size();
+}
+
+/**
+ * @brief Collect keys of variables changed between two snapshots. Paged out
+ *        values are compared by their pages: a changed value is always
+ *        paged out to a new page.
+ *
+ * @param[in] from Old variables
+ * @param[in] to New variables
+ *
+ * @return keys of added, removed and changed variables
+ */
+static std::vector<VariableKey> changedKeys(const Variables& from,
+                                            const Variables& to)
+{
+    std::vector<VariableKey> keys;
+    const VariableKeyLess less;
+    auto itFrom = from.begin();
+    auto itTo = to.begin();
+    while (itFrom != from.end() || itTo != to.end())
+    {
+        if (itTo == to.end() ||
+            (itFrom != from.end() && less(itFrom->first, itTo->first)))
+        {
+            keys.push_back((itFrom++)->first);
+        }
+        else if (itFrom == from.end() || less(itTo->first, itFrom->first))
+        {
+            keys.push_back((itTo++)->first);
+        }
+        else
+        {
+            const VariableValue& oldVal = itFrom->second;
+            const VariableValue& newVal = itTo->second;
+            if (oldVal.attributes != newVal.attributes ||
+                oldVal.page != newVal.page || oldVal.data != newVal.data)
+            {
+                keys.push_back(itTo->first);
+            }
+            ++itFrom;
+            ++itTo;
+        }
+    }
+    return keys;
+}
+
+/**
+ * @brief Add variable to the usage counters or subtract it.
+ *
+ * @param[in,out] usage Usage counters
+ * @param[in] key Variable key
+ * @param[in] value Variable value
+ * @param[in] add Add (true) or subtract (false)
+ */
+static void account(Storage::Usage& usage, const VariableKeyView& key,
+                    const VariableValue& value, bool add)
+{
+    const size_t keyBytes = key.name.size() + sizeof(uuid_t);
+    if (add)
+    {
+        ++usage.count;
+        usage.keyBytes += keyBytes;
+        usage.dataBytes += dataSize(value);
+    }
+    else
+    {
+        --usage.count;
+        usage.keyBytes -= keyBytes;
+        usage.dataBytes -= dataSize(value);
+    }
+}
+
+/**
+ * @brief Set or remove variable.
+ *
+ * @param[in,out] vars Set of variables
+ * @param[in] key Variable key
+ * @param[in] value New value, none to remove the variable
+ */
+static void assign(Variables& vars, const VariableKey& key,
+                   const std::optional<VariableValue>& value)
+{
+    if (value)
+    {
+        vars[key] = *value;
+    }
+    else
+    {
+        vars.erase(key);
+    }
+}
+
+/**
+ * @brief Memory pool for variables. Each snapshot is built in its own
+ *        monotonic arena taken from the pool, so a new snapshot is a
+ *        compacted copy of the previous one, and an outdated snapshot is
+ *        released in a single step.
+ */
+struct Storage::Memory
+{
+    CountingResource counter;
+    std::pmr::synchronized_pool_resource pool{&counter};
+};
+
+struct Storage::Arena
+{
+    /**
+     * @brief Constructor.
+     *
+     * @param[in] mem Memory pool to allocate arena from
+     */
+    explicit Arena(const std::shared_ptr<Memory>& mem);
+
+    std::shared_ptr<Memory> memory; ///< Keep pool alive
+    std::pmr::monotonic_buffer_resource arena;
+    Variables variables;
+};
+
+Storage::Arena::Arena(const std::shared_ptr<Memory>& mem) :
+    memory(mem), arena(&memory->pool), variables(&arena)
+{}
+
+struct Storage::Index
+{
+    /** @brief Reference to the indexed variable. */
+    using Entry = const Variables::value_type*;
+
+    /**
+     * @brief Constructor, indexes the variables.
+     *
+     * @param[in] vars Variables to index
+     */
+    explicit Index(const Snapshot& vars);
+
+    Snapshot source;           ///< Indexed variables
+    std::vector<Entry> byName; ///< Variables ordered by name, then by GUID
+    std::map<uint32_t, std::vector<Entry>> byAttributes; ///< Storage order
+};
+
+Storage::Index::Index(const Snapshot& vars) : source(vars)
+{
+    byName.reserve(vars->size());
+    for (const auto& var : *vars)
+    {
+        byName.push_back(&var);
+        byAttributes[var.second.attributes].push_back(&var);
+    }
+    // stable sort keeps the GUID order for equal names
+    std::stable_sort(byName.begin(), byName.end(), [](Entry lhs, Entry rhs) {
+        return lhs->first.name < rhs->first.name;
+    });
+}
+
+/**
+ * @brief Check if the name starts with the prefix.
+ *
+ * @param[in] name Variable name
+ * @param[in] prefix Name prefix
+ *
+ * @return true if the name starts with the prefix
+ */
+static bool startsWith(std::string_view name, std::string_view prefix)
+{
+    return name.substr(0, prefix.size()) == prefix;
+}
+
+Storage::Storage(const std::filesystem::path& varFile, bool background,
+                 bool waitOwner, std::chrono::milliseconds timeout) :
+    Storage(varFile, std::make_unique<JsonBackend>(varFile), background,
+            waitOwner, timeout)
+{}
+
+Storage::Storage(const std::filesystem::path& varFile,
+                 std::unique_ptr<Backend> persistence, bool background,
+                 bool waitOwner, std::chrono::milliseconds timeout) :
+    memory(std::make_shared<Memory>()), variables(allocate()),
+    ownerWait(timeout), file(varFile), audit(varFile),
+    backend(std::move(persistence))
+{
+    if (!waitOwner && !owner.lock(file, false))
+    {
+        throw std::runtime_error("UEFI storage is locked by another process");
+    }
+    if (background)
+    {
+        loaded = std::async(std::launch::async, &Storage::load, this).share();
+    }
+    else
+    {
+        load();
+        std::promise<void> done;
+        done.set_value();
+        loaded = done.get_future().share();
+    }
+}
+
+Storage::~Storage()
+{
+    stopLoader = true;
+    if (flushThread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(writeLock);
+            stopFlusher = true;
+        }
+        flushSignal.notify_one();
+        flushThread.join();
+    }
+    try
+    {
+        wait();
+    }
+    catch (const std::exception&)
+    {
+        // nothing was loaded, nothing to save
+        return;
+    }
+    try
+    {
+        flush();
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::ERR>("Unable to save delayed UEFI settings",
+                        entry("FILE=%s", file.c_str()),
+                        entry("EXCEPTION=%s", ex.what()));
+    }
+}
+
+bool Storage::ready() const
+{
+    return loaded.wait_for(std::chrono::seconds(0)) ==
+           std::future_status::ready;
+}
+
+void Storage::wait() const
+{
+    loaded.get();
+}
+
+bool Storage::empty() const
+{
+    return snapshot()->empty();
+}
+
+Storage::Snapshot Storage::snapshot() const
+{
+    wait();
+    return std::atomic_load(&variables);
+}
+
+void Storage::setLimits(const Limits& quotas)
+{
+    std::lock_guard<std::mutex> lock(usageLock);
+    limits = quotas;
+}
+
+Storage::Usage Storage::usage(bool hwErr) const
+{
+    wait();
+    std::lock_guard<std::mutex> lock(usageLock);
+    return counters[hwErr];
+}
+
+Storage::Info Storage::queryInfo(uint32_t attributes) const
+{
+    wait();
+    std::lock_guard<std::mutex> lock(usageLock);
+
+    const bool hwErr = isHwErr(attributes);
+    const uint64_t used = counters[hwErr].size();
+
+    Info info;
+    info.maxStorage = hwErr ? limits.maxHwErrStorage : limits.maxStorage;
+    info.remaining = info.maxStorage > used ? info.maxStorage - used : 0;
+    info.maxVariable = limits.maxVariable;
+    return info;
+}
+
+void Storage::recount(const Variables& vars)
+{
+    Usage fresh[2];
+    for (const auto& it : vars)
+    {
+        account(fresh[isHwErr(it.second.attributes)], it.first, it.second,
+                true);
+    }
+    std::lock_guard<std::mutex> lock(usageLock);
+    counters[0] = fresh[0];
+    counters[1] = fresh[1];
+}
+
+void Storage::setWriteBudget(const WriteBudget& newBudget)
+{
+    std::lock_guard<std::mutex> lock(writeLock);
+    budget = newBudget;
+    if (budget.writes && !flushThread.joinable())
+    {
+        flushThread = std::thread(&Storage::flusher, this);
+    }
+}
+
+Storage::WriteStats Storage::writeStats() const
+{
+    std::lock_guard<std::mutex> lock(writesLock);
+    return totalWrites;
+}
+
+std::map<VariableKey, Storage::WriteStats> Storage::variableWriteStats() const
+{
+    std::map<VariableKey, WriteStats> stats;
+    std::lock_guard<std::mutex> lock(writesLock);
+    for (const auto& [key, state] : writes)
+    {
+        stats.emplace_hint(stats.end(), key, state.stats);
+    }
+    return stats;
+}
+
+bool Storage::flush()
+{
+    wait();
+    std::lock_guard<std::mutex> lock(writeLock);
+    if (!flushDeadline)
+    {
+        return false;
+    }
+    persist(std::atomic_load(&variables));
+    return true;
+}
+
+void Storage::setAuditFilter(std::vector<Audit::Rule> rules)
+{
+    std::lock_guard<std::mutex> lock(writeLock);
+    audit.setFilter(std::move(rules));
+}
+
+size_t Storage::flushAudit()
+{
+    return audit.drain();
+}
+
+bool Storage::auditPending() const
+{
+    return audit.pending();
+}
+
+size_t Storage::memoryUsage() const
+{
+    return memory->counter.used();
+}
+
+uint64_t Storage::generation() const
+{
+    return generationNumber;
+}
+
+size_t Storage::corrupted() const
+{
+    return corruptedCount;
+}
+
+std::vector<VariableKey> Storage::scrub()
+{
+    wait();
+    std::lock_guard<std::mutex> lock(writeLock);
+    if (!(Stamp::of(file) == stamp))
+    {
+        // replaced by someone else, to be reloaded instead of repaired
+        return {};
+    }
+
+    // delayed changes are not on the media yet
+    const std::vector<VariableKey> damaged =
+        backend->scrub(*materialize(persisted));
+    stamp = Stamp::of(file);
+    reportCorrupted(damaged);
+    log<level::INFO>("UEFI storage scrubbed", entry("FILE=%s", file.c_str()),
+                     entry("DAMAGED=%zu", damaged.size()));
+
+    return damaged;
+}
+
+void Storage::reportCorrupted(const std::vector<VariableKey>& keys)
+{
+    for (const auto& key : keys)
+    {
+        char guid[UUID_STR_LEN];
+        uuid_unparse_upper(key.guid, guid);
+        log<level::ERR>("UEFI variable is damaged",
+                        entry("FILE=%s", file.c_str()),
+                        entry("NAME=%s", key.name.c_str()),
+                        entry("GUID=%s", guid));
+    }
+    corruptedCount = keys.size();
+}
+
+bool Storage::changed()
+{
+    wait();
+    const Stamp current = Stamp::of(file);
+    std::lock_guard<std::mutex> lock(writeLock);
+    return !(current == stamp) && current.inode;
+}
+
+bool Storage::reload()
+{
+    const Stamp current = Stamp::of(file);
+    if (!changed())
+    {
+        return false;
+    }
+
+    // backend state is shared with writers, readers are not blocked
+    std::lock_guard<std::mutex> lock(writeLock);
+    auto vars = allocate();
+    auto image = backend->load(vars->get_allocator().resource());
+    if (!image)
+    {
+        return false;
+    }
+    *vars = std::move(*image);
+    reportCorrupted(backend->corrupted());
+
+    if (!(Stamp::of(file) == current))
+    {
+        // modified again while loading, will be reloaded on the next event
+        return false;
+    }
+    stamp = current;
+    profileSet = backend->profiles();
+    if (flushDeadline)
+    {
+        log<level::WARNING>("Delayed UEFI settings discarded",
+                            entry("FILE=%s", file.c_str()));
+        flushDeadline.reset();
+    }
+    remember(snapshot(), vars);
+    pageOut(*vars);
+    persisted = vars;
+    recount(*vars);
+    log<level::INFO>("UEFI settings reloaded", entry("FILE=%s", file.c_str()),
+                     entry("VARS=%u", vars->size()));
+    publish(std::move(vars));
+
+    return true;
+}
+
+std::shared_ptr<const VariableValue> Storage::get(const VariableKeyView& key)
+{
+    const Snapshot vars = snapshot();
+    auto it = vars->find(key);
+    return it == vars->end() ? nullptr : retrieve(vars, it->second);
+}
+
+void Storage::set(VariableKey key, VariableValue value)
+{
+    // the cache and history records keep 16-bit name size
+    if (key.name.size() > std::numeric_limits<uint16_t>::max())
+    {
+        throw std::length_error("Variable name is too long");
+    }
+
+    // the loader takes the write lock to publish variables
+    wait();
+    std::lock_guard<std::mutex> lock(writeLock);
+
+    const Snapshot current = snapshot();
+    std::optional<AuditRecord::Action> action;
+    auto existing = current->find(key);
+    std::shared_ptr<const VariableValue> previous;
+    if (existing != current->end())
+    {
+        previous = retrieve(current, existing->second);
+    }
+
+    // the appended value is built as a new copy and persisted as a whole,
+    // like any other change
+    const bool append = value.attributes & EFI_VARIABLE_APPEND_WRITE;
+    if (append)
+    {
+        value.attributes &= ~EFI_VARIABLE_APPEND_WRITE;
+        if (previous && previous->attributes != value.attributes)
+        {
+            throw std::invalid_argument("Attributes of appended data differ");
+        }
+        value.data = signature::append(
+            previous ? previous->data.get() : std::vector<uint8_t>(),
+            value.data);
+    }
+    if (!backend->storable(value.attributes))
+    {
+        throw std::invalid_argument("Attributes are not supported");
+    }
+
+    if (!previous)
+    {
+        action = AuditRecord::Action::create;
+    }
+    else if (previous->attributes != value.attributes ||
+             (append ? previous->data.size() != value.data.size()
+                     : previous->data != value.data))
+    {
+        action = append ? AuditRecord::Action::append
+                        : AuditRecord::Action::change;
+    }
+
+    if (action)
+    {
+        // check quotas
+        const bool hwErr = isHwErr(value.attributes);
+        const uint64_t size =
+            key.name.size() + sizeof(uuid_t) + value.data.size();
+        {
+            std::lock_guard<std::mutex> usageGuard(usageLock);
+            uint64_t used = counters[hwErr].size();
+            if (existing != current->end() &&
+                isHwErr(existing->second.attributes) == hwErr)
+            {
+                used -= existing->first.name.size() + sizeof(uuid_t) +
+                        dataSize(existing->second);
+            }
+            const uint64_t maxStorage =
+                hwErr ? limits.maxHwErrStorage : limits.maxStorage;
+            if (size > limits.maxVariable || used > maxStorage ||
+                size > maxStorage - used)
+            {
+                throw std::length_error("Storage quota exceeded");
+            }
+        }
+
+        const bool delayed = throttle(key, size);
+        // profiles are small, a copy is simpler than undoing the change
+        std::optional<Profiles> profiles;
+        if (!profileSet.active.empty())
+        {
+            profiles = profileSet;
+            track(*current, key, value);
+        }
+        auto vars = clone(*current, key);
+        auto it = vars->emplace(std::move(key), std::move(value)).first;
+        try
+        {
+            commit(vars, delayed);
+        }
+        catch (...)
+        {
+            if (profiles)
+            {
+                profileSet = std::move(*profiles);
+            }
+            throw;
+        }
+        remember(current, vars, it->first);
+
+        {
+            std::lock_guard<std::mutex> usageGuard(usageLock);
+            if (existing != current->end())
+            {
+                account(counters[isHwErr(existing->second.attributes)],
+                        existing->first, existing->second, false);
+            }
+            account(counters[hwErr], it->first, it->second, true);
+        }
+
+        audit.record(*action, it->first);
+    }
+}
+
+uint32_t Storage::beginWrite(VariableKey key, uint32_t attributes,
+                             size_t size)
+{
+    if (size > maxStagedSize)
+    {
+        throw std::invalid_argument("Variable is too big");
+    }
+
+    std::lock_guard<std::mutex> lock(stagedLock);
+
+    if (staged.size() >= maxStagedWrites)
+    {
+        // handles grow monotonically, the first one is the oldest
+        const VariableKey& oldest = staged.begin()->second.key;
+        log<level::WARNING>("Discard staged write",
+                            entry("NAME=%s", oldest.name.c_str()));
+        staged.erase(staged.begin());
+    }
+
+    // zero handle is never used
+    do
+    {
+        ++lastHandle;
+    } while (!lastHandle || staged.find(lastHandle) != staged.end());
+
+    staged.emplace(lastHandle,
+                   StagedWrite{std::move(key), attributes,
+                               std::vector<uint8_t>(size)});
+
+    return lastHandle;
+}
+
+void Storage::writeChunk(uint32_t handle, size_t offset,
+                         const std::vector<uint8_t>& data)
+{
+    std::lock_guard<std::mutex> lock(stagedLock);
+
+    auto it = staged.find(handle);
+    if (it == staged.end())
+    {
+        throw std::invalid_argument("Unknown staged write handle");
+    }
+    std::vector<uint8_t>& buffer = it->second.data;
+    if (offset > buffer.size() || data.size() > buffer.size() - offset)
+    {
+        throw std::invalid_argument("Chunk is out of variable range");
+    }
+    std::copy(data.begin(), data.end(), buffer.begin() + offset);
+}
+
+void Storage::commitWrite(uint32_t handle)
+{
+    StagedWrite var;
+    {
+        std::lock_guard<std::mutex> lock(stagedLock);
+        auto it = staged.find(handle);
+        if (it == staged.end())
+        {
+            throw std::invalid_argument("Unknown staged write handle");
+        }
+        var = std::move(it->second);
+        staged.erase(it);
+    }
+    set(std::move(var.key),
+        VariableValue{var.attributes, std::move(var.data)});
+}
+
+void Storage::remove(const VariableKeyView& key)
+{
+    wait();
+    std::lock_guard<std::mutex> lock(writeLock);
+
+    const Snapshot current = snapshot();
+    auto existing = current->find(key);
+    if (existing != current->end())
+    {
+        const bool delayed =
+            throttle(key, key.name.size() + sizeof(uuid_t));
+        std::optional<Profiles> previous;
+        if (!profileSet.active.empty())
+        {
+            previous = profileSet;
+            track(*current, existing->first, std::nullopt);
+        }
+        auto vars = clone(*current, key);
+        try
+        {
+            commit(vars, delayed);
+        }
+        catch (...)
+        {
+            if (previous)
+            {
+                profileSet = std::move(*previous);
+            }
+            throw;
+        }
+        remember(current, vars, key);
+        {
+            std::lock_guard<std::mutex> usageGuard(usageLock);
+            account(counters[isHwErr(existing->second.attributes)],
+                    existing->first, existing->second, false);
+        }
+
+        audit.record(AuditRecord::Action::remove, key);
+    }
+}
+
+void Storage::apply(const VariableDelta& changes)
+{
+    wait();
+    std::lock_guard<std::mutex> lock(writeLock);
+
+    const Snapshot current = snapshot();
+    auto vars = clone(*current);
+    for (const auto& [key, value] : changes)
+    {
+        if (value)
+        {
+            if (!backend->storable(value->attributes))
+            {
+                throw std::invalid_argument("Attributes are not supported");
+            }
+            (*vars)[key] = *value;
+        }
+        else
+        {
+            vars->erase(key);
+        }
+    }
+
+    commit(vars);
+    remember(current, vars);
+    recount(*vars);
+}
+
+std::optional<VariableKey> Storage::next(const VariableKeyView& key)
+{
+    const Snapshot vars = snapshot();
+
+    if (key.name.empty())
+    {
+        // Request for the first variable
+        return vars->empty()
+                   ? std::nullopt
+                   : std::optional<VariableKey>(vars->begin()->first);
+    }
+
+    auto it = vars->upper_bound(key);
+    return it != vars->end() ? std::optional<VariableKey>(it->first)
+                             : std::nullopt;
+}
+
+std::vector<Storage::Match> Storage::find(const Query& query)
+{
+    std::vector<Match> found;
+    auto add = [&found, &query](const Variables::value_type& var) {
+        const uint32_t attributes = var.second.attributes;
+        if ((attributes & query.attributes) == query.attributes)
+        {
+            found.push_back(Match{var.first, attributes});
+        }
+    };
+
+    if (!query.anyGuid)
+    {
+        // variables of the GUID follow each other, ordered by name
+        const Snapshot vars = snapshot();
+        for (auto it = vars->lower_bound(
+                 VariableKeyView(query.prefix, query.guid));
+             it != vars->end() &&
+             memcmp(it->first.guid, query.guid, sizeof(uuid_t)) == 0 &&
+             startsWith(it->first.name, query.prefix);
+             ++it)
+        {
+            add(*it);
+        }
+        return found;
+    }
+
+    const std::shared_ptr<const Index> idx = indexes();
+    if (!query.prefix.empty() || !query.attributes)
+    {
+        auto it = std::lower_bound(
+            idx->byName.begin(), idx->byName.end(), query.prefix,
+            [](Index::Entry entry, const std::string& prefix) {
+                return entry->first.name < prefix;
+            });
+        for (; it != idx->byName.end() &&
+               startsWith((*it)->first.name, query.prefix);
+             ++it)
+        {
+            add(**it);
+        }
+    }
+    else
+    {
+        for (const auto& [attributes, entries] : idx->byAttributes)
+        {
+            if ((attributes & query.attributes) == query.attributes)
+            {
+                for (const Index::Entry entry : entries)
+                {
+                    found.push_back(Match{entry->first, attributes});
+                }
+            }
+        }
+    }
+
+    std::sort(found.begin(), found.end(),
+              [](const Match& lhs, const Match& rhs) {
+                  return lhs.key < rhs.key;
+              });
+    return found;
+}
+
+void Storage::reset()
+{
+    wait();
+    std::lock_guard<std::mutex> lock(writeLock);
+    auto vars = allocate();
+    replace(vars);
+    recount(*vars);
+    audit.drain(); // keep order of records
+    log<level::INFO>("AUDIT: Reset UEFI settings");
+}
+
+void Storage::updateVars(const std::filesystem::path& newNvram)
+{
+    // get default variables to determine their new sizes
+    const Variables newVars = nvram::parseVolume(newNvram);
+    auto itDefaults = newVars.find(stdDefaults);
+    if (itDefaults == newVars.end() || itDefaults->second.data.empty())
+    {
+        throw std::runtime_error("StdDefaults not found");
+    }
+    const Variables defVars = nvram::parseNvram(
+        itDefaults->second.data.data(), itDefaults->second.data.size());
+
+    wait();
+    std::lock_guard<std::mutex> lock(writeLock);
+    const Snapshot current = snapshot();
+    auto vars = clone(*materialize(current));
 
-using namespace phosphor::logging;
+    for (auto const& defVar : defVars)
+    {
+        auto existing = vars->find(defVar.first);
+        if (existing != vars->end())
+        {
+            const VariableValue& newVar = defVar.second;
+            VariableValue& oldVar = existing->second;
+            oldVar.attributes = newVar.attributes;
+            const size_t newDataSize = newVar.data.size();
+            const size_t oldDataSize = oldVar.data.size();
+            if (newDataSize != oldDataSize)
+            {
+                std::vector<uint8_t> data = oldVar.data;
+                data.resize(newDataSize);
+                if (newDataSize > oldDataSize)
+                {
+                    std::copy(newVar.data.begin() + oldDataSize,
+                              newVar.data.end(), data.begin() + oldDataSize);
+                }
+                oldVar.data = std::move(data);
+            }
+        }
+    }
+
+    commit(vars);
+    remember(current, vars);
+    recount(*vars);
+
+    audit.drain();
+    log<level::INFO>("AUDIT: Update UEFI settings");
+}
+
+void Storage::importVars(const std::filesystem::path& oldNvram)
+{
+    importVars(nvram::parseVolume(oldNvram));
+}
 
-// Special variable which contains default values for UEFI settings
-static const VariableKey stdDefaults{"StdDefaults",
-                                     {0x45, 0x99, 0xD2, 0x6F, 0x1A, 0x11, 0x49,
-                                      0xB8, 0xB9, 0x1F, 0x85, 0x87, 0x45, 0xCF,
-                                      0xF8, 0x24}};
+void Storage::importVars(const Variables& oldVars)
+{
+    wait();
+
+    // unpack and put default variables
+    auto itDefaults = oldVars.find(stdDefaults);
+    if (itDefaults == oldVars.end() || itDefaults->second.data.empty())
+    {
+        throw std::runtime_error("StdDefaults not found");
+    }
+    auto vars = allocate();
+    *vars = nvram::parseNvram(itDefaults->second.data.data(),
+                              itDefaults->second.data.size(),
+                              vars->get_allocator().resource());
+    // put old variables
+    for (const auto& var : oldVars)
+    {
+        if (var.first.name != stdDefaults.name)
+        {
+            (*vars)[var.first] = var.second;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(writeLock);
+    replace(vars);
+    recount(*vars);
 
-Storage::Storage(const std::filesystem::path& varFile) : file(varFile)
+    audit.drain();
+    log<level::INFO>("AUDIT: Import UEFI settings");
+}
+
+void Storage::load()
 {
-    if (!std::filesystem::exists(file))
+    if (!owner.locked() && !owner.lock(file, false))
+    {
+        log<level::WARNING>("UEFI storage is locked by another process",
+                            entry("FILE=%s", file.c_str()));
+        // poll to let the destructor cancel the load
+        const auto deadline = std::chrono::steady_clock::now() + ownerWait;
+        while (!owner.lock(file, false))
+        {
+            if (stopLoader)
+            {
+                throw std::runtime_error("UEFI storage loading cancelled");
+            }
+            if (std::chrono::steady_clock::now() >= deadline)
+            {
+                log<level::ERR>("UEFI storage was not released by its owner",
+                                entry("FILE=%s", file.c_str()));
+                throw std::runtime_error(
+                    "UEFI storage is locked by another process");
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+
+    // variables are loaded right into the arena, move is just a swap
+    std::shared_ptr<Variables> vars = allocate();
+    auto image = backend->load(vars->get_allocator().resource());
+    if (!image)
     {
         log<level::WARNING>("UEFI storage is empty",
                             entry("FILE=%s", file.c_str()));
+        vars.reset();
     }
     else
     {
-        variables = loadVariables(file);
+        *vars = std::move(*image);
+        reportCorrupted(backend->corrupted());
+        profileSet = backend->profiles();
         log<level::INFO>("UEFI settings loaded", entry("FILE=%s", file.c_str()),
-                         entry("VARS=%u", variables.size()));
+                         entry("VARS=%u", vars->size()),
+                         entry("MEMORY=%zu", memoryUsage()));
+        recount(*vars);
+        stamp = Stamp::of(file);
+    }
+
+    // tiering can be enabled while loading
+    std::lock_guard<std::mutex> lock(writeLock);
+    if (vars)
+    {
+        pageOut(*vars);
+        publish(std::move(vars));
     }
+    persisted = std::atomic_load(&variables);
 }
 
-bool Storage::empty() const
+std::shared_ptr<Variables> Storage::allocate() const
 {
-    return variables.empty();
+    auto arena = std::make_shared<Arena>(memory);
+    return std::shared_ptr<Variables>(arena, &arena->variables);
 }
 
-std::optional<VariableValue> Storage::get(const VariableKey& key)
+std::shared_ptr<Variables>
+    Storage::clone(const Variables& src,
+                   const std::optional<VariableKeyView>& skip) const
 {
-    auto it = variables.find(key);
-    return it == variables.end() ? std::nullopt
-                                 : std::optional<VariableValue>(it->second);
+    auto vars = allocate();
+    auto split = skip ? src.find(*skip) : src.end();
+    vars->insert(src.begin(), split);
+    if (split != src.end())
+    {
+        vars->insert(std::next(split), src.end());
+    }
+    return vars;
 }
 
-void Storage::set(const VariableKey& key, const VariableValue& value)
+void Storage::commit(std::shared_ptr<Variables> vars, bool delayed)
 {
-    const char* action = nullptr;
-    auto existing = variables.find(key);
-    if (existing == variables.end())
+    if (!delayed)
     {
-        variables[key] = value;
-        action = "Create";
+        persist(vars);
     }
-    else if (existing->second.attributes != value.attributes ||
-             existing->second.data != value.data)
+    else if (!flushDeadline)
     {
-        existing->second = value;
-        action = "Change";
+        flushDeadline = std::chrono::steady_clock::now() + budget.delay;
+        flushSignal.notify_one();
     }
+    pageOut(*vars);
+    publish(std::move(vars));
+}
 
-    if (action)
+void Storage::persist(const Snapshot& vars)
+{
+    // only incremental backends compare data, others load paged out values
+    // one by one while saving
+    size_t bytes;
+    if (backend->incremental())
+    {
+        const Snapshot full = materialize(vars);
+        const Snapshot previous =
+            persisted == vars ? full : materialize(persisted);
+        bytes = backend->saveProfiles(*previous, *full, profileSet);
+    }
+    else
+    {
+        bytes = backend->saveProfiles(*persisted, *vars, profileSet);
+    }
+    const std::vector<VariableKey> changes = changedKeys(*persisted, *vars);
+    persisted = vars;
+    stamp = Stamp::of(file);
+    flushDeadline.reset();
+
+    // media writes are shared by the variables saved together
+    std::lock_guard<std::mutex> lock(writesLock);
+    totalWrites.physicalBytes += bytes;
+    for (size_t i = 0; i < changes.size(); ++i)
+    {
+        const size_t share = bytes / changes.size() +
+                             (i < bytes % changes.size() ? 1 : 0);
+        writes[changes[i]].stats.physicalBytes += share;
+    }
+}
+
+bool Storage::throttle(const VariableKeyView& key, size_t size)
+{
+    const auto now = std::chrono::steady_clock::now();
+    bool exceeded = false;
     {
-        saveVariables(variables, file);
+        std::lock_guard<std::mutex> lock(writesLock);
+        auto it = writes.find(key);
+        if (it == writes.end())
+        {
+            it = writes.emplace(VariableKey{key.name, key.guid}, WriteState{})
+                     .first;
+        }
+        WriteState& state = it->second;
+        ++state.stats.writes;
+        state.stats.logicalBytes += size;
+        ++totalWrites.writes;
+        totalWrites.logicalBytes += size;
+        if (!budget.writes)
+        {
+            return false;
+        }
+        if (state.writes == 0 || now - state.start >= budget.period)
+        {
+            state.start = now;
+            state.writes = 0;
+        }
+        if (++state.writes <= budget.writes)
+        {
+            return false;
+        }
+        ++state.stats.throttled;
+        ++totalWrites.throttled;
+        exceeded = state.writes == budget.writes + 1;
+    }
 
-        // Create audit record in log
+    if (exceeded)
+    {
         char uuid[UUID_STR_LEN];
         uuid_unparse_upper(key.guid, uuid);
+        const std::string name(key.name);
+        log<level::WARNING>("UEFI variable writes throttled",
+                            entry("NAME=%s", name.c_str()),
+                            entry("GUID=%s", uuid),
+                            entry("WRITES=%zu", budget.writes));
+    }
+    return true;
+}
 
-        std::string msg = "AUDIT: ";
-        msg += action;
-        msg += " UEFI setting ";
-        msg += key.name;
-        log<level::INFO>(msg.c_str(), entry("NAME=%s", key.name.c_str()),
-                         entry("GUID=%s", uuid));
+void Storage::flusher()
+{
+    std::unique_lock<std::mutex> lock(writeLock);
+    while (!stopFlusher)
+    {
+        if (!flushDeadline)
+        {
+            flushSignal.wait(lock);
+            continue;
+        }
+        if (std::chrono::steady_clock::now() < *flushDeadline)
+        {
+            flushSignal.wait_until(lock, *flushDeadline);
+            continue;
+        }
+        try
+        {
+            persist(std::atomic_load(&variables));
+        }
+        catch (const std::exception& ex)
+        {
+            log<level::ERR>("Unable to save delayed UEFI settings",
+                            entry("FILE=%s", file.c_str()),
+                            entry("EXCEPTION=%s", ex.what()));
+            flushDeadline = std::chrono::steady_clock::now() + budget.delay;
+        }
     }
 }
 
-void Storage::remove(const VariableKey& key)
+void Storage::replace(std::shared_ptr<Variables> vars)
 {
-    auto existing = variables.find(key);
-    if (existing != variables.end())
+    // the active profile can't be reverted on the new base set
+    Profiles previous = profileSet;
+    profileSet.active.clear();
+    profileSet.shadow.clear();
+    const Snapshot current = snapshot();
+    try
+    {
+        commit(vars);
+    }
+    catch (...)
     {
-        variables.erase(key);
-        saveVariables(variables, file);
+        profileSet = std::move(previous);
+        throw;
+    }
+    remember(current, vars);
+}
 
-        // Create audit record in log
-        char uuid[UUID_STR_LEN];
-        uuid_unparse_upper(key.guid, uuid);
-        std::string msg = "AUDIT: Remove UEFI setting ";
-        msg += key.name;
-        log<level::INFO>(msg.c_str(), entry("NAME=%s", key.name.c_str()),
-                         entry("GUID=%s", uuid));
+void Storage::track(const Variables& current, const VariableKey& key,
+                    const std::optional<VariableValue>& value)
+{
+    // the first change of the variable in the profile keeps its base value
+    if (profileSet.shadow.find(key) == profileSet.shadow.end())
+    {
+        auto it = current.find(key);
+        profileSet.shadow.emplace(
+            key, it == current.end()
+                     ? std::nullopt
+                     : std::optional<VariableValue>(expand(it->second)));
     }
+    profileSet.deltas[profileSet.active][key] = value;
 }
 
-std::optional<VariableKey> Storage::next(const VariableKey& key)
+void Storage::createProfile(const std::string& name)
 {
-    if (key.name.empty())
+    wait();
+    std::lock_guard<std::mutex> lock(writeLock);
+    if (name.empty() ||
+        profileSet.deltas.find(name) != profileSet.deltas.end())
     {
-        // Request for the first variable
-        return variables.empty()
-                   ? std::nullopt
-                   : std::optional<VariableKey>(variables.begin()->first);
+        throw std::invalid_argument("Invalid profile name");
+    }
+
+    profileSet.deltas[name] = profileSet.active.empty()
+                                  ? VariableDelta()
+                                  : profileSet.deltas[profileSet.active];
+    try
+    {
+        persist(std::atomic_load(&variables));
+    }
+    catch (...)
+    {
+        profileSet.deltas.erase(name);
+        throw;
     }
 
-    auto existing = variables.find(key);
-    return (existing != variables.end() && ++existing != variables.end())
-               ? std::optional<VariableKey>(existing->first)
-               : std::nullopt;
+    audit.drain();
+    log<level::INFO>("AUDIT: Create UEFI settings profile",
+                     entry("PROFILE=%s", name.c_str()));
 }
 
-void Storage::reset()
+void Storage::deleteProfile(const std::string& name)
 {
-    variables.clear();
-    saveVariables(variables, file);
-    log<level::INFO>("AUDIT: Reset UEFI settings");
+    wait();
+    std::lock_guard<std::mutex> lock(writeLock);
+    auto it = profileSet.deltas.find(name);
+    if (it == profileSet.deltas.end())
+    {
+        throw std::out_of_range("Profile not found");
+    }
+    if (name == profileSet.active)
+    {
+        throw std::invalid_argument("Profile is active");
+    }
+
+    VariableDelta delta = std::move(it->second);
+    profileSet.deltas.erase(it);
+    try
+    {
+        persist(std::atomic_load(&variables));
+    }
+    catch (...)
+    {
+        profileSet.deltas.emplace(name, std::move(delta));
+        throw;
+    }
+
+    audit.drain();
+    log<level::INFO>("AUDIT: Delete UEFI settings profile",
+                     entry("PROFILE=%s", name.c_str()));
 }
 
-void Storage::updateVars(const std::filesystem::path& newNvram)
+void Storage::selectProfile(const std::string& name)
 {
-    // get default variables to determine their new sizes
-    const Variables newVars = nvram::parseVolume(newNvram);
-    auto itDefaults = newVars.find(stdDefaults);
-    if (itDefaults == newVars.end() || itDefaults->second.data.empty())
+    wait();
+    std::lock_guard<std::mutex> lock(writeLock);
+    if (name == profileSet.active)
     {
-        throw std::runtime_error("StdDefaults not found");
+        return;
+    }
+    auto profile = profileSet.deltas.find(name);
+    if (!name.empty() && profile == profileSet.deltas.end())
+    {
+        throw std::out_of_range("Profile not found");
     }
-    const Variables defVars = nvram::parseNvram(
-        &itDefaults->second.data.front(), itDefaults->second.data.size());
 
-    for (auto const& defVar : defVars)
+    // only variables changed by the old and the new profiles are touched
+    const Snapshot current = snapshot();
+    auto vars = clone(*current);
+    for (const auto& [key, value] : profileSet.shadow)
+    {
+        assign(*vars, key, value);
+    }
+    VariableDelta shadow;
+    if (!name.empty())
     {
-        auto existing = variables.find(defVar.first);
-        if (existing != variables.end())
+        for (const auto& [key, value] : profile->second)
         {
-            const VariableValue& newVar = defVar.second;
-            VariableValue& oldVar = existing->second;
-            oldVar.attributes = newVar.attributes;
-            const size_t newDataSize = newVar.data.size();
-            const size_t oldDataSize = oldVar.data.size();
-            if (newDataSize > oldDataSize)
+            std::optional<VariableValue> base;
+            auto it = vars->find(key);
+            if (it != vars->end())
+            {
+                base = expand(it->second);
+            }
+            shadow.emplace(key, std::move(base));
+            assign(*vars, key, value);
+        }
+    }
+
+    std::string active = name;
+    std::swap(profileSet.active, active);
+    std::swap(profileSet.shadow, shadow);
+    try
+    {
+        commit(vars);
+    }
+    catch (...)
+    {
+        std::swap(profileSet.active, active);
+        std::swap(profileSet.shadow, shadow);
+        throw;
+    }
+    remember(current, vars);
+    recount(*vars);
+
+    audit.drain();
+    log<level::INFO>("AUDIT: Select UEFI settings profile",
+                     entry("PROFILE=%s", name.c_str()));
+}
+
+std::vector<std::string> Storage::profiles()
+{
+    wait();
+    std::lock_guard<std::mutex> lock(writeLock);
+    std::vector<std::string> names;
+    names.reserve(profileSet.deltas.size());
+    for (const auto& it : profileSet.deltas)
+    {
+        names.push_back(it.first);
+    }
+    return names;
+}
+
+std::string Storage::activeProfile()
+{
+    wait();
+    std::lock_guard<std::mutex> lock(writeLock);
+    return profileSet.active;
+}
+
+void Storage::enableHistory(const std::filesystem::path& logFile,
+                            size_t maxBytes)
+{
+    std::lock_guard<std::mutex> lock(writeLock);
+    history = std::make_unique<History>(logFile, maxBytes);
+}
+
+bool Storage::hasHistory() const
+{
+    return history != nullptr;
+}
+
+std::vector<History::Change> Storage::changes(size_t count)
+{
+    std::lock_guard<std::mutex> lock(writeLock);
+    if (!history)
+    {
+        throw std::runtime_error("History is disabled");
+    }
+    return history->list(count);
+}
+
+void Storage::rollback(uint64_t generation)
+{
+    wait();
+    std::lock_guard<std::mutex> lock(writeLock);
+    revert(generation);
+}
+
+void Storage::rollbackToTime(uint64_t time)
+{
+    wait();
+    std::lock_guard<std::mutex> lock(writeLock);
+    if (!history)
+    {
+        throw std::runtime_error("History is disabled");
+    }
+    revert(history->generationAt(time));
+}
+
+void Storage::remember(const Snapshot& from, const Snapshot& to,
+                       const std::optional<VariableKeyView>& key)
+{
+    if (!history)
+    {
+        return;
+    }
+    try
+    {
+        if (key)
+        {
+            // only the changed variable is loaded
+            Variables before, after;
+            auto it = from->find(*key);
+            if (it != from->end())
             {
-                oldVar.data.insert(oldVar.data.end(),
-                                   newVar.data.begin() + oldDataSize,
-                                   newVar.data.end());
+                before.emplace(it->first, expand(it->second));
             }
-            else if (newDataSize < oldDataSize)
+            it = to->find(*key);
+            if (it != to->end())
             {
-                oldVar.data.resize(newDataSize);
+                after.emplace(it->first, expand(it->second));
             }
+            history->record(before, after, *key);
         }
+        else
+        {
+            history->record(*materialize(from), *materialize(to));
+        }
+    }
+    catch (const std::exception& ex)
+    {
+        log<level::ERR>("Unable to record UEFI settings history",
+                        entry("FILE=%s", file.c_str()),
+                        entry("EXCEPTION=%s", ex.what()));
+    }
+}
+
+void Storage::revert(uint64_t generation)
+{
+    if (!history)
+    {
+        throw std::runtime_error("History is disabled");
     }
 
-    saveVariables(variables, file);
+    const Snapshot current = snapshot();
+    const VariableDelta delta =
+        history->rollback(*materialize(current), generation);
+    if (delta.empty())
+    {
+        return;
+    }
+    auto vars = clone(*current);
+    for (const auto& [key, value] : delta)
+    {
+        assign(*vars, key, value);
+    }
+    replace(vars);
+    recount(*vars);
 
-    log<level::INFO>("AUDIT: Update UEFI settings");
+    audit.drain();
+    log<level::INFO>("AUDIT: Roll back UEFI settings",
+                     entry("FILE=%s", file.c_str()),
+                     entry("GENERATION=%llu",
+                           static_cast<unsigned long long>(generation)));
 }
 
-void Storage::importVars(const std::filesystem::path& oldNvram)
+void Storage::enableTiering(const std::filesystem::path& spillFile,
+                            size_t threshold, size_t cacheBytes)
 {
-    const Variables oldVars = nvram::parseVolume(oldNvram);
+    std::lock_guard<std::mutex> lock(writeLock);
+    pager = Pager::create(spillFile, cacheBytes);
+    pageThreshold = threshold;
+    backend->setPageLoader([pager = pager](const Page& page) {
+        // bulk loads don't evict recently read values from the cache
+        return pager->load(page, false);
+    });
 
-    // unpack and put default variables
-    auto itDefaults = oldVars.find(stdDefaults);
-    if (itDefaults == oldVars.end() || itDefaults->second.data.empty())
+    // variables loaded before are paged out at once, the content is the
+    // same, so the generation is kept
+    const Snapshot current = std::atomic_load(&variables);
+    auto vars = clone(*current);
+    if (pageOut(*vars))
     {
-        throw std::runtime_error("StdDefaults not found");
+        if (persisted == current)
+        {
+            persisted = vars;
+        }
+        std::atomic_store(&variables, Snapshot(std::move(vars)));
     }
-    variables = nvram::parseNvram(&itDefaults->second.data.front(),
-                                  itDefaults->second.data.size());
-    // put old variables
-    for (const auto& var : oldVars)
+}
+
+Storage::Snapshot Storage::materialize() const
+{
+    return materialize(snapshot());
+}
+
+Storage::Snapshot Storage::materialize(const Snapshot& vars) const
+{
+    if (!pager || std::none_of(vars->begin(), vars->end(), [](const auto& it) {
+            return it.second.page != nullptr;
+        }))
     {
-        if (var.first.name != stdDefaults.name)
+        return vars;
+    }
+    auto full = allocate();
+    for (const auto& [key, value] : *vars)
+    {
+        full->emplace_hint(full->end(), key, expand(value));
+    }
+    return full;
+}
+
+VariableValue Storage::expand(const VariableValue& value) const
+{
+    // bulk loads don't evict recently read values from the cache
+    return value.page ? *pager->load(*value.page, false) : value;
+}
+
+std::shared_ptr<const VariableValue>
+    Storage::retrieve(const Snapshot& vars, const VariableValue& value) const
+{
+    return value.page ? pager->load(*value.page)
+                      : std::shared_ptr<const VariableValue>(vars, &value);
+}
+
+size_t Storage::pageOut(Variables& vars)
+{
+    if (!pager)
+    {
+        return 0;
+    }
+    size_t count = 0;
+    for (auto& [key, value] : vars)
+    {
+        if (value.page || value.data.empty() ||
+            value.data.size() < pageThreshold)
+        {
+            continue;
+        }
+        try
+        {
+            value.page = pager->store(value);
+        }
+        catch (const std::exception& ex)
         {
-            variables[var.first] = var.second;
+            // kept resident
+            log<level::ERR>("Unable to page out UEFI variable",
+                            entry("FILE=%s", file.c_str()),
+                            entry("NAME=%s", key.name.c_str()),
+                            entry("EXCEPTION=%s", ex.what()));
+            break;
         }
+        value.data.clear();
+        ++count;
     }
+    return count;
+}
 
-    saveVariables(variables, file);
+void Storage::publish(std::shared_ptr<Variables> vars)
+{
+    std::atomic_store(&variables, Snapshot(std::move(vars)));
+    std::atomic_store(&index, std::shared_ptr<const Index>());
+    ++generationNumber;
+}
 
-    log<level::INFO>("AUDIT: Import UEFI settings");
+std::shared_ptr<const Storage::Index> Storage::indexes()
+{
+    const Snapshot vars = snapshot();
+    std::shared_ptr<const Index> idx = std::atomic_load(&index);
+    if (!idx || idx->source != vars)
+    {
+        idx = std::make_shared<const Index>(vars);
+        std::atomic_store(&index, idx);
+    }
+    return idx;
+}
+
+bool Storage::Stamp::operator==(const Stamp& rhs) const
+{
+    return device == rhs.device && inode == rhs.inode && size == rhs.size &&
+           mtime == rhs.mtime;
+}
+
+Storage::Stamp Storage::Stamp::of(const std::filesystem::path& file)
+{
+    Stamp stamp;
+    struct stat st;
+    if (stat(file.c_str(), &st) == 0)
+    {
+        stamp.device = st.st_dev;
+        stamp.inode = st.st_ino;
+        stamp.size = st.st_size;
+        stamp.mtime = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                      st.st_mtim.tv_nsec;
+    }
+    return stamp;
 }
@@ -3,9 +3,22 @@
 
 #pragma once
 
+#include "audit.hpp"
+#include "backend.hpp"
+#include "history.hpp"
+#include "lock.hpp"
+#include "pager.hpp"
 #include "variable.hpp"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <thread>
 
 /**
  * @brief Storage for UEFI variables.
@@ -16,14 +29,168 @@ class Storage final
     /** @brief Default path for UEFI storage file. */
     static constexpr const char* defaultFile = "/var/lib/uefivar.json";
 
+    /** @brief Default directory for storage files in multi-host mode. */
+    static constexpr const char* hostDir = "/var/lib/uefivar";
+
+    /** @brief Max number of simultaneous staged writes. */
+    static constexpr size_t maxStagedWrites = 8;
+
+    /** @brief Max size of variable written by chunks. */
+    static constexpr size_t maxStagedSize = 1024 * 1024;
+
+    /** @brief Default time to wait for the storage file release. */
+    static constexpr std::chrono::milliseconds ownerTimeout =
+        std::chrono::seconds(60);
+
+    /** @brief Special variable of NVRAM dumps, contains packed default
+     *         values of UEFI settings. */
+    static const VariableKey stdDefaults;
+
+    /**
+     * @brief Immutable set of variables. Each commit publishes a new
+     *        snapshot, readers keep the old one alive as long as they hold it.
+     */
+    using Snapshot = std::shared_ptr<const Variables>;
+
+    /** @brief Value used for unlimited sizes. */
+    static constexpr uint64_t unlimited = UINT64_MAX;
+
+    /**
+     * @brief Storage quotas, checked on setting variables.
+     */
+    struct Limits
+    {
+        uint64_t maxStorage = unlimited;      ///< Total size of variables
+        uint64_t maxHwErrStorage = unlimited; ///< Total size of HW errors
+        uint64_t maxVariable = unlimited;     ///< Size of a single variable
+    };
+
+    /**
+     * @brief Usage counters of a class of variables.
+     */
+    struct Usage
+    {
+        size_t count = 0;     ///< Number of variables
+        size_t keyBytes = 0;  ///< Size of keys (names and GUIDs)
+        size_t dataBytes = 0; ///< Size of payloads
+
+        /** @brief Get total size of the variables. */
+        size_t size() const
+        {
+            return keyBytes + dataBytes;
+        }
+    };
+
+    /**
+     * @brief Write budget of a single variable: rewriting the variable more
+     *        often switches it to delayed persistence until the end of the
+     *        budget period, changes are coalesced and saved after the delay.
+     */
+    struct WriteBudget
+    {
+        size_t writes = 0; ///< Writes per period, 0 for unlimited
+        std::chrono::milliseconds period = std::chrono::hours(1);
+        std::chrono::milliseconds delay = std::chrono::minutes(1);
+    };
+
+    /**
+     * @brief Write counters of a variable or the whole storage.
+     */
+    struct WriteStats
+    {
+        uint64_t writes = 0;        ///< Number of modifications
+        uint64_t logicalBytes = 0;  ///< Size of keys and data set by clients
+        uint64_t physicalBytes = 0; ///< Bytes written to the media
+        uint64_t throttled = 0;     ///< Modifications with delayed saving
+    };
+
+    /**
+     * @brief Result of QueryVariableInfo.
+     */
+    struct Info
+    {
+        uint64_t maxStorage;  ///< Max size of storage for variables
+        uint64_t remaining;   ///< Remaining size of storage
+        uint64_t maxVariable; ///< Max size of a single variable
+    };
+
+    /**
+     * @brief Filter of variables for enumeration.
+     */
+    struct Query
+    {
+        bool anyGuid = true;     ///< Don't filter by GUID
+        uuid_t guid = {};        ///< Vendor GUID, if anyGuid is false
+        std::string prefix;      ///< Name prefix, empty for any name
+        uint32_t attributes = 0; ///< Attributes a variable must have
+    };
+
+    /**
+     * @brief Variable found by the query.
+     */
+    struct Match
+    {
+        VariableKey key;     ///< Variable key
+        uint32_t attributes; ///< Variable attributes
+    };
+
     /**
      * @brief Constructor.
      *
+     * The storage file is owned exclusively by a single instance of storage
+     * (see FileLock). Loading waits until the storage file is released by
+     * the previous owner, but not longer than the timeout, then the load
+     * fails. Waiting in background is cancelled by destruction of the
+     * storage.
+     *
      * @param[in] varFile Path to the variables storage file
+     * @param[in] background Load variables in a background thread, any
+     *                       access to the storage waits for the load
+     * @param[in] waitOwner Wait for the storage file release, otherwise
+     *                      fail at once if it is owned by someone else
+     * @param[in] timeout Max time to wait for the storage file release
      *
      * @throw std::runtime_error in case of errors
      */
-    Storage(const std::filesystem::path& varFile);
+    Storage(const std::filesystem::path& varFile, bool background = false,
+            bool waitOwner = true,
+            std::chrono::milliseconds timeout = ownerTimeout);
+
+    /**
+     * @brief Constructor.
+     *
+     * @param[in] varFile Path to the storage file or device, used for
+     *                    locking and change detection
+     * @param[in] persistence Persistence backend
+     * @param[in] background Load variables in a background thread
+     * @param[in] waitOwner Wait for the storage file release
+     * @param[in] timeout Max time to wait for the storage file release
+     *
+     * @throw std::exception in case of errors
+     */
+    Storage(const std::filesystem::path& varFile,
+            std::unique_ptr<Backend> persistence, bool background = false,
+            bool waitOwner = true,
+            std::chrono::milliseconds timeout = ownerTimeout);
+
+    /**
+     * @brief Destructor, saves delayed changes.
+     */
+    ~Storage();
+
+    /**
+     * @brief Check if variables are loaded.
+     *
+     * @return true if loading is completed (successfully or not)
+     */
+    bool ready() const;
+
+    /**
+     * @brief Wait for the variables loading.
+     *
+     * @throw std::runtime_error if loading failed
+     */
+    void wait() const;
 
     /**
      * @brief Check if storage is empty.
@@ -32,24 +199,77 @@ class Storage final
      */
     bool empty() const;
 
+    /**
+     * @brief Get current snapshot of variables.
+     *
+     * @return snapshot that is not affected by subsequent modifications
+     */
+    Snapshot snapshot() const;
+
     /**
      * @brief Get UEFI variable.
      *
      * @param[in] key Variable key
      *
-     * @return variable value or nullopt if not found
+     * @return pointer to the stored variable value (the snapshot containing
+     *         it is kept alive while the pointer exists) or nullptr if not
+     *         found
      */
-    std::optional<VariableValue> get(const VariableKey& key);
+    std::shared_ptr<const VariableValue> get(const VariableKeyView& key);
 
     /**
      * @brief Set UEFI variable.
+     *        If EFI_VARIABLE_APPEND_WRITE attribute is specified, the data is
+     *        appended to the existing variable (duplicate signatures are
+     *        skipped for signature databases), the attributes must match
+     *        the existing ones. The appended value is copied and persisted
+     *        as a whole.
      *
      * @param[in] key Variable key
-     * @param[in] value Variable value
+     * @param[in] value Variable value, moved to the storage as is
      *
+     * @throw std::invalid_argument if the backend can't store attributes
      * @throw std::runtime_error in case of errors
      */
-    void set(const VariableKey& key, const VariableValue& value);
+    void set(VariableKey key, VariableValue value);
+
+    /**
+     * @brief Start staged (chunked) write of UEFI variable.
+     *        If the limit of staged writes is reached, the oldest one is
+     *        discarded.
+     *
+     * @param[in] key Variable key
+     * @param[in] attributes Variable attributes
+     * @param[in] size Full size of variable data in bytes
+     *
+     * @return staged write handle
+     *
+     * @throw std::invalid_argument if size is too big
+     */
+    uint32_t beginWrite(VariableKey key, uint32_t attributes, size_t size);
+
+    /**
+     * @brief Put chunk of data to the staged write buffer.
+     *
+     * @param[in] handle Staged write handle
+     * @param[in] offset Offset of the chunk in variable data
+     * @param[in] data Chunk data
+     *
+     * @throw std::invalid_argument if handle is unknown or chunk is out of
+     *        variable range
+     */
+    void writeChunk(uint32_t handle, size_t offset,
+                    const std::vector<uint8_t>& data);
+
+    /**
+     * @brief Finish staged write and set the variable.
+     *
+     * @param[in] handle Staged write handle
+     *
+     * @throw std::invalid_argument if handle is unknown
+     * @throw std::runtime_error in case of errors
+     */
+    void commitWrite(uint32_t handle);
 
     /**
      * @brief Remove UEFI variable.
@@ -58,16 +278,43 @@ class Storage final
      *
      * @throw std::runtime_error in case of errors
      */
-    void remove(const VariableKey& key);
+    void remove(const VariableKeyView& key);
+
+    /**
+     * @brief Apply batch of changes with a single save.
+     *
+     * @param[in] changes New values of variables, none to remove
+     *
+     * @throw std::exception in case of errors
+     */
+    void apply(const VariableDelta& changes);
 
     /**
      * @brief Get next UEFI variable.
      *
      * @param[in] key The last variable key that was returned by next()
      *
+     * The next variable is the first one that follows the specified key in
+     * the storage order, so the key doesn't need to exist anymore: a
+     * variable removed in the middle of enumeration doesn't break it.
+     *
      * @return next variable id or nullopt if not found
      */
-    std::optional<VariableKey> next(const VariableKey& key);
+    std::optional<VariableKey> next(const VariableKeyView& key);
+
+    /**
+     * @brief Find UEFI variables matching the query.
+     *
+     * Variables of a GUID are found in the primary order, other queries use
+     * secondary indexes (by name and by attributes) built for the current
+     * snapshot on demand, so the cost depends on the number of matches, not
+     * on the number of variables.
+     *
+     * @param[in] query Filter of variables
+     *
+     * @return matching variables in the storage order
+     */
+    std::vector<Match> find(const Query& query);
 
     /**
      * @brief Reset UEFI setting by removing existing variables.
@@ -94,9 +341,580 @@ class Storage final
      */
     void importVars(const std::filesystem::path& oldNvram);
 
+    /**
+     * @brief Import variables of NVRAM: default values are unpacked from
+     *        StdDefaults, other variables are put over them.
+     *
+     * @param[in] oldVars variables of old version of NVRAM
+     *
+     * @throw std::exception in case of errors
+     */
+    void importVars(const Variables& oldVars);
+
+    /**
+     * @brief Set storage quotas.
+     *
+     * @param[in] quotas New storage quotas
+     */
+    void setLimits(const Limits& quotas);
+
+    /**
+     * @brief Get usage counters for a class of variables.
+     *
+     * @param[in] hwErr Class of variables: hardware error records or others
+     *
+     * @return usage counters
+     */
+    Usage usage(bool hwErr = false) const;
+
+    /**
+     * @brief Get storage capacity info for variables with specified
+     *        attributes, see QueryVariableInfo() in UEFI specification.
+     *
+     * @param[in] attributes Variable attributes
+     *
+     * @return storage capacity info
+     */
+    Info queryInfo(uint32_t attributes) const;
+
+    /**
+     * @brief Set filter of variables to audit.
+     *
+     * @param[in] rules Rules to match variables, empty to audit all
+     */
+    void setAuditFilter(std::vector<Audit::Rule> rules);
+
+    /**
+     * @brief Write queued audit records to the journal. Modifications are
+     *        audited asynchronously, records are written in batches by the
+     *        event loop, when the queue is full or on destruction.
+     *
+     * @return number of written records
+     */
+    size_t flushAudit();
+
+    /**
+     * @brief Check if there are audit records waiting for flush.
+     *
+     * @return true if flushAudit should be called
+     */
+    bool auditPending() const;
+
+    /**
+     * @brief Set write budget of variables.
+     *
+     * @param[in] newBudget New write budget
+     */
+    void setWriteBudget(const WriteBudget& newBudget);
+
+    /**
+     * @brief Get write counters of the whole storage.
+     *
+     * @return write counters since the storage was created
+     */
+    WriteStats writeStats() const;
+
+    /**
+     * @brief Get write counters of variables.
+     *
+     * @return write counters of each variable modified since the storage
+     *         was created
+     */
+    std::map<VariableKey, WriteStats> variableWriteStats() const;
+
+    /**
+     * @brief Save delayed changes immediately.
+     *
+     * @return true if there were delayed changes
+     *
+     * @throw std::exception in case of errors
+     */
+    bool flush();
+
+    /**
+     * @brief Get size of memory used by variables containers.
+     *
+     * @return number of bytes allocated for all live snapshots
+     */
+    size_t memoryUsage() const;
+
+    /**
+     * @brief Get generation of variables, incremented each time a new
+     *        snapshot is published.
+     *
+     * @return generation number
+     */
+    uint64_t generation() const;
+
+    /**
+     * @brief Check if the storage file was changed by someone else.
+     *
+     * @return true if the file differs from the last one loaded or saved
+     */
+    bool changed();
+
+    /**
+     * @brief Reload variables if the storage file was changed by someone
+     *        else (e.g. restored from backup). The file is parsed without
+     *        blocking readers, then the new snapshot replaces the current
+     *        one.
+     *
+     * @return true if variables were reloaded
+     *
+     * @throw std::runtime_error in case of errors
+     */
+    bool reload();
+
+    /**
+     * @brief Verify the persistent copy of variables against the current
+     *        snapshot and rewrite it if it is damaged, e.g. by bit rot of
+     *        the media. Writers are blocked while scrubbing, readers aren't.
+     *
+     * @return keys of damaged variables
+     *
+     * @throw std::exception in case of errors
+     */
+    std::vector<VariableKey> scrub();
+
+    /**
+     * @brief Get number of damaged variables found by the last load or
+     *        scrub.
+     *
+     * @return number of damaged variables
+     */
+    size_t corrupted() const;
+
+    /**
+     * @brief Create configuration profile as a copy of the active one.
+     *        Profiles keep only variables changed against the base set.
+     *
+     * @param[in] name Name of the new profile
+     *
+     * @throw std::invalid_argument if the name is empty or already used
+     * @throw std::exception in case of other errors
+     */
+    void createProfile(const std::string& name);
+
+    /**
+     * @brief Delete configuration profile.
+     *
+     * @param[in] name Name of the profile
+     *
+     * @throw std::out_of_range if the profile doesn't exist
+     * @throw std::invalid_argument if the profile is active
+     * @throw std::exception in case of other errors
+     */
+    void deleteProfile(const std::string& name);
+
+    /**
+     * @brief Switch to another configuration profile: changes of the
+     *        active profile are reverted and changes of the new one are
+     *        applied, the result is saved at once. Variables modified while
+     *        a profile is active are kept in that profile.
+     *
+     * @param[in] name Name of the profile, empty for the base set
+     *
+     * @throw std::out_of_range if the profile doesn't exist
+     * @throw std::exception in case of other errors
+     */
+    void selectProfile(const std::string& name);
+
+    /**
+     * @brief Get names of configuration profiles.
+     *
+     * @return names of profiles
+     */
+    std::vector<std::string> profiles();
+
+    /**
+     * @brief Get name of the active configuration profile.
+     *
+     * @return name of the profile, empty for the base set
+     */
+    std::string activeProfile();
+
+    /**
+     * @brief Enable change history: each commit records previous values of
+     *        the changed variables to the bounded log. Must be called before
+     *        the storage is shared with other threads.
+     *
+     * @param[in] logFile Path to the history log
+     * @param[in] maxBytes Max size of the log
+     *
+     * @throw std::exception in case of errors
+     */
+    void enableHistory(const std::filesystem::path& logFile,
+                       size_t maxBytes);
+
+    /**
+     * @brief Check if change history is enabled.
+     *
+     * @return true if history is enabled
+     */
+    bool hasHistory() const;
+
+    /**
+     * @brief Get recent changes from the history.
+     *
+     * @param[in] count Max number of changes to get
+     *
+     * @return changes, the newest first
+     *
+     * @throw std::exception in case of errors
+     */
+    std::vector<History::Change> changes(size_t count);
+
+    /**
+     * @brief Roll variables back to the state right after the generation.
+     *        The rollback is saved at once and recorded as a new
+     *        generation, the active profile is deselected.
+     *
+     * @param[in] generation History generation to roll back to
+     *
+     * @throw std::out_of_range if the generation is not in the history
+     * @throw std::exception in case of other errors
+     */
+    void rollback(uint64_t generation);
+
+    /**
+     * @brief Roll variables back to the state they had at the given time.
+     *
+     * @param[in] time Time, seconds since Epoch
+     *
+     * @throw std::out_of_range if the time precedes the history
+     * @throw std::exception in case of other errors
+     */
+    void rollbackToTime(uint64_t time);
+
+    /**
+     * @brief Enable tiering: data of large variables is kept in the spill
+     *        file and loaded on demand through the LRU cache. Must be
+     *        called before the storage is shared with other threads.
+     *
+     * @param[in] spillFile Path to the spill file
+     * @param[in] threshold Min size of data to page out
+     * @param[in] cacheBytes Max size of cached data
+     *
+     * @throw std::exception in case of errors
+     */
+    void enableTiering(const std::filesystem::path& spillFile,
+                       size_t threshold, size_t cacheBytes);
+
+    /**
+     * @brief Get the current snapshot with data of all variables. Unlike
+     *        snapshot(), paged out data is loaded.
+     *
+     * @return snapshot of variables
+     *
+     * @throw std::runtime_error if paged out data can't be loaded
+     */
+    Snapshot materialize() const;
+
   private:
-    /** @brief Container for variables. */
-    Variables variables;
+    /**
+     * @brief Identity of the storage file content.
+     */
+    struct Stamp
+    {
+        uint64_t device = 0; ///< Device ID
+        uint64_t inode = 0;  ///< Inode number
+        uint64_t size = 0;   ///< File size in bytes
+        uint64_t mtime = 0;  ///< Modification time in nanoseconds
+
+        bool operator==(const Stamp& rhs) const;
+
+        /**
+         * @brief Get identity of the file.
+         *
+         * @param[in] file Path to the file
+         *
+         * @return file identity, zeroed if the file doesn't exist
+         */
+        static Stamp of(const std::filesystem::path& file);
+    };
+
+    /**
+     * @brief Create new empty set of variables with its own memory arena.
+     *        The arena is released with the last reference to the set.
+     *
+     * @return new set of variables
+     */
+    std::shared_ptr<Variables> allocate() const;
+
+    /**
+     * @brief Copy variables to a new set with its own memory arena. Only
+     *        the nodes are copied, the data is shared with the source.
+     *
+     * @param[in] src source set of variables
+     * @param[in] skip key of the variable to exclude from copy
+     *
+     * @return new set of variables
+     */
+    std::shared_ptr<Variables>
+        clone(const Variables& src,
+              const std::optional<VariableKeyView>& skip = std::nullopt) const;
+
+    /**
+     * @brief Load variables from the storage file.
+     *
+     * @throw std::runtime_error in case of errors
+     */
+    void load();
+
+    /**
+     * @brief Recalculate usage counters. Must be called with the write lock
+     *        held.
+     *
+     * @param[in] vars Set of variables to count
+     */
+    void recount(const Variables& vars);
+
+    /**
+     * @brief Report damaged variables.
+     *
+     * @param[in] keys Keys of damaged variables
+     */
+    void reportCorrupted(const std::vector<VariableKey>& keys);
+
+    /**
+     * @brief Save variables and publish them as the current snapshot.
+     *        Must be called with the write lock held.
+     *
+     * @param[in] vars new set of variables
+     * @param[in] delayed Publish only, save later with other changes
+     *
+     * @throw std::runtime_error in case of errors
+     */
+    void commit(std::shared_ptr<Variables> vars, bool delayed = false);
+
+    /**
+     * @brief Save variables and account written bytes.
+     *        Must be called with the write lock held.
+     *
+     * @param[in] vars set of variables to save
+     *
+     * @throw std::runtime_error in case of errors
+     */
+    void persist(const Snapshot& vars);
+
+    /**
+     * @brief Account modification of the variable and check its write
+     *        budget. Must be called with the write lock held.
+     *
+     * @param[in] key Variable key
+     * @param[in] size Size of the variable key and data
+     *
+     * @return true if the variable exceeded its budget and the change must
+     *         be saved later
+     */
+    bool throttle(const VariableKeyView& key, size_t size);
+
+    /** @brief Save delayed changes when their delay expires. */
+    void flusher();
+
+    /**
+     * @brief Save and publish the new base set of variables, the active
+     *        profile is deselected. Must be called with the write lock held.
+     *
+     * @param[in] vars new set of variables
+     *
+     * @throw std::runtime_error in case of errors
+     */
+    void replace(std::shared_ptr<Variables> vars);
+
+    /**
+     * @brief Keep change of the variable in the active profile.
+     *        Must be called with the write lock held.
+     *
+     * @param[in] current Variables before the change
+     * @param[in] key Variable key
+     * @param[in] value New value, none for the removed variable
+     */
+    void track(const Variables& current, const VariableKey& key,
+               const std::optional<VariableValue>& value);
+
+    /**
+     * @brief Record change to the history, if enabled. Errors are logged,
+     *        the change is kept. Must be called with the write lock held.
+     *
+     * @param[in] from Variables before the change
+     * @param[in] to Variables after the change
+     * @param[in] key Key of the changed variable, none to compare all
+     */
+    void remember(const Snapshot& from, const Snapshot& to,
+                  const std::optional<VariableKeyView>& key = std::nullopt);
+
+    /**
+     * @brief Get variables with paged out data loaded.
+     *
+     * @param[in] vars Variables
+     *
+     * @return the same variables if nothing is paged out, or their copy
+     *
+     * @throw std::runtime_error if paged out data can't be loaded
+     */
+    Snapshot materialize(const Snapshot& vars) const;
+
+    /**
+     * @brief Get variable value with paged out data loaded.
+     *
+     * @param[in] value Variable value
+     *
+     * @return value with data
+     *
+     * @throw std::runtime_error if paged out data can't be loaded
+     */
+    VariableValue expand(const VariableValue& value) const;
+
+    /**
+     * @brief Get variable value for readers: resident value is referred in
+     *        the snapshot, paged out one is taken from the cache.
+     *
+     * @param[in] vars Snapshot containing the value
+     * @param[in] value Variable value
+     *
+     * @return value with data
+     *
+     * @throw std::runtime_error if paged out data can't be loaded
+     */
+    std::shared_ptr<const VariableValue>
+        retrieve(const Snapshot& vars, const VariableValue& value) const;
+
+    /**
+     * @brief Page out data of large variables, if tiering is enabled.
+     *        Errors are logged, the data is kept resident.
+     *        Must be called with the write lock held.
+     *
+     * @param[in,out] vars Variables not published yet
+     *
+     * @return number of paged out variables
+     */
+    size_t pageOut(Variables& vars);
+
+    /**
+     * @brief Roll variables back to the generation.
+     *        Must be called with the write lock held.
+     *
+     * @param[in] generation History generation to roll back to
+     *
+     * @throw std::exception in case of errors
+     */
+    void revert(uint64_t generation);
+
+    /**
+     * @brief Write accounting of a variable.
+     */
+    struct WriteState
+    {
+        /** @brief Write counters. */
+        WriteStats stats;
+        /** @brief Start of the current budget period. */
+        std::chrono::steady_clock::time_point start;
+        /** @brief Number of writes in the current budget period. */
+        size_t writes = 0;
+    };
+
+    /**
+     * @brief Variable being written by chunks.
+     */
+    struct StagedWrite
+    {
+        /** @brief Variable key. */
+        VariableKey key;
+        /** @brief Variable attributes. */
+        uint32_t attributes;
+        /** @brief Buffer of the variable data. */
+        std::vector<uint8_t> data;
+    };
+
+    /**
+     * @brief Publish variables as the current snapshot.
+     *        Must be called with the write lock held.
+     *
+     * @param[in] vars new set of variables
+     */
+    void publish(std::shared_ptr<Variables> vars);
+
+    /** @brief Memory pool for variables. */
+    struct Memory;
+    /** @brief Variables with their own memory arena. */
+    struct Arena;
+    /** @brief Secondary indexes of a snapshot. */
+    struct Index;
+
+    /**
+     * @brief Get secondary indexes of the current snapshot, build them if
+     *        the snapshot was changed since the last query.
+     *
+     * @return indexes, keeping the indexed snapshot alive
+     */
+    std::shared_ptr<const Index> indexes();
+
+    /** @brief Memory pool shared by all snapshots. */
+    std::shared_ptr<Memory> memory;
+    /** @brief Current snapshot, accessed atomically. */
+    Snapshot variables;
+    /** @brief Secondary indexes, accessed atomically, dropped on publish. */
+    std::shared_ptr<const Index> index;
+    /** @brief Lock to serialize writers. */
+    std::mutex writeLock;
+    /** @brief Generation of the current snapshot. */
+    std::atomic<uint64_t> generationNumber = 0;
+    /** @brief Number of damaged variables found by the last load or scrub. */
+    std::atomic<size_t> corruptedCount = 0;
+    /** @brief Cancel waiting for the storage file owner. */
+    std::atomic<bool> stopLoader = false;
+    /** @brief Max time to wait for the storage file owner. */
+    std::chrono::milliseconds ownerWait;
+    /** @brief Identity of the storage file last loaded or saved. */
+    Stamp stamp;
+    /** @brief Usage counters: common variables and HW error records. */
+    Usage counters[2];
+    /** @brief Storage quotas. */
+    Limits limits;
+    /** @brief Lock to protect counters and quotas. */
+    mutable std::mutex usageLock;
+    /** @brief Staged writes: handle to variable being written. */
+    std::map<uint32_t, StagedWrite> staged;
+    /** @brief Last used staged write handle. */
+    uint32_t lastHandle = 0;
+    /** @brief Lock to protect staged writes. */
+    std::mutex stagedLock;
     /** @brief File used as persistent storage. */
     std::filesystem::path file;
+    /** @brief Audit log of modifications. */
+    Audit audit;
+    /** @brief Persistence backend. */
+    std::unique_ptr<Backend> backend;
+    /** @brief Configuration profiles, used with the write lock. */
+    Profiles profileSet;
+    /** @brief Change history, used with the write lock. */
+    std::unique_ptr<History> history;
+    /** @brief Storage tier for large data, if enabled. */
+    std::shared_ptr<Pager> pager;
+    /** @brief Min size of data to page out. */
+    size_t pageThreshold = 0;
+    /** @brief The last snapshot saved by the backend. */
+    Snapshot persisted;
+    /** @brief Write budget of variables. */
+    WriteBudget budget;
+    /** @brief Write accounting of the whole storage. */
+    WriteStats totalWrites;
+    /** @brief Write accounting of variables. */
+    std::map<VariableKey, WriteState, VariableKeyLess> writes;
+    /** @brief Lock to protect write accounting. */
+    mutable std::mutex writesLock;
+    /** @brief Deadline to save delayed changes, if any. */
+    std::optional<std::chrono::steady_clock::time_point> flushDeadline;
+    /** @brief Signal to the flusher thread, used with the write lock. */
+    std::condition_variable flushSignal;
+    /** @brief Stop the flusher thread. */
+    bool stopFlusher = false;
+    /** @brief Thread to save delayed changes. */
+    std::thread flushThread;
+    /** @brief Ownership lock of the storage file. */
+    FileLock owner;
+    /** @brief Result of loading, must be the last member to join the loader
+     *         thread before destroying the rest. */
+    std::shared_future<void> loaded;
 };
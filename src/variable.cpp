@@ -1,25 +1,33 @@
 // SPDX-License-Identifier: Apache-2.0
 // Copyright (C) 2021 YADRO
 
+#include "crc32c.hpp"
 #include "variable.hpp"
 
+#include <endian.h>
+#include <fcntl.h>
 #include <json.h>
+#include <unistd.h>
 
 #include <cstring>
 #include <stdexcept>
+#include <system_error>
 
 // Names of JSON field used to save/load variables
 static const char* jsonRootNode = "variables";
+static const char* jsonGenerationNode = "generation";
+static const char* jsonChecksumNode = "checksum";
 static const char* jsonNameNode = "name";
 static const char* jsonGuidNode = "guid";
 static const char* jsonAttrNode = "attr";
 static const char* jsonDataNode = "data";
-
-bool VariableKey::operator<(const VariableKey& rhs) const
-{
-    const int gc = uuid_compare(guid, rhs.guid);
-    return gc < 0 || (gc == 0 && name < rhs.name);
-}
+static const char* jsonCrcNode = "crc";
+static const char* jsonRemovedNode = "removed";
+static const char* jsonProfilesNode = "profiles";
+static const char* jsonActiveNode = "active";
+static const char* jsonShadowNode = "shadow";
+static const char* jsonListNode = "list";
+static const char* jsonChangesNode = "changes";
 
 /**
  * @brief Convert binary array to hexadecimal string.
@@ -101,9 +109,361 @@ static std::vector<uint8_t> hexToBin(const char* hex)
     return data;
 }
 
-Variables loadVariables(const std::filesystem::path& jsonFile)
+/**
+ * @brief Calculate checksum of a variable key, used for removed variables.
+ *
+ * @param[in] key Variable key
+ *
+ * @return CRC32C of the key
+ */
+static uint32_t checksum(const VariableKey& key)
+{
+    const uint32_t crc = crc32c(key.guid, sizeof(uuid_t));
+    return crc32c(key.name.c_str(), key.name.size() + 1, crc);
+}
+
+/**
+ * @brief Calculate checksum of a single variable, independent of the JSON
+ *        formatting.
+ *
+ * @param[in] key Variable key
+ * @param[in] value Variable value
+ *
+ * @return CRC32C of the key and value
+ */
+static uint32_t checksum(const VariableKey& key, const VariableValue& value)
+{
+    const uint32_t attributes = htole32(value.attributes);
+    uint32_t crc = checksum(key);
+    crc = crc32c(&attributes, sizeof(attributes), crc);
+    return crc32c(value.data.data(), value.data.size(), crc);
+}
+
+/**
+ * @brief Calculate checksum of the whole file.
+ *
+ * @param[in] crcs Checksums of all records in the order of the file
+ *
+ * @return CRC32C of the record checksums
+ */
+static uint32_t checksum(std::vector<uint32_t> crcs)
+{
+    for (uint32_t& crc : crcs)
+    {
+        crc = htole32(crc);
+    }
+    return crc32c(crcs.data(), crcs.size() * sizeof(uint32_t));
+}
+
+/**
+ * @brief Parse key of the variable record.
+ *
+ * @param[in] jvar JSON object of the record
+ * @param[out] key Variable key, filled as far as parsed on errors
+ *
+ * @throw std::runtime_error in case of format errors
+ */
+static void parseKey(json_object* jvar, VariableKey& key)
+{
+    struct json_object* jname;
+    struct json_object* jguid;
+    if (!json_object_object_get_ex(jvar, jsonNameNode, &jname) ||
+        !json_object_object_get_ex(jvar, jsonGuidNode, &jguid))
+    {
+        throw std::runtime_error("JSON: incomplete variable");
+    }
+
+    const char* name = json_object_get_string(jname);
+    if (!name || !*name)
+    {
+        throw std::runtime_error("JSON: invalid variable name");
+    }
+    key.name = name;
+    const char* guid = json_object_get_string(jguid);
+    uuid_t uuid;
+    if (!guid || uuid_parse(guid, uuid) != 0)
+    {
+        throw std::runtime_error("JSON: invalid variable GUID");
+    }
+    key.guid = uuid;
+}
+
+/**
+ * @brief Parse variable record.
+ *
+ * @param[in] jvar JSON object of the record
+ * @param[out] key Variable key, filled as far as parsed on errors
+ * @param[out] value Variable value
+ *
+ * @throw std::runtime_error in case of format errors
+ */
+static void parseVariable(json_object* jvar, VariableKey& key,
+                          VariableValue& value)
+{
+    parseKey(jvar, key);
+
+    struct json_object* jattr;
+    struct json_object* jdata;
+    if (!json_object_object_get_ex(jvar, jsonAttrNode, &jattr) ||
+        !json_object_object_get_ex(jvar, jsonDataNode, &jdata))
+    {
+        throw std::runtime_error("JSON: incomplete variable");
+    }
+
+    value.attributes = static_cast<uint32_t>(json_object_get_int(jattr));
+    if (value.attributes == 0 && errno == EINVAL)
+    {
+        throw std::runtime_error("JSON: invalid attribute");
+    }
+    const char* data = json_object_get_string(jdata);
+    if (!data || !*data)
+    {
+        throw std::runtime_error("JSON: invalid data");
+    }
+    value.data = hexToBin(data);
+}
+
+/**
+ * @brief Make variable record.
+ *
+ * @param[in] key Variable key
+ * @param[in] value Variable value, none for the removed variable
+ * @param[in,out] crcs Checksums of records, the record one is appended
+ *
+ * @return JSON object of the record
+ */
+static json_object* makeRecord(const VariableKey& key,
+                               const std::optional<VariableValue>& value,
+                               std::vector<uint32_t>& crcs)
+{
+    json_object* jvar = json_object_new_object();
+
+    json_object_object_add(jvar, jsonNameNode,
+                           json_object_new_string(key.name.c_str()));
+    char uuid[UUID_STR_LEN];
+    uuid_unparse_upper(key.guid, uuid);
+    json_object_object_add(jvar, jsonGuidNode, json_object_new_string(uuid));
+    if (value)
+    {
+        json_object_object_add(jvar, jsonAttrNode,
+                               json_object_new_int64(value->attributes));
+        const std::string data = binToHex(value->data);
+        json_object_object_add(jvar, jsonDataNode,
+                               json_object_new_string(data.c_str()));
+        crcs.push_back(checksum(key, *value));
+    }
+    else
+    {
+        json_object_object_add(jvar, jsonRemovedNode,
+                               json_object_new_boolean(true));
+        crcs.push_back(checksum(key));
+    }
+    json_object_object_add(jvar, jsonCrcNode,
+                           json_object_new_int64(crcs.back()));
+
+    return jvar;
+}
+
+/**
+ * @brief Make array of records of the delta.
+ *
+ * @param[in] delta Changes of variables
+ * @param[in,out] crcs Checksums of records, the delta ones are appended
+ *
+ * @return JSON array of records
+ */
+static json_object* makeDelta(const VariableDelta& delta,
+                              std::vector<uint32_t>& crcs)
+{
+    json_object* jdelta = json_object_new_array();
+    for (const auto& [key, value] : delta)
+    {
+        json_object_array_add(jdelta, makeRecord(key, value, crcs));
+    }
+    return jdelta;
+}
+
+/**
+ * @brief Parse array of records of the delta. Profiles are small, so any
+ *        damaged record invalidates the whole file.
+ *
+ * @param[in] jdelta JSON array of records
+ * @param[in,out] crcs Checksums of records, the delta ones are appended
+ *
+ * @return changes of variables
+ *
+ * @throw std::runtime_error in case of format errors or checksum mismatch
+ */
+static VariableDelta parseDelta(json_object* jdelta,
+                                std::vector<uint32_t>& crcs)
+{
+    if (!json_object_is_type(jdelta, json_type_array))
+    {
+        throw std::runtime_error("JSON: invalid profile");
+    }
+
+    VariableDelta delta;
+    const int count = json_object_array_length(jdelta);
+    for (int idx = 0; idx < count; ++idx)
+    {
+        struct json_object* jvar = json_object_array_get_idx(jdelta, idx);
+        struct json_object* jcrc;
+        struct json_object* jremoved;
+        if (!json_object_object_get_ex(jvar, jsonCrcNode, &jcrc))
+        {
+            throw std::runtime_error("JSON: incomplete variable");
+        }
+        VariableKey key{};
+        std::optional<VariableValue> value;
+        if (json_object_object_get_ex(jvar, jsonRemovedNode, &jremoved) &&
+            json_object_get_boolean(jremoved))
+        {
+            parseKey(jvar, key);
+            crcs.push_back(checksum(key));
+        }
+        else
+        {
+            value.emplace();
+            parseVariable(jvar, key, *value);
+            crcs.push_back(checksum(key, *value));
+        }
+        if (static_cast<uint32_t>(json_object_get_int64(jcrc)) != crcs.back())
+        {
+            throw std::runtime_error("JSON: profile checksum mismatch");
+        }
+        delta.emplace(std::move(key), std::move(value));
+    }
+    return delta;
+}
+
+/**
+ * @brief Parse configuration profiles.
+ *
+ * @param[in] jprofiles JSON object of profiles
+ * @param[in,out] crcs Checksums of records, the profile ones are appended
+ *
+ * @return configuration profiles
+ *
+ * @throw std::runtime_error in case of format errors or checksum mismatch
+ */
+static Profiles parseProfiles(json_object* jprofiles,
+                              std::vector<uint32_t>& crcs)
+{
+    struct json_object* jactive;
+    struct json_object* jshadow;
+    struct json_object* jlist;
+    if (!json_object_object_get_ex(jprofiles, jsonActiveNode, &jactive) ||
+        !json_object_object_get_ex(jprofiles, jsonShadowNode, &jshadow) ||
+        !json_object_object_get_ex(jprofiles, jsonListNode, &jlist) ||
+        !json_object_is_type(jlist, json_type_array))
+    {
+        throw std::runtime_error("JSON: incomplete profiles");
+    }
+
+    Profiles profiles;
+    const char* active = json_object_get_string(jactive);
+    profiles.active = active ? active : "";
+    profiles.shadow = parseDelta(jshadow, crcs);
+    const int count = json_object_array_length(jlist);
+    for (int idx = 0; idx < count; ++idx)
+    {
+        struct json_object* jprofile = json_object_array_get_idx(jlist, idx);
+        struct json_object* jname;
+        struct json_object* jchanges;
+        if (!json_object_object_get_ex(jprofile, jsonNameNode, &jname) ||
+            !json_object_object_get_ex(jprofile, jsonChangesNode, &jchanges))
+        {
+            throw std::runtime_error("JSON: incomplete profile");
+        }
+        const char* name = json_object_get_string(jname);
+        if (!name || !*name)
+        {
+            throw std::runtime_error("JSON: invalid profile name");
+        }
+        profiles.deltas[name] = parseDelta(jchanges, crcs);
+    }
+    if (!profiles.active.empty() &&
+        profiles.deltas.find(profiles.active) == profiles.deltas.end())
+    {
+        throw std::runtime_error("JSON: active profile not found");
+    }
+    return profiles;
+}
+
+/**
+ * @brief Write text to file and flush it to the disk.
+ *
+ * @param[in] file Path to the file to write
+ * @param[in] text Text to write
+ *
+ * @throw std::system_error in case of file IO errors
+ */
+static void writeFile(const std::filesystem::path& file, const char* text)
 {
-    Variables variables;
+    const int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        throw std::system_error(errno, std::generic_category(),
+                                "Unable to write file " + file.string());
+    }
+    const size_t size = strlen(text);
+    size_t pos = 0;
+    while (pos < size)
+    {
+        const ssize_t rc = write(fd, text + pos, size - pos);
+        if (rc == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rc == -1)
+        {
+            const int err = errno;
+            close(fd);
+            throw std::system_error(err, std::generic_category(),
+                                    "Unable to write file " + file.string());
+        }
+        pos += rc;
+    }
+    const int rc = fsync(fd);
+    const int err = errno;
+    close(fd);
+    if (rc == -1)
+    {
+        throw std::system_error(err, std::generic_category(),
+                                "Unable to sync file " + file.string());
+    }
+}
+
+/**
+ * @brief Flush entries of the directory (renamed and linked files) to the
+ *        disk.
+ *
+ * @param[in] dir Path to the directory
+ *
+ * @throw std::system_error in case of file IO errors
+ */
+static void syncDirectory(const std::filesystem::path& dir)
+{
+    const int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        throw std::system_error(errno, std::generic_category(),
+                                "Unable to open directory " + dir.string());
+    }
+    const int rc = fsync(fd);
+    const int err = errno;
+    close(fd);
+    if (rc == -1)
+    {
+        throw std::system_error(err, std::generic_category(),
+                                "Unable to sync directory " + dir.string());
+    }
+}
+
+Variables loadVariables(const std::filesystem::path& jsonFile,
+                        LoadInfo* info, std::pmr::memory_resource* resource)
+{
+    Variables variables(resource);
 
     std::unique_ptr<json_object, decltype(&json_object_put)> jobj(
         json_object_from_file(jsonFile.c_str()), json_object_put);
@@ -129,100 +489,163 @@ Variables loadVariables(const std::filesystem::path& jsonFile)
         throw std::runtime_error("JSON: root node not found");
     }
 
-    int idx = json_object_array_length(jvarlist);
+    // damaged records are reported and skipped, the rest is loaded;
+    // records of files written before checksums were added aren't verified
+    const int count = json_object_array_length(jvarlist);
+    std::vector<uint32_t> crcs(count);
+    int idx = count;
     while (--idx >= 0)
     {
         struct json_object* jvar = json_object_array_get_idx(jvarlist, idx);
-        struct json_object* jname;
-        struct json_object* jguid;
-        struct json_object* jattr;
-        struct json_object* jdata;
-        if (!json_object_object_get_ex(jvar, jsonNameNode, &jname) ||
-            !json_object_object_get_ex(jvar, jsonGuidNode, &jguid) ||
-            !json_object_object_get_ex(jvar, jsonAttrNode, &jattr) ||
-            !json_object_object_get_ex(jvar, jsonDataNode, &jdata))
+        struct json_object* jcrc;
+        const bool verify = json_object_object_get_ex(jvar, jsonCrcNode, &jcrc);
+        if (verify)
         {
-            throw std::runtime_error("JSON: incomplete variable");
+            crcs[idx] = static_cast<uint32_t>(json_object_get_int64(jcrc));
         }
 
-        VariableKey key;
-        const char* name = json_object_get_string(jname);
-        if (!name || !*name)
+        VariableKey key{};
+        VariableValue value;
+        try
         {
-            throw std::runtime_error("JSON: invalid variable name");
+            parseVariable(jvar, key, value);
         }
-        key.name = name;
-        const char* guid = json_object_get_string(jguid);
-        if (!guid || uuid_parse(guid, key.guid) != 0)
+        catch (const std::exception&)
         {
-            throw std::runtime_error("JSON: invalid variable GUID");
+            // bit rot of data turns hex digits into invalid characters
+            if (!verify || !info)
+            {
+                throw;
+            }
+            info->corrupted.push_back(std::move(key));
+            continue;
         }
-
-        VariableValue value;
-        value.attributes = static_cast<uint32_t>(json_object_get_int(jattr));
-        if (value.attributes == 0 && errno == EINVAL)
+        if (verify && checksum(key, value) != crcs[idx])
         {
-            throw std::runtime_error("JSON: invalid attribute");
+            if (!info)
+            {
+                throw std::runtime_error("JSON: variable checksum mismatch");
+            }
+            info->corrupted.push_back(std::move(key));
+            continue;
         }
-        const char* data = json_object_get_string(jdata);
-        if (!data || !*data)
+
+        variables[key] = value;
+    }
+
+    // profiles follow variables in the order of records
+    json_object* jprofiles;
+    if (json_object_object_get_ex(jobj.get(), jsonProfilesNode, &jprofiles))
+    {
+        Profiles profiles = parseProfiles(jprofiles, crcs);
+        if (info)
         {
-            throw std::runtime_error("JSON: invalid data");
+            info->profiles = std::move(profiles);
         }
-        value.data = hexToBin(data);
+    }
 
-        variables[key] = value;
+    // whole file checksum covers record checksums: it detects lost or
+    // reordered records, damaged records are detected by their own checksum
+    json_object* jcrc;
+    if (json_object_object_get_ex(jobj.get(), jsonChecksumNode, &jcrc) &&
+        static_cast<uint32_t>(json_object_get_int64(jcrc)) != checksum(crcs))
+    {
+        throw std::runtime_error("JSON: checksum mismatch");
+    }
+    if (info)
+    {
+        json_object* jgen;
+        info->generation =
+            json_object_object_get_ex(jobj.get(), jsonGenerationNode, &jgen)
+                ? static_cast<uint64_t>(json_object_get_int64(jgen))
+                : 0;
     }
 
     return variables;
 }
 
-void saveVariables(const Variables& variables,
-                   const std::filesystem::path& jsonFile)
+size_t saveVariables(const Variables& variables,
+                     const std::filesystem::path& jsonFile, uint64_t generation,
+                     const Profiles* profiles, const PageLoader& loader)
 {
     std::unique_ptr<json_object, decltype(&json_object_put)> jobj(
         json_object_new_object(), json_object_put);
 
     json_object* jvars = json_object_new_array();
+    std::vector<uint32_t> crcs;
+    crcs.reserve(variables.size());
 
     for (auto const& it : variables)
     {
-        json_object* jvar = json_object_new_object();
-
-        json_object_object_add(jvar, jsonNameNode,
-                               json_object_new_string(it.first.name.c_str()));
-        char uuid[UUID_STR_LEN];
-        uuid_unparse_upper(it.first.guid, uuid);
-        json_object_object_add(jvar, jsonGuidNode,
-                               json_object_new_string(uuid));
-        json_object_object_add(jvar, jsonAttrNode,
-                               json_object_new_int64(it.second.attributes));
-        const std::string data = binToHex(it.second.data);
-        json_object_object_add(jvar, jsonDataNode,
-                               json_object_new_string(data.c_str()));
+        // paged out data is held only while its record is built
+        const std::shared_ptr<const VariableValue> paged =
+            it.second.page ? loader(*it.second.page) : nullptr;
+        json_object_array_add(
+            jvars, makeRecord(it.first, paged ? *paged : it.second, crcs));
+    }
 
-        json_object_array_add(jvars, jvar);
+    json_object* jprofiles = nullptr;
+    if (profiles && !profiles->deltas.empty())
+    {
+        jprofiles = json_object_new_object();
+        json_object_object_add(
+            jprofiles, jsonActiveNode,
+            json_object_new_string(profiles->active.c_str()));
+        json_object_object_add(jprofiles, jsonShadowNode,
+                               makeDelta(profiles->shadow, crcs));
+        json_object* jlist = json_object_new_array();
+        for (const auto& [name, delta] : profiles->deltas)
+        {
+            json_object* jprofile = json_object_new_object();
+            json_object_object_add(jprofile, jsonNameNode,
+                                   json_object_new_string(name.c_str()));
+            json_object_object_add(jprofile, jsonChangesNode,
+                                   makeDelta(delta, crcs));
+            json_object_array_add(jlist, jprofile);
+        }
+        json_object_object_add(jprofiles, jsonListNode, jlist);
     }
 
+    json_object_object_add(jobj.get(), jsonGenerationNode,
+                           json_object_new_int64(generation));
+    json_object_object_add(jobj.get(), jsonChecksumNode,
+                           json_object_new_int64(checksum(crcs)));
     json_object_object_add(jobj.get(), jsonRootNode, jvars);
+    if (jprofiles)
+    {
+        json_object_object_add(jobj.get(), jsonProfilesNode, jprofiles);
+    }
 
-    std::filesystem::create_directories(jsonFile.parent_path());
+    if (jsonFile.has_parent_path())
+    {
+        std::filesystem::create_directories(jsonFile.parent_path());
+    }
 
-    if (json_object_to_file_ext(jsonFile.c_str(), jobj.get(),
-                                JSON_C_TO_STRING_PRETTY |
-                                    JSON_C_TO_STRING_SPACED) == -1)
+    // the file is replaced atomically with the complete and synced copy,
+    // a power loss leaves either the old or the new file
+    const char* text = json_object_to_json_string_ext(
+        jobj.get(), JSON_C_TO_STRING_PRETTY | JSON_C_TO_STRING_SPACED);
+    if (!text)
     {
-        std::string msg;
-        const char* err = json_util_get_last_err();
-        if (err)
-        {
-            msg = err;
-        }
-        else
-        {
-            msg = "Unable to write file ";
-            msg += jsonFile;
-        }
-        throw std::runtime_error(msg);
+        throw std::runtime_error("JSON: unable to serialize variables");
+    }
+    std::filesystem::path tmp = jsonFile;
+    tmp += ".tmp";
+    try
+    {
+        writeFile(tmp, text);
+        std::filesystem::rename(tmp, jsonFile);
     }
+    catch (...)
+    {
+        std::error_code ec;
+        std::filesystem::remove(tmp, ec);
+        throw;
+    }
+    // the rename and the backup link made before are durable only with
+    // the directory entries
+    syncDirectory(jsonFile.has_parent_path() ? jsonFile.parent_path()
+                                             : std::filesystem::path("."));
+
+    return strlen(text);
 }
@@ -3,56 +3,519 @@
 
 #pragma once
 
+#include "intern.hpp"
+
+#include <endian.h>
 #include <uuid.h>
 
+#include <algorithm>
+#include <array>
+#include <cstring>
 #include <filesystem>
+#include <functional>
 #include <map>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <ostream>
 #include <string>
+#include <string_view>
 #include <vector>
 
+/**
+ * @brief Name of UEFI variable, interned: the same names of different
+ *        variables, snapshots and deltas share a single string.
+ */
+class VariableName
+{
+  public:
+    VariableName() : VariableName(std::string())
+    {}
+
+    VariableName(const std::string& name) : name(name)
+    {}
+
+    VariableName(const char* name) : VariableName(std::string(name))
+    {}
+
+    VariableName(std::string_view name) : VariableName(std::string(name))
+    {}
+
+    /**
+     * @brief Replace the name with the range of characters.
+     *
+     * @param[in] first,last Range of characters
+     */
+    template <typename It>
+    void assign(It first, It last)
+    {
+        *this = VariableName(std::string(first, last));
+    }
+
+    /**
+     * @brief Replace the name with the array of characters.
+     *
+     * @param[in] data Pointer to the characters
+     * @param[in] size Number of characters
+     */
+    void assign(const char* data, size_t size)
+    {
+        *this = VariableName(std::string(data, size));
+    }
+
+    const std::string& str() const
+    {
+        return name.get();
+    }
+
+    operator const std::string&() const
+    {
+        return name.get();
+    }
+
+    operator std::string_view() const
+    {
+        return name.get();
+    }
+
+    const char* c_str() const
+    {
+        return name.get().c_str();
+    }
+
+    const char* data() const
+    {
+        return name.get().data();
+    }
+
+    size_t size() const
+    {
+        return name.get().size();
+    }
+
+    bool empty() const
+    {
+        return name.get().empty();
+    }
+
+    std::string substr(size_t pos = 0, size_t count = std::string::npos) const
+    {
+        return name.get().substr(pos, count);
+    }
+
+    friend bool operator==(const VariableName& lhs, const VariableName& rhs)
+    {
+        return lhs.data() == rhs.data();
+    }
+
+    template <typename T>
+    friend bool operator==(const VariableName& lhs, const T& rhs)
+    {
+        return lhs.str() == rhs;
+    }
+
+    template <typename T>
+    friend bool operator!=(const VariableName& lhs, const T& rhs)
+    {
+        return !(lhs == rhs);
+    }
+
+    friend bool operator<(const VariableName& lhs, const VariableName& rhs)
+    {
+        return lhs.str() < rhs.str();
+    }
+
+    template <typename T>
+    friend bool operator<(const VariableName& lhs, const T& rhs)
+    {
+        return lhs.str() < rhs;
+    }
+
+    friend std::string operator+(const std::string& lhs,
+                                 const VariableName& rhs)
+    {
+        return lhs + rhs.str();
+    }
+
+    friend std::ostream& operator<<(std::ostream& os, const VariableName& name)
+    {
+        return os << name.str();
+    }
+
+  private:
+    Interned<std::string> name;
+};
+
+/**
+ * @brief Vendor GUID of UEFI variable, interned: the GUID is shared by all
+ *        variables of the vendor, so equal GUIDs have the same address.
+ *        Converted to the pointer to 16 bytes of uuid_t.
+ */
+class VariableGuid
+{
+  public:
+    using Bytes = std::array<uint8_t, sizeof(uuid_t)>;
+
+    /** @brief Constructor of the null GUID. */
+    VariableGuid() : guid(Bytes{})
+    {}
+
+    /**
+     * @brief Constructor.
+     *
+     * @param[in] uuid GUID (array of 16 bytes)
+     */
+    VariableGuid(const uint8_t* uuid) : guid(toBytes(uuid))
+    {}
+
+    /**
+     * @brief Constructor, allows initializing GUID with the list of bytes.
+     *
+     * @param[in] bytes GUID bytes, missing trailing bytes are zero
+     */
+    VariableGuid(std::initializer_list<uint8_t> bytes) : guid(toBytes(bytes))
+    {}
+
+    operator const uint8_t*() const
+    {
+        return guid.get().data();
+    }
+
+  private:
+    /** @brief Hash of GUID bytes. */
+    struct Hash
+    {
+        size_t operator()(const Bytes& bytes) const
+        {
+            return std::hash<std::string_view>()(std::string_view(
+                reinterpret_cast<const char*>(bytes.data()), bytes.size()));
+        }
+    };
+
+    static Bytes toBytes(const uint8_t* uuid)
+    {
+        Bytes bytes;
+        memcpy(bytes.data(), uuid, bytes.size());
+        return bytes;
+    }
+
+    static Bytes toBytes(std::initializer_list<uint8_t> list)
+    {
+        Bytes bytes{};
+        std::copy_n(list.begin(), std::min(list.size(), bytes.size()),
+                    bytes.begin());
+        return bytes;
+    }
+
+    Interned<Bytes, Hash> guid;
+};
+
 /**
  * @brief Unique variable key.
+ *
+ * Both parts are references to the interned values, so the key is two
+ * pointers: copying a snapshot or a delta does not copy the names, and the
+ * keys of the same variable are compared by addresses.
  */
 struct VariableKey
 {
-    std::string name; ///< Variable name
-    uuid_t guid;      ///< Vendor GUID
+    VariableName name; ///< Variable name
+    VariableGuid guid; ///< Vendor GUID
 
     /* Comparator for using as a key in map. */
-    bool operator<(const VariableKey& rhs) const;
+    inline bool operator<(const VariableKey& rhs) const;
 };
 
+/**
+ * @brief Non-owning reference to the variable key, used for lookups
+ *        without constructing VariableKey.
+ */
+struct VariableKeyView
+{
+    /**
+     * @brief Constructor.
+     *
+     * @param[in] name Variable name
+     * @param[in] guid Vendor GUID (array of 16 bytes)
+     */
+    VariableKeyView(std::string_view name, const uint8_t* guid) :
+        name(name), guid(guid)
+    {}
+
+    /**
+     * @brief Constructor.
+     *
+     * @param[in] key Variable key to refer
+     */
+    VariableKeyView(const VariableKey& key) : name(key.name), guid(key.guid)
+    {}
+
+    std::string_view name; ///< Variable name
+    const uint8_t* guid;   ///< Vendor GUID
+};
+
+/**
+ * @brief Comparator of variable keys, supports heterogeneous lookup.
+ *
+ * Keys are ordered by GUID, then by name. Interned parts of the keys are
+ * equal if their addresses are, so the keys of the same vendor skip the
+ * GUID comparison. Different GUIDs are compared as two big-endian 64-bit
+ * integers: binary UUID fields are big-endian, so the order is the same
+ * as of uuid_compare().
+ */
+struct VariableKeyLess
+{
+    using is_transparent = void;
+
+    bool operator()(const VariableKeyView& lhs,
+                    const VariableKeyView& rhs) const
+    {
+        if (lhs.guid != rhs.guid)
+        {
+            for (size_t i = 0; i < sizeof(uuid_t); i += sizeof(uint64_t))
+            {
+                uint64_t l, r;
+                memcpy(&l, lhs.guid + i, sizeof(l));
+                memcpy(&r, rhs.guid + i, sizeof(r));
+                if (l != r)
+                {
+                    return be64toh(l) < be64toh(r);
+                }
+            }
+        }
+        if (lhs.name.data() == rhs.name.data() &&
+            lhs.name.size() == rhs.name.size())
+        {
+            return false;
+        }
+        return lhs.name < rhs.name;
+    }
+};
+
+bool VariableKey::operator<(const VariableKey& rhs) const
+{
+    return VariableKeyLess()(*this, rhs);
+}
+
+/**
+ * @brief Data of UEFI variable. The bytes are immutable and shared by the
+ *        copies, so copying a value, or a snapshot of all variables, copies
+ *        a pointer instead of the data. Converted to the vector of bytes.
+ */
+class VariableData
+{
+  public:
+    using Bytes = std::vector<uint8_t>;
+    using value_type = uint8_t;
+    using size_type = size_t;
+    using const_iterator = Bytes::const_iterator;
+    using iterator = const_iterator;
+
+    VariableData() = default;
+
+    VariableData(Bytes bytes) :
+        bytes(bytes.empty() ? nullptr
+                            : std::make_shared<const Bytes>(std::move(bytes)))
+    {}
+
+    VariableData(std::initializer_list<uint8_t> list) :
+        VariableData(Bytes(list))
+    {}
+
+    template <typename It>
+    VariableData(It first, It last) : VariableData(Bytes(first, last))
+    {}
+
+    /**
+     * @brief Replace the data with the range of bytes.
+     *
+     * @param[in] first,last Range of bytes
+     */
+    template <typename It>
+    void assign(It first, It last)
+    {
+        *this = VariableData(first, last);
+    }
+
+    void clear()
+    {
+        bytes.reset();
+    }
+
+    const Bytes& get() const
+    {
+        static const Bytes none;
+        return bytes ? *bytes : none;
+    }
+
+    operator const Bytes&() const
+    {
+        return get();
+    }
+
+    const uint8_t* data() const
+    {
+        return get().data();
+    }
+
+    size_t size() const
+    {
+        return bytes ? bytes->size() : 0;
+    }
+
+    bool empty() const
+    {
+        return !bytes;
+    }
+
+    const_iterator begin() const
+    {
+        return get().begin();
+    }
+
+    const_iterator end() const
+    {
+        return get().end();
+    }
+
+    const uint8_t& operator[](size_t pos) const
+    {
+        return (*bytes)[pos];
+    }
+
+    const uint8_t& front() const
+    {
+        return bytes->front();
+    }
+
+    const uint8_t& back() const
+    {
+        return bytes->back();
+    }
+
+    friend bool operator==(const VariableData& lhs, const VariableData& rhs)
+    {
+        return lhs.bytes == rhs.bytes || lhs.get() == rhs.get();
+    }
+
+    friend bool operator==(const VariableData& lhs, const Bytes& rhs)
+    {
+        return lhs.get() == rhs;
+    }
+
+    friend bool operator==(const Bytes& lhs, const VariableData& rhs)
+    {
+        return lhs == rhs.get();
+    }
+
+    template <typename T>
+    friend bool operator!=(const VariableData& lhs, const T& rhs)
+    {
+        return !(lhs == rhs);
+    }
+
+    friend bool operator!=(const Bytes& lhs, const VariableData& rhs)
+    {
+        return !(lhs == rhs);
+    }
+
+  private:
+    std::shared_ptr<const Bytes> bytes;
+};
+
+class Page;
+
 /**
  * @brief Value of UEFI variable.
+ *
+ * The storage may page out large data to keep it off memory, such value has
+ * empty data and refers to its page. Readers get values with data, savers
+ * load paged out data one value at a time with PageLoader.
  */
 struct VariableValue
 {
-    uint32_t attributes;       ///< UEFI attributes
-    std::vector<uint8_t> data; ///< Raw data
+    uint32_t attributes;                        ///< UEFI attributes
+    VariableData data;                          ///< Raw data
+    std::shared_ptr<const Page> page = nullptr; ///< Paged out data, if any
+};
+
+/**
+ * @brief Loader of paged out data.
+ */
+using PageLoader =
+    std::function<std::shared_ptr<const VariableValue>(const Page&)>;
+
+/**
+ * @brief UEFI variables container. Nodes are allocated from the memory
+ *        resource of the container, which is the default heap unless
+ *        specified explicitly.
+ */
+using Variables = std::pmr::map<VariableKey, VariableValue, VariableKeyLess>;
+
+/**
+ * @brief Changes of variables: new value, or none for removed variable.
+ */
+using VariableDelta = std::map<VariableKey, std::optional<VariableValue>>;
+
+/**
+ * @brief Named configuration profiles. Each profile is a delta against the
+ *        base set of variables, unchanged variables are shared by all
+ *        profiles.
+ */
+struct Profiles
+{
+    /** @brief Name of the active profile, empty for the base set. */
+    std::string active;
+    /** @brief Base values of variables changed by the active profile. */
+    VariableDelta shadow;
+    /** @brief Deltas of profiles by name. */
+    std::map<std::string, VariableDelta> deltas;
 };
 
 /**
- * @brief UEFI variables container.
+ * @brief Details of the loaded JSON file.
  */
-using Variables = std::map<VariableKey, VariableValue>;
+struct LoadInfo
+{
+    uint64_t generation = 0;            ///< Generation stamp of the file
+    std::vector<VariableKey> corrupted; ///< Records failed integrity check
+    Profiles profiles;                  ///< Configuration profiles
+};
 
 /**
  * @brief Load variables from JSON file.
  *
  * @param[in] file Path to the JSON file to load
+ * @param[out] info Details of the file, optional. If specified, records
+ *                  with checksum mismatch are skipped and reported instead
+ *                  of failing the whole load.
+ * @param[in] resource Memory resource of the variables container
+ *
  * @return UEFI variables
  *
- * @throw std::runtime_error in case of errors
+ * @throw std::runtime_error in case of errors or checksum mismatch
  */
-Variables loadVariables(const std::filesystem::path& jsonFile);
+Variables loadVariables(const std::filesystem::path& jsonFile,
+                        LoadInfo* info = nullptr,
+                        std::pmr::memory_resource* resource =
+                            std::pmr::get_default_resource());
 
 /**
- * @brief Save variables to JSON file.
+ * @brief Save variables to JSON file. The file is written to a temporary
+ *        file, synced and renamed, so it is never left partially written.
  *
  * @param[in] variables UEFI variables to save
  * @param[in] file Path to the JSON file to write
+ * @param[in] generation Generation stamp of the file
+ * @param[in] profiles Configuration profiles to save with variables
+ * @param[in] loader Loader of paged out values, required if there are any
+ *
+ * @return number of bytes written
  *
  * @throw std::runtime_error in case of errors
  */
-void saveVariables(const Variables& variables,
-                   const std::filesystem::path& jsonFile);
+size_t saveVariables(const Variables& variables,
+                     const std::filesystem::path& jsonFile,
+                     uint64_t generation = 0,
+                     const Profiles* profiles = nullptr,
+                     const PageLoader& loader = nullptr);
@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#include "watcher.hpp"
+
+#include <sys/inotify.h>
+
+#include <system_error>
+
+Watcher::Watcher(sd_event* event, const std::filesystem::path& file,
+                 Callback callback) :
+    name(file.filename()),
+    callback(std::move(callback))
+{
+    const std::filesystem::path dir = file.parent_path();
+    std::filesystem::create_directories(dir);
+
+    const int rc =
+        sd_event_add_inotify(event, &source, dir.c_str(),
+                             IN_CLOSE_WRITE | IN_MOVED_TO, handler, this);
+    if (rc < 0)
+    {
+        throw std::system_error(-rc, std::generic_category(),
+                                "Unable to watch " + dir.string());
+    }
+}
+
+Watcher::~Watcher()
+{
+    sd_event_source_unref(source);
+}
+
+int Watcher::handler(sd_event_source*, const struct inotify_event* ev,
+                     void* userdata)
+{
+    Watcher* watcher = static_cast<Watcher*>(userdata);
+    if ((ev->mask & IN_Q_OVERFLOW) || (ev->len && watcher->name == ev->name))
+    {
+        watcher->callback();
+    }
+    return 0;
+}
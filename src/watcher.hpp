@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#pragma once
+
+#include <systemd/sd-event.h>
+
+#include <filesystem>
+#include <functional>
+
+/**
+ * @brief Watcher of file modifications on the event loop.
+ *
+ * The parent directory is watched instead of the file itself, so the file
+ * replaced by renaming is also detected.
+ */
+class Watcher
+{
+  public:
+    /** @brief Callback called when the file is written or replaced. */
+    using Callback = std::function<void()>;
+
+    /**
+     * @brief Constructor.
+     *
+     * @param[in] event Event loop
+     * @param[in] file Path to the file to watch
+     * @param[in] callback Modification callback
+     *
+     * @throw std::system_error in case of errors
+     */
+    Watcher(sd_event* event, const std::filesystem::path& file,
+            Callback callback);
+
+    Watcher(const Watcher&) = delete;
+    Watcher& operator=(const Watcher&) = delete;
+
+    ~Watcher();
+
+  private:
+    /** @brief Handler of inotify events. */
+    static int handler(sd_event_source* source, const struct inotify_event* ev,
+                       void* userdata);
+
+    /** @brief Name of the watched file. */
+    std::string name;
+    /** @brief Modification callback. */
+    Callback callback;
+    /** @brief Inotify event source. */
+    sd_event_source* source = nullptr;
+};
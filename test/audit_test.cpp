@@ -0,0 +1,136 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#include "audit.hpp"
+
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+// clang-format off
+#define GUID1 { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 }
+#define GUID2 { 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1 }
+// clang-format on
+
+TEST(AuditQueueTest, PushPop)
+{
+    AuditQueue queue(3);
+    EXPECT_EQ(queue.capacity(), 4);
+
+    AuditRecord record;
+    EXPECT_FALSE(queue.pop(record));
+    for (size_t i = 0; i < queue.capacity(); ++i)
+    {
+        record.key.name = std::to_string(i);
+        EXPECT_TRUE(queue.push(record));
+    }
+    record.key.name = "full";
+    EXPECT_FALSE(queue.push(record));
+    EXPECT_EQ(record.key.name, "full");
+
+    for (size_t i = 0; i < queue.capacity(); ++i)
+    {
+        ASSERT_TRUE(queue.pop(record));
+        EXPECT_EQ(record.key.name, std::to_string(i));
+    }
+    EXPECT_FALSE(queue.pop(record));
+}
+
+TEST(AuditQueueTest, Producers)
+{
+    constexpr size_t producers = 4;
+    constexpr size_t records = 10000;
+    AuditQueue queue(64);
+
+    std::vector<std::thread> threads;
+    for (size_t id = 0; id < producers; ++id)
+    {
+        threads.emplace_back([&queue, id]() {
+            for (size_t i = 0; i < records; ++i)
+            {
+                AuditRecord record;
+                record.key.name = std::to_string(i);
+                record.key.guid = {static_cast<uint8_t>(id)};
+                while (!queue.push(record))
+                {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    // records of each producer keep their order
+    std::vector<size_t> next(producers, 0);
+    AuditRecord record;
+    for (size_t count = 0; count < producers * records;)
+    {
+        if (!queue.pop(record))
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        ASSERT_LT(record.key.guid[0], producers);
+        EXPECT_EQ(record.key.name, std::to_string(next[record.key.guid[0]]));
+        ++next[record.key.guid[0]];
+        ++count;
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    EXPECT_FALSE(queue.pop(record));
+}
+
+TEST(AuditTest, Rules)
+{
+    const VariableKey var1{"BootOrder", GUID1};
+    const VariableKey var2{"Boot0001", GUID2};
+
+    Audit::Rule rule = Audit::Rule::parse("BootOrder");
+    EXPECT_TRUE(rule.match(var1));
+    EXPECT_FALSE(rule.match(var2));
+
+    rule = Audit::Rule::parse("Boot*");
+    EXPECT_TRUE(rule.match(var1));
+    EXPECT_TRUE(rule.match(var2));
+
+    rule = Audit::Rule::parse("100F0E0D-0C0B-0A09-0807-060504030201");
+    EXPECT_FALSE(rule.match(var1));
+    EXPECT_TRUE(rule.match(var2));
+
+    rule = Audit::Rule::parse("01020304-0506-0708-090a-0b0c0d0e0f10:Boot0*");
+    EXPECT_FALSE(rule.match(var1));
+    EXPECT_TRUE(rule.match(VariableKey{"Boot0001", GUID1}));
+    EXPECT_FALSE(rule.match(var2));
+
+    EXPECT_THROW(Audit::Rule::parse(""), std::invalid_argument);
+    EXPECT_THROW(Audit::Rule::parse("invalid:Name"), std::invalid_argument);
+}
+
+TEST(AuditTest, Drain)
+{
+    Audit audit("uefivar.json", 4);
+    EXPECT_FALSE(audit.pending());
+    EXPECT_EQ(audit.drain(), 0);
+
+    EXPECT_TRUE(
+        audit.record(AuditRecord::Action::create, VariableKey{"Var1", GUID1}));
+    EXPECT_TRUE(audit.pending());
+    EXPECT_EQ(audit.drain(), 1);
+    EXPECT_FALSE(audit.pending());
+
+    // full queue is drained by the writer
+    for (int i = 0; i < 5; ++i)
+    {
+        audit.record(AuditRecord::Action::change, VariableKey{"Var1", GUID1});
+    }
+    EXPECT_EQ(audit.drain(), 1);
+
+    audit.setFilter({Audit::Rule::parse("Var2")});
+    EXPECT_FALSE(
+        audit.record(AuditRecord::Action::remove, VariableKey{"Var1", GUID1}));
+    EXPECT_TRUE(
+        audit.record(AuditRecord::Action::remove, VariableKey{"Var2", GUID1}));
+    EXPECT_EQ(audit.drain(), 1);
+}
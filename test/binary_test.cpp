@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#include "binary.hpp"
+
+#include <fstream>
+
+#include <gtest/gtest.h>
+
+namespace fs = std::filesystem;
+
+// clang-format off
+#define GUID1 { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 }
+#define GUID2 { 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1 }
+// clang-format on
+
+TEST(BinaryTest, SaveLoad)
+{
+    const fs::path file = fs::temp_directory_path() / "uefivar.bin";
+    const binary::Source src{1, 2, 3};
+
+    Variables variables;
+    variables[VariableKey{"TestVariable1", GUID1}] = VariableValue{1, {1, 2}};
+    variables[VariableKey{"TestVariable2", GUID2}] = VariableValue{2, {}};
+    binary::saveVariables(variables, src, file);
+
+    auto loaded = binary::loadVariables(file, src);
+    ASSERT_TRUE(loaded);
+    ASSERT_EQ(loaded->size(), 2);
+    auto var = loaded->find(VariableKey{"TestVariable1", GUID1});
+    ASSERT_NE(var, loaded->end());
+    EXPECT_EQ(var->second.attributes, 1);
+    EXPECT_EQ(var->second.data, (std::vector<uint8_t>{1, 2}));
+    var = loaded->find(VariableKey{"TestVariable2", GUID2});
+    ASSERT_NE(var, loaded->end());
+    EXPECT_EQ(var->second.attributes, 2);
+    EXPECT_TRUE(var->second.data.empty());
+
+    // source mismatch
+    EXPECT_FALSE(binary::loadVariables(file, binary::Source{1, 2, 4}));
+
+    fs::remove(file);
+}
+
+TEST(BinaryTest, Corrupted)
+{
+    const fs::path file = fs::temp_directory_path() / "uefivar.bin";
+    const binary::Source src{1, 2, 3};
+
+    Variables variables;
+    variables[VariableKey{"TestVariable", GUID1}] = VariableValue{1, {1, 2}};
+    binary::saveVariables(variables, src, file);
+
+    // flip the last data byte
+    {
+        std::fstream stream(file, std::ios::in | std::ios::out |
+                                      std::ios::binary | std::ios::ate);
+        stream.seekp(-1, std::ios::end);
+        stream.put(0x42);
+    }
+    EXPECT_FALSE(binary::loadVariables(file, src));
+
+    EXPECT_FALSE(binary::loadVariables(file.string() + ".none", src));
+
+    fs::remove(file);
+}
+
+TEST(BinaryTest, LongName)
+{
+    const fs::path file = fs::temp_directory_path() / "uefivar.bin";
+
+    Variables variables;
+    variables[VariableKey{std::string(0x10000, 'A'), GUID1}] =
+        VariableValue{1, {1}};
+    EXPECT_THROW(binary::saveVariables(variables, binary::Source{}, file),
+                 std::length_error);
+    EXPECT_FALSE(fs::exists(file));
+}
@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#include "crc32c.hpp"
+
+#include <cstring>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+TEST(Crc32cTest, Check)
+{
+    const char* data = "123456789";
+    EXPECT_EQ(crc32c(data, strlen(data)), 0xe3069283);
+    EXPECT_EQ(crc32c(data, 0), 0);
+    EXPECT_EQ(crc32cSoftware(data, strlen(data)), 0xe3069283);
+}
+
+TEST(Crc32cTest, Continue)
+{
+    const char* data = "123456789";
+    const uint32_t head = crc32c(data, 4);
+    EXPECT_EQ(crc32c(data + 4, strlen(data) - 4, head), 0xe3069283);
+}
+
+TEST(Crc32cTest, Kernels)
+{
+    std::vector<uint8_t> data(1031);
+    for (size_t i = 0; i < data.size(); ++i)
+    {
+        data[i] = static_cast<uint8_t>(i * 131 + 7);
+    }
+    // unaligned heads and tails of all sizes
+    for (size_t offset = 0; offset < 8; ++offset)
+    {
+        for (size_t size = 0; size < data.size() - offset; size += 13)
+        {
+            EXPECT_EQ(crc32c(&data[offset], size),
+                      crc32cSoftware(&data[offset], size));
+        }
+    }
+}
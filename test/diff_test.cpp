@@ -0,0 +1,86 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#include "binary.hpp"
+#include "diff.hpp"
+
+#include <fstream>
+
+#include <gtest/gtest.h>
+
+namespace fs = std::filesystem;
+
+// clang-format off
+#define GUID1 { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 }
+#define GUID2 { 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1 }
+// clang-format on
+
+TEST(DiffTest, Variables)
+{
+    Variables from;
+    from[VariableKey{"Same", GUID1}] = VariableValue{1, {1, 2}};
+    from[VariableKey{"Removed", GUID1}] = VariableValue{1, {}};
+    from[VariableKey{"Attributes", GUID2}] = VariableValue{1, {1}};
+    from[VariableKey{"Data", GUID2}] = VariableValue{1, {1, 2, 3}};
+
+    Variables to;
+    to[VariableKey{"Same", GUID1}] = VariableValue{1, {1, 2}};
+    to[VariableKey{"Added", GUID1}] = VariableValue{1, {}};
+    to[VariableKey{"Attributes", GUID2}] = VariableValue{3, {1}};
+    to[VariableKey{"Data", GUID2}] = VariableValue{1, {1, 5, 3}};
+
+    const auto diffs = diff::compare(from, to);
+    ASSERT_EQ(diffs.size(), 4);
+    EXPECT_EQ(diffs[0].key.name, "Added");
+    EXPECT_EQ(diffs[0].kind, diff::Difference::added);
+    EXPECT_EQ(diffs[1].key.name, "Removed");
+    EXPECT_EQ(diffs[1].kind, diff::Difference::removed);
+    EXPECT_EQ(diffs[2].key.name, "Attributes");
+    EXPECT_EQ(diffs[2].kind, diff::Difference::attributes);
+    EXPECT_TRUE(diffs[2].ranges.empty());
+    EXPECT_EQ(diffs[3].key.name, "Data");
+    EXPECT_EQ(diffs[3].kind, diff::Difference::data);
+    EXPECT_EQ(diffs[3].ranges, (std::vector<diff::Range>{{1, 1}}));
+
+    EXPECT_TRUE(diff::compare(from, from).empty());
+    EXPECT_EQ(diff::compare(Variables(), to).size(), to.size());
+}
+
+TEST(DiffTest, Data)
+{
+    using Ranges = std::vector<diff::Range>;
+    const std::vector<uint8_t> data = {0, 1, 2, 3, 4, 5};
+
+    EXPECT_TRUE(diff::compare(data, data).empty());
+    EXPECT_EQ(diff::compare(data, {9, 1, 9, 9, 4, 9}),
+              (Ranges{{0, 1}, {2, 2}, {5, 1}}));
+    EXPECT_EQ(diff::compare(data, {0, 1, 2}), (Ranges{{3, 3}}));
+    EXPECT_EQ(diff::compare(data, {0, 1, 2, 3, 9, 9, 6, 7}), (Ranges{{4, 4}}));
+    EXPECT_EQ(diff::compare({}, data), (Ranges{{0, 6}}));
+}
+
+TEST(DiffTest, Load)
+{
+    const fs::path json = fs::path(TEST_DATA_DIR) / "nvram.json";
+    const fs::path nvram = fs::path(TEST_DATA_DIR) / "nvram.bin";
+    const fs::path image = fs::temp_directory_path() / "uefivar.bin";
+
+    const Variables vars = diff::load(json);
+    EXPECT_FALSE(vars.empty());
+    EXPECT_FALSE(diff::load(nvram).empty());
+
+    binary::saveVariables(vars, binary::Source::of(json), image);
+    EXPECT_TRUE(diff::compare(vars, diff::load(image)).empty());
+    fs::remove(image);
+
+    EXPECT_THROW(diff::load(image), std::system_error);
+
+    // format errors are told apart from IO errors
+    std::ofstream(image) << "{ broken";
+    EXPECT_THROW(diff::load(image), std::invalid_argument);
+    std::ofstream(image) << "garbage";
+    EXPECT_THROW(diff::load(image), std::invalid_argument);
+    std::ofstream(image).close();
+    EXPECT_THROW(diff::load(image), std::invalid_argument);
+    fs::remove(image);
+}
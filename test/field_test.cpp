@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#include "field.hpp"
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using Word = field::Field<uint16_t, 1>;
+using Long = field::Field<uint32_t, 3>;
+using Short = field::Field<uint32_t, 7, 3>;
+using Quad = field::Field<uint64_t, 10>;
+using Tag = field::Bytes<18, 2>;
+
+TEST(FieldTest, Get)
+{
+    // fields are unaligned and little-endian
+    const std::vector<uint8_t> data = {
+        0xee,                                           // padding
+        0x34, 0x12,                                     // Word
+        0x78, 0x56, 0x34, 0x12,                         // Long
+        0x03, 0x02, 0x01,                               // Short
+        0x08, 0x07, 0x06, 0x05, 0x04, 0x03, 0x02, 0x01, // Quad
+        'N',  'V',                                      // Tag
+        0xff,                                           // padding
+    };
+    EXPECT_EQ(field::get<Word>(data.data()), 0x1234);
+    EXPECT_EQ(field::get<Long>(data.data()), 0x12345678);
+    EXPECT_EQ(field::get<Short>(data.data()), 0x010203);
+    EXPECT_EQ(field::get<Quad>(data.data()), 0x0102030405060708);
+    EXPECT_EQ(field::data<Tag>(data.data())[0], 'N');
+    EXPECT_EQ(field::data<Tag>(data.data())[1], 'V');
+}
+
+TEST(FieldTest, Set)
+{
+    std::vector<uint8_t> data(Tag::end + 1, 0xee);
+    field::set<Word>(data.data(), 0x1234);
+    field::set<Long>(data.data(), 0x12345678);
+    field::set<Short>(data.data(), 0xff010203); // truncated
+    field::set<Quad>(data.data(), 0x0102030405060708);
+
+    EXPECT_EQ(data[0], 0xee);
+    EXPECT_EQ(data[1], 0x34);
+    EXPECT_EQ(data[2], 0x12);
+    EXPECT_EQ(data[3], 0x78);
+    EXPECT_EQ(data[6], 0x12);
+    EXPECT_EQ(data[7], 0x03);
+    EXPECT_EQ(data[9], 0x01);
+    EXPECT_EQ(data[10], 0x08);
+    EXPECT_EQ(data[17], 0x01);
+    EXPECT_EQ(data[18], 0xee);
+
+    EXPECT_EQ(field::get<Short>(data.data()), 0x010203);
+    EXPECT_EQ(field::get<Quad>(data.data()), 0x0102030405060708);
+}
@@ -0,0 +1,148 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#include "history.hpp"
+
+#include <ctime>
+
+#include <gtest/gtest.h>
+
+namespace fs = std::filesystem;
+
+// clang-format off
+#define GUID1 { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 }
+// clang-format on
+
+/**
+ * @brief Change history tests.
+ */
+class HistoryTest : public ::testing::Test
+{
+  protected:
+    void SetUp() override
+    {
+        fs::remove(file);
+    }
+
+    void TearDown() override
+    {
+        fs::remove(file);
+    }
+
+    const fs::path file = fs::temp_directory_path() / "uefivar.history";
+};
+
+TEST_F(HistoryTest, RecordAndList)
+{
+    const VariableKey var1{"Var1", GUID1};
+    const VariableKey var2{"Var2", GUID1};
+    Variables v0, v1, v2;
+    v1[var1] = VariableValue{0, {1}};
+    v1[var2] = VariableValue{0, {2}};
+    v2[var1] = VariableValue{7, {1}};
+
+    {
+        History history(file, 4096);
+        EXPECT_EQ(history.generation(), 0);
+        history.record(v0, v1);
+        history.record(v1, v2);
+        history.record(v2, v2);
+        EXPECT_EQ(history.generation(), 2);
+    }
+
+    History history(file, 4096);
+    EXPECT_EQ(history.generation(), 2);
+    const auto changes = history.list(10);
+    ASSERT_EQ(changes.size(), 4);
+    EXPECT_EQ(changes[0].generation, 2);
+    EXPECT_EQ(changes[0].key.name, "Var2");
+    EXPECT_EQ(changes[0].kind, History::removed);
+    EXPECT_EQ(changes[1].generation, 2);
+    EXPECT_EQ(changes[1].key.name, "Var1");
+    EXPECT_EQ(changes[1].kind, History::modified);
+    EXPECT_EQ(changes[3].generation, 1);
+    EXPECT_EQ(changes[3].kind, History::created);
+    EXPECT_EQ(history.list(1).size(), 1);
+}
+
+TEST_F(HistoryTest, Rollback)
+{
+    const VariableKey var1{"Var1", GUID1};
+    Variables v0, v1, v2, v3;
+    std::vector<uint8_t> data(1000, 1);
+    v1[var1] = VariableValue{0, data};
+    v2 = v1;
+    data[500] = 2;
+    v2[var1].data = data;
+    v3 = v2;
+    data.resize(10);
+    v3[var1].data = data;
+
+    History history(file, 16384);
+    history.record(v0, v1);
+    history.record(v1, v2, var1);
+    history.record(v2, v3, var1);
+    // the small change is stored as a delta
+    EXPECT_LT(fs::file_size(file), 2200);
+
+    VariableDelta delta = history.rollback(v3, 2);
+    ASSERT_EQ(delta.size(), 1);
+    EXPECT_EQ(delta[var1]->data, v2[var1].data);
+    delta = history.rollback(v3, 1);
+    EXPECT_EQ(delta[var1]->data, v1[var1].data);
+    delta = history.rollback(v3, 0);
+    EXPECT_FALSE(delta[var1]);
+    EXPECT_TRUE(history.rollback(v3, 3).empty());
+
+    EXPECT_THROW(history.rollback(v3, 4), std::out_of_range);
+    EXPECT_THROW(history.rollback(v1, 1), std::runtime_error);
+}
+
+TEST_F(HistoryTest, Trim)
+{
+    const VariableKey var1{"Var1", GUID1};
+    Variables from, to;
+    to[var1] = VariableValue{0, std::vector<uint8_t>(100)};
+
+    History history(file, 1024);
+    for (uint8_t i = 0; i < 50; ++i)
+    {
+        from = to;
+        to[var1].data = std::vector<uint8_t>(100, i);
+        history.record(from, to, var1);
+        EXPECT_LE(fs::file_size(file), 1024);
+    }
+    EXPECT_EQ(history.generation(), 50);
+
+    const auto changes = history.list(100);
+    ASSERT_FALSE(changes.empty());
+    EXPECT_LT(changes.size(), 10);
+    const uint64_t oldest = changes.back().generation;
+    EXPECT_THROW(history.rollback(to, oldest - 2), std::out_of_range);
+    VariableDelta delta = history.rollback(to, oldest - 1);
+    EXPECT_EQ(delta[var1]->data,
+              std::vector<uint8_t>(100, static_cast<uint8_t>(oldest - 2)));
+
+    // the dropped part is before the time of the oldest change
+    EXPECT_EQ(history.generationAt(std::time(nullptr) + 10), 50);
+    EXPECT_THROW(history.generationAt(0), std::out_of_range);
+}
+
+TEST_F(HistoryTest, Truncated)
+{
+    const VariableKey var1{"Var1", GUID1};
+    Variables v0, v1;
+    v1[var1] = VariableValue{0, {1, 2, 3}};
+    {
+        History history(file, 4096);
+        history.record(v0, v1);
+        history.record(v1, v0);
+    }
+    fs::resize_file(file, fs::file_size(file) - 1);
+
+    History history(file, 4096);
+    EXPECT_EQ(history.generation(), 1);
+    EXPECT_EQ(history.list(10).size(), 1);
+    history.record(v1, v0);
+    EXPECT_EQ(history.generation(), 2);
+}
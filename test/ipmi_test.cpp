@@ -0,0 +1,175 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#include "ipmi.hpp"
+
+#include <ipmid/api.h>
+
+#include <map>
+
+#include <gtest/gtest.h>
+
+namespace fs = std::filesystem;
+
+/** @brief Handlers registered in the ipmid stub. */
+static std::map<std::pair<ipmi_netfn_t, ipmi_cmd_t>,
+                std::pair<ipmid_callback_t, ipmi_context_t>>
+    handlers;
+
+void ipmi_register_callback(ipmi_netfn_t netfn, ipmi_cmd_t cmd,
+                            ipmi_context_t context, ipmid_callback_t handler,
+                            ipmi_cmd_privilege_t)
+{
+    handlers[std::make_pair(netfn, cmd)] = std::make_pair(handler, context);
+}
+
+/**
+ * @brief IPMI provider tests.
+ */
+class IpmiTest : public ::testing::Test
+{
+  protected:
+    void SetUp() override
+    {
+        fs::remove(file);
+        fs::remove(cache);
+        fs::remove(backup);
+        fs::remove(lock);
+        handlers.clear();
+    }
+
+    void TearDown() override
+    {
+        fs::remove(file);
+        fs::remove(cache);
+        fs::remove(backup);
+        fs::remove(lock);
+    }
+
+    /**
+     * @brief Call registered command handler.
+     *
+     * @param[in] cmd Command
+     * @param[in] req Request data without IANA
+     * @param[out] rsp Response data without IANA
+     *
+     * @return completion code
+     */
+    ipmi_ret_t call(uint8_t cmd, const std::vector<uint8_t>& req,
+                    std::vector<uint8_t>& rsp)
+    {
+        std::vector<uint8_t> request = {0x69, 0xc2, 0x00};
+        request.insert(request.end(), req.begin(), req.end());
+        std::vector<uint8_t> response(Ipmi::maxResponse);
+        size_t len = request.size();
+
+        auto it = handlers.find(std::make_pair(Ipmi::netFn, cmd));
+        if (it == handlers.end())
+        {
+            return Ipmi::ccInvalidCommand;
+        }
+        const ipmi_ret_t rc =
+            it->second.first(Ipmi::netFn, cmd, request.data(),
+                             response.data(), &len, it->second.second);
+        if (rc == Ipmi::ccSuccess)
+        {
+            EXPECT_GE(len, Ipmi::ianaSize);
+            EXPECT_LE(len, Ipmi::maxResponse);
+            response.resize(len);
+            EXPECT_EQ(response[0], 0x69);
+            rsp.assign(response.begin() + Ipmi::ianaSize, response.end());
+        }
+        return rc;
+    }
+
+    const fs::path file = fs::temp_directory_path() / "uefivar.json";
+    const fs::path cache = fs::temp_directory_path() / "uefivar.json.bin";
+    const fs::path backup = fs::temp_directory_path() / "uefivar.json.bak";
+    const fs::path lock = fs::temp_directory_path() / "uefivar.json.lock";
+};
+
+TEST_F(IpmiTest, SetGetNext)
+{
+    Storage storage(file);
+    Ipmi ipmi(storage);
+    ipmi.registerHandlers();
+    std::vector<uint8_t> rsp;
+    storage.set(VariableKey{"A", {}}, VariableValue{7, {1}});
+
+    // set: GUID, attributes, name size, name, data
+    const std::vector<uint8_t> set = {1, 2,   3,   4,   5,   6,   7,   8,
+                                      9, 10,  11,  12,  13,  14,  15,  16,
+                                      7, 0,   0,   0,   2,   'B', 'o', 0xaa,
+                                      0xbb, 0xcc};
+    ASSERT_EQ(call(Ipmi::setVariable, set, rsp), Ipmi::ccSuccess);
+    EXPECT_TRUE(rsp.empty());
+
+    // get: GUID, offset, name
+    std::vector<uint8_t> get(set.begin(), set.begin() + 16);
+    get.insert(get.end(), {1, 0, 0, 0, 'B', 'o'});
+    ASSERT_EQ(call(Ipmi::getVariable, get, rsp), Ipmi::ccSuccess);
+    EXPECT_EQ(rsp, std::vector<uint8_t>({7, 0, 0, 0, 3, 0, 0, 0, 0xbb, 0xcc}));
+
+    // next: GUID, name
+    std::vector<uint8_t> next(16, 0);
+    next.push_back('A');
+    ASSERT_EQ(call(Ipmi::nextVariable, next, rsp), Ipmi::ccSuccess);
+    std::vector<uint8_t> key(set.begin(), set.begin() + 16);
+    key.insert(key.end(), {'B', 'o'});
+    EXPECT_EQ(rsp, key);
+    EXPECT_EQ(call(Ipmi::nextVariable, key, rsp), Ipmi::ccDataNotPresent);
+
+    // remove with empty data
+    std::vector<uint8_t> remove(set.begin(), set.begin() + 23);
+    ASSERT_EQ(call(Ipmi::setVariable, remove, rsp), Ipmi::ccSuccess);
+    EXPECT_EQ(call(Ipmi::getVariable, get, rsp), Ipmi::ccDataNotPresent);
+    EXPECT_EQ(call(Ipmi::setVariable, remove, rsp), Ipmi::ccDataNotPresent);
+}
+
+TEST_F(IpmiTest, LargeVariable)
+{
+    Storage storage(file);
+    Ipmi ipmi(storage);
+    ipmi.registerHandlers();
+    std::vector<uint8_t> rsp;
+
+    VariableKey key{"Big", {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                            16}};
+    storage.set(key, VariableValue{7, std::vector<uint8_t>(100, 0x5a)});
+
+    const uint8_t* guid = key.guid;
+    std::vector<uint8_t> get(guid, guid + sizeof(uuid_t));
+    get.insert(get.end(), {0, 0, 0, 0, 'B', 'i', 'g'});
+    ASSERT_EQ(call(Ipmi::getVariable, get, rsp), Ipmi::ccSuccess);
+    EXPECT_EQ(rsp.size(), Ipmi::maxResponse - Ipmi::ianaSize);
+    EXPECT_EQ(rsp[4], 100);
+
+    get[16] = 90; // offset
+    ASSERT_EQ(call(Ipmi::getVariable, get, rsp), Ipmi::ccSuccess);
+    EXPECT_EQ(rsp.size(), 8 + 10);
+
+    get[16] = 101;
+    EXPECT_EQ(call(Ipmi::getVariable, get, rsp), Ipmi::ccInvalidField);
+}
+
+TEST_F(IpmiTest, InvalidRequest)
+{
+    Storage storage(file);
+    Ipmi ipmi(storage);
+    std::vector<uint8_t> rsp(Ipmi::maxResponse);
+    size_t len = 0;
+
+    const uint8_t wrongIana[] = {0x01, 0x02, 0x03};
+    EXPECT_EQ(ipmi.handle(Ipmi::getVariable, wrongIana, sizeof(wrongIana),
+                          rsp.data(), len),
+              Ipmi::ccInvalidField);
+    EXPECT_EQ(ipmi.handle(Ipmi::getVariable, wrongIana, 2, rsp.data(), len),
+              Ipmi::ccReqDataLenInvalid);
+    const uint8_t shortReq[] = {0x69, 0xc2, 0x00, 1, 2, 3};
+    EXPECT_EQ(ipmi.handle(Ipmi::setVariable, shortReq, sizeof(shortReq),
+                          rsp.data(), len),
+              Ipmi::ccReqDataLenInvalid);
+    EXPECT_EQ(ipmi.handle(0x7f, shortReq, sizeof(shortReq), rsp.data(), len),
+              Ipmi::ccInvalidCommand);
+    EXPECT_EQ(len, 0);
+}
@@ -0,0 +1,34 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+// Stub of the legacy ipmid registration API (<ipmid/api.h>) for unit tests.
+
+#pragma once
+
+#include <cstddef>
+
+typedef unsigned char ipmi_netfn_t;
+typedef unsigned char ipmi_cmd_t;
+typedef void* ipmi_request_t;
+typedef void* ipmi_response_t;
+typedef void* ipmi_context_t;
+typedef size_t* ipmi_data_len_t;
+typedef unsigned char ipmi_ret_t;
+
+enum CommandPrivilege
+{
+    PRIVILEGE_CALLBACK = 0x01,
+    PRIVILEGE_USER,
+    PRIVILEGE_OPERATOR,
+    PRIVILEGE_ADMIN,
+    PRIVILEGE_OEM,
+};
+typedef enum CommandPrivilege ipmi_cmd_privilege_t;
+
+typedef ipmi_ret_t (*ipmid_callback_t)(ipmi_netfn_t, ipmi_cmd_t, ipmi_request_t,
+                                       ipmi_response_t, ipmi_data_len_t,
+                                       ipmi_context_t);
+
+/** @brief Registration function, implemented by the test. */
+void ipmi_register_callback(ipmi_netfn_t, ipmi_cmd_t, ipmi_context_t,
+                            ipmid_callback_t, ipmi_cmd_privilege_t);
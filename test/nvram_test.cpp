@@ -1,7 +1,16 @@
 // SPDX-License-Identifier: Apache-2.0
 // Copyright (C) 2021 YADRO
 
+#include "crc32c.hpp"
+#include "diff.hpp"
 #include "nvram.hpp"
+#include "storage.hpp"
+
+#include <endian.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
 
 #include <gtest/gtest.h>
 
@@ -30,3 +39,282 @@ TEST(NvramParser, Volume)
         }
     }
 }
+
+/**
+ * @brief NVAR log backend tests, a plain file stands in for the flash.
+ */
+class LogBackendTest : public ::testing::Test
+{
+  protected:
+    void SetUp() override
+    {
+        std::filesystem::remove(file);
+    }
+
+    void TearDown() override
+    {
+        std::filesystem::remove(file);
+        std::filesystem::remove(FileLock::lockFile(file));
+    }
+
+    const std::filesystem::path file =
+        std::filesystem::temp_directory_path() / "uefivar.nvar";
+};
+
+TEST_F(LogBackendTest, SaveLoad)
+{
+    Variables vars;
+    vars[VariableKey{"Var1", {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+                              15, 16}}] = VariableValue{7, {1, 2, 3}};
+    vars[VariableKey{"Var2", {16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3,
+                              2, 1}}] = VariableValue{3, {4}};
+    {
+        nvram::LogBackend backend(file, 8192);
+        EXPECT_FALSE(backend.load());
+        backend.save(Variables(), vars);
+    }
+
+    nvram::LogBackend backend(file);
+    auto loaded = backend.load();
+    ASSERT_TRUE(loaded);
+    EXPECT_TRUE(diff::compare(*loaded, vars).empty());
+
+    // native format in the first half, readable by the NVRAM parser
+    std::vector<uint8_t> image(std::filesystem::file_size(file));
+    FILE* fp = fopen(file.c_str(), "rb");
+    ASSERT_TRUE(fp);
+    ASSERT_EQ(fread(image.data(), 1, image.size(), fp), image.size());
+    fclose(fp);
+    EXPECT_TRUE(
+        diff::compare(nvram::parseNvram(image.data(), image.size() / 2), vars)
+            .empty());
+}
+
+TEST_F(LogBackendTest, Append)
+{
+    const VariableKey key1{"Var1", {1}};
+    const VariableKey key2{"Var2", {2}};
+
+    Variables vars;
+    vars[key1] = VariableValue{3, {1}};
+    vars[key2] = VariableValue{3, {2}};
+
+    nvram::LogBackend backend(file, 8192);
+    backend.save(Variables(), vars);
+    const size_t size = std::filesystem::file_size(file);
+
+    Variables updated = vars;
+    updated[key1].data = {5, 6};
+    updated.erase(key2);
+    backend.save(vars, updated);
+    EXPECT_EQ(backend.erased(), 0);
+    EXPECT_EQ(std::filesystem::file_size(file), size);
+
+    auto loaded = nvram::LogBackend(file).load();
+    ASSERT_TRUE(loaded);
+    EXPECT_TRUE(diff::compare(*loaded, updated).empty());
+}
+
+TEST_F(LogBackendTest, Compaction)
+{
+    const VariableKey key{"Var", {1}};
+    const VariableKey fixed{"Fixed", {2}};
+
+    Variables vars;
+    vars[fixed] = VariableValue{3, std::vector<uint8_t>(3000, 0x5a)};
+    nvram::LogBackend backend(file, 4 * 4096);
+    backend.save(Variables(), vars);
+
+    // each update appends 1KiB node, the log is compacted when full
+    for (uint8_t i = 0; i < 32; ++i)
+    {
+        Variables updated = vars;
+        updated[key] = VariableValue{3, std::vector<uint8_t>(1024, i)};
+        backend.save(vars, updated);
+        vars = std::move(updated);
+    }
+    // the block with the fixed variable is never erased
+    EXPECT_GT(backend.erased(), 0);
+    EXPECT_LT(backend.erased(), 32);
+
+    auto loaded = nvram::LogBackend(file).load();
+    ASSERT_TRUE(loaded);
+    EXPECT_TRUE(diff::compare(*loaded, vars).empty());
+}
+
+TEST_F(LogBackendTest, Scrub)
+{
+    const VariableKey key{"Var", {1}};
+    Variables vars;
+    vars[key] = VariableValue{3, {0x5a, 0x5a, 0x5a, 0x5a}};
+
+    nvram::LogBackend backend(file, 8192);
+    backend.save(Variables(), vars);
+    EXPECT_TRUE(backend.scrub(vars).empty());
+
+    // flip bits of the data on the media
+    std::vector<uint8_t> image(std::filesystem::file_size(file));
+    FILE* fp = fopen(file.c_str(), "r+b");
+    ASSERT_TRUE(fp);
+    ASSERT_EQ(fread(image.data(), 1, image.size(), fp), image.size());
+    const uint8_t pattern[] = {0x5a, 0x5a, 0x5a, 0x5a};
+    auto pos = std::search(image.begin(), image.end(), std::begin(pattern),
+                           std::end(pattern));
+    ASSERT_NE(pos, image.end());
+    fseek(fp, pos - image.begin(), SEEK_SET);
+    fputc(0x18, fp);
+    fclose(fp);
+
+    const std::vector<VariableKey> damaged = backend.scrub(vars);
+    ASSERT_EQ(damaged.size(), 1);
+    EXPECT_EQ(damaged[0].name, "Var");
+
+    auto loaded = nvram::LogBackend(file).load();
+    ASSERT_TRUE(loaded);
+    EXPECT_TRUE(diff::compare(*loaded, vars).empty());
+}
+
+TEST_F(LogBackendTest, Attributes)
+{
+    // time-based authenticated write access can't be stored in NVAR flags
+    const VariableKey db{"db", {1}};
+    const VariableKey var{"Var", {1}};
+    Variables vars;
+    vars[db] = VariableValue{0x27, {1, 2}};
+
+    nvram::LogBackend backend(file, 8192);
+    EXPECT_FALSE(backend.storable(0x27));
+    EXPECT_FALSE(backend.storable(0x06));
+    EXPECT_TRUE(backend.storable(0x17));
+    EXPECT_THROW(backend.save(Variables(), vars), std::invalid_argument);
+
+    Storage storage(file, std::make_unique<nvram::LogBackend>(file, 8192));
+    EXPECT_THROW(storage.set(db, VariableValue{0x27, {1, 2}}),
+                 std::invalid_argument);
+    EXPECT_FALSE(storage.get(db));
+
+    // stored variables don't differ from the media
+    storage.set(db, VariableValue{0x17, {1, 2}});
+    storage.set(var, VariableValue{7, {3}});
+    EXPECT_TRUE(storage.scrub().empty());
+    EXPECT_EQ(storage.get(db)->attributes, 0x17);
+}
+
+TEST_F(LogBackendTest, Full)
+{
+    Variables vars;
+    vars[VariableKey{"Var", {1}}] =
+        VariableValue{3, std::vector<uint8_t>(5000, 0)};
+
+    nvram::LogBackend backend(file, 2 * 4096);
+    EXPECT_THROW(backend.save(Variables(), vars), std::length_error);
+}
+
+TEST_F(LogBackendTest, DefaultSize)
+{
+    nvram::LogBackend backend(file);
+    EXPECT_FALSE(backend.load());
+    EXPECT_EQ(std::filesystem::file_size(file),
+              nvram::LogBackend::defaultSize);
+    EXPECT_THROW(nvram::LogBackend(file.string() + ".small", 4096),
+                 std::runtime_error);
+    std::filesystem::remove(file.string() + ".small");
+}
+
+TEST_F(LogBackendTest, Journal)
+{
+    constexpr size_t blockSize = nvram::LogBackend::defaultEraseSize;
+    constexpr size_t size = 4 * blockSize;
+    const VariableKey key{"Var", {1}};
+    Variables oldVars;
+    oldVars[key] = VariableValue{3, {1, 1, 1}};
+    Variables newVars;
+    newVars[key] = VariableValue{3, {2, 2}};
+
+    // new content of the NVAR area, built on the side
+    const std::filesystem::path other = file.string() + ".new";
+    std::filesystem::remove(other);
+    nvram::LogBackend(other, size).save(Variables(), newVars);
+    std::vector<uint8_t> area(size / 2);
+    FILE* fp = fopen(other.c_str(), "rb");
+    ASSERT_TRUE(fp);
+    ASSERT_EQ(fread(area.data(), 1, area.size(), fp), area.size());
+    fclose(fp);
+    std::filesystem::remove(other);
+
+    // journal of the compaction interrupted before the log was touched:
+    // erase every block of the area and program its used range
+    std::vector<uint8_t> entries;
+    for (size_t block = 0; block < area.size(); block += blockSize)
+    {
+        const auto begin = area.begin() + block;
+        const auto end = begin + blockSize;
+        const auto first = std::find_if(
+            begin, end, [](uint8_t byte) { return byte != 0xff; });
+        const auto last =
+            std::find_if(std::make_reverse_iterator(end),
+                         std::make_reverse_iterator(first),
+                         [](uint8_t byte) { return byte != 0xff; })
+                .base();
+        const uint32_t entry[] = {htole32(first - area.begin()),
+                                  htole32(last - first), htole32(1)};
+        const uint8_t* raw = reinterpret_cast<const uint8_t*>(entry);
+        entries.insert(entries.end(), raw, raw + sizeof(entry));
+        entries.insert(entries.end(), first, last);
+    }
+    const uint32_t hdr[] = {htole32(0x5241564e), htole32(0x4c4e524a),
+                            htole32(entries.size()),
+                            htole32(crc32c(entries.data(), entries.size()))};
+    const auto writeJournal = [&](bool valid) {
+        nvram::LogBackend(file, size).save(Variables(), oldVars);
+        FILE* fp = fopen(file.c_str(), "r+b");
+        ASSERT_TRUE(fp);
+        fseek(fp, size / 2 + sizeof(hdr), SEEK_SET);
+        fwrite(entries.data(), 1, entries.size(), fp);
+        if (valid)
+        {
+            fseek(fp, size / 2, SEEK_SET);
+            fwrite(hdr, 1, sizeof(hdr), fp);
+        }
+        fclose(fp);
+    };
+
+    // complete journal is replayed
+    writeJournal(true);
+    auto loaded = nvram::LogBackend(file).load();
+    ASSERT_TRUE(loaded);
+    EXPECT_TRUE(diff::compare(*loaded, newVars).empty());
+
+    // journal without header is dropped, the log is intact
+    std::filesystem::remove(file);
+    writeJournal(false);
+    loaded = nvram::LogBackend(file).load();
+    ASSERT_TRUE(loaded);
+    EXPECT_TRUE(diff::compare(*loaded, oldVars).empty());
+
+    // the spare region is clear after recovery
+    std::vector<uint8_t> image(size);
+    fp = fopen(file.c_str(), "rb");
+    ASSERT_TRUE(fp);
+    ASSERT_EQ(fread(image.data(), 1, image.size(), fp), image.size());
+    fclose(fp);
+    EXPECT_TRUE(std::all_of(image.begin() + size / 2, image.end(),
+                            [](uint8_t byte) { return byte == 0xff; }));
+}
+
+TEST_F(LogBackendTest, Storage)
+{
+    const VariableKey key{"Var", {1}};
+    {
+        Storage storage(file,
+                        std::make_unique<nvram::LogBackend>(file, 8192));
+        storage.set(key, VariableValue{7, {1, 2, 3}});
+        storage.set(key, VariableValue{7, {4, 5}});
+    }
+
+    Storage storage(file, std::make_unique<nvram::LogBackend>(file));
+    auto var = storage.get(key);
+    ASSERT_TRUE(var);
+    EXPECT_EQ(var->attributes, 7);
+    EXPECT_EQ(var->data, (std::vector<uint8_t>{4, 5}));
+}
@@ -0,0 +1,83 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#include "pager.hpp"
+
+#include <gtest/gtest.h>
+
+namespace fs = std::filesystem;
+
+static const fs::path spill = fs::temp_directory_path() / "uefivar.spill";
+
+TEST(PagerTest, StoreLoad)
+{
+    auto pager = Pager::create(spill, 1024);
+    EXPECT_FALSE(fs::exists(spill));
+
+    const VariableValue value{7, std::vector<uint8_t>(300, 0x5a)};
+    auto page = pager->store(value);
+    EXPECT_EQ(page->attributes, 7);
+    EXPECT_EQ(page->size, 300);
+    EXPECT_EQ(pager->stored(), 300);
+    EXPECT_EQ(pager->cached(), 0);
+
+    auto loaded = pager->load(*page);
+    EXPECT_EQ(loaded->attributes, 7);
+    EXPECT_EQ(loaded->data, value.data);
+    EXPECT_FALSE(loaded->page);
+    EXPECT_EQ(pager->cached(), 300);
+    EXPECT_EQ(pager->load(*page), loaded);
+
+    page.reset();
+    EXPECT_EQ(pager->stored(), 0);
+    EXPECT_EQ(pager->cached(), 0);
+}
+
+TEST(PagerTest, Cache)
+{
+    auto pager = Pager::create(spill, 1000);
+    std::vector<std::shared_ptr<const Page>> pages;
+    for (uint8_t i = 0; i < 4; ++i)
+    {
+        pages.push_back(
+            pager->store(VariableValue{i, std::vector<uint8_t>(400, i)}));
+    }
+
+    // the least recently used value is evicted
+    auto first = pager->load(*pages[0]);
+    pager->load(*pages[1]);
+    EXPECT_EQ(pager->cached(), 800);
+    pager->load(*pages[0]);
+    pager->load(*pages[2]);
+    EXPECT_EQ(pager->cached(), 800);
+    EXPECT_EQ(pager->load(*pages[0]), first);
+
+    // bulk loads are not cached
+    pager->load(*pages[3], false);
+    EXPECT_EQ(pager->load(*pages[0]), first);
+}
+
+TEST(PagerTest, Compact)
+{
+    auto pager = Pager::create(spill, 0);
+    std::vector<std::shared_ptr<const Page>> pages;
+    for (uint8_t i = 0; i < 8; ++i)
+    {
+        pages.push_back(pager->store(
+            VariableValue{i, std::vector<uint8_t>(32 * 1024, i)}));
+    }
+    // release most of the pages to move the rest
+    for (size_t i = 0; i < 6; ++i)
+    {
+        pages[i].reset();
+    }
+    EXPECT_EQ(pager->stored(), 64 * 1024);
+    for (uint8_t i = 6; i < 8; ++i)
+    {
+        EXPECT_EQ(pager->load(*pages[i])->data,
+                  std::vector<uint8_t>(32 * 1024, i));
+    }
+    pages.push_back(
+        pager->store(VariableValue{9, std::vector<uint8_t>(100, 9)}));
+    EXPECT_EQ(pager->load(*pages.back())->data, std::vector<uint8_t>(100, 9));
+}
@@ -0,0 +1,43 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2021 YADRO
+
+#include "signature.hpp"
+
+#include <gtest/gtest.h>
+
+// clang-format off
+// EFI_CERT_SHA256_GUID
+#define SHA256_TYPE 0x26, 0x16, 0xc4, 0xc1, 0x4c, 0x50, 0x92, 0x40, \
+                    0xac, 0xa9, 0x41, 0xf9, 0x36, 0x93, 0x43, 0x28
+// signature list header with 2-byte signatures (16-byte owner is omitted
+// for simplicity, the format doesn't care)
+#define LIST_HDR(count) SHA256_TYPE, \
+                        28 + 2 * (count), 0, 0, 0, /* list size */ \
+                        0, 0, 0, 0,                /* header size */ \
+                        2, 0, 0, 0                 /* signature size */
+// clang-format on
+
+TEST(SignatureTest, AppendRaw)
+{
+    EXPECT_EQ(signature::append({1, 2}, {3, 4}),
+              (std::vector<uint8_t>{1, 2, 3, 4}));
+    EXPECT_EQ(signature::append({}, {3, 4}), (std::vector<uint8_t>{3, 4}));
+    EXPECT_EQ(signature::append({1, 2}, {}), (std::vector<uint8_t>{1, 2}));
+}
+
+TEST(SignatureTest, AppendUnique)
+{
+    const std::vector<uint8_t> db{LIST_HDR(2), 0xa1, 0xa2, 0xb1, 0xb2};
+    const std::vector<uint8_t> add{LIST_HDR(3), 0xb1, 0xb2, 0xc1,
+                                   0xc2,        0xc1, 0xc2};
+    const std::vector<uint8_t> expect{LIST_HDR(2), 0xa1, 0xa2, 0xb1, 0xb2,
+                                      LIST_HDR(1), 0xc1, 0xc2};
+    EXPECT_EQ(signature::append(db, add), expect);
+}
+
+TEST(SignatureTest, AppendDuplicates)
+{
+    const std::vector<uint8_t> db{LIST_HDR(2), 0xa1, 0xa2, 0xb1, 0xb2};
+    const std::vector<uint8_t> add{LIST_HDR(1), 0xa1, 0xa2};
+    EXPECT_EQ(signature::append(db, add), db);
+}
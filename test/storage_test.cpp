@@ -1,14 +1,54 @@
 // SPDX-License-Identifier: Apache-2.0
 // Copyright (C) 2021 YADRO
 
+#include "binary.hpp"
 #include "storage.hpp"
 
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <future>
+#include <new>
+#include <sstream>
+#include <thread>
 
 #include <gtest/gtest.h>
 
 namespace fs = std::filesystem;
 
+/** @brief Number of heap allocations made by counting threads. */
+static std::atomic<size_t> allocations = 0;
+/** @brief Count heap allocations of the current thread, other threads of
+ *         the process (loaders, flushers) are not counted. */
+static thread_local bool countAllocations = false;
+
+// Replacements of global allocation functions, kept out of line to let the
+// compiler see the matching new/delete pair
+__attribute__((noinline)) void* operator new(size_t size)
+{
+    if (countAllocations)
+    {
+        ++allocations;
+    }
+    void* ptr = malloc(size ? size : 1);
+    if (!ptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
 // clang-format off
 #define GUID1 { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 }
 #define GUID2 { 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1 }
@@ -23,14 +63,23 @@ class StorageTest : public ::testing::Test
     void SetUp() override
     {
         fs::remove(file);
+        fs::remove(cache);
+        fs::remove(backup);
+        fs::remove(lock);
     }
 
     void TearDown() override
     {
         fs::remove(file);
+        fs::remove(cache);
+        fs::remove(backup);
+        fs::remove(lock);
     }
 
     const fs::path file = fs::temp_directory_path() / "uefivar.json";
+    const fs::path cache = fs::temp_directory_path() / "uefivar.json.bin";
+    const fs::path backup = fs::temp_directory_path() / "uefivar.json.bak";
+    const fs::path lock = fs::temp_directory_path() / "uefivar.json.lock";
 };
 
 TEST_F(StorageTest, SetAndGet)
@@ -50,6 +99,640 @@ TEST_F(StorageTest, SetAndGet)
     EXPECT_FALSE(storage.get(VariableKey{"TestVariable", GUID2}));
 }
 
+TEST_F(StorageTest, BackgroundLoad)
+{
+    {
+        Storage storage(file);
+        storage.set(VariableKey{"TestVariable", GUID1},
+                    VariableValue{42, {1, 2, 3}});
+    }
+
+    Storage storage(file, true);
+    auto var = storage.get(VariableKey{"TestVariable", GUID1});
+    EXPECT_TRUE(storage.ready());
+    ASSERT_TRUE(var);
+    EXPECT_EQ(var->data, (std::vector<uint8_t>{1, 2, 3}));
+}
+
+TEST_F(StorageTest, BackgroundLoadError)
+{
+    std::ofstream(file) << "invalid";
+
+    Storage storage(file, true);
+    EXPECT_THROW(storage.wait(), std::runtime_error);
+    EXPECT_TRUE(storage.ready());
+    EXPECT_THROW(storage.get(VariableKey{"TestVariable", GUID1}),
+                 std::runtime_error);
+}
+
+TEST_F(StorageTest, SetWhileLoading)
+{
+    FileLock lock;
+    ASSERT_TRUE(lock.lock(file));
+
+    // the loader waits for the lock, the writer waits for the loader
+    Storage storage(file, true);
+    auto writer = std::async(std::launch::async, [&storage]() {
+        storage.set(VariableKey{"Early", GUID1}, VariableValue{1, {1}});
+    });
+    EXPECT_EQ(writer.wait_for(std::chrono::milliseconds(100)),
+              std::future_status::timeout);
+    EXPECT_FALSE(storage.ready());
+
+    lock.unlock();
+    ASSERT_EQ(writer.wait_for(std::chrono::seconds(10)),
+              std::future_status::ready);
+    writer.get();
+    auto var = storage.get(VariableKey{"Early", GUID1});
+    ASSERT_TRUE(var);
+    EXPECT_EQ(var->data, (std::vector<uint8_t>{1}));
+}
+
+TEST_F(StorageTest, Cache)
+{
+    {
+        Storage storage(file);
+        storage.set(VariableKey{"TestVariable", GUID1},
+                    VariableValue{42, {1, 2, 3}});
+    }
+    ASSERT_TRUE(fs::exists(cache));
+    EXPECT_TRUE(binary::loadVariables(cache, binary::Source::of(file)));
+
+    // replace storage file, cache must be ignored and rebuilt
+    Variables variables;
+    variables[VariableKey{"TestVariable", GUID1}] = VariableValue{1, {4}};
+    saveVariables(variables, file);
+    EXPECT_FALSE(binary::loadVariables(cache, binary::Source::of(file)));
+
+    Storage storage(file);
+    auto var = storage.get(VariableKey{"TestVariable", GUID1});
+    ASSERT_TRUE(var);
+    EXPECT_EQ(var->attributes, 1);
+    EXPECT_EQ(var->data, (std::vector<uint8_t>{4}));
+    EXPECT_TRUE(binary::loadVariables(cache, binary::Source::of(file)));
+}
+
+TEST_F(StorageTest, Backup)
+{
+    {
+        Storage storage(file);
+        storage.set(VariableKey{"TestVariable", GUID1},
+                    VariableValue{1, {1}});
+        storage.set(VariableKey{"TestVariable", GUID1},
+                    VariableValue{1, {2}});
+    }
+    ASSERT_TRUE(fs::exists(backup));
+
+    // interrupted write, the previous version is loaded from the backup
+    std::ofstream(file) << "{ \"variables\": [";
+    fs::remove(cache);
+    Storage storage(file);
+    auto var = storage.get(VariableKey{"TestVariable", GUID1});
+    ASSERT_TRUE(var);
+    EXPECT_EQ(var->data, (std::vector<uint8_t>{1}));
+
+    // corrupted file is not kept as the backup
+    storage.set(VariableKey{"TestVariable", GUID1}, VariableValue{1, {3}});
+    Variables vars = loadVariables(backup);
+    auto it = vars.find(VariableKey{"TestVariable", GUID1});
+    ASSERT_NE(it, vars.end());
+    EXPECT_EQ(it->second.data, (std::vector<uint8_t>{1}));
+}
+
+TEST_F(StorageTest, Scrub)
+{
+    const VariableKey key1{"Var1", GUID1};
+    const VariableKey key2{"Var2", GUID1};
+    {
+        Storage storage(file);
+        storage.set(key1, VariableValue{1, {0x11, 0x11}});
+        storage.set(key2, VariableValue{1, {0x22, 0x22}});
+    }
+
+    // bit rot: content changed in place, file attributes are the same
+    const auto damage = [this](const char* from, const char* to) {
+        const auto mtime = fs::last_write_time(file);
+        std::stringstream text;
+        text << std::ifstream(file).rdbuf();
+        std::string json = text.str();
+        json.replace(json.find(from), strlen(from), to);
+        std::ofstream(file) << json;
+        fs::last_write_time(file, mtime);
+    };
+    damage("2222", "2223");
+    fs::remove(cache);
+
+    Storage storage(file);
+    EXPECT_EQ(storage.corrupted(), 1);
+    EXPECT_TRUE(storage.get(key1));
+    EXPECT_FALSE(storage.get(key2));
+
+    // the damaged record is dropped from the file
+    std::vector<VariableKey> damaged = storage.scrub();
+    ASSERT_EQ(damaged.size(), 1);
+    EXPECT_EQ(damaged[0].name, "Var2");
+
+    damage("1111", "1113");
+    damaged = storage.scrub();
+    ASSERT_EQ(damaged.size(), 1);
+    EXPECT_EQ(damaged[0].name, "Var1");
+    EXPECT_EQ(storage.corrupted(), 1);
+
+    // repaired from memory
+    LoadInfo info;
+    Variables vars = loadVariables(file, &info);
+    EXPECT_TRUE(info.corrupted.empty());
+    ASSERT_EQ(vars.size(), 1);
+    EXPECT_EQ(vars.begin()->second.data, (std::vector<uint8_t>{0x11, 0x11}));
+    EXPECT_TRUE(storage.scrub().empty());
+    EXPECT_EQ(storage.corrupted(), 0);
+}
+
+TEST_F(StorageTest, ZeroCopy)
+{
+    Storage storage(file);
+    const uint8_t guid[] = GUID1;
+    std::vector<uint8_t> data(4096, 0x42);
+    const uint8_t* buffer = data.data();
+
+    // value is moved to the storage
+    storage.set(VariableKey{"TestVariable", GUID1},
+                VariableValue{1, std::move(data)});
+    auto var = storage.get(VariableKeyView("TestVariable", guid));
+    ASSERT_TRUE(var);
+    EXPECT_EQ(var->data.data(), buffer);
+
+    // lookup doesn't allocate and doesn't copy
+    countAllocations = true;
+    const size_t before = allocations;
+    var = storage.get(VariableKeyView("TestVariable", guid));
+    const size_t found = allocations;
+    const bool missing = !storage.get(VariableKeyView("NotFound", guid));
+    const size_t notFound = allocations;
+    countAllocations = false;
+
+    EXPECT_EQ(found, before);
+    ASSERT_TRUE(var);
+    EXPECT_EQ(var->data.data(), buffer);
+    EXPECT_TRUE(missing);
+    EXPECT_EQ(notFound, before);
+}
+
+TEST_F(StorageTest, StagedWrite)
+{
+    Storage storage(file);
+
+    const uint32_t handle =
+        storage.beginWrite(VariableKey{"TestVariable", GUID1}, 42, 5);
+    storage.writeChunk(handle, 0, {1, 2});
+    storage.writeChunk(handle, 2, {3, 4, 5});
+    EXPECT_THROW(storage.writeChunk(handle, 4, {6, 7}), std::invalid_argument);
+    EXPECT_FALSE(storage.get(VariableKey{"TestVariable", GUID1}));
+
+    storage.commitWrite(handle);
+    auto var = storage.get(VariableKey{"TestVariable", GUID1});
+    ASSERT_TRUE(var);
+    EXPECT_EQ(var->attributes, 42);
+    EXPECT_EQ(var->data, (std::vector<uint8_t>{1, 2, 3, 4, 5}));
+
+    EXPECT_THROW(storage.commitWrite(handle), std::invalid_argument);
+    EXPECT_THROW(storage.beginWrite(VariableKey{"TestVariable", GUID1}, 0,
+                                    Storage::maxStagedSize + 1),
+                 std::invalid_argument);
+}
+
+TEST_F(StorageTest, StagedWriteLimit)
+{
+    Storage storage(file);
+
+    const uint32_t first =
+        storage.beginWrite(VariableKey{"TestVariable", GUID1}, 0, 1);
+    for (size_t idx = 0; idx < Storage::maxStagedWrites; ++idx)
+    {
+        storage.beginWrite(VariableKey{"TestVariable", GUID1}, 0, 1);
+    }
+    // the oldest one is discarded
+    EXPECT_THROW(storage.writeChunk(first, 0, {1}), std::invalid_argument);
+}
+
+TEST_F(StorageTest, Append)
+{
+    constexpr uint32_t appendWrite = 0x40; // EFI_VARIABLE_APPEND_WRITE
+    Storage storage(file);
+
+    storage.set(VariableKey{"TestVariable", GUID1},
+                VariableValue{3 | appendWrite, {1, 2}});
+    storage.set(VariableKey{"TestVariable", GUID1},
+                VariableValue{3 | appendWrite, {3}});
+    auto var = storage.get(VariableKey{"TestVariable", GUID1});
+    ASSERT_TRUE(var);
+    EXPECT_EQ(var->attributes, 3);
+    EXPECT_EQ(var->data, (std::vector<uint8_t>{1, 2, 3}));
+
+    // empty append doesn't change the variable
+    storage.set(VariableKey{"TestVariable", GUID1},
+                VariableValue{3 | appendWrite, {}});
+    EXPECT_EQ(storage.get(VariableKey{"TestVariable", GUID1})->data,
+              (std::vector<uint8_t>{1, 2, 3}));
+
+    // append can't change attributes
+    EXPECT_THROW(storage.set(VariableKey{"TestVariable", GUID1},
+                             VariableValue{7 | appendWrite, {4}}),
+                 std::invalid_argument);
+    var = storage.get(VariableKey{"TestVariable", GUID1});
+    EXPECT_EQ(var->attributes, 3);
+    EXPECT_EQ(var->data, (std::vector<uint8_t>{1, 2, 3}));
+}
+
+TEST_F(StorageTest, Usage)
+{
+    constexpr uint32_t hwErr = 0x08; // EFI_VARIABLE_HARDWARE_ERROR_RECORD
+    Storage storage(file);
+
+    storage.set(VariableKey{"Var1", GUID1}, VariableValue{0, {1, 2}});
+    storage.set(VariableKey{"Var2", GUID1}, VariableValue{0, {1, 2, 3}});
+    storage.set(VariableKey{"HwErr", GUID1}, VariableValue{hwErr, {1}});
+
+    Storage::Usage usage = storage.usage();
+    EXPECT_EQ(usage.count, 2);
+    EXPECT_EQ(usage.keyBytes, 4 + 4 + 2 * sizeof(uuid_t));
+    EXPECT_EQ(usage.dataBytes, 5);
+    usage = storage.usage(true);
+    EXPECT_EQ(usage.count, 1);
+    EXPECT_EQ(usage.dataBytes, 1);
+
+    storage.set(VariableKey{"Var1", GUID1}, VariableValue{0, {1}});
+    EXPECT_EQ(storage.usage().dataBytes, 4);
+    storage.remove(VariableKey{"Var2", GUID1});
+    usage = storage.usage();
+    EXPECT_EQ(usage.count, 1);
+    EXPECT_EQ(usage.keyBytes, 4 + sizeof(uuid_t));
+    EXPECT_EQ(usage.dataBytes, 1);
+
+    storage.reset();
+    EXPECT_EQ(storage.usage().count, 0);
+    EXPECT_EQ(storage.usage(true).count, 0);
+}
+
+TEST_F(StorageTest, Quota)
+{
+    Storage storage(file);
+
+    Storage::Limits limits;
+    limits.maxStorage = 2 * (sizeof(uuid_t) + 4 + 8);
+    limits.maxVariable = sizeof(uuid_t) + 4 + 10;
+    storage.setLimits(limits);
+
+    Storage::Info info = storage.queryInfo(0);
+    EXPECT_EQ(info.maxStorage, limits.maxStorage);
+    EXPECT_EQ(info.remaining, limits.maxStorage);
+    EXPECT_EQ(info.maxVariable, limits.maxVariable);
+    EXPECT_EQ(storage.queryInfo(0x08).maxStorage, Storage::unlimited);
+
+    storage.set(VariableKey{"Var1", GUID1},
+                VariableValue{0, std::vector<uint8_t>(8)});
+    EXPECT_EQ(storage.queryInfo(0).remaining, sizeof(uuid_t) + 4 + 8);
+
+    // too big variable
+    EXPECT_THROW(storage.set(VariableKey{"Var2", GUID1},
+                             VariableValue{0, std::vector<uint8_t>(11)}),
+                 std::length_error);
+    // storage is full
+    EXPECT_THROW(storage.set(VariableKey{"Var2", GUID1},
+                             VariableValue{0, std::vector<uint8_t>(9)}),
+                 std::length_error);
+    EXPECT_FALSE(storage.get(VariableKey{"Var2", GUID1}));
+
+    // replacing the variable reuses its space
+    storage.set(VariableKey{"Var1", GUID1},
+                VariableValue{0, std::vector<uint8_t>(10)});
+    storage.set(VariableKey{"Var2", GUID1},
+                VariableValue{0, std::vector<uint8_t>(6)});
+    EXPECT_EQ(storage.queryInfo(0).remaining, 0);
+}
+
+TEST_F(StorageTest, WriteStats)
+{
+    Storage storage(file);
+
+    storage.set(VariableKey{"Var1", GUID1}, VariableValue{0, {1, 2}});
+    storage.set(VariableKey{"Var1", GUID1}, VariableValue{0, {1, 2}});
+    storage.set(VariableKey{"Var1", GUID1}, VariableValue{0, {3}});
+    storage.set(VariableKey{"Var2", GUID2}, VariableValue{0, {}});
+    storage.remove(VariableKey{"Var2", GUID2});
+
+    const Storage::WriteStats total = storage.writeStats();
+    EXPECT_EQ(total.writes, 4); // unchanged value is not written
+    EXPECT_EQ(total.logicalBytes, 4 * (4 + sizeof(uuid_t)) + 2 + 1);
+    EXPECT_GT(total.physicalBytes, total.logicalBytes);
+    EXPECT_EQ(total.throttled, 0);
+
+    const auto stats = storage.variableWriteStats();
+    ASSERT_EQ(stats.size(), 2);
+    const auto it = stats.find(VariableKey{"Var1", GUID1});
+    ASSERT_NE(it, stats.end());
+    EXPECT_EQ(it->second.writes, 2);
+    EXPECT_EQ(it->second.logicalBytes, 2 * (4 + sizeof(uuid_t)) + 2 + 1);
+    uint64_t physical = 0;
+    for (const auto& [key, var] : stats)
+    {
+        physical += var.physicalBytes;
+    }
+    EXPECT_EQ(physical, total.physicalBytes);
+}
+
+TEST_F(StorageTest, WriteBudget)
+{
+    const VariableKey key{"Var1", GUID1};
+    {
+        Storage storage(file);
+        Storage::WriteBudget budget;
+        budget.writes = 1;
+        budget.delay = std::chrono::milliseconds(100);
+        storage.setWriteBudget(budget);
+
+        storage.set(key, VariableValue{0, {1}});
+        EXPECT_EQ(loadVariables(file).at(key).data,
+                  (std::vector<uint8_t>{1}));
+
+        // exceeded budget: published, but saved with delay
+        storage.set(key, VariableValue{0, {2}});
+        EXPECT_EQ(storage.get(key)->data, (std::vector<uint8_t>{2}));
+        EXPECT_EQ(loadVariables(file).at(key).data,
+                  (std::vector<uint8_t>{1}));
+        EXPECT_EQ(storage.writeStats().throttled, 1);
+
+        for (int i = 0; i < 50 && loadVariables(file).at(key).data[0] != 2;
+             ++i)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        EXPECT_EQ(loadVariables(file).at(key).data,
+                  (std::vector<uint8_t>{2}));
+        EXPECT_FALSE(storage.flush());
+
+        // changes are coalesced and saved on destruction
+        budget.delay = std::chrono::hours(1);
+        storage.setWriteBudget(budget);
+        storage.set(key, VariableValue{0, {3}});
+        storage.set(key, VariableValue{0, {4}});
+        EXPECT_EQ(loadVariables(file).at(key).data,
+                  (std::vector<uint8_t>{2}));
+        EXPECT_EQ(storage.writeStats().throttled, 3);
+    }
+    EXPECT_EQ(loadVariables(file).at(key).data, (std::vector<uint8_t>{4}));
+}
+
+TEST_F(StorageTest, Profiles)
+{
+    const VariableKey var1{"Var1", GUID1};
+    const VariableKey var2{"Var2", GUID1};
+    const VariableKey var3{"Var3", GUID2};
+    {
+        Storage storage(file);
+        storage.set(var1, VariableValue{0, {1}});
+        storage.set(var2, VariableValue{0, {2}});
+
+        storage.createProfile("perf");
+        EXPECT_THROW(storage.createProfile("perf"), std::invalid_argument);
+        EXPECT_THROW(storage.createProfile(""), std::invalid_argument);
+        EXPECT_THROW(storage.selectProfile("none"), std::out_of_range);
+
+        storage.selectProfile("perf");
+        EXPECT_EQ(storage.activeProfile(), "perf");
+        storage.set(var1, VariableValue{0, {10}});
+        storage.remove(var2);
+        storage.set(var3, VariableValue{0, {3}});
+        EXPECT_THROW(storage.deleteProfile("perf"), std::invalid_argument);
+
+        // back to the base set
+        storage.selectProfile("");
+        EXPECT_EQ(storage.get(var1)->data, (std::vector<uint8_t>{1}));
+        EXPECT_EQ(storage.get(var2)->data, (std::vector<uint8_t>{2}));
+        EXPECT_FALSE(storage.get(var3));
+        EXPECT_EQ(storage.usage().count, 2);
+
+        // changes of the base set are kept under the profile ones
+        storage.set(var1, VariableValue{0, {5}});
+        storage.selectProfile("perf");
+        EXPECT_EQ(storage.get(var1)->data, (std::vector<uint8_t>{10}));
+        EXPECT_FALSE(storage.get(var2));
+        EXPECT_EQ(storage.get(var3)->data, (std::vector<uint8_t>{3}));
+        EXPECT_EQ(storage.usage().count, 2);
+    }
+
+    // profiles and the active one are persistent
+    {
+        Storage storage(file);
+        EXPECT_EQ(storage.profiles(), (std::vector<std::string>{"perf"}));
+        EXPECT_EQ(storage.activeProfile(), "perf");
+        EXPECT_EQ(storage.get(var1)->data, (std::vector<uint8_t>{10}));
+
+        storage.createProfile("debug");
+        storage.selectProfile("debug");
+        EXPECT_EQ(storage.get(var1)->data, (std::vector<uint8_t>{10}));
+        storage.selectProfile("");
+        EXPECT_EQ(storage.get(var1)->data, (std::vector<uint8_t>{5}));
+        EXPECT_EQ(storage.get(var2)->data, (std::vector<uint8_t>{2}));
+
+        EXPECT_THROW(storage.deleteProfile("none"), std::out_of_range);
+        storage.deleteProfile("perf");
+        storage.deleteProfile("debug");
+        EXPECT_TRUE(storage.profiles().empty());
+    }
+
+    Storage storage(file);
+    EXPECT_TRUE(storage.profiles().empty());
+    EXPECT_EQ(storage.get(var1)->data, (std::vector<uint8_t>{5}));
+}
+
+TEST_F(StorageTest, Rollback)
+{
+    const fs::path log = fs::temp_directory_path() / "uefivar.json.history";
+    fs::remove(log);
+
+    const VariableKey var1{"Var1", GUID1};
+    const VariableKey var2{"Var2", GUID2};
+    Storage storage(file);
+    EXPECT_FALSE(storage.hasHistory());
+    storage.enableHistory(log, 4096);
+    EXPECT_TRUE(storage.hasHistory());
+
+    storage.set(var1, VariableValue{0, {1, 2, 3}});
+    storage.set(var2, VariableValue{0, {4}});
+    storage.set(var1, VariableValue{0, {1, 5, 3}});
+    storage.remove(var2);
+
+    const auto changes = storage.changes(10);
+    ASSERT_EQ(changes.size(), 4);
+    EXPECT_EQ(changes[0].key.name, var2.name);
+    EXPECT_EQ(changes[0].kind, History::removed);
+    EXPECT_EQ(changes[3].key.name, var1.name);
+    EXPECT_EQ(changes[3].kind, History::created);
+
+    storage.rollback(changes[2].generation);
+    EXPECT_EQ(storage.get(var1)->data, (std::vector<uint8_t>{1, 2, 3}));
+    EXPECT_EQ(storage.get(var2)->data, (std::vector<uint8_t>{4}));
+    EXPECT_EQ(storage.usage().count, 2);
+
+    // rollback is a change too
+    EXPECT_EQ(storage.changes(10).size(), 6);
+    storage.rollback(changes[0].generation);
+    EXPECT_EQ(storage.get(var1)->data, (std::vector<uint8_t>{1, 5, 3}));
+    EXPECT_FALSE(storage.get(var2));
+
+    EXPECT_THROW(storage.rollback(100), std::out_of_range);
+    storage.rollbackToTime(0);
+    EXPECT_TRUE(storage.empty());
+
+    fs::remove(log);
+}
+
+TEST_F(StorageTest, Apply)
+{
+    const fs::path log = fs::temp_directory_path() / "uefivar.json.history";
+    fs::remove(log);
+
+    const VariableKey var1{"Var1", GUID1};
+    const VariableKey var2{"Var2", GUID2};
+    Storage storage(file);
+    storage.enableHistory(log, 4096);
+    storage.set(var1, VariableValue{0, {1}});
+
+    // batch is saved and recorded as a single generation
+    VariableDelta delta;
+    delta[var1] = std::nullopt;
+    delta[var2] = VariableValue{0, {2}};
+    storage.apply(delta);
+    EXPECT_FALSE(storage.get(var1));
+    EXPECT_EQ(storage.get(var2)->data, (std::vector<uint8_t>{2}));
+    EXPECT_EQ(storage.usage().count, 1);
+
+    const auto changes = storage.changes(10);
+    ASSERT_EQ(changes.size(), 3);
+    EXPECT_EQ(changes[0].generation, changes[1].generation);
+    storage.rollback(changes[2].generation);
+    EXPECT_EQ(storage.get(var1)->data, (std::vector<uint8_t>{1}));
+    EXPECT_FALSE(storage.get(var2));
+
+    fs::remove(log);
+}
+
+TEST_F(StorageTest, Tiering)
+{
+    const fs::path spill = fs::temp_directory_path() / "uefivar.json.cold";
+    const VariableKey hot{"Hot", GUID1};
+    const VariableKey cold{"Cold", GUID1};
+    std::vector<uint8_t> blob(4096, 0xa5);
+    {
+        Storage storage(file);
+        storage.set(cold, VariableValue{1, blob});
+    }
+    {
+        Storage storage(file);
+        storage.enableTiering(spill, 1024, 8192);
+        storage.set(hot, VariableValue{0, {1, 2}});
+
+        // large data is paged out, readers get it loaded
+        const Storage::Snapshot vars = storage.snapshot();
+        EXPECT_TRUE(vars->at(cold).page);
+        EXPECT_TRUE(vars->at(cold).data.empty());
+        EXPECT_FALSE(vars->at(hot).page);
+        EXPECT_EQ(storage.get(cold)->data, blob);
+        EXPECT_EQ(storage.get(cold)->attributes, 1);
+        EXPECT_EQ(storage.materialize()->at(cold).data, blob);
+        EXPECT_EQ(storage.usage().dataBytes, blob.size() + 2);
+
+        // appended data is paged out again
+        constexpr uint32_t appendWrite = 0x40; // EFI_VARIABLE_APPEND_WRITE
+        storage.set(cold, VariableValue{1 | appendWrite, {1}});
+        blob.push_back(1);
+        EXPECT_EQ(storage.get(cold)->data, blob);
+        EXPECT_TRUE(storage.snapshot()->at(cold).page);
+
+        // paged out data is saved without expanding the snapshot
+        auto cached = binary::loadVariables(cache, binary::Source::of(file));
+        ASSERT_TRUE(cached);
+        EXPECT_EQ(cached->at(cold).data, blob);
+        EXPECT_GT(storage.variableWriteStats().at(cold).physicalBytes, 0);
+    }
+
+    // the storage file keeps the data
+    Storage storage(file);
+    EXPECT_EQ(storage.get(cold)->data, blob);
+    EXPECT_EQ(storage.get(hot)->data, (std::vector<uint8_t>{1, 2}));
+}
+
+TEST_F(StorageTest, Owner)
+{
+    auto storage = std::make_unique<Storage>(file);
+
+    FileLock lock;
+    EXPECT_FALSE(lock.lock(file, false));
+    EXPECT_THROW(Storage(file, true, false), std::runtime_error);
+    storage.reset();
+    EXPECT_TRUE(lock.lock(file, false));
+
+    // waiting for the owner is cancelled on destruction
+    storage = std::make_unique<Storage>(file, true);
+    EXPECT_FALSE(storage->ready());
+    storage.reset();
+}
+
+TEST_F(StorageTest, OwnerTimeout)
+{
+    FileLock lock;
+    ASSERT_TRUE(lock.lock(file));
+
+    // the owner doesn't release the file, the load fails after the timeout
+    Storage storage(file, true, true, std::chrono::milliseconds(300));
+    EXPECT_FALSE(storage.ready());
+    EXPECT_THROW(storage.wait(), std::runtime_error);
+    EXPECT_TRUE(storage.ready());
+}
+
+TEST_F(StorageTest, Reload)
+{
+    Storage storage(file);
+    storage.set(VariableKey{"Own", GUID1}, VariableValue{1, {1}});
+    EXPECT_FALSE(storage.changed());
+    EXPECT_FALSE(storage.reload());
+    const uint64_t generation = storage.generation();
+
+    // restore from "backup"
+    const fs::path restored = file.string() + ".restored";
+    Variables vars;
+    vars[VariableKey{"Restored", GUID2}] = VariableValue{2, {2, 3}};
+    saveVariables(vars, restored);
+    fs::rename(restored, file);
+
+    EXPECT_TRUE(storage.changed());
+    EXPECT_TRUE(storage.reload());
+    EXPECT_EQ(storage.generation(), generation + 1);
+    EXPECT_FALSE(storage.get(VariableKey{"Own", GUID1}));
+    auto var = storage.get(VariableKey{"Restored", GUID2});
+    ASSERT_TRUE(var);
+    EXPECT_EQ(var->data, (std::vector<uint8_t>{2, 3}));
+    EXPECT_EQ(storage.usage().count, 1);
+    EXPECT_FALSE(storage.changed());
+}
+
+TEST_F(StorageTest, SharedData)
+{
+    Storage storage(file);
+    storage.set(VariableKey{"Big", GUID1},
+                VariableValue{7, std::vector<uint8_t>(4096, 0x5a)});
+    const auto before = storage.get(VariableKey{"Big", GUID1});
+
+    // snapshots made by other changes share the data of unchanged variables
+    storage.set(VariableKey{"Small", GUID1}, VariableValue{7, {1}});
+    storage.remove(VariableKey{"Small", GUID1});
+    const auto after = storage.get(VariableKey{"Big", GUID1});
+    ASSERT_TRUE(after);
+    EXPECT_NE(before, after);
+    EXPECT_EQ(before->data.data(), after->data.data());
+}
+
 TEST_F(StorageTest, Remove)
 {
     Storage storage(file);
@@ -82,6 +765,123 @@ TEST_F(StorageTest, GetNext)
     EXPECT_FALSE(storage.next(*var2));
 }
 
+TEST_F(StorageTest, GetNextRemoved)
+{
+    Storage storage(file);
+
+    storage.set(VariableKey{"TestVariable1", GUID1}, VariableValue{0, {0}});
+    storage.set(VariableKey{"TestVariable2", GUID1}, VariableValue{0, {0}});
+    storage.set(VariableKey{"TestVariable3", GUID1}, VariableValue{0, {0}});
+
+    auto var1 = storage.next(VariableKey{});
+    ASSERT_TRUE(var1);
+    auto var2 = storage.next(*var1);
+    ASSERT_TRUE(var2);
+    EXPECT_EQ(var2->name, "TestVariable2");
+
+    // remove the last returned variable, enumeration must continue
+    storage.remove(*var2);
+    auto var3 = storage.next(*var2);
+    ASSERT_TRUE(var3);
+    EXPECT_EQ(var3->name, "TestVariable3");
+}
+
+TEST_F(StorageTest, Find)
+{
+    Storage storage(file);
+
+    storage.set(VariableKey{"Boot0001", GUID2}, VariableValue{7, {0}});
+    storage.set(VariableKey{"BootOrder", GUID1}, VariableValue{7, {0}});
+    storage.set(VariableKey{"Boot0000", GUID1}, VariableValue{3, {0}});
+    storage.set(VariableKey{"Lang", GUID1}, VariableValue{1, {0}});
+    storage.set(VariableKey{"Timeout", GUID2}, VariableValue{7, {0}});
+
+    Storage::Query query;
+    auto found = storage.find(query);
+    ASSERT_EQ(found.size(), 5);
+    EXPECT_EQ(found[0].key.name, "Boot0000");
+    EXPECT_EQ(found[4].key.name, "Timeout");
+
+    // by GUID and name
+    query.anyGuid = false;
+    const uuid_t guid = GUID1;
+    memcpy(query.guid, guid, sizeof(guid));
+    query.prefix = "Boot";
+    found = storage.find(query);
+    ASSERT_EQ(found.size(), 2);
+    EXPECT_EQ(found[0].key.name, "Boot0000");
+    EXPECT_EQ(found[0].attributes, 3);
+    EXPECT_EQ(found[1].key.name, "BootOrder");
+
+    // by name, results are in the storage order
+    query.anyGuid = true;
+    found = storage.find(query);
+    ASSERT_EQ(found.size(), 3);
+    EXPECT_EQ(found[0].key.name, "Boot0000");
+    EXPECT_EQ(found[1].key.name, "BootOrder");
+    EXPECT_EQ(found[2].key.name, "Boot0001");
+
+    // by attributes
+    query.prefix.clear();
+    query.attributes = 4;
+    found = storage.find(query);
+    ASSERT_EQ(found.size(), 3);
+    EXPECT_EQ(found[0].key.name, "BootOrder");
+    EXPECT_EQ(found[1].key.name, "Boot0001");
+    EXPECT_EQ(found[2].key.name, "Timeout");
+
+    // indexes follow changes
+    storage.remove(VariableKey{"Timeout", GUID2});
+    storage.set(VariableKey{"BootNext", GUID1}, VariableValue{6, {0}});
+    found = storage.find(query);
+    ASSERT_EQ(found.size(), 3);
+    EXPECT_EQ(found[0].key.name, "BootNext");
+    EXPECT_EQ(found[1].key.name, "BootOrder");
+    EXPECT_EQ(found[2].key.name, "Boot0001");
+
+    query.prefix = "None";
+    EXPECT_TRUE(storage.find(query).empty());
+}
+
+TEST_F(StorageTest, Snapshot)
+{
+    Storage storage(file);
+    storage.set(VariableKey{"TestVariable1", GUID1}, VariableValue{0, {0}});
+
+    const Storage::Snapshot snapshot = storage.snapshot();
+    ASSERT_EQ(snapshot->size(), 1);
+
+    storage.set(VariableKey{"TestVariable1", GUID1}, VariableValue{1, {1}});
+    storage.set(VariableKey{"TestVariable2", GUID1}, VariableValue{0, {0}});
+
+    // pinned snapshot is not affected by writers
+    EXPECT_EQ(snapshot->size(), 1);
+    EXPECT_EQ(snapshot->begin()->second.attributes, 0);
+    EXPECT_EQ(storage.snapshot()->size(), 2);
+    EXPECT_EQ(storage.get(VariableKey{"TestVariable1", GUID1})->attributes, 1);
+}
+
+TEST_F(StorageTest, Memory)
+{
+    Storage storage(file);
+
+    for (uint8_t idx = 0; idx < 100; ++idx)
+    {
+        const std::string name = "TestVariable" + std::to_string(idx);
+        storage.set(VariableKey{name, GUID1}, VariableValue{0, {idx}});
+    }
+    const size_t used = storage.memoryUsage();
+    EXPECT_NE(used, 0);
+
+    // outdated snapshots are released, the arena doesn't grow on rewrites
+    for (uint8_t idx = 0; idx < 100; ++idx)
+    {
+        storage.set(VariableKey{"TestVariable0", GUID1},
+                    VariableValue{0, {idx}});
+    }
+    EXPECT_LE(storage.memoryUsage(), used);
+}
+
 TEST_F(StorageTest, MergeUpgrade)
 {
     const VariableKey netVar{"NetworkStackVar",
@@ -4,6 +4,8 @@
 #include "variable.hpp"
 
 #include <fstream>
+#include <sstream>
+#include <thread>
 
 #include <gtest/gtest.h>
 
@@ -25,6 +27,80 @@ TEST(VariableKeyTest, Less)
     EXPECT_TRUE((VariableKey{nameL, GUID1}) < (VariableKey{nameG, GUID1}));
 }
 
+TEST(VariableKeyTest, GuidOrder)
+{
+    // byte order of GUIDs must match uuid_compare() to keep the map order
+    const uuid_t guids[] = {
+        GUID1,
+        GUID2,
+        {0xff, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+        {0, 0, 0, 0, 0xff, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+        {0, 0, 0, 0, 0, 0, 0xff, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+        {0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0, 0, 0, 0, 0, 0, 0},
+        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff},
+        {0, 0, 0, 0x01, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+        {0x01, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+    };
+    for (const auto& lhs : guids)
+    {
+        for (const auto& rhs : guids)
+        {
+            VariableKey keyL{"Var", lhs};
+            VariableKey keyR{"Var", rhs};
+            EXPECT_EQ(keyL < keyR, uuid_compare(lhs, rhs) < 0);
+        }
+    }
+}
+
+TEST(VariableKeyTest, Interned)
+{
+    static_assert(sizeof(VariableKey) == 2 * sizeof(void*));
+
+    const std::string name = "OsIndicationsSupported";
+    const uuid_t guid = GUID1;
+    const VariableKey key{name, guid};
+    const VariableKey same{name.c_str(), GUID1};
+    const VariableKey other{name, GUID2};
+
+    EXPECT_EQ(key.name.data(), same.name.data());
+    EXPECT_EQ(key.name.data(), other.name.data());
+    EXPECT_EQ(key.name, name);
+    EXPECT_EQ(static_cast<const uint8_t*>(key.guid),
+              static_cast<const uint8_t*>(same.guid));
+    EXPECT_NE(static_cast<const uint8_t*>(key.guid),
+              static_cast<const uint8_t*>(other.guid));
+    EXPECT_EQ(memcmp(key.guid, guid, sizeof(uuid_t)), 0);
+
+    EXPECT_FALSE(key < same);
+    EXPECT_FALSE(same < key);
+    EXPECT_TRUE(key < other);
+
+    // lookup by a view of not interned data
+    Variables vars;
+    vars.emplace(key, VariableValue{});
+    EXPECT_NE(vars.find(VariableKeyView(name, guid)), vars.end());
+}
+
+TEST(VariableKeyTest, InternedConcurrent)
+{
+    // names are released and interned again concurrently
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < 4; ++i)
+    {
+        threads.emplace_back([]() {
+            for (size_t j = 0; j < 10000; ++j)
+            {
+                const VariableKey key{std::to_string(j % 8), GUID1};
+                EXPECT_EQ(key.name, std::to_string(j % 8));
+            }
+        });
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+}
+
 TEST(VariablesTest, LoadSave)
 {
     fs::path file = fs::temp_directory_path() / "uefivar.json";
@@ -48,6 +124,69 @@ TEST(VariablesTest, LoadSave)
     fs::remove(file);
 }
 
+TEST(VariablesTest, Integrity)
+{
+    fs::path file = fs::temp_directory_path() / "uefivar.json";
+
+    Variables variables;
+    variables[VariableKey{"TestVariable", GUID1}] =
+        VariableValue{7, {0x01, 0x02, 0x03, 0x04}};
+    saveVariables(variables, file, 42);
+
+    LoadInfo info;
+    EXPECT_EQ(loadVariables(file, &info).size(), 1);
+    EXPECT_EQ(info.generation, 42);
+    EXPECT_TRUE(info.corrupted.empty());
+    EXPECT_FALSE(fs::exists(file.string() + ".tmp"));
+
+    // damaged data must be detected
+    std::stringstream text;
+    text << std::ifstream(file).rdbuf();
+    std::string json = text.str();
+    const size_t pos = json.find("01020304");
+    ASSERT_NE(pos, std::string::npos);
+    json.replace(pos, 8, "01020305");
+    std::ofstream(file) << json;
+    EXPECT_THROW(loadVariables(file), std::runtime_error);
+
+    // damaged record is reported, the rest of the file is loaded
+    EXPECT_TRUE(loadVariables(file, &info).empty());
+    ASSERT_EQ(info.corrupted.size(), 1);
+    EXPECT_EQ(info.corrupted[0].name, "TestVariable");
+
+    fs::remove(file);
+}
+
+TEST(VariablesTest, IntegrityInvalidHex)
+{
+    fs::path file = fs::temp_directory_path() / "uefivar.json";
+
+    Variables variables;
+    variables[VariableKey{"Damaged", GUID1}] =
+        VariableValue{7, {0x01, 0x02, 0x03, 0x04}};
+    variables[VariableKey{"Intact", GUID1}] = VariableValue{7, {0x05, 0x06}};
+    saveVariables(variables, file, 42);
+
+    // a flipped bit makes the data character not a hex digit
+    std::stringstream text;
+    text << std::ifstream(file).rdbuf();
+    std::string json = text.str();
+    const size_t pos = json.find("01020304");
+    ASSERT_NE(pos, std::string::npos);
+    json[pos + 7] = '4' ^ 0x40;
+    std::ofstream(file) << json;
+
+    LoadInfo info;
+    const Variables loaded = loadVariables(file, &info);
+    ASSERT_EQ(loaded.size(), 1);
+    EXPECT_EQ(loaded.begin()->first.name, "Intact");
+    EXPECT_EQ(info.generation, 42);
+    ASSERT_EQ(info.corrupted.size(), 1);
+    EXPECT_EQ(info.corrupted[0].name, "Damaged");
+
+    fs::remove(file);
+}
+
 TEST(VariablesTest, LoadFull)
 {
     Variables variables = loadVariables(TEST_DATA_DIR "/nvram.json");